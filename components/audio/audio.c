@@ -1,43 +1,53 @@
 #include "audio.h"
+#include "audio_sink.h"
 #include "audio_common.h"
 #include "flac_wrapper.h"
 #include "mad_wrapper.h"
 #include "helix_wrapper.h"
 #include "wav_wrapper.h"
+#include "mp4_wrapper.h"
+#include "vorbis_wrapper.h"
+#include "opus_wrapper.h"
+#include "pcm_ring.h"
+#include "pcm_kernels.h"
+#include "resampler.h"
 
 #include <stdbool.h>
 #include <memory.h>
 #include <sys/param.h>
 
 #include <esp_log.h>
-#include <driver/i2s.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
 
-#define I2S_NUM     (0)
-//#define WROVER_KIT
-
-#ifdef WROVER_KIT
-#define I2S_WS      (GPIO_NUM_27)
-#define I2S_BCK     (GPIO_NUM_26)
-#define I2S_MCK     (I2S_PIN_NO_CHANGE)
-#define I2S_DO      (GPIO_NUM_25)
-#else
-#define I2S_WS      (GPIO_NUM_21)
-#define I2S_BCK     (GPIO_NUM_23)
-#define I2S_MCK     (GPIO_NUM_0)
-#define I2S_DO      (GPIO_NUM_19)
-#define MUTE        (GPIO_NUM_18)
-#endif
-
 static const char TAG[] = "audio";
 
+#define OUTPUT_DATA                     BIT0
+#define OUTPUT_PAUSE                    BIT1
+#define OUTPUT_RESUME                   BIT2
+#define OUTPUT_FLUSH                    BIT3
+#define OUTPUT_RECLOCK                  BIT4
+#define OUTPUT_DISCARD                  BIT5
+#define OUTPUT_MUTE                     BIT6
+
+#define OUTPUT_CHUNK_FRAMES 511
+#define OUTPUT_WAIT_MS      50
+#define GAIN_RAMP_FRAMES    256
+#define RESAMPLE_FRAMES     256
+
+static const AudioSink_t* sink;
 static xTaskHandle audio_task;
+static xTaskHandle output_task;
 static SemaphoreHandle_t audio_mutex;
+static SemaphoreHandle_t ring_space;
+static SemaphoreHandle_t output_ack;
 static AudioDecoderConfig_t decoder_config;
+static PcmRing_t* output_ring;
 
-#define MAX_DECODERS 6
+#define MAX_DECODERS 15
 static const struct {
     const char* mime_type;
     const DecoderWrapper_t* decoder;
@@ -47,23 +57,105 @@ static const struct {
         { "audio/mpeg", &mad_wrapper },
         { "audio/aac", &helix_wrapper },
         { "audio/wav", &wav_wrapper },
-        { "audio/x-wav", &wav_wrapper }
+        { "audio/x-wav", &wav_wrapper },
+        { "audio/mp4", &mp4_wrapper },
+        { "audio/x-m4a", &mp4_wrapper },
+        { "audio/m4a", &mp4_wrapper },
+        { "audio/ogg", &vorbis_wrapper },
+        { "audio/vorbis", &vorbis_wrapper },
+        { "application/ogg", &vorbis_wrapper },
+        { "audio/opus", &opus_wrapper },
+        { "audio/ogg", &opus_wrapper },
+        { "application/ogg", &opus_wrapper }
 };
 static const DecoderWrapper_t* current_decoder = NULL;
+static const char* current_type = NULL;
 
 static const unsigned int max_sample_rate = 48000;
 
+#define BRIDGE_LEN 8192
+// Forward seeks shorter than this read through the stream rather than reopening it
+#define SEEK_READ_LEN (64 * 1024)
+
+// Positions are absolute stream offsets. The bridge only holds data while a peek straddles two stream buffers:
+// it starts with the tail of the previous buffer, followed by a copy of the head of the current one.
 struct {
+    const uint8_t* pending_buffer;
+    size_t pending_length;
     const uint8_t* current_buffer;
+    size_t buffer_start;
     size_t buffer_length;
-    size_t remaining_bytes;
-    size_t offset;
-    size_t total_written;
-    int32_t* write_buff;
+    size_t position;
+    uint8_t* bridge;
+    size_t bridge_start;
+    size_t bridge_length;
     unsigned int sample_rate;
+    unsigned int bit_depth;
     bool failed;
+    bool started;
+    int64_t start_time;
 } buffer_info = { 0 };
 
+static uint32_t track_start_ms = 0;
+
+// Timed from audio_seek() to the first samples written from the new position
+static struct {
+    int64_t request_time;
+    bool measuring;
+    uint32_t restarts;
+    uint32_t count;
+    uint32_t last_ms;
+    uint32_t max_ms;
+    uint32_t last_restarts;
+} seek_stats = { 0 };
+
+static struct {
+    unsigned int sample_rate;
+    unsigned int pending_rate;
+    unsigned int slot_bits;
+    unsigned int pending_bits;
+    bool native_width;
+    bool paused;
+    bool starved;
+    bool sink_queued;       // Written to the sink since it was last drained or flushed
+    int64_t resume_time;
+    // Ring position of the current track's first frame, until the output has reached it
+    uint32_t track_start;
+    volatile bool track_pending;
+} output_info = { 0 };
+
+// The target is set from any task. The rest belongs to the output task, which ramps towards the target as frames
+// go to the sink, so a change is heard once the sink's own queue has played out rather than the whole ring.
+static struct {
+    volatile int32_t volume;
+    volatile bool muted;
+    int32_t current;
+    int32_t ramp_target;
+    int32_t step;
+    size_t ramp_left;
+    bool sink_muted;
+    size_t silent_frames;   // Written at zero gain since the ramp down ended
+} gain_info = {
+    .volume = PCM_GAIN_UNITY,
+    .current = PCM_GAIN_UNITY,
+    .ramp_target = PCM_GAIN_UNITY
+};
+
+// Only used from the decoder task, or with audio_mutex held
+static struct {
+    unsigned int output_rate;
+    AudioResampleQuality_t quality;
+    Resampler_t* resampler;
+    int32_t left[RESAMPLE_FRAMES];
+    int32_t right[RESAMPLE_FRAMES];
+} resample_info = { 0 };
+
+static volatile bool decoder_stop = false;
+static volatile bool decoder_running = false;
+static volatile bool decoder_ended = false;
+static volatile bool seek_requested = false;
+static volatile uint32_t seek_target_ms = 0;
+
 static inline void send_ready(void) {
     decoder_config.decoder_ready_cb();
 }
@@ -73,102 +165,282 @@ void send_finished(void) {
     decoder_config.decoder_finished_cb();
 }
 
-static size_t fill_buffer(uint8_t* encoded_buffer, size_t buffer_length) {
-    assert(buffer_length != 0);
+static bool next_buffer(void) {
+    size_t next_start = buffer_info.buffer_start + buffer_info.buffer_length;
+
+    send_ready();
+    uint32_t bits = 0;
+    do {
+        xTaskNotifyWait(0, CONTINUE_DECODER, &bits, portMAX_DELAY);
+        if (bits & STOP_DECODER) {
+            return false;
+        }
+    } while (!(bits & CONTINUE_DECODER));
+
+    // The input ends wherever an empty buffer arrives
+    if (buffer_info.pending_length == 0)
+        decoder_config.file_size = next_start;
+
+    buffer_info.current_buffer = buffer_info.pending_buffer;
+    buffer_info.buffer_start = next_start;
+    buffer_info.buffer_length = MIN(buffer_info.pending_length, decoder_config.file_size - next_start);
+    return true;
+}
 
-    if (buffer_info.failed || buffer_info.total_written == decoder_config.file_size)
+static size_t peek(const uint8_t** data, size_t min_length) {
+    if (buffer_info.failed || decoder_stop || buffer_info.position >= decoder_config.file_size)
         return 0;
 
-    size_t len = buffer_length;
+    size_t position = buffer_info.position;
+    size_t buffer_end = buffer_info.buffer_start + buffer_info.buffer_length;
+    min_length = MIN(min_length, BRIDGE_LEN);
+    min_length = MIN(min_length, decoder_config.file_size - position);
 
-    if (buffer_info.remaining_bytes == 0) {
-        send_ready();
-        uint32_t bits = 0;
-        do {
-            xTaskNotifyWait(0, CONTINUE_DECODER, &bits, portMAX_DELAY);
-            if (bits & STOP_DECODER) {
-                return 0;
-            }
-        } while (!(bits & CONTINUE_DECODER));
-        buffer_info.remaining_bytes = buffer_info.buffer_length;
-        buffer_info.offset = 0;
+    if (buffer_info.bridge_length != 0 && position >= buffer_info.buffer_start) {
+        // Consumed past the previous buffer's tail, so the current buffer can be read directly again
+        buffer_info.bridge_length = 0;
     }
 
-    len = MIN(len, buffer_info.remaining_bytes);
-    len = MIN(len, decoder_config.file_size - buffer_info.total_written);
-
-    buffer_info.remaining_bytes -= len;
+    if (buffer_info.bridge_length == 0) {
+        if (position == buffer_end) {
+            if (next_buffer() == false)
+                return 0;
+            buffer_end = buffer_info.buffer_start + buffer_info.buffer_length;
+        }
 
-    memcpy(encoded_buffer, buffer_info.current_buffer + buffer_info.offset, len);
-    buffer_info.offset += len;
-    buffer_info.total_written += len;
+        size_t available = buffer_end - position;
+        *data = buffer_info.current_buffer + (position - buffer_info.buffer_start);
+        if (available >= min_length)
+            return available;
+
+        memcpy(buffer_info.bridge, *data, available);
+        buffer_info.bridge_start = position;
+        buffer_info.bridge_length = available;
+
+        if (next_buffer() == false)
+            return 0;
+    } else if (position != buffer_info.bridge_start) {
+        size_t skip = position - buffer_info.bridge_start;
+        buffer_info.bridge_length -= skip;
+        memmove(buffer_info.bridge, buffer_info.bridge + skip, buffer_info.bridge_length);
+        buffer_info.bridge_start = position;
+    }
 
-    if (len < buffer_length){
-        size_t tmp = buffer_length - len;
-        len += fill_buffer(encoded_buffer + len, tmp);
+    // Top the bridge up from the head of the current buffer
+    if (buffer_info.bridge_length < min_length) {
+        size_t copied = buffer_info.bridge_start + buffer_info.bridge_length - buffer_info.buffer_start;
+        size_t len = MIN(min_length - buffer_info.bridge_length, buffer_info.buffer_length - copied);
+        memcpy(buffer_info.bridge + buffer_info.bridge_length, buffer_info.current_buffer + copied, len);
+        buffer_info.bridge_length += len;
     }
 
-    return len;
+    *data = buffer_info.bridge;
+    return buffer_info.bridge_length;
 }
 
-static bool write(const int32_t* left_samples, const int32_t* right_samples, size_t sample_length, unsigned int sample_rate, unsigned int bit_depth) {
-    if (buffer_info.failed) {
-        i2s_zero_dma_buffer(I2S_NUM);
+static void consume(size_t length) {
+    buffer_info.position += length;
+    assert(buffer_info.position <= decoder_config.file_size);
+}
+
+static bool seek(size_t position) {
+    if (position > decoder_config.file_size)
         return false;
+
+    size_t buffer_end = buffer_info.buffer_start + buffer_info.buffer_length;
+    if (position >= buffer_info.buffer_start && position <= buffer_end) {
+        buffer_info.position = position;
+        return true;
     }
 
-    if (buffer_info.sample_rate != sample_rate) {
-        buffer_info.sample_rate = sample_rate;
-        i2s_set_sample_rates(I2S_NUM, sample_rate);
+    if (position > buffer_end && (position - buffer_end < SEEK_READ_LEN || decoder_config.seek_cb == NULL)) {
+        buffer_info.position = MAX(buffer_info.position, buffer_end);
+        while (buffer_info.position < position) {
+            const uint8_t* data;
+            size_t len = peek(&data, 0);
+            if (len == 0)
+                return false;
+            consume(MIN(len, position - buffer_info.position));
+        }
+        return true;
     }
 
-    if (buffer_info.write_buff == NULL) {
-        buffer_info.write_buff = malloc(2*sample_length*sizeof(int32_t));
-        assert(buffer_info.write_buff != NULL);
+    if (decoder_config.seek_cb == NULL)
+        return false;
+
+    // The next peek() asks for a buffer, which the input now starts at position
+    ESP_LOGI(TAG, "Seeking input to %u", position);
+    buffer_info.buffer_start = position;
+    buffer_info.buffer_length = 0;
+    buffer_info.bridge_length = 0;
+    buffer_info.position = position;
+    seek_stats.restarts++;
+    decoder_config.seek_cb(position);
+    return true;
+}
+
+static size_t read_at(size_t position, uint8_t* buffer, size_t length) {
+    if (decoder_config.read_cb == NULL || position >= decoder_config.file_size)
+        return 0;
+    return decoder_config.read_cb(position, buffer, MIN(length, decoder_config.file_size - position));
+}
+
+// Blocks until the output task has played everything in the ring
+static bool output_drain(void) {
+    while (pcm_ring_fill(output_ring) > 0) {
+        if (decoder_stop)
+            return false;
+        xSemaphoreTake(ring_space, pdMS_TO_TICKS(OUTPUT_WAIT_MS));
     }
 
-    size_t shift = 0;
-    if (bit_depth == 24)
-        shift = 8;
-    else if (bit_depth == 16)
-        shift = 16;
+    return true;
+}
+
+static bool output_reclock(unsigned int sample_rate, unsigned int slot_bits) {
+    if (output_drain() == false)
+        return false;
 
-    int j = 0;
-    for (int i = 0; i < sample_length; i++) {
-        buffer_info.write_buff[j++] = left_samples[i] << shift;
-        buffer_info.write_buff[j++] = right_samples[i] << shift;
+    output_info.pending_rate = sample_rate;
+    output_info.pending_bits = slot_bits;
+    xTaskNotify(output_task, OUTPUT_RECLOCK, eSetBits);
+    xSemaphoreTake(output_ack, portMAX_DELAY);
+    return true;
+}
+
+// 16-bit sources get 16-bit slots in native width mode, which halves the DMA memory and bus traffic.
+// Anything deeper, and streams that have not said, keep the slots they have.
+static unsigned int output_slot_bits(unsigned int bit_depth) {
+    if (!output_info.native_width)
+        return 32;
+
+    if (bit_depth == 0)
+        return output_info.slot_bits;
+
+    return bit_depth <= 16 ? 16 : 32;
+}
+
+// Rates above the configured output rate are resampled instead of reclocking the APLL
+static bool configure_output(unsigned int sample_rate, unsigned int bit_depth) {
+    unsigned int output_rate = sample_rate;
+    unsigned int slot_bits = output_slot_bits(bit_depth);
+
+    if (resample_info.quality != AUDIO_RESAMPLE_OFF && sample_rate > resample_info.output_rate) {
+        output_rate = resample_info.output_rate;
+        Resampler_t* resampler = resample_info.resampler;
+
+        if (resampler == NULL || resampler->in_rate != sample_rate || resampler->out_rate != output_rate) {
+            if (resampler != NULL)
+                resampler_delete(resampler);
+
+            resample_info.resampler = resampler_create(sample_rate, output_rate, resample_info.quality);
+            ESP_LOGI(TAG, "Resampling %u Hz to %u Hz (%u taps)", sample_rate, output_rate, resample_info.resampler->taps);
+        }
+    } else if (resample_info.resampler != NULL) {
+        resampler_delete(resample_info.resampler);
+        resample_info.resampler = NULL;
     }
 
-    uint32_t bits = 0;
-    xTaskNotifyWait(0, (STOP_DECODER | PAUSE_DECODER), &bits, 0);
+    if (output_rate == output_info.sample_rate && slot_bits == output_info.slot_bits)
+        return true;
+
+    return output_reclock(output_rate, slot_bits);
+}
+
+static bool update_format(unsigned int sample_rate, unsigned int bit_depth) {
+    if (buffer_info.sample_rate == sample_rate && buffer_info.bit_depth == bit_depth)
+        return true;
+
+    buffer_info.sample_rate = sample_rate;
+    buffer_info.bit_depth = bit_depth;
+    return configure_output(sample_rate, bit_depth);
+}
+
+static void log_track_start(void) {
+    buffer_info.started = true;
+    track_start_ms = (esp_timer_get_time() - buffer_info.start_time) / 1000;
+
+    ESP_LOGI(TAG, "First samples after %u ms, minimum free heap %u internal, %u SPIRAM", track_start_ms,
+             heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL), heap_caps_get_minimum_free_size(MALLOC_CAP_SPIRAM));
+}
+
+static void log_seek(void) {
+    seek_stats.measuring = false;
+    seek_stats.count++;
+    seek_stats.last_ms = (esp_timer_get_time() - seek_stats.request_time) / 1000;
+    seek_stats.max_ms = MAX(seek_stats.max_ms, seek_stats.last_ms);
+    seek_stats.last_restarts = seek_stats.restarts;
 
-    if (bits & STOP_DECODER)
+    ESP_LOGI(TAG, "Seek played after %u ms with %u input restarts (%u seeks, slowest %u ms)",
+             seek_stats.last_ms, seek_stats.last_restarts, seek_stats.count, seek_stats.max_ms);
+}
+
+static bool write(const int32_t* left_samples, const int32_t* right_samples, size_t sample_length, unsigned int sample_rate, unsigned int bit_depth) {
+    if (buffer_info.failed || decoder_stop)
         return false;
 
-    if (bits & PAUSE_DECODER) {
-        i2s_zero_dma_buffer(I2S_NUM);
-        do {
-            xTaskNotifyWait(0, (PAUSE_DECODER | STOP_DECODER | RESUME_DECODER), &bits, portMAX_DELAY);
+    // Whatever is decoded before a pending seek would be dropped, so the decoder is let through to it
+    if (seek_requested)
+        return true;
 
-            if (bits & STOP_DECODER)
+    if (!buffer_info.started)
+        log_track_start();
+
+    if (seek_stats.measuring)
+        log_seek();
+
+    if (update_format(sample_rate, bit_depth) == false)
+        return false;
+
+    unsigned int shift = pcm_normalize_shift(bit_depth);
+    Resampler_t* resampler = resample_info.resampler;
+
+    size_t i = 0;
+    while (i < sample_length) {
+        int32_t* frames;
+        size_t len = pcm_ring_write_begin(output_ring, &frames);
+
+        if (len == 0) {
+            if (decoder_stop)
                 return false;
 
-        } while ((bits & RESUME_DECODER) == false);
+            xSemaphoreTake(ring_space, pdMS_TO_TICKS(OUTPUT_WAIT_MS));
+            continue;
+        }
+
+        if (resampler != NULL) {
+            size_t in_len = sample_length - i;
+            len = resampler_process(resampler, left_samples + i, right_samples + i, &in_len,
+                                    resample_info.left, resample_info.right, MIN(len, RESAMPLE_FRAMES), shift);
+            const int32_t* right = left_samples == right_samples ? resample_info.left : resample_info.right;
+            pcm_interleave(frames, resample_info.left, right, len, 0);
+            i += in_len;
+        } else {
+            len = MIN(len, sample_length - i);
+            pcm_interleave(frames, left_samples + i, right_samples + i, len, shift);
+            i += len;
+        }
+
+        pcm_ring_write_end(output_ring, len);
+        xTaskNotify(output_task, OUTPUT_DATA, eSetBits);
     }
 
-    decoder_config.wrote_samples_cb(sample_length, sample_rate);
-    size_t bytes_written;
-    i2s_write(I2S_NUM, buffer_info.write_buff, 2*sample_length*sizeof(int32_t), &bytes_written, portMAX_DELAY);
     return true;
 }
 
 static bool eof(void) {
-    return buffer_info.total_written == decoder_config.file_size;
+    return buffer_info.position == decoder_config.file_size;
 }
 
+// The output task reports the end of playback once the ring has drained, unless another track follows.
+// In that case the next decoder starts filling the ring behind this track's tail, so the I2S output never stops.
 static void decoder_finished(void) {
     ESP_LOGI(TAG, "Decoder finished");
-    decoder_config.decoder_finished_cb();
+    decoder_running = false;
+    if (decoder_config.track_ending_cb != NULL && decoder_config.track_ending_cb())
+        return;
+
+    decoder_ended = true;
+    xTaskNotify(output_task, OUTPUT_DATA, eSetBits);
 }
 
 static void decoder_failed(void) {
@@ -178,7 +450,7 @@ static void decoder_failed(void) {
 }
 
 static size_t bytes_elapsed(void) {
-    return buffer_info.total_written;
+    return buffer_info.position;
 }
 
 static size_t total_bytes(void) {
@@ -186,36 +458,126 @@ static size_t total_bytes(void) {
 }
 
 void audio_pause_playback(void) {
-    xTaskNotify(audio_task, PAUSE_DECODER, eSetBits);
+    xTaskNotify(output_task, OUTPUT_PAUSE, eSetBits);
 }
 
 void audio_resume_playback(void) {
-    xTaskNotify(audio_task, RESUME_DECODER, eSetBits);
+    output_info.resume_time = esp_timer_get_time();
+    xTaskNotify(output_task, OUTPUT_RESUME, eSetBits);
+}
+
+void audio_set_volume(int volume_db) {
+    gain_info.volume = pcm_gain_from_db(volume_db);
+}
+
+// The gain ramps down as the output task writes, and the sink's own mute is switched once that has played
+void audio_set_mute(bool mute) {
+    gain_info.muted = mute;
+    xTaskNotify(output_task, OUTPUT_MUTE, eSetBits);
+}
+
+// Takes effect from the next change of stream sample rate
+void audio_set_resampling(unsigned int output_rate, AudioResampleQuality_t quality) {
+    xSemaphoreTake(audio_mutex, portMAX_DELAY);
+    resample_info.output_rate = MIN(output_rate, max_sample_rate);
+    resample_info.quality = quality;
+    buffer_info.sample_rate = 0;
+    xSemaphoreGive(audio_mutex);
+}
+
+// Takes effect from the next track or change of stream format
+void audio_set_native_width(bool enabled) {
+    xSemaphoreTake(audio_mutex, portMAX_DELAY);
+    output_info.native_width = enabled;
+    buffer_info.sample_rate = 0;
+    xSemaphoreGive(audio_mutex);
 }
 
 void audio_reset(void) {
+    decoder_stop = true;
+    decoder_ended = false;
     xTaskNotify(audio_task, STOP_DECODER, eSetBits);
     xSemaphoreTake(audio_mutex, portMAX_DELAY);
-    free(buffer_info.write_buff);
+    uint8_t* bridge = buffer_info.bridge;
     memset(&buffer_info, 0, sizeof(buffer_info));
+    buffer_info.bridge = bridge;
+
+    if (resample_info.resampler != NULL)
+        resampler_reset(resample_info.resampler);
+
+    xTaskNotify(output_task, OUTPUT_FLUSH, eSetBits);
+    xSemaphoreTake(output_ack, portMAX_DELAY);
     xSemaphoreGive(audio_mutex);
 }
 
+void audio_get_output_stats(AudioOutputStats_t* stats) {
+    unsigned int sample_rate = output_info.sample_rate;
+    stats->buffered_ms = pcm_ring_fill(output_ring) * 1000 / sample_rate;
+    stats->capacity_ms = output_ring->capacity * 1000 / sample_rate;
+    stats->underruns = pcm_ring_underruns(output_ring);
+    stats->track_start_ms = track_start_ms;
+    stats->slot_bits = output_info.slot_bits;
+    stats->seeks = seek_stats.count;
+    stats->last_seek_ms = seek_stats.last_ms;
+    stats->max_seek_ms = seek_stats.max_ms;
+    stats->last_seek_restarts = seek_stats.last_restarts;
+    stats->min_free_internal = heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL);
+    stats->min_free_spiram = heap_caps_get_minimum_free_size(MALLOC_CAP_SPIRAM);
+}
+
 void audio_decoder_continue(const uint8_t* new_buffer, size_t buffer_length) {
-    buffer_info.current_buffer = new_buffer;
-    buffer_info.buffer_length = buffer_length;
+    buffer_info.pending_buffer = new_buffer;
+    buffer_info.pending_length = buffer_length;
 
     xTaskNotify(audio_task, CONTINUE_DECODER, eSetBits);
 }
 
+bool audio_seek(uint32_t position_ms) {
+    if (!decoder_running || decoder_stop || !current_decoder->seekable || decoder_config.file_size == AUDIO_UNKNOWN_LENGTH)
+        return false;
+
+    seek_target_ms = position_ms;
+    seek_stats.request_time = esp_timer_get_time();
+    seek_requested = true;
+    xSemaphoreGive(ring_space);
+    return true;
+}
+
+static bool seek_pending(uint32_t* position_ms) {
+    if (!seek_requested)
+        return false;
+
+    *position_ms = seek_target_ms;
+    seek_requested = false;
+    seek_stats.restarts = 0;
+    return true;
+}
+
+static void seek_done(uint64_t sample, unsigned int sample_rate) {
+    if (resample_info.resampler != NULL)
+        resampler_reset(resample_info.resampler);
+
+    xTaskNotify(output_task, OUTPUT_DISCARD, eSetBits);
+    xSemaphoreTake(output_ack, portMAX_DELAY);
+    seek_stats.measuring = true;
+
+    if (decoder_config.seeked_cb != NULL)
+        decoder_config.seeked_cb(sample, sample_rate);
+}
+
 static const AudioContext_t context = {
-        .fill_buffer = fill_buffer,
+        .peek = peek,
+        .consume = consume,
+        .seek = seek,
+        .read_at = read_at,
         .write = write,
         .decoder_failed = decoder_failed,
         .decoder_finished = decoder_finished,
         .bytes_elapsed = bytes_elapsed,
         .total_bytes = total_bytes,
-        .eof = eof
+        .eof = eof,
+        .seek_pending = seek_pending,
+        .seek_done = seek_done
 };
 
 bool audio_init_decoder(const char* content_type, const AudioDecoderConfig_t* config) {
@@ -231,26 +593,75 @@ bool audio_init_decoder(const char* content_type, const AudioDecoderConfig_t* co
 
     if (i == MAX_DECODERS) {
         ESP_LOGW(TAG, "Decoder not found");
+        xSemaphoreGive(audio_mutex);
         return false;
     }
 
-    if (current_decoder == decoders[i].decoder) {
-        ESP_LOGI(TAG, "Re-using previous decoder");
-    } else if (current_decoder != NULL) {
-        current_decoder->delete();
-    }
-
+    // Every decoder keeps its working memory once allocated, so switching codecs does not free anything
     current_decoder = decoders[i].decoder;
     current_decoder->init();
+    current_type = decoders[i].mime_type;
+
+    size_t buffered = pcm_ring_fill(output_ring);
+    if (buffered != 0)
+        ESP_LOGI(TAG, "Track handover with %u ms buffered", buffered * 1000 / output_info.sample_rate);
+
+    // Input state is reset here rather than in audio_reset() so the previous track's tail keeps playing
+    uint8_t* bridge = buffer_info.bridge;
+    memset(&buffer_info, 0, sizeof(buffer_info));
+    buffer_info.bridge = bridge;
 
     memcpy(&decoder_config, config, sizeof(decoder_config));
-    buffer_info.sample_rate = max_sample_rate;
+    buffer_info.sample_rate = output_info.sample_rate;
+    buffer_info.start_time = esp_timer_get_time();
+
+    // The previous decoder has stopped, so everything it wrote is ahead of this point
+    output_info.track_start = pcm_ring_written(output_ring);
+    output_info.track_pending = true;
+    decoder_stop = false;
+    decoder_ended = false;
+    seek_requested = false;
 
     xSemaphoreGive(audio_mutex);
     xTaskNotify(audio_task, RUN_DECODER, eSetBits);
     return true;
 }
 
+static bool probe_decoder(const DecoderWrapper_t* decoder, AudioStreamInfo_t* info) {
+    memset(info, 0, sizeof(AudioStreamInfo_t));
+    return decoder->probe != NULL && decoder->probe(&context, info) && info->sample_rate != 0;
+}
+
+// Sets the output up from the stream header, so the first write() does not have to reclock mid-buffer.
+// Containers like Ogg carry more than one codec, so other decoders listed for the same type get a try.
+static void probe_stream(void) {
+    AudioStreamInfo_t info;
+    bool found = probe_decoder(current_decoder, &info);
+    for (int i = 0; i < MAX_DECODERS && !found; i++) {
+        const DecoderWrapper_t* decoder = decoders[i].decoder;
+        if (decoder == current_decoder || strcmp(decoders[i].mime_type, current_type) != 0)
+            continue;
+
+        decoder->init();
+        found = probe_decoder(decoder, &info);
+        if (found)
+            current_decoder = decoder;
+    }
+
+    if (!found) {
+        ESP_LOGW(TAG, "Could not probe stream header");
+        return;
+    }
+
+    ESP_LOGI(TAG, "Stream is %u Hz, %u bit, %u channels, %llu samples",
+             info.sample_rate, info.bit_depth, info.channels, info.total_samples);
+
+    update_format(info.sample_rate, info.bit_depth);
+
+    if (decoder_config.stream_info_cb != NULL)
+        decoder_config.stream_info_cb(&info);
+}
+
 _Noreturn static void audio_loop(void* args) {
     ESP_LOGI(TAG, "Audio loop started");
     while(1) {
@@ -261,45 +672,189 @@ _Noreturn static void audio_loop(void* args) {
             ESP_LOGI(TAG, "Starting decoder");
             asm volatile("" : : : "memory");
             xSemaphoreTake(audio_mutex, portMAX_DELAY);
+            decoder_running = true;
+            probe_stream();
             current_decoder->run(&context);
-            i2s_zero_dma_buffer(I2S_NUM);
+            decoder_running = false;
             xSemaphoreGive(audio_mutex);
             ESP_LOGI(TAG, "Decoder stopped");
         }
     }
 }
 
-void audio_start(size_t stack_size, int priority) {
-    ESP_LOGI(TAG, "Initializing I2S");
-
-    i2s_config_t i2s_config = {
-            .mode = I2S_MODE_MASTER | I2S_MODE_TX,
-            .sample_rate = max_sample_rate,
-            .bits_per_sample = I2S_BITS_PER_SAMPLE_32BIT,
-            .channel_format = I2S_CHANNEL_FMT_RIGHT_LEFT,
-            .communication_format = I2S_COMM_FORMAT_STAND_I2S,
-            .tx_desc_auto_clear = true,
-            .dma_buf_count = 8,
-            .dma_buf_len = 511,
-            .use_apll = true,
-            .intr_alloc_flags = ESP_INTR_FLAG_LEVEL1
-    };
-    i2s_driver_install(I2S_NUM, &i2s_config, 0, NULL);
-
-    i2s_pin_config_t pin_config = {
-            .mck_io_num = I2S_MCK,
-            .bck_io_num = I2S_BCK,
-            .ws_io_num = I2S_WS,
-            .data_out_num = I2S_DO,
-            .data_in_num = I2S_PIN_NO_CHANGE
-    };
-    i2s_set_pin(I2S_NUM, &pin_config);
-
-#ifndef WROVER_KIT
-    gpio_set_direction(MUTE, GPIO_MODE_OUTPUT);
-    gpio_set_level(MUTE, 1);
-#endif
+// Waits for the sink to play out what it holds, so nothing queued at the old clock is cut or played at the new one
+static void sink_drain(void) {
+    if (!output_info.sink_queued)
+        return;
+
+    sink->drain();
+    output_info.sink_queued = false;
+}
+
+static void set_sink_mute(bool mute) {
+    sink->mute(mute);
+    gain_info.sink_muted = mute;
+    gain_info.silent_frames = 0;
+}
+
+// Frames are written at the gain they play at, with a chunk cut short where a ramp ends. The DAC is muted once the
+// ramp down has played out of the sink's queue.
+static size_t write_frames(const int32_t* frames, size_t len) {
+    int32_t target = gain_info.muted ? 0 : gain_info.volume;
+    if (target != gain_info.ramp_target) {
+        gain_info.ramp_target = target;
+        gain_info.step = ((int64_t)target - gain_info.current) / GAIN_RAMP_FRAMES;
+        gain_info.ramp_left = GAIN_RAMP_FRAMES;
+    }
+
+    if (gain_info.ramp_left != 0) {
+        len = sink->write(frames, MIN(len, gain_info.ramp_left), gain_info.current, gain_info.step);
+        gain_info.current += gain_info.step * (int32_t)len;
+        gain_info.ramp_left -= len;
+        if (gain_info.ramp_left == 0)
+            gain_info.current = gain_info.ramp_target;
+        return len;
+    }
+
+    len = sink->write(frames, len, gain_info.current, 0);
+    if (gain_info.muted && !gain_info.sink_muted && gain_info.current == 0) {
+        gain_info.silent_frames += len;
+        if (gain_info.silent_frames > sink->latency())
+            set_sink_mute(true);
+    }
+    return len;
+}
+
+static void service_output(uint32_t bits) {
+    // A seek drops what is queued but stays paused if it was
+    if (bits & OUTPUT_DISCARD) {
+        // The seek sets the position itself, so a track start dropped with the ring is not reported
+        output_info.track_pending = false;
+        pcm_ring_flush(output_ring);
+        sink->flush();
+        output_info.sink_queued = false;
+        xSemaphoreGive(ring_space);
+        xSemaphoreGive(output_ack);
+    }
+
+    if (bits & OUTPUT_FLUSH) {
+        output_info.track_pending = false;
+        pcm_ring_flush(output_ring);
+        sink->flush();
+        output_info.sink_queued = false;
+        output_info.paused = false;
+        xSemaphoreGive(ring_space);
+        xSemaphoreGive(output_ack);
+    }
+
+    if (bits & OUTPUT_RECLOCK) {
+        output_info.sample_rate = output_info.pending_rate;
+        output_info.slot_bits = output_info.pending_bits;
+        sink_drain();
+        sink->open(output_info.sample_rate, output_info.slot_bits);
+        xSemaphoreGive(output_ack);
+    }
+
+    if (bits & OUTPUT_PAUSE) {
+        output_info.paused = true;
+        sink->pause(true);
+    } else if (bits & OUTPUT_RESUME) {
+        output_info.paused = false;
+        sink->pause(false);
+    }
+
+    // The DAC is released before the ramp up is written; muting waits for the ramp down in write_frames()
+    if ((bits & OUTPUT_MUTE) && !gain_info.muted && gain_info.sink_muted)
+        set_sink_mute(false);
+}
+
+_Noreturn static void output_loop(void* args) {
+    ESP_LOGI(TAG, "Output loop started");
+    while (1) {
+        uint32_t bits = 0;
+        xTaskNotifyWait(0, ULONG_MAX, &bits, 0);
+        service_output(bits);
+
+        const int32_t* frames;
+        size_t len = output_info.paused ? 0 : pcm_ring_read_begin(output_ring, &frames);
+
+        if (len == 0) {
+            if (!output_info.paused && decoder_running && !output_info.starved) {
+                pcm_ring_count_underrun(output_ring);
+                ESP_LOGD(TAG, "Output underrun (%u)", pcm_ring_underruns(output_ring));
+            }
+            output_info.starved = true;
+
+            if (!output_info.paused && decoder_ended) {
+                decoder_ended = false;
+                sink_drain();
+                decoder_config.decoder_finished_cb();
+            }
+
+            // With nothing left to ramp, the DAC is muted once the sink has played what it holds
+            if (gain_info.muted && !gain_info.sink_muted) {
+                if (!output_info.paused)
+                    sink_drain();
+                gain_info.current = gain_info.ramp_target = 0;
+                gain_info.ramp_left = 0;
+                set_sink_mute(true);
+            }
+
+            xTaskNotifyWait(0, ULONG_MAX, &bits, portMAX_DELAY);
+            service_output(bits);
+            continue;
+        }
+
+        output_info.starved = false;
+        len = MIN(len, OUTPUT_CHUNK_FRAMES);
+
+        // The previous track's tail is counted as its own, and the chunk split where the current track begins
+        if (output_info.track_pending) {
+            int32_t until_start = (int32_t)(output_info.track_start - pcm_ring_read(output_ring));
+            if (until_start <= 0) {
+                output_info.track_pending = false;
+                if (decoder_config.track_started_cb != NULL)
+                    decoder_config.track_started_cb();
+            } else {
+                len = MIN(len, (size_t)until_start);
+            }
+        }
+
+        len = write_frames(frames, len);
+        output_info.sink_queued = true;
+        pcm_ring_read_end(output_ring, len);
+        xSemaphoreGive(ring_space);
+
+        if (output_info.resume_time != 0) {
+            // Everything the sink queued ahead of these samples still has to play out
+            unsigned int queued_ms = sink->latency() * 1000 / output_info.sample_rate;
+            ESP_LOGI(TAG, "Output started %lld us after resume, at most %u ms behind the sink",
+                     esp_timer_get_time() - output_info.resume_time, queued_ms);
+            output_info.resume_time = 0;
+        }
+
+        decoder_config.wrote_samples_cb(len, output_info.sample_rate);
+    }
+}
+
+void audio_start(const AudioSink_t* output_sink, size_t stack_size, int priority, unsigned int buffer_ms) {
+    sink = output_sink;
+    output_info.slot_bits = 32;
+    if (!sink->open(max_sample_rate, output_info.slot_bits))
+        ESP_LOGE(TAG, "Cannot open the output sink");
+
+    pcm_gain_init();
+
+    output_info.sample_rate = max_sample_rate;
+    output_ring = pcm_ring_create(buffer_ms * max_sample_rate / 1000);
+    ESP_LOGI(TAG, "Output buffer holds %u frames", output_ring->capacity);
+
+    buffer_info.bridge = malloc(BRIDGE_LEN);
+    assert(buffer_info.bridge != NULL);
 
     audio_mutex = xSemaphoreCreateMutex();
-    xTaskCreate(audio_loop, "Audio Loop", stack_size, NULL, priority, &audio_task);
+    ring_space = xSemaphoreCreateBinary();
+    output_ack = xSemaphoreCreateBinary();
+    xTaskCreate(output_loop, "Audio Output", stack_size, NULL, priority+1, &output_task);
+    xTaskCreatePinnedToCore(audio_loop, "Audio Loop", stack_size, NULL, priority, &audio_task, DECODER_CORE);
 }
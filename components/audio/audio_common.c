@@ -1 +1,23 @@
 #include "audio_common.h"
+
+#include <string.h>
+
+// Length of an ID3v2 tag at the start of data, including its header and footer
+size_t id3v2_length(const uint8_t* data, size_t length) {
+    if (length < 10 || memcmp(data, "ID3", 3) != 0)
+        return 0;
+
+    // The size is syncsafe: 7 bits per byte
+    size_t size = ((data[6] & 0x7F) << 21) | ((data[7] & 0x7F) << 14) | ((data[8] & 0x7F) << 7) | (data[9] & 0x7F);
+    size += 10;
+    if (data[5] & 0x10)
+        size += 10;
+
+    return size;
+}
+
+// peek() returns nothing once the decoder is stopped, which is not a stream error
+bool input_stopped(const AudioContext_t* ctx) {
+    const uint8_t* data;
+    return ctx->peek(&data, 0) == 0 && !ctx->eof();
+}
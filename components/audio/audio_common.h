@@ -5,28 +5,64 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "audio.h"
+
 #define STOP_DECODER                    BIT0
 #define CONTINUE_DECODER                BIT1
 #define RUN_DECODER                     BIT2
-#define PAUSE_DECODER                  BIT3
-#define RESUME_DECODER                 BIT4
 
+// Headers are probed from a single peek, so anything past this is not seen
+#define PROBE_LEN                       4096
+
+// The decoder task is pinned here, and helper tasks that must overlap with it go on the other core
+#define DECODER_CORE                    0
+#define DECODER_HELPER_CORE             ((DECODER_CORE + 1) % portNUM_PROCESSORS)
+
+// peek() returns how many contiguous bytes are readable at *data without copying them out of the stream buffers.
+// At least min_length bytes (up to 8 KB) are returned unless the stream ends first; 0 means end of stream or stop.
+// The pointer stays valid until the next peek(). consume() advances past bytes the decoder is done with.
+// seek() moves to an absolute offset. Short forward seeks read through the stream, anything else restarts the
+// input there. It returns false if the input cannot seek.
+// read_at() reads from an absolute offset and leaves the input where it is, for the odd table far from the audio.
+// It returns how many bytes were read, 0 if the input cannot.
+// seek_pending() returns true once for each audio_seek() with its target. The decoder moves its input there and
+// calls seek_done() with the first sample it will write, which drops everything decoded from before the seek.
 struct AudioContext {
-    size_t (*fill_buffer)(uint8_t* encoded_buffer, size_t buff_len);
+    size_t (*peek)(const uint8_t** data, size_t min_length);
+    void (*consume)(size_t length);
+    bool (*seek)(size_t position);
+    size_t (*read_at)(size_t position, uint8_t* buffer, size_t length);
     bool (*write)(const int32_t* left_samples, const int32_t* right_samples, size_t sample_length, unsigned int sample_rate, unsigned int bit_depth);
     void (*decoder_failed)(void);
     void (*decoder_finished)(void);
     size_t (*bytes_elapsed)(void);
     size_t (*total_bytes)(void);
     bool (*eof)(void);
+    bool (*seek_pending)(uint32_t* position_ms);
+    void (*seek_done)(uint64_t sample, unsigned int sample_rate);
 };
 typedef struct AudioContext AudioContext_t;
 
+// init() is called for every track. Working memory is allocated on the first call and then kept, so track
+// changes and codec switches never go back to the allocator; later calls only reset per-track state.
+// probe() reads the stream header with peek() only, so run() still starts at the beginning of the stream.
+// It fills in what the header gives and returns false if the header was not recognised.
+// seekable decoders check seek_pending() between frames.
 struct DecoderWrapper {
     void (*init)(void);
+    bool (*probe)(const AudioContext_t* ctx, AudioStreamInfo_t* info);
     void (*run)(const AudioContext_t* ctx);
     void (*delete)(void);
+    bool seekable;
 };
 typedef struct DecoderWrapper DecoderWrapper_t;
 
+#define READ_BE16(_buff) (((uint16_t)(_buff)[0] << 8) | (_buff)[1])
+#define READ_BE32(_buff) (((uint32_t)(_buff)[0] << 24) | ((uint32_t)(_buff)[1] << 16) | ((uint32_t)(_buff)[2] << 8) | (_buff)[3])
+#define READ_LE16(_buff) (((uint16_t)(_buff)[1] << 8) | (_buff)[0])
+#define READ_LE32(_buff) (((uint32_t)(_buff)[3] << 24) | ((uint32_t)(_buff)[2] << 16) | ((uint32_t)(_buff)[1] << 8) | (_buff)[0])
+
+size_t id3v2_length(const uint8_t* data, size_t length);
+bool input_stopped(const AudioContext_t* ctx);
+
 #endif //AIRDAC_FIRMWARE_AUDIO_COMMON_H
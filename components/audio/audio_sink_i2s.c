@@ -0,0 +1,181 @@
+#include "audio_sink.h"
+#include "pcm_ring.h"
+#include "pcm_kernels.h"
+
+#include <esp_log.h>
+#include <driver/i2s.h>
+#include <driver/gpio.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#define I2S_NUM     (0)
+//#define WROVER_KIT
+
+#ifdef WROVER_KIT
+#define I2S_WS      (GPIO_NUM_27)
+#define I2S_BCK     (GPIO_NUM_26)
+#define I2S_MCK     (I2S_PIN_NO_CHANGE)
+#define I2S_DO      (GPIO_NUM_25)
+#else
+#define I2S_WS      (GPIO_NUM_21)
+#define I2S_BCK     (GPIO_NUM_23)
+#define I2S_MCK     (GPIO_NUM_0)
+#define I2S_DO      (GPIO_NUM_19)
+#define MUTE        (GPIO_NUM_18)
+#endif
+
+// The DMA queue is kept short so output starts quickly after a resume; the PCM ring does the buffering
+#define DMA_BUF_COUNT       4
+#define DMA_BUF_LEN         511
+
+static const char TAG[] = "audio_i2s";
+
+static bool installed = false;
+static unsigned int current_bits;
+static unsigned int current_rate;
+
+// Attenuated frames are scaled, and 16-bit slots packed, here a DMA buffer at a time
+static union {
+    int32_t wide[DMA_BUF_LEN * PCM_RING_CHANNELS];
+    int16_t narrow[DMA_BUF_LEN * PCM_RING_CHANNELS];
+} staged;
+
+static void log_dma(void) {
+    ESP_LOGI(TAG, "%u-bit slots, %u bytes of DMA buffers", current_bits,
+             DMA_BUF_COUNT * DMA_BUF_LEN * PCM_RING_CHANNELS * current_bits / 8);
+}
+
+static void install(unsigned int sample_rate, unsigned int slot_bits) {
+    ESP_LOGI(TAG, "Initializing I2S");
+
+    i2s_config_t i2s_config = {
+            .mode = I2S_MODE_MASTER | I2S_MODE_TX,
+            .sample_rate = sample_rate,
+            .bits_per_sample = slot_bits,
+            .channel_format = I2S_CHANNEL_FMT_RIGHT_LEFT,
+            .communication_format = I2S_COMM_FORMAT_STAND_I2S,
+            .tx_desc_auto_clear = true,
+            .dma_buf_count = DMA_BUF_COUNT,
+            .dma_buf_len = DMA_BUF_LEN,
+            .use_apll = true,
+            .intr_alloc_flags = ESP_INTR_FLAG_LEVEL1
+    };
+    i2s_driver_install(I2S_NUM, &i2s_config, 0, NULL);
+
+    i2s_pin_config_t pin_config = {
+            .mck_io_num = I2S_MCK,
+            .bck_io_num = I2S_BCK,
+            .ws_io_num = I2S_WS,
+            .data_out_num = I2S_DO,
+            .data_in_num = I2S_PIN_NO_CHANGE
+    };
+    i2s_set_pin(I2S_NUM, &pin_config);
+
+#ifndef WROVER_KIT
+    gpio_set_direction(MUTE, GPIO_MODE_OUTPUT);
+    gpio_set_level(MUTE, 1);
+#endif
+
+    installed = true;
+    current_bits = slot_bits;
+    current_rate = sample_rate;
+    log_dma();
+}
+
+// A change of slot width makes the driver reallocate its DMA buffers at the new size
+static bool i2s_sink_open(unsigned int sample_rate, unsigned int slot_bits) {
+    if (!installed) {
+        install(sample_rate, slot_bits);
+        return true;
+    }
+
+    if (slot_bits == current_bits) {
+        if (i2s_set_sample_rates(I2S_NUM, sample_rate) != ESP_OK)
+            return false;
+
+        current_rate = sample_rate;
+        return true;
+    }
+
+    if (i2s_set_clk(I2S_NUM, sample_rate, slot_bits, I2S_CHANNEL_STEREO) != ESP_OK)
+        return false;
+
+    current_bits = slot_bits;
+    current_rate = sample_rate;
+    log_dma();
+    return true;
+}
+
+// At unity gain 32-bit frames go to the driver as they are. Otherwise the gain is applied in the one pass that
+// copies or packs them.
+static size_t i2s_sink_write(const int32_t* frames, size_t count, int32_t gain, int32_t step) {
+    size_t bytes_written;
+    bool unity = gain == PCM_GAIN_UNITY && step == 0;
+    if (current_bits == 32 && unity) {
+        i2s_write(I2S_NUM, frames, count * PCM_RING_CHANNELS * sizeof(int32_t), &bytes_written, portMAX_DELAY);
+        return bytes_written / (PCM_RING_CHANNELS * sizeof(int32_t));
+    }
+
+    count = count < DMA_BUF_LEN ? count : DMA_BUF_LEN;
+    if (current_bits == 32) {
+        pcm_copy_gain(staged.wide, frames, count, gain, step);
+        i2s_write(I2S_NUM, staged.wide, count * PCM_RING_CHANNELS * sizeof(int32_t), &bytes_written, portMAX_DELAY);
+        return bytes_written / (PCM_RING_CHANNELS * sizeof(int32_t));
+    }
+
+    if (unity)
+        pcm_pack_16(staged.narrow, frames, count * PCM_RING_CHANNELS);
+    else
+        pcm_pack_16_gain(staged.narrow, frames, count, gain, step);
+    i2s_write(I2S_NUM, staged.narrow, count * PCM_RING_CHANNELS * sizeof(int16_t), &bytes_written, portMAX_DELAY);
+    return bytes_written / (PCM_RING_CHANNELS * sizeof(int16_t));
+}
+
+// The driver cannot say when its queue has gone out, so this waits for every DMA buffer to be clocked out once
+static void i2s_sink_drain(void) {
+    if (!installed)
+        return;
+
+    unsigned int queue_ms = DMA_BUF_COUNT * DMA_BUF_LEN * 1000 / current_rate + 1;
+    vTaskDelay(pdMS_TO_TICKS(queue_ms) + 1);
+}
+
+static void i2s_sink_flush(void) {
+    i2s_zero_dma_buffer(I2S_NUM);
+}
+
+static void i2s_sink_pause(bool paused) {
+    if (paused)
+        i2s_zero_dma_buffer(I2S_NUM);
+}
+
+// At most every DMA buffer but the one being clocked out
+static size_t i2s_sink_latency(void) {
+    return (DMA_BUF_COUNT - 1) * DMA_BUF_LEN;
+}
+
+static void i2s_sink_mute(bool mute) {
+#ifndef WROVER_KIT
+    gpio_set_level(MUTE, mute ? 0 : 1);
+#endif
+}
+
+static void i2s_sink_close(void) {
+    if (!installed)
+        return;
+
+    i2s_driver_uninstall(I2S_NUM);
+    installed = false;
+}
+
+const AudioSink_t i2s_sink = {
+        .open = i2s_sink_open,
+        .write = i2s_sink_write,
+        .drain = i2s_sink_drain,
+        .flush = i2s_sink_flush,
+        .pause = i2s_sink_pause,
+        .latency = i2s_sink_latency,
+        .mute = i2s_sink_mute,
+        .close = i2s_sink_close
+};
@@ -0,0 +1,48 @@
+#include "audio_sink.h"
+
+#include <stdatomic.h>
+
+static atomic_uint_least64_t frames_written;
+
+static bool null_sink_open(unsigned int sample_rate, unsigned int slot_bits) {
+    return true;
+}
+
+static size_t null_sink_write(const int32_t* frames, size_t count, int32_t gain, int32_t step) {
+    atomic_fetch_add(&frames_written, count);
+    return count;
+}
+
+static void null_sink_drain(void) {
+}
+
+static void null_sink_flush(void) {
+}
+
+static void null_sink_pause(bool paused) {
+}
+
+static size_t null_sink_latency(void) {
+    return 0;
+}
+
+static void null_sink_mute(bool mute) {
+}
+
+static void null_sink_close(void) {
+}
+
+uint64_t null_sink_frames(void) {
+    return atomic_load(&frames_written);
+}
+
+const AudioSink_t null_sink = {
+        .open = null_sink_open,
+        .write = null_sink_write,
+        .drain = null_sink_drain,
+        .flush = null_sink_flush,
+        .pause = null_sink_pause,
+        .latency = null_sink_latency,
+        .mute = null_sink_mute,
+        .close = null_sink_close
+};
@@ -0,0 +1,138 @@
+#include "audio_sink.h"
+#include "pcm_ring.h"
+#include "pcm_kernels.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <esp_log.h>
+
+#define WAV_HEADER_LEN      44
+#define WAV_BYTES_PER_FRAME (PCM_RING_CHANNELS * sizeof(int32_t))
+#define SCALE_FRAMES        512
+
+static const char TAG[] = "audio_wav_sink";
+
+static struct {
+    const char* path;
+    FILE* file;
+    unsigned int sample_rate;
+    uint32_t data_bytes;
+    int32_t scaled[SCALE_FRAMES * PCM_RING_CHANNELS];
+} wav_file = { 0 };
+
+static void put_le16(uint8_t* out, uint16_t value) {
+    out[0] = value;
+    out[1] = value >> 8;
+}
+
+static void put_le32(uint8_t* out, uint32_t value) {
+    put_le16(out, value);
+    put_le16(out + 2, value >> 16);
+}
+
+static void write_header(void) {
+    uint8_t header[WAV_HEADER_LEN];
+    memcpy(header, "RIFF", 4);
+    put_le32(header + 4, WAV_HEADER_LEN - 8 + wav_file.data_bytes);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    put_le32(header + 16, 16);
+    put_le16(header + 20, 1);
+    put_le16(header + 22, PCM_RING_CHANNELS);
+    put_le32(header + 24, wav_file.sample_rate);
+    put_le32(header + 28, wav_file.sample_rate * WAV_BYTES_PER_FRAME);
+    put_le16(header + 32, WAV_BYTES_PER_FRAME);
+    put_le16(header + 34, 32);
+    memcpy(header + 36, "data", 4);
+    put_le32(header + 40, wav_file.data_bytes);
+
+    fseek(wav_file.file, 0, SEEK_SET);
+    fwrite(header, 1, WAV_HEADER_LEN, wav_file.file);
+    fseek(wav_file.file, 0, SEEK_END);
+}
+
+void wav_sink_set_path(const char* path) {
+    wav_file.path = path;
+}
+
+// A WAV file has one rate, so a change after the first samples is only logged. It always holds the full 32 bits.
+static bool wav_sink_open(unsigned int sample_rate, unsigned int slot_bits) {
+    if (wav_file.file == NULL) {
+        wav_file.file = fopen(wav_file.path, "wb");
+        if (wav_file.file == NULL) {
+            ESP_LOGE(TAG, "Cannot create %s", wav_file.path);
+            return false;
+        }
+    }
+
+    if (wav_file.data_bytes != 0 && sample_rate != wav_file.sample_rate) {
+        ESP_LOGW(TAG, "Rate changed to %u Hz after %u bytes", sample_rate, wav_file.data_bytes);
+        return true;
+    }
+
+    wav_file.sample_rate = sample_rate;
+    write_header();
+    return true;
+}
+
+// The file gets what the DAC would, so attenuated frames are scaled a block at a time on the way
+static size_t wav_sink_write(const int32_t* frames, size_t count, int32_t gain, int32_t step) {
+    if (wav_file.file == NULL)
+        return count;
+
+    if (gain == PCM_GAIN_UNITY && step == 0) {
+        size_t written = fwrite(frames, WAV_BYTES_PER_FRAME, count, wav_file.file);
+        wav_file.data_bytes += written * WAV_BYTES_PER_FRAME;
+        return count;
+    }
+
+    for (size_t i = 0; i < count; i += SCALE_FRAMES) {
+        size_t len = count - i < SCALE_FRAMES ? count - i : SCALE_FRAMES;
+        pcm_copy_gain(wav_file.scaled, frames + i * PCM_RING_CHANNELS, len, gain + step * (int32_t)i, step);
+        size_t written = fwrite(wav_file.scaled, WAV_BYTES_PER_FRAME, len, wav_file.file);
+        wav_file.data_bytes += written * WAV_BYTES_PER_FRAME;
+    }
+    return count;
+}
+
+// Played means written to the file
+static void wav_sink_drain(void) {
+    if (wav_file.file != NULL)
+        fflush(wav_file.file);
+}
+
+static void wav_sink_flush(void) {
+}
+
+static void wav_sink_pause(bool paused) {
+    if (paused && wav_file.file != NULL)
+        fflush(wav_file.file);
+}
+
+static size_t wav_sink_latency(void) {
+    return 0;
+}
+
+static void wav_sink_mute(bool mute) {
+}
+
+static void wav_sink_close(void) {
+    if (wav_file.file == NULL)
+        return;
+
+    write_header();
+    fclose(wav_file.file);
+    wav_file.file = NULL;
+    wav_file.data_bytes = 0;
+}
+
+const AudioSink_t wav_sink = {
+        .open = wav_sink_open,
+        .write = wav_sink_write,
+        .drain = wav_sink_drain,
+        .flush = wav_sink_flush,
+        .pause = wav_sink_pause,
+        .latency = wav_sink_latency,
+        .mute = wav_sink_mute,
+        .close = wav_sink_close
+};
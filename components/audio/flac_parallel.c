@@ -0,0 +1,713 @@
+#include "flac_parallel.h"
+
+#include "codecs/FLAC/format.h"
+#include "codecs/FLAC/stream_decoder.h"
+
+#include <memory.h>
+#include <sys/param.h>
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+
+// One per core of the ESP32. Set from the build to try others; host_test/bench_flac_parallel compares them.
+#ifndef FLAC_WORKERS
+#define FLAC_WORKERS        2
+#endif
+#define FLAC_JOBS           MAX(6, 2 * FLAC_WORKERS)    // Frames in flight, which is also the depth of the reorder buffer
+#define FLAC_MIN_FRAME      10
+#define FLAC_MAX_HEADER     16
+#define STREAMINFO_LEN      (4 + 4 + FLAC__STREAM_METADATA_STREAMINFO_LENGTH)
+#define WORKER_STACK        6144
+#define SEEKPOINT_LEN       18
+#define MAX_SEEKPOINTS      512     // Larger tables are thinned out evenly
+#define SEEK_ATTEMPTS       3
+
+static const char TAG[] = "audio_flac_mt";
+
+struct flac_job {
+    uint8_t* data;
+    size_t length;
+    int32_t* left;
+    int32_t* right;
+    unsigned int samples;
+    unsigned int channels;
+    unsigned int sample_rate;
+    unsigned int bit_depth;
+    unsigned int skip;          // Samples before a seek target
+    bool failed;
+    SemaphoreHandle_t done;
+};
+
+// Each worker owns a libFLAC decoder that only ever sees STREAMINFO followed by whole frames
+struct flac_worker {
+    FLAC__StreamDecoder* decoder;
+    const uint8_t* data;
+    size_t length;
+    struct flac_job* job;
+};
+
+// Allocated on first use and kept; buffers only grow when a stream needs bigger frames
+static struct {
+    struct flac_worker workers[FLAC_WORKERS];
+    struct flac_job jobs[FLAC_JOBS];
+    QueueHandle_t queue;
+    size_t frame_capacity;
+    size_t block_capacity;
+    bool ready;
+} pool = { 0 };
+
+// Frames are found by their sync code, then confirmed by the header CRC-8 and by the CRC-16 of the frame before it
+static struct {
+    uint8_t* buffer;
+    size_t capacity;
+    size_t fill;
+    size_t scan;
+    uint16_t crc;
+    uint8_t sync;       // Second header byte, which also carries the blocking strategy
+    bool error;
+} split = { 0 };
+
+// "fLaC" and the STREAMINFO block, marked as the last metadata block
+static uint8_t streaminfo[STREAMINFO_LEN];
+
+struct seek_point {
+    uint64_t sample;
+    uint64_t offset;            // From the first frame
+};
+
+// What seeking needs to know about the current stream
+static struct {
+    unsigned int sample_rate;
+    unsigned int block_size;    // Of fixed blocksize streams, where frame headers carry a frame number
+    uint64_t total_samples;
+    size_t first_frame;
+    struct seek_point* points;
+    size_t point_count;
+    uint64_t target;            // Frames ending before this are dropped without decoding
+} seek_info = { 0 };
+
+static uint8_t crc8_table[256];
+static uint16_t crc16_table[256];
+
+#define CRC16_UPDATE(_crc, _byte) ((uint16_t)(((_crc) << 8) ^ crc16_table[((_crc) >> 8) ^ (_byte)]))
+
+static void init_crc_tables(void) {
+    for (int i = 0; i < 256; i++) {
+        uint8_t crc8 = i;
+        uint16_t crc16 = i << 8;
+        for (int b = 0; b < 8; b++) {
+            crc8 = (crc8 & 0x80) ? (crc8 << 1) ^ 0x07 : crc8 << 1;
+            crc16 = (crc16 & 0x8000) ? (crc16 << 1) ^ 0x8005 : crc16 << 1;
+        }
+        crc8_table[i] = crc8;
+        crc16_table[i] = crc16;
+    }
+}
+
+// Returns the length of a valid frame header at h, or 0
+static size_t frame_header_length(const uint8_t* h, size_t available) {
+    if (available < 6 || h[0] != 0xFF || h[1] != split.sync)
+        return 0;
+
+    unsigned int block_code = h[2] >> 4;
+    unsigned int rate_code = h[2] & 0x0F;
+    unsigned int channel_code = h[3] >> 4;
+    unsigned int bps_code = (h[3] >> 1) & 0x07;
+    if (block_code == 0 || rate_code == 15 || channel_code > 10 || bps_code == 3 || (h[3] & 0x01))
+        return 0;
+
+    // Frame or sample number, UTF-8 coded
+    size_t len = 5;
+    uint8_t first = h[4];
+    if (first & 0x80) {
+        uint8_t mask = 0x40;
+        while (first & mask) {
+            len++;
+            mask >>= 1;
+        }
+
+        if (len == 5 || len > 11)
+            return 0;
+    }
+
+    if (block_code == 6)
+        len += 1;
+    else if (block_code == 7)
+        len += 2;
+
+    if (rate_code == 12)
+        len += 1;
+    else if (rate_code == 13 || rate_code == 14)
+        len += 2;
+
+    if (available < len + 1)
+        return 0;
+
+    uint8_t crc = 0;
+    for (size_t i = 0; i < len; i++)
+        crc = crc8_table[crc ^ h[i]];
+
+    return crc == h[len] ? len + 1 : 0;
+}
+
+// The first sample and length of the frame whose header, already validated, is at h
+static void read_frame_position(const uint8_t* h, uint64_t* first_sample, unsigned int* block_size) {
+    uint64_t number = h[4];
+    size_t pos = 5;
+    if (number & 0x80) {
+        uint8_t mask = 0x40;
+        size_t extra = 0;
+        for (; number & mask; mask >>= 1)
+            extra++;
+        number &= mask - 1;
+
+        for (size_t i = 0; i < extra; i++)
+            number = (number << 6) | (h[pos++] & 0x3F);
+    }
+
+    unsigned int block_code = h[2] >> 4;
+    if (block_code == 1)
+        *block_size = 192;
+    else if (block_code <= 5)
+        *block_size = 576 << (block_code - 2);
+    else if (block_code == 6)
+        *block_size = h[pos] + 1;
+    else if (block_code == 7)
+        *block_size = ((h[pos] << 8) | h[pos + 1]) + 1;
+    else
+        *block_size = 256 << (block_code - 8);
+
+    // Variable blocksize streams number their samples instead of their frames
+    *first_sample = (h[1] & 0x01) ? number : number * seek_info.block_size;
+}
+
+// Finds the end of the frame at the start of the split buffer. Returns its length, or 0 at the end of the input.
+static size_t split_frame(const AudioContext_t* ctx) {
+    bool end = false;
+
+    while (1) {
+        while (split.scan < split.fill) {
+            size_t i = split.scan;
+            if (i >= FLAC_MIN_FRAME && split.crc == 0 && split.buffer[i] == 0xFF) {
+                // The whole candidate header is needed before deciding
+                if (!end && split.fill - i < FLAC_MAX_HEADER)
+                    break;
+
+                if (frame_header_length(split.buffer + i, split.fill - i) != 0)
+                    return i;
+            }
+
+            split.crc = CRC16_UPDATE(split.crc, split.buffer[i]);
+            split.scan++;
+        }
+
+        if (end) {
+            // The last frame runs to the end of the stream
+            if (split.fill != 0 && split.scan == split.fill && split.crc == 0)
+                return split.fill;
+
+            if (split.fill != 0) {
+                ESP_LOGE(TAG, "Stream ends inside a frame");
+                split.error = true;
+            }
+            return 0;
+        }
+
+        if (split.fill == split.capacity) {
+            ESP_LOGE(TAG, "No frame boundary found in %u bytes", split.capacity);
+            split.error = true;
+            return 0;
+        }
+
+        const uint8_t* data;
+        size_t len = ctx->peek(&data, 0);
+        if (len == 0) {
+            if (!ctx->eof())
+                return 0;
+
+            end = true;
+            continue;
+        }
+
+        len = MIN(len, split.capacity - split.fill);
+        memcpy(split.buffer + split.fill, data, len);
+        ctx->consume(len);
+        split.fill += len;
+    }
+}
+
+static void split_advance(size_t length) {
+    split.fill -= length;
+    memmove(split.buffer, split.buffer + length, split.fill);
+    split.scan = 0;
+    split.crc = 0;
+}
+
+// Drops what the splitter holds, once the input has moved
+static void split_reset(void) {
+    split.fill = 0;
+    split.scan = 0;
+    split.crc = 0;
+}
+
+static FLAC__StreamDecoderReadStatus worker_read(const FLAC__StreamDecoder *decoder, FLAC__byte buffer[], size_t *bytes, void* ctx) {
+    struct flac_worker* worker = ctx;
+    if (worker->length == 0) {
+        *bytes = 0;
+        return FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM;
+    }
+
+    *bytes = MIN(*bytes, worker->length);
+    memcpy(buffer, worker->data, *bytes);
+    worker->data += *bytes;
+    worker->length -= *bytes;
+    return FLAC__STREAM_DECODER_READ_STATUS_CONTINUE;
+}
+
+static FLAC__StreamDecoderWriteStatus worker_write(const FLAC__StreamDecoder *decoder, const FLAC__Frame *frame, const FLAC__int32 *const buffer[], void* ctx) {
+    struct flac_worker* worker = ctx;
+    struct flac_job* job = worker->job;
+
+    unsigned int samples = frame->header.blocksize;
+    if (job == NULL || samples > pool.block_capacity)
+        return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+
+    memcpy(job->left, buffer[0], samples * sizeof(int32_t));
+    if (frame->header.channels > 1)
+        memcpy(job->right, buffer[1], samples * sizeof(int32_t));
+
+    job->samples = samples;
+    job->channels = frame->header.channels;
+    job->sample_rate = frame->header.sample_rate;
+    job->bit_depth = frame->header.bits_per_sample;
+    return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+}
+
+static void worker_error(const FLAC__StreamDecoder *decoder, FLAC__StreamDecoderErrorStatus status, void* ctx) {
+    struct flac_worker* worker = ctx;
+    ESP_LOGW(TAG, "Frame error: %s", FLAC__StreamDecoderErrorStatusString[status]);
+
+    if (worker->job != NULL)
+        worker->job->failed = true;
+}
+
+_Noreturn static void worker_loop(void* args) {
+    struct flac_worker* worker = args;
+
+    while (1) {
+        struct flac_job* job;
+        xQueueReceive(pool.queue, &job, portMAX_DELAY);
+
+        job->samples = 0;
+        job->failed = false;
+        worker->job = job;
+        worker->data = job->data;
+        worker->length = job->length;
+
+        // A failed frame leaves the decoder at the end of its input
+        if (FLAC__stream_decoder_get_state(worker->decoder) != FLAC__STREAM_DECODER_SEARCH_FOR_FRAME_SYNC)
+            FLAC__stream_decoder_flush(worker->decoder);
+
+        if (!FLAC__stream_decoder_process_single(worker->decoder) || job->samples == 0)
+            job->failed = true;
+
+        worker->job = NULL;
+        xSemaphoreGive(job->done);
+    }
+}
+
+// Workers run at the priority of the task that first plays FLAC, pinned to the cores in turn
+static void init_pool(void) {
+    init_crc_tables();
+    pool.queue = xQueueCreate(FLAC_JOBS, sizeof(struct flac_job*));
+    assert(pool.queue != NULL);
+
+    for (int i = 0; i < FLAC_JOBS; i++) {
+        pool.jobs[i].done = xSemaphoreCreateBinary();
+        assert(pool.jobs[i].done != NULL);
+    }
+
+    UBaseType_t priority = uxTaskPriorityGet(NULL);
+    for (int i = 0; i < FLAC_WORKERS; i++) {
+        pool.workers[i].decoder = FLAC__stream_decoder_new();
+        assert(pool.workers[i].decoder != NULL);
+
+        xTaskCreatePinnedToCore(worker_loop, "FLAC worker", WORKER_STACK, &pool.workers[i], priority, NULL,
+                                i % portNUM_PROCESSORS);
+    }
+
+    seek_info.points = heap_caps_malloc(MAX_SEEKPOINTS * sizeof(struct seek_point), MALLOC_CAP_SPIRAM);
+    assert(seek_info.points != NULL);
+
+    pool.ready = true;
+}
+
+static void reserve_buffers(size_t frame_capacity, size_t block_capacity) {
+    if (frame_capacity > pool.frame_capacity) {
+        for (int i = 0; i < FLAC_JOBS; i++) {
+            free(pool.jobs[i].data);
+            pool.jobs[i].data = heap_caps_malloc(frame_capacity, MALLOC_CAP_SPIRAM);
+            assert(pool.jobs[i].data != NULL);
+        }
+
+        free(split.buffer);
+        split.capacity = 2 * frame_capacity;
+        split.buffer = heap_caps_malloc(split.capacity, MALLOC_CAP_SPIRAM);
+        assert(split.buffer != NULL);
+
+        pool.frame_capacity = frame_capacity;
+        ESP_LOGI(TAG, "Frame buffers resized to %u bytes", frame_capacity);
+    }
+
+    if (block_capacity > pool.block_capacity) {
+        for (int i = 0; i < FLAC_JOBS; i++) {
+            free(pool.jobs[i].left);
+            free(pool.jobs[i].right);
+            pool.jobs[i].left = heap_caps_malloc(block_capacity * sizeof(int32_t), MALLOC_CAP_SPIRAM);
+            pool.jobs[i].right = heap_caps_malloc(block_capacity * sizeof(int32_t), MALLOC_CAP_SPIRAM);
+            assert(pool.jobs[i].left != NULL && pool.jobs[i].right != NULL);
+        }
+
+        pool.block_capacity = block_capacity;
+    }
+}
+
+// Skips length bytes of input, which may span several stream buffers
+static bool skip(const AudioContext_t* ctx, size_t length) {
+    while (length > 0) {
+        const uint8_t* data;
+        size_t len = ctx->peek(&data, 0);
+        if (len == 0)
+            return false;
+
+        len = MIN(len, length);
+        ctx->consume(len);
+        length -= len;
+    }
+
+    return true;
+}
+
+// Only an ID3v2 tag is consumed before the STREAMINFO block is found, which the serial decoder skips anyway
+static bool read_streaminfo(const AudioContext_t* ctx) {
+    const uint8_t* data;
+    size_t len = ctx->peek(&data, PROBE_LEN);
+
+    size_t offset = id3v2_length(data, len);
+    if (offset != 0) {
+        if (skip(ctx, offset) == false)
+            return false;
+        len = ctx->peek(&data, STREAMINFO_LEN);
+    }
+
+    if (len < STREAMINFO_LEN || memcmp(data, "fLaC", 4) != 0 || (data[4] & 0x7F) != FLAC__METADATA_TYPE_STREAMINFO)
+        return false;
+
+    memcpy(streaminfo, data, STREAMINFO_LEN);
+    streaminfo[4] |= 0x80;
+    return true;
+}
+
+// Placeholder points are left out
+static bool read_seektable(const AudioContext_t* ctx, size_t block_len) {
+    size_t count = block_len / SEEKPOINT_LEN;
+    size_t stride = (count + MAX_SEEKPOINTS - 1) / MAX_SEEKPOINTS;
+
+    for (size_t i = 0; i < count; i++) {
+        const uint8_t* data;
+        if (ctx->peek(&data, SEEKPOINT_LEN) < SEEKPOINT_LEN)
+            return false;
+
+        uint64_t sample = ((uint64_t)READ_BE32(data) << 32) | READ_BE32(data + 4);
+        if (i % stride == 0 && sample != UINT64_MAX && seek_info.point_count < MAX_SEEKPOINTS) {
+            struct seek_point* point = &seek_info.points[seek_info.point_count++];
+            point->sample = sample;
+            point->offset = ((uint64_t)READ_BE32(data + 8) << 32) | READ_BE32(data + 12);
+        }
+        ctx->consume(SEEKPOINT_LEN);
+    }
+
+    return skip(ctx, block_len - count * SEEKPOINT_LEN);
+}
+
+static bool skip_metadata(const AudioContext_t* ctx) {
+    const uint8_t* data;
+    bool last = ctx->peek(&data, 5) >= 5 && (data[4] & 0x80);
+    ctx->consume(STREAMINFO_LEN);
+    seek_info.point_count = 0;
+
+    while (!last) {
+        if (ctx->peek(&data, 4) < 4)
+            return false;
+
+        last = data[0] & 0x80;
+        unsigned int type = data[0] & 0x7F;
+        size_t block_len = (data[1] << 16) | (data[2] << 8) | data[3];
+        ctx->consume(4);
+
+        bool read = type == FLAC__METADATA_TYPE_SEEKTABLE ? read_seektable(ctx, block_len) : skip(ctx, block_len);
+        if (read == false)
+            return false;
+    }
+
+    seek_info.first_frame = ctx->bytes_elapsed();
+    return true;
+}
+
+// Finds the next valid frame header at or after the input position
+static bool find_frame(const AudioContext_t* ctx) {
+    while (1) {
+        const uint8_t* data;
+        size_t len = ctx->peek(&data, FLAC_MAX_HEADER);
+        if (len < FLAC_MAX_HEADER)
+            return false;
+
+        for (size_t i = 0; i + FLAC_MAX_HEADER <= len; i++) {
+            if (data[i] == 0xFF && frame_header_length(data + i, len - i) != 0) {
+                ctx->consume(i);
+                return true;
+            }
+        }
+
+        ctx->consume(len - FLAC_MAX_HEADER + 1);
+    }
+}
+
+// The last seek point at or before sample, if any
+static const struct seek_point* find_seek_point(uint64_t sample) {
+    const struct seek_point* found = NULL;
+    size_t low = 0, high = seek_info.point_count;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (seek_info.points[mid].sample <= sample) {
+            found = &seek_info.points[mid];
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return found;
+}
+
+// Lands on a frame at or before the target, from the seektable when it covers it and otherwise by the average
+// bitrate, stepping back when the estimate overshoots. Frames up to the target are then dropped by the splitter.
+// If no frame is found there, playback goes back to the first frame. Returns false if the input is lost.
+static bool seek_frames(const AudioContext_t* ctx, uint32_t position_ms) {
+    uint64_t target = (uint64_t)position_ms * seek_info.sample_rate / 1000;
+    uint64_t total = seek_info.total_samples;
+    size_t audio_bytes = ctx->total_bytes() - seek_info.first_frame;
+    if (total == 0 || target >= total)
+        return true;
+
+    const struct seek_point* point = find_seek_point(target);
+    uint64_t offset = point != NULL ? point->offset : audio_bytes * target / total;
+    uint64_t landed = 0;
+    bool found = false;
+
+    for (int attempt = 0; attempt < SEEK_ATTEMPTS; attempt++) {
+        offset = MIN(offset, audio_bytes);
+        bool moved = ctx->seek(seek_info.first_frame + offset);
+
+        // A failed seek may still have read part of the way
+        split_reset();
+        if (!moved || !find_frame(ctx))
+            break;
+
+        const uint8_t* data;
+        ctx->peek(&data, FLAC_MAX_HEADER);
+        uint64_t first_sample;
+        unsigned int block_size;
+        read_frame_position(data, &first_sample, &block_size);
+        found = true;
+        landed = first_sample;
+        if (first_sample <= target || offset == 0)
+            break;
+
+        // Twice the overshoot in bytes and a whole frame, so the next try lands before the target even when the
+        // estimate was inside the frame that holds it
+        uint64_t back = 2 * (first_sample - target) * audio_bytes / total + pool.frame_capacity;
+        offset = offset > back ? offset - back : 0;
+    }
+
+    // Still past the target after the last try, so that is where playback resumes
+    if (found && landed > target)
+        target = landed;
+
+    if (!found) {
+        ESP_LOGW(TAG, "No frame found seeking to sample %llu, restarting from the first frame", target);
+        if (!ctx->seek(seek_info.first_frame)) {
+            ESP_LOGE(TAG, "Input lost while seeking");
+            return false;
+        }
+
+        split_reset();
+        target = 0;
+    }
+
+    seek_info.target = target;
+
+    ESP_LOGI(TAG, "Seeking to sample %llu from %s", target, point != NULL ? "seektable" : "bitrate");
+    ctx->seek_done(target, seek_info.sample_rate);
+    return true;
+}
+
+// Called while the workers are idle, so their decoders can be driven from this task
+static bool start_workers(void) {
+    for (int i = 0; i < FLAC_WORKERS; i++) {
+        struct flac_worker* worker = &pool.workers[i];
+        FLAC__stream_decoder_finish(worker->decoder);
+
+        FLAC__StreamDecoderInitStatus status = FLAC__stream_decoder_init_stream(worker->decoder,
+                                                                                worker_read, NULL, NULL, NULL, NULL,
+                                                                                worker_write, NULL, worker_error, worker);
+        if (status != FLAC__STREAM_DECODER_INIT_STATUS_OK)
+            return false;
+
+        worker->job = NULL;
+        worker->data = streaminfo;
+        worker->length = STREAMINFO_LEN;
+        if (FLAC__stream_decoder_process_until_end_of_metadata(worker->decoder) == false)
+            return false;
+    }
+
+    return true;
+}
+
+bool flac_parallel_run(const AudioContext_t* audio_ctx) {
+    if (read_streaminfo(audio_ctx) == false)
+        return false;
+
+    if (!pool.ready)
+        init_pool();
+
+    // Worst case is a verbatim frame, where the side channel of a stereo pair needs one extra bit
+    const uint8_t* info = streaminfo + 8;
+    size_t max_block = READ_BE16(info + 2);
+    unsigned int channels = ((info[12] >> 1) & 0x07) + 1;
+    unsigned int bit_depth = (((info[12] & 0x01) << 4) | (info[13] >> 4)) + 1;
+    reserve_buffers(max_block * channels * (bit_depth + 1) / 8 + 64, max_block);
+
+    seek_info.block_size = READ_BE16(info);
+    seek_info.sample_rate = (info[10] << 12) | (info[11] << 4) | (info[12] >> 4);
+    seek_info.total_samples = ((uint64_t)(info[13] & 0x0F) << 32) | READ_BE32(info + 14);
+    seek_info.target = 0;
+
+    // Running out of metadata without the end of the stream means the decoder was stopped
+    if (skip_metadata(audio_ctx) == false) {
+        if (audio_ctx->eof())
+            audio_ctx->decoder_failed();
+        return true;
+    }
+
+    if (start_workers() == false) {
+        ESP_LOGE(TAG, "Workers rejected the STREAMINFO block");
+        audio_ctx->decoder_failed();
+        return true;
+    }
+
+    const uint8_t* data;
+    if (audio_ctx->peek(&data, 2) < 2 || data[0] != 0xFF || (data[1] & 0xFE) != 0xF8) {
+        ESP_LOGE(TAG, "No frame after metadata");
+        audio_ctx->decoder_failed();
+        return true;
+    }
+
+    split_reset();
+    split.sync = data[1];
+    split.error = false;
+
+    size_t next_in = 0;
+    size_t next_out = 0;
+    bool input_done = false;
+    bool stopped = false;
+
+    while (1) {
+        uint32_t position_ms;
+        if (!input_done && audio_ctx->seek_pending(&position_ms)) {
+            // Frames in flight are from before the seek
+            while (next_out != next_in)
+                xSemaphoreTake(pool.jobs[next_out++ % FLAC_JOBS].done, portMAX_DELAY);
+
+            if (seek_frames(audio_ctx, position_ms) == false) {
+                split.error = !input_stopped(audio_ctx);
+                input_done = true;
+            }
+        }
+
+        while (!input_done && next_in - next_out < FLAC_JOBS) {
+            size_t len = split_frame(audio_ctx);
+            if (len == 0 || len > pool.frame_capacity) {
+                split.error |= len != 0;
+                input_done = true;
+                break;
+            }
+
+            unsigned int skip_samples = 0;
+            if (seek_info.target != 0) {
+                uint64_t first_sample;
+                unsigned int block_size;
+                read_frame_position(split.buffer, &first_sample, &block_size);
+                if (first_sample + block_size <= seek_info.target) {
+                    split_advance(len);
+                    continue;
+                }
+
+                skip_samples = seek_info.target > first_sample ? seek_info.target - first_sample : 0;
+                seek_info.target = 0;
+            }
+
+            struct flac_job* job = &pool.jobs[next_in % FLAC_JOBS];
+            memcpy(job->data, split.buffer, len);
+            job->length = len;
+            job->skip = skip_samples;
+            split_advance(len);
+
+            xQueueSend(pool.queue, &job, portMAX_DELAY);
+            next_in++;
+        }
+
+        if (next_out == next_in)
+            break;
+
+        // Frames are written in stream order, whichever worker finishes first
+        struct flac_job* job = &pool.jobs[next_out % FLAC_JOBS];
+        xSemaphoreTake(job->done, portMAX_DELAY);
+        next_out++;
+
+        if (stopped)
+            continue;
+
+        if (job->failed) {
+            ESP_LOGW(TAG, "Dropping frame %u", next_out - 1);
+            continue;
+        }
+
+        if (job->skip >= job->samples)
+            continue;
+
+        const int32_t* left = job->left + job->skip;
+        const int32_t* right = job->channels > 1 ? job->right + job->skip : left;
+        if (audio_ctx->write(left, right, job->samples - job->skip, job->sample_rate, job->bit_depth) == false) {
+            stopped = true;
+            input_done = true;
+        }
+    }
+
+    ESP_LOGI(TAG, "Decoded %u frames on %d workers", next_out, FLAC_WORKERS);
+
+    if (stopped)
+        return true;
+
+    if (split.error)
+        audio_ctx->decoder_failed();
+    else if (audio_ctx->eof())
+        audio_ctx->decoder_finished();
+
+    return true;
+}
@@ -0,0 +1,12 @@
+#ifndef AIRDAC_FIRMWARE_FLAC_PARALLEL_H
+#define AIRDAC_FIRMWARE_FLAC_PARALLEL_H
+
+#include "audio_common.h"
+
+#include <stdbool.h>
+
+// Decodes a native FLAC stream with one worker task per core. Returns false if the stream does not start with
+// a STREAMINFO block, having consumed at most an ID3v2 tag, so the caller can fall back to serial decoding.
+bool flac_parallel_run(const AudioContext_t* audio_ctx);
+
+#endif //AIRDAC_FIRMWARE_FLAC_PARALLEL_H
@@ -1,9 +1,11 @@
 #include "flac_wrapper.h"
+#include "flac_parallel.h"
 
 #include "codecs/FLAC/format.h"
 #include "codecs/FLAC/stream_decoder.h"
 
 #include <memory.h>
+#include <sys/param.h>
 #include <esp_log.h>
 
 #define I2S_NUM 0
@@ -16,14 +18,17 @@ static FLAC__StreamDecoderReadStatus read_callback(const FLAC__StreamDecoder *de
 {
     AudioContext_t* audio_ctx = ctx;
 
-    size_t read = audio_ctx->fill_buffer(buffer, *bytes);
-    if (read == 0)
-        return FLAC__STREAM_DECODER_READ_STATUS_ABORT;
-    else if (read < *bytes) {
-        *bytes = read;
-        return FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM;
+    const uint8_t* data;
+    size_t read = audio_ctx->peek(&data, 0);
+    if (read == 0) {
+        *bytes = 0;
+        return audio_ctx->eof() ? FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM : FLAC__STREAM_DECODER_READ_STATUS_ABORT;
     }
 
+    *bytes = MIN(*bytes, read);
+    memcpy(buffer, data, *bytes);
+    audio_ctx->consume(*bytes);
+
     return FLAC__STREAM_DECODER_READ_STATUS_CONTINUE;
 }
 
@@ -46,7 +51,12 @@ static void error_callback(const FLAC__StreamDecoder *decoder, FLAC__StreamDecod
     audio_ctx->decoder_failed();
 }
 
+// Only called from FLAC__stream_decoder_seek_absolute(). Far seeks restart the input with a Range request.
 static FLAC__StreamDecoderSeekStatus seek_callback(const FLAC__StreamDecoder *decoder, FLAC__uint64 absolute_byte_offset, void* ctx) {
+    AudioContext_t* audio_ctx = ctx;
+    if (absolute_byte_offset > audio_ctx->total_bytes() || !audio_ctx->seek(absolute_byte_offset))
+        return FLAC__STREAM_DECODER_SEEK_STATUS_ERROR;
+
     return FLAC__STREAM_DECODER_SEEK_STATUS_OK;
 }
 
@@ -58,6 +68,9 @@ static FLAC__StreamDecoderTellStatus tell_callback(const FLAC__StreamDecoder *de
 
 static FLAC__StreamDecoderLengthStatus length_callback(const FLAC__StreamDecoder *decoder, FLAC__uint64 *stream_length, void* ctx) {
     AudioContext_t* audio_ctx = ctx;
+    if (audio_ctx->total_bytes() == AUDIO_UNKNOWN_LENGTH)
+        return FLAC__STREAM_DECODER_LENGTH_STATUS_UNSUPPORTED;
+
     *stream_length = audio_ctx->total_bytes();
 
     return FLAC__STREAM_DECODER_LENGTH_STATUS_OK;
@@ -70,9 +83,29 @@ static FLAC__bool eof_callback(const FLAC__StreamDecoder *decoder, void* ctx) {
 
 void delete_flac_decoder(void) {
     FLAC__stream_decoder_delete(decoder_ptr);
+    decoder_ptr = NULL;
+}
+
+// libFLAC narrows the search with the SEEKTABLE when the file has one. The target frame is written from inside
+// the seek, so the output is dropped before rather than after.
+static void seek_flac(const AudioContext_t* audio_ctx, uint32_t position_ms) {
+    unsigned int sample_rate = FLAC__stream_decoder_get_sample_rate(decoder_ptr);
+    FLAC__uint64 total = FLAC__stream_decoder_get_total_samples(decoder_ptr);
+    FLAC__uint64 sample = (FLAC__uint64)position_ms * sample_rate / 1000;
+    if (sample_rate == 0 || (total != 0 && sample >= total))
+        return;
+
+    audio_ctx->seek_done(sample, sample_rate);
+    if (!FLAC__stream_decoder_seek_absolute(decoder_ptr, sample)) {
+        ESP_LOGW(TAG, "Seek to %u ms failed", position_ms);
+        FLAC__stream_decoder_flush(decoder_ptr);
+    }
 }
 
 void run_flac_decoder(const AudioContext_t* audio_ctx) {
+    if (flac_parallel_run(audio_ctx))
+        return;
+
     FLAC__StreamDecoderInitStatus status = FLAC__stream_decoder_init_stream(decoder_ptr,
                                                                             read_callback, seek_callback, tell_callback,
                                                                             length_callback, eof_callback,
@@ -80,21 +113,59 @@ void run_flac_decoder(const AudioContext_t* audio_ctx) {
                                                                             error_callback, audio_ctx);
     assert(status == FLAC__STREAM_DECODER_INIT_STATUS_OK);
 
-    FLAC__bool b = FLAC__stream_decoder_process_until_end_of_stream(decoder_ptr);
-    if (b == true)
-        audio_ctx->decoder_finished();
+    // Frame by frame, so seeks can be taken between frames
+    while (FLAC__stream_decoder_process_single(decoder_ptr)) {
+        FLAC__StreamDecoderState state = FLAC__stream_decoder_get_state(decoder_ptr);
+        if (state == FLAC__STREAM_DECODER_END_OF_STREAM) {
+            audio_ctx->decoder_finished();
+            break;
+        }
+
+        // Seeking needs STREAMINFO, so it waits until the metadata is read
+        bool in_frames = state == FLAC__STREAM_DECODER_SEARCH_FOR_FRAME_SYNC || state == FLAC__STREAM_DECODER_READ_FRAME;
+        uint32_t position_ms;
+        if (in_frames && audio_ctx->seek_pending(&position_ms))
+            seek_flac(audio_ctx, position_ms);
+    }
 
-    b = FLAC__stream_decoder_finish(decoder_ptr);
+    FLAC__bool b = FLAC__stream_decoder_finish(decoder_ptr);
     assert(b);
 }
 
+// STREAMINFO is always the first metadata block, straight after the "fLaC" marker
+bool probe_flac_decoder(const AudioContext_t* audio_ctx, AudioStreamInfo_t* info) {
+    const uint8_t* data;
+    size_t len = audio_ctx->peek(&data, PROBE_LEN);
+
+    size_t offset = id3v2_length(data, len);
+    if (len < offset + 8 + FLAC__STREAM_METADATA_STREAMINFO_LENGTH)
+        return false;
+
+    data += offset;
+    if (memcmp(data, "fLaC", 4) != 0 || (data[4] & 0x7F) != FLAC__METADATA_TYPE_STREAMINFO)
+        return false;
+
+    const uint8_t* streaminfo = data + 8;
+    info->sample_rate = (streaminfo[10] << 12) | (streaminfo[11] << 4) | (streaminfo[12] >> 4);
+    info->channels = ((streaminfo[12] >> 1) & 0x07) + 1;
+    info->bit_depth = (((streaminfo[12] & 0x01) << 4) | (streaminfo[13] >> 4)) + 1;
+    info->total_samples = ((uint64_t)(streaminfo[13] & 0x0F) << 32) | READ_BE32(streaminfo + 14);
+    return true;
+}
+
+// The stream decoder is reset by FLAC__stream_decoder_finish() at the end of every run
 void init_flac_decoder(void) {
+    if (decoder_ptr != NULL)
+        return;
+
     decoder_ptr = FLAC__stream_decoder_new();
     assert (decoder_ptr != NULL);
 }
 
 const DecoderWrapper_t flac_wrapper = {
         .init = init_flac_decoder,
+        .probe = probe_flac_decoder,
         .run = run_flac_decoder,
-        .delete = delete_flac_decoder
+        .delete = delete_flac_decoder,
+        .seekable = true
 };
\ No newline at end of file
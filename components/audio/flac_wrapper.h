@@ -4,6 +4,7 @@
 #include "audio_common.h"
 
 void init_flac_decoder(void);
+bool probe_flac_decoder(const AudioContext_t* audio_ctx, AudioStreamInfo_t* info);
 void run_flac_decoder(const AudioContext_t* audio_ctx);
 void delete_flac_decoder(void);
 
@@ -1,245 +1,232 @@
 #include "helix_wrapper.h"
+#include "pcm_kernels.h"
 #include "codecs/helix-aac/aacdec.h"
 
 #include <sys/param.h>
 #include <memory.h>
 #include <esp_log.h>
 
-#define SYNCH_WORD_LEN 4
-#define AAC_MAX_OUTPUT_SIZE 1024 * 3
-#define AAC_MAX_FRAME_SIZE 2100
+#define ADTS_HEADER_LEN     7
+#define AAC_OUTPUT_SAMPLES  (AAC_MAX_NSAMPS * 2)            // Per channel, SBR doubles the core frame
+#define AAC_MAX_ERRORS      8
 
 static HAACDecoder decoder;
 
 static const char TAG[] = "audio_helix";
 
 static struct aac_stat {
-    size_t buffer_size;
-    uint8_t* frame_buffer;
-    int16_t* pwm_buffer;
+    int16_t* pcm;           // Interleaved, as Helix writes it
+    int32_t* left;
+    int32_t* right;
     bool active;
+    bool raw;               // Helix keeps raw block parameters until it is recreated
     uint32_t frame_counter;
 } *stat;
 
-//void run_helix_decoder(AudioContext_t* audio_ctx) {
-//    size_t bytes = 0;
-//    int offset = 0;
-//    do {
-//        bytes = audio_ctx->fill_buffer(stat->in_buffer, AAC_MAINBUF_SIZE);
-//        ESP_LOGI(TAG, "Retrieved %d bytes", bytes);
-//        if (bytes == 0) {
-//            audio_ctx->decoder_finished();
-//            return;
-//        }
-//
-//        offset = AACFindSyncWord(stat->in_buffer, AAC_MAINBUF_SIZE);
-//    } while (offset < 0);
-//
-//    ESP_LOGI(TAG, "Found offset at %d! Shifting data", offset);
-//    size_t fill_size = AAC_MAINBUF_SIZE - offset;
-//    memmove(stat->in_buffer, stat->in_buffer+offset, fill_size);
-//    bytes = audio_ctx->fill_buffer(stat->in_buffer+offset, fill_size);
-//
-//    ESP_LOGI(TAG, "Filled %d bytes", bytes);
-//    offset = AACFindSyncWord(stat->in_buffer, AAC_MAINBUF_SIZE);
-//    ESP_LOGI(TAG, "Offset is now %d", offset);
-//
-//    uint8_t* in_ptr = stat->in_buffer;
-//    bytes = AAC_MAINBUF_SIZE;
-//    while (1) {
-//        ESP_LOGI(TAG, "Giving %d", bytes);
-//        int ret = AACDecode(decoder, &in_ptr, (int*)&bytes, stat->out_buffer);
-//        ESP_LOGI(TAG, "Bytes left: %d | return: %d\n", bytes, ret);
-//
-//        if (ret == 0) {
-//            size_t bytes_written;
-//            i2s_write(I2S_NUM_0, stat->out_buffer, AAC_MAX_NSAMPS*sizeof(int16_t), &bytes_written, portMAX_DELAY);
-//        }
-//
-//        ESP_LOGI(TAG, "in_ptr is %d away, bytes is %d", in_ptr-stat->in_buffer, bytes);
-//
-//        offset = AACFindSyncWord(stat->in_buffer+5, AAC_MAINBUF_SIZE);
-//        while (offset < 0) {
-//            bytes = audio_ctx->fill_buffer(stat->in_buffer, AAC_MAINBUF_SIZE);
-//            ESP_LOGI(TAG, "Retrieved %d bytes", bytes);
-//            if (bytes == 0) {
-//                audio_ctx->decoder_finished();
-//                return;
-//            }
-//            offset = AACFindSyncWord(stat->in_buffer, AAC_MAINBUF_SIZE);
-//        }
-//
-//        ESP_LOGI(TAG, "New offset at %d. Shifting data", offset);
-//        if (offset > 0) {
-//            fill_size = AAC_MAINBUF_SIZE - offset;
-//            memmove(stat->in_buffer, stat->in_buffer+offset, fill_size);
-//            bytes = audio_ctx->fill_buffer(stat->in_buffer+offset, fill_size);
-//
-//            if (bytes == 0) {
-//                audio_ctx->decoder_finished();
-//                return;
-//            }
-//        }
-//
-//        bytes = AAC_MAINBUF_SIZE;
-//    }
-//    AACFlushCodec(decoder);
-//}
-
-struct Range {
-    int start;
-    int end;
+static const uint32_t adts_sample_rates[13] = {
+        96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350
 };
 
-static int findSynchWord(int offset) {
-    int result = AACFindSyncWord(stat->frame_buffer+offset, stat->buffer_size-offset);
-    return result < 0 ? result : result + offset;
-}
+// ADTS has no sample count, so the length is estimated from the size of the first frame.
+// This is the core rate; HE-AAC streams switch to twice this once SBR is found.
+bool probe_helix_decoder(const AudioContext_t* ctx, AudioStreamInfo_t* info) {
+    const uint8_t* data;
+    size_t len = ctx->peek(&data, PROBE_LEN);
+    size_t pos = id3v2_length(data, len);
+    if (pos + 7 > len)
+        return false;
 
-/// returns valid start and end synch word.
-static void synchronizeFrame(struct Range* range) {
-    range->start = findSynchWord(0);
-    range->end = findSynchWord(range->start + SYNCH_WORD_LEN);
-    ESP_LOGI(TAG, "-> frameRange -> %d - %d", range->start, range->end);
-    if (range->start < 0){
-        // there is no Synch in the buffer at all -> we can ignore all data
-        range->end = -1;
-        if (stat->buffer_size==AAC_MAX_FRAME_SIZE) {
-            stat->buffer_size = 0;
-            ESP_LOGI(TAG, "-> buffer cleared");
-        }
-    } else if (range->start>0) {
-        // make sure that buffer starts with a synch word
-        ESP_LOGI(TAG, "-> moving to new start %d", range->start);
-        stat->buffer_size -= range->start;
-        assert(stat->buffer_size<=AAC_MAX_FRAME_SIZE);
-
-        memmove(stat->frame_buffer, stat->frame_buffer + range->start, stat->buffer_size);
-        range->end -= range->start;
-        range->start = 0;
-        ESP_LOGI(TAG, "-> we are at beginning of synch word");
-    } else if (range->start==0) {
-        ESP_LOGI(TAG, "-> we are at beginning of synch word");
-        if (range->end < 0 && stat->buffer_size == AAC_MAX_FRAME_SIZE){
-            stat->buffer_size = 0;
-            ESP_LOGI(TAG, "-> buffer cleared");
-        }
-    }
+    const uint8_t* header = data + pos;
+    if (header[0] != 0xFF || (header[1] & 0xF6) != 0xF0)
+        return false;
+
+    unsigned int rate_i = (header[2] >> 2) & 0x0F;
+    if (rate_i >= 13)
+        return false;
+
+    info->sample_rate = adts_sample_rates[rate_i];
+    info->channels = ((header[2] & 0x01) << 2) | (header[3] >> 6);
+
+    size_t frame_length = ((header[3] & 0x03) << 11) | (header[4] << 3) | (header[5] >> 5);
+    if (frame_length != 0 && ctx->total_bytes() != AUDIO_UNKNOWN_LENGTH)
+        info->total_samples = (uint64_t)(ctx->total_bytes() - pos) / frame_length * AAC_MAX_NSAMPS;
+
+    return true;
 }
 
-/// decodes the data and removes the decoded frame from the buffer
-static bool decode(struct Range* r) {
-    ESP_LOGI(TAG, "decode %d", r->end);
-    int len = stat->buffer_size - r->start;
-    int bytesLeft =  len;
-    uint8_t* ptr = stat->frame_buffer + r->start;
-
-    int result = AACDecode(decoder, &ptr, &bytesLeft, stat->pwm_buffer);
-    int decoded = len - bytesLeft;
-    assert(decoded == ptr-(stat->frame_buffer + r->start));
-    if (result == 0){
-        ESP_LOGI(TAG, "-> bytesLeft %d -> %d  = %d ", stat->buffer_size, bytesLeft, decoded);
-        ESP_LOGI(TAG, "-> End of frame (%d) vs end of decoding (%d)", r->end, decoded);
-
-        // return the decoded result
-    //    struct _AACFrameInfo info;
-    //    AACGetLastFrameInfo(decoder, &info);
-    //    provideResult(info);
-
-        // remove processed data from buffer
-        if (decoded<=stat->buffer_size) {
-            stat->buffer_size -= decoded;
-            //assert(buffer_size<=maxFrameSize());
-            memmove(stat->frame_buffer, stat->frame_buffer+r->start+decoded, stat->buffer_size);
-            ESP_LOGI(TAG, " -> decoded %d bytes - remaining buffer_size: %d", decoded, stat->buffer_size);
-        } else {
-            ESP_LOGW(TAG, " -> decoded %d > buffersize %d", decoded, stat->buffer_size);
-            stat->buffer_size = 0;
-        }
-    } else {
-        // decoding error
-        ESP_LOGI(TAG, " -> decode error: %d - removing frame!", result);
-        int ignore = decoded;
-        if (ignore == 0) ignore = r->end;
-        // We advance to the next synch world
-        if (ignore <= stat->buffer_size){
-            stat->buffer_size -= ignore;
-            memmove(stat->frame_buffer, stat->frame_buffer+ignore, stat->buffer_size);
-        }  else {
-            stat->buffer_size = 0;
-        }
+bool helix_set_raw_format(unsigned int channels, unsigned int sample_rate, unsigned int profile) {
+    if (stat == NULL || !stat->active)
+        return false;
+
+    AACFrameInfo frame_info = {
+            .nChans = (int)channels,
+            .sampRateCore = (int)sample_rate,
+            .profile = (int)profile
+    };
+
+    stat->raw = true;
+    return AACSetRawBlockParams(decoder, 0, &frame_info) == ERR_AAC_NONE;
+}
 
+// A flush leaves Helix decoding raw blocks, so after an MP4 track it is recreated before it sees ADTS again
+static bool leave_raw_mode(void) {
+    AACFreeDecoder(decoder);
+    decoder = AACInitDecoder();
+    stat->raw = false;
+    if (decoder == NULL) {
+        ESP_LOGE(TAG, "Not enough memory to reset the decoder");
+        stat->active = false;
         return false;
     }
-
     return true;
 }
 
+int helix_decode_frame(const AudioContext_t* ctx, const uint8_t* data, size_t length, bool* run) {
+    uint8_t* ptr = (uint8_t*)data;
+    int bytes_left = (int)length;
+    int result = AACDecode(decoder, &ptr, &bytes_left, stat->pcm);
+    if (result != ERR_AAC_NONE) {
+        ESP_LOGW(TAG, "Decode error %d", result);
+        return result;
+    }
+
+    stat->frame_counter++;
+
+    // The output rate doubles once SBR data is found in an HE-AAC stream
+    AACFrameInfo frame_info;
+    AACGetLastFrameInfo(decoder, &frame_info);
+    size_t samples = frame_info.outputSamps / frame_info.nChans;
+
+    pcm_unpack_le(stat->left, stat->right, (const uint8_t*)stat->pcm, samples, sizeof(int16_t), frame_info.nChans);
+    *run = ctx->write(stat->left, frame_info.nChans == 1 ? stat->left : stat->right,
+                      samples, frame_info.sampRateOut, frame_info.bitsPerSample);
+    return ERR_AAC_NONE;
+}
+
+// Returns the length of the ADTS frame whose header is at data, or 0 if it is not a plausible header
+static size_t adts_frame_length(const uint8_t* header) {
+    if (header[0] != 0xFF || (header[1] & 0xF6) != 0xF0 || ((header[2] >> 2) & 0x0F) >= 13)
+        return 0;
+
+    size_t frame_length = ((header[3] & 0x03) << 11) | (header[4] << 3) | (header[5] >> 5);
+    return frame_length > ADTS_HEADER_LEN ? frame_length : 0;
+}
+
+// Frames are located from their headers and decoded straight out of the stream buffers.
+// Each sync word is only searched for once, and only a damaged frame is ever skipped.
 void run_helix_decoder(const AudioContext_t* ctx) {
-//    size_t start = 0;
-    // we can not write more then the AAC_MAX_FRAME_SIZE
-    size_t write_len = MIN(ctx->total_bytes(), AAC_MAX_FRAME_SIZE-stat->buffer_size);
-    while (1) {
-        if (ctx->eof()) {
-            ctx->decoder_finished();
+    if (stat == NULL || !stat->active || (stat->raw && !leave_raw_mode())) {
+        ctx->decoder_failed();
+        return;
+    }
+
+    unsigned int errors = 0;
+    bool run = true;
+
+    while (run) {
+        const uint8_t* data;
+        size_t len = ctx->peek(&data, ADTS_HEADER_LEN);
+        if (len == 0) {
+            if (ctx->eof())
+                ctx->decoder_finished();
             break;
         }
 
-        // we have some space left in the buffer
-        stat->buffer_size = ctx->fill_buffer(stat->frame_buffer, write_len);
+        size_t offset = 0;
+        size_t frame_length = 0;
+        for (; offset + ADTS_HEADER_LEN <= len; offset++) {
+            frame_length = adts_frame_length(data + offset);
+            if (frame_length != 0)
+                break;
+        }
 
-        if (stat->buffer_size == 0)
-            break;
+        if (frame_length == 0) {
+            // Keep the last few bytes in case a sync word straddles the end
+            ctx->consume(len < ADTS_HEADER_LEN ? len : len - ADTS_HEADER_LEN + 1);
+            continue;
+        } else if (offset > 0) {
+            ESP_LOGD(TAG, "Skipping %u bytes to sync word", offset);
+            ctx->consume(offset);
+            continue;
+        }
+
+        len = ctx->peek(&data, frame_length);
+        if (len < frame_length) {
+            ESP_LOGW(TAG, "Dropping truncated frame");
+            ctx->consume(len);
+            continue;
+        }
+
+        int result = helix_decode_frame(ctx, data, frame_length, &run);
+        ctx->consume(frame_length);
 
-        struct Range r;
-        synchronizeFrame(&r);
-        // Decode if we have a valid start and end synch word
-        if( r.start >= 0 && r.end > r.start && (r.end - r.start)<=AAC_MAX_FRAME_SIZE) {
-            if (decode(&r) == false) {
+        if (result != ERR_AAC_NONE) {
+            if (++errors > AAC_MAX_ERRORS) {
                 ctx->decoder_failed();
                 break;
             }
-        } else {
-            ESP_LOGW(TAG, " -> invalid frame size: %d / max: %d", r.end-r.start, AAC_MAX_FRAME_SIZE);
+            continue;
         }
-        stat->frame_counter++;
-        ESP_LOGI(TAG,"-> Written %zu of %zu - Counter %zu", ctx->bytes_elapsed(), ctx->total_bytes(), stat->frame_counter);
-        write_len = MIN(ctx->bytes_elapsed(), AAC_MAX_FRAME_SIZE - stat->buffer_size);;
+
+        errors = 0;
     }
 
     AACFlushCodec(decoder);
 }
 
 void delete_helix_decoder(void) {
-    AACFreeDecoder(decoder);
+    if (decoder != NULL)
+        AACFreeDecoder(decoder);
+    decoder = NULL;
+
+    if (stat == NULL)
+        return;
+
+    free(stat->pcm);
+    free(stat->left);
+    free(stat->right);
     free(stat);
+    stat = NULL;
 }
 
 void init_helix_decoder(void) {
-    decoder = AACInitDecoder();
-    stat = malloc(sizeof(struct aac_stat));
-    memset(stat, 0, sizeof(struct aac_stat));
-
-    if (stat->frame_buffer == NULL) {
-        ESP_LOGI(TAG,"allocating frame_buffer with %zu bytes", AAC_MAX_FRAME_SIZE);
-        stat->frame_buffer = malloc(AAC_MAX_FRAME_SIZE);
+    if (stat != NULL && stat->active) {
+        AACFlushCodec(decoder);
+        stat->frame_counter = 0;
+        return;
     }
-    if (stat->pwm_buffer == NULL) {
-        ESP_LOGI(TAG,"allocating pwm_buffer with %zu bytes", AAC_MAX_OUTPUT_SIZE);
-        stat->pwm_buffer = malloc(AAC_MAX_OUTPUT_SIZE);
+
+    if (decoder == NULL)
+        decoder = AACInitDecoder();
+
+    if (stat == NULL) {
+        stat = calloc(1, sizeof(struct aac_stat));
+        if (stat == NULL) {
+            ESP_LOGE(TAG, "Not enough memory for decoder state");
+            return;
+        }
     }
-    if (stat->pwm_buffer==NULL || stat->frame_buffer==NULL){
+
+    // Whatever failed last time is tried again
+    if (stat->pcm == NULL)
+        stat->pcm = malloc(AAC_OUTPUT_SAMPLES * AAC_MAX_NCHANS * sizeof(int16_t));
+    if (stat->left == NULL)
+        stat->left = malloc(AAC_OUTPUT_SAMPLES * sizeof(int32_t));
+    if (stat->right == NULL)
+        stat->right = malloc(AAC_OUTPUT_SAMPLES * sizeof(int32_t));
+    if (decoder == NULL || stat->pcm == NULL || stat->left == NULL || stat->right == NULL) {
         ESP_LOGE(TAG, "Not enough memory for buffers");
         stat->active = false;
         return;
     }
-    memset(stat->frame_buffer,0, AAC_MAX_FRAME_SIZE);
-    memset(stat->pwm_buffer,0, AAC_MAX_OUTPUT_SIZE);
+
+    stat->frame_counter = 0;
     stat->active = true;
 }
 
 const DecoderWrapper_t helix_wrapper = {
         .init = init_helix_decoder,
+        .probe = probe_helix_decoder,
         .run = run_helix_decoder,
         .delete = delete_helix_decoder
 };
\ No newline at end of file
@@ -3,10 +3,17 @@
 
 #include "audio_common.h"
 
+bool probe_helix_decoder(const AudioContext_t* ctx, AudioStreamInfo_t* info);
 void run_helix_decoder(const AudioContext_t* audio_ctx);
 void init_helix_decoder(void);
 void delete_helix_decoder(void);
 
+// Containers carry AAC as raw access units without ADTS headers, so the format comes from their config instead.
+// profile is the AAC object type minus one. Returns false if Helix cannot decode the format.
+bool helix_set_raw_format(unsigned int channels, unsigned int sample_rate, unsigned int profile);
+// Decodes one frame and writes its samples. Returns the Helix error code; *run is false once output has stopped.
+int helix_decode_frame(const AudioContext_t* ctx, const uint8_t* data, size_t length, bool* run);
+
 extern const DecoderWrapper_t helix_wrapper;
 
 #endif //AIRDAC_FIRMWARE_HELIX_WRAPPER_H
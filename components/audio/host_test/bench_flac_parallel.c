@@ -0,0 +1,50 @@
+#include "host_test.h"
+#include "fake_context.h"
+#include "flac_parallel.h"
+#include "flac_verbatim.h"
+
+#include <stdlib.h>
+#include <sys/param.h>
+
+// flac_parallel.c at the FLAC_WORKERS it was built with, over a stream of verbatim frames. Those decode far faster
+// than real FLAC, so this shows what the splitter and the hand-off to the workers cost and how that scales with
+// the worker count, not libFLAC. CMake builds one of these per count, and the bench_flac_parallel target runs them.
+#define SAMPLE_RATE     44100
+#define BLOCK_SIZE      4096
+#define FRAMES          1000
+#define ROUNDS          3
+#define MAX_CHUNK       8192
+
+static int16_t sample(size_t index, int channel) {
+    return (int16_t)(index * 31 + channel * 12345);
+}
+
+int main(void) {
+    struct flac_verbatim_stream stream = {
+            .sample_rate = SAMPLE_RATE,
+            .block_size = BLOCK_SIZE,
+            .frames = FRAMES,
+            .last_block = BLOCK_SIZE,
+            .sample = sample
+    };
+    uint8_t* data = malloc(flac_verbatim_stream_size(&stream));
+    size_t first_frame;
+    size_t length = flac_verbatim_write_stream(data, &stream, &first_frame);
+    fake_context_init((size_t)FRAMES * BLOCK_SIZE, MAX_CHUNK, 0x2545F491);
+
+    // The best of a few runs, as the first one also starts the workers
+    double best = 0;
+    for (int r = 0; r < ROUNDS; r++) {
+        fake_context_reset(data, length);
+        int64_t start = now_ns();
+        CHECK(flac_parallel_run(&fake_context));
+        double seconds = (now_ns() - start) / 1e9;
+        CHECK_EQ(fake_output.count, (size_t)FRAMES * BLOCK_SIZE);
+        best = MAX(best, FRAMES / seconds);
+    }
+
+    printf("%d workers: %8.0f frames/s, %6.1fx real time\n", FLAC_WORKERS, best, best * BLOCK_SIZE / SAMPLE_RATE);
+    CHECK_EQ(fake_context_faults, 0);
+    free(data);
+    return check_result();
+}
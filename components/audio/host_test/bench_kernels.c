@@ -0,0 +1,114 @@
+#include "host_test.h"
+#include "pcm_kernels.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Run with a Release build. The ESP32 numbers are lower by the clock ratio and then some,
+// but the relative cost of each kernel carries over.
+#define FRAMES      4096
+#define ROUNDS      2000
+// As configured in audio_sink_i2s.c
+#define DMA_BUF_COUNT   4
+#define DMA_BUF_LEN     511
+
+static int32_t left[FRAMES];
+static int32_t right[FRAMES];
+static int32_t out[FRAMES * 2];
+static int32_t staged[DMA_BUF_LEN * 2];
+static int16_t packed[DMA_BUF_LEN * 2];
+// Stands in for the driver copying each write into its DMA buffers
+static uint8_t dma[DMA_BUF_LEN * 2 * sizeof(int32_t)];
+
+// Keeps the compiler from dropping the work; the DMA copies are kept with a compiler barrier
+static volatile int32_t sink;
+
+static double ns_per_sample(int64_t elapsed_ns, size_t samples) {
+    return (double)elapsed_ns / ((double)samples * ROUNDS);
+}
+
+static void bench_depth(unsigned int bit_depth) {
+    unsigned int shift = pcm_normalize_shift(bit_depth);
+    int64_t start;
+
+    start = now_ns();
+    for (int r = 0; r < ROUNDS; r++)
+        pcm_interleave(out, left, right, FRAMES, shift);
+    double stereo = ns_per_sample(now_ns() - start, FRAMES * 2);
+    sink = out[FRAMES];
+
+    start = now_ns();
+    for (int r = 0; r < ROUNDS; r++)
+        pcm_mono_to_stereo(out, left, FRAMES, shift);
+    double mono = ns_per_sample(now_ns() - start, FRAMES * 2);
+    sink = out[FRAMES];
+
+    printf("%2u-bit  %6.3f  %6.3f\n", bit_depth, stereo, mono);
+}
+
+// What the I2S sink does per DMA buffer: 32-bit slots are copied as they are, 16-bit slots are packed first and
+// copied at half the size. Below unity gain, or on a ramp, the gain is applied in that same pass.
+// Times are per stereo frame, bytes are the DMA buffers the driver allocates.
+static void bench_slots(void) {
+    int64_t start = now_ns();
+    for (int r = 0; r < ROUNDS; r++) {
+        for (size_t f = 0; f + DMA_BUF_LEN <= FRAMES; f += DMA_BUF_LEN) {
+            memcpy(dma, out + 2 * f, DMA_BUF_LEN * 2 * sizeof(int32_t));
+            asm volatile("" : : "r"(dma) : "memory");
+        }
+    }
+    double wide = ns_per_sample(now_ns() - start, FRAMES / DMA_BUF_LEN * DMA_BUF_LEN);
+
+    start = now_ns();
+    for (int r = 0; r < ROUNDS; r++) {
+        for (size_t f = 0; f + DMA_BUF_LEN <= FRAMES; f += DMA_BUF_LEN) {
+            pcm_pack_16(packed, out + 2 * f, DMA_BUF_LEN * 2);
+            memcpy(dma, packed, DMA_BUF_LEN * 2 * sizeof(int16_t));
+            asm volatile("" : : "r"(dma) : "memory");
+        }
+    }
+    double narrow = ns_per_sample(now_ns() - start, FRAMES / DMA_BUF_LEN * DMA_BUF_LEN);
+
+    start = now_ns();
+    for (int r = 0; r < ROUNDS; r++) {
+        for (size_t f = 0; f + DMA_BUF_LEN <= FRAMES; f += DMA_BUF_LEN) {
+            pcm_copy_gain(staged, out + 2 * f, DMA_BUF_LEN, 1 << 30, -1000);
+            memcpy(dma, staged, DMA_BUF_LEN * 2 * sizeof(int32_t));
+            asm volatile("" : : "r"(dma) : "memory");
+        }
+    }
+    double wide_gain = ns_per_sample(now_ns() - start, FRAMES / DMA_BUF_LEN * DMA_BUF_LEN);
+
+    start = now_ns();
+    for (int r = 0; r < ROUNDS; r++) {
+        for (size_t f = 0; f + DMA_BUF_LEN <= FRAMES; f += DMA_BUF_LEN) {
+            pcm_pack_16_gain(packed, out + 2 * f, DMA_BUF_LEN, 1 << 30, -1000);
+            memcpy(dma, packed, DMA_BUF_LEN * 2 * sizeof(int16_t));
+            asm volatile("" : : "r"(dma) : "memory");
+        }
+    }
+    double narrow_gain = ns_per_sample(now_ns() - start, FRAMES / DMA_BUF_LEN * DMA_BUF_LEN);
+
+    printf("\nns per frame to the DMA buffers, and their size\n");
+    printf("              unity    gain\n");
+    printf("32-bit slots  %6.3f  %6.3f  %5u bytes\n", wide, wide_gain, DMA_BUF_COUNT * DMA_BUF_LEN * 2 * 4);
+    printf("16-bit slots  %6.3f  %6.3f  %5u bytes\n", narrow, narrow_gain, DMA_BUF_COUNT * DMA_BUF_LEN * 2 * 2);
+}
+
+int main(void) {
+    uint32_t random = 1;
+    for (size_t i = 0; i < FRAMES; i++) {
+        left[i] = (int32_t)test_random(&random) >> 8;
+        right[i] = (int32_t)test_random(&random) >> 8;
+    }
+
+    printf("ns per output sample\n");
+    printf("        stereo    mono\n");
+    bench_depth(16);
+    bench_depth(24);
+    bench_depth(32);
+
+    pcm_interleave(out, left, right, FRAMES, pcm_normalize_shift(24));
+    bench_slots();
+    return check_result();
+}
@@ -0,0 +1,64 @@
+#include "host_test.h"
+#include "tone.h"
+#include "audio.h"
+#include "resampler.h"
+
+#include <stdlib.h>
+#include <sys/param.h>
+
+// Real-time factor is processing time over audio time for 24-bit stereo, so 0.01 takes 1% of a core.
+// THD+N is everything but a 1 kHz tone at -1 dBFS, over the whole output band.
+#define SECONDS         4
+#define OUTPUT_RATE     48000
+#define BLOCK_FRAMES    1024
+
+static const unsigned int input_rates[] = { 88200, 96000, 176400, 192000 };
+static const AudioResampleQuality_t qualities[] = { AUDIO_RESAMPLE_LOW, AUDIO_RESAMPLE_MEDIUM, AUDIO_RESAMPLE_HIGH };
+
+static void bench(unsigned int in_rate, AudioResampleQuality_t quality) {
+    size_t frames = (size_t)in_rate * SECONDS;
+    int32_t* left = malloc(frames * sizeof(int32_t));
+    int32_t* right = malloc(frames * sizeof(int32_t));
+    size_t out_capacity = (size_t)OUTPUT_RATE * SECONDS + BLOCK_FRAMES;
+    int32_t* out_left = malloc(out_capacity * sizeof(int32_t));
+    int32_t* out_right = malloc(out_capacity * sizeof(int32_t));
+
+    double amplitude = pow(10.0, -1.0 / 20.0);
+    tone_generate(left, frames, amplitude, 1000.0 / in_rate, 24);
+    tone_generate(right, frames, amplitude, 1000.0 / in_rate, 24);
+
+    Resampler_t* resampler = resampler_create(in_rate, OUTPUT_RATE, quality);
+    size_t used = 0;
+    size_t produced = 0;
+    int64_t start = now_ns();
+    while (used < frames) {
+        size_t in_len = MIN(BLOCK_FRAMES, frames - used);
+        produced += resampler_process(resampler, left + used, right + used, &in_len, out_left + produced,
+                                      out_right + produced, out_capacity - produced, 8);
+        used += in_len;
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    double fitted;
+    double residual;
+    size_t skip = 1024;
+    tone_fit(out_left + skip, produced - skip, 1000.0 / OUTPUT_RATE, &fitted, &residual);
+
+    printf("%3u taps (%3u per phase)  %6u Hz  RTF %.4f  THD+N %6.1f dB\n", quality, resampler->taps, in_rate,
+           seconds / SECONDS, to_db(residual / (fitted / M_SQRT2)));
+
+    resampler_delete(resampler);
+    free(left);
+    free(right);
+    free(out_left);
+    free(out_right);
+}
+
+int main(void) {
+    for (size_t q = 0; q < sizeof(qualities) / sizeof(qualities[0]); q++) {
+        for (size_t r = 0; r < sizeof(input_rates) / sizeof(input_rates[0]); r++)
+            bench(input_rates[r], qualities[q]);
+    }
+
+    return check_result();
+}
@@ -0,0 +1,32 @@
+#include "flac_wrapper.h"
+#include "mad_wrapper.h"
+#include "helix_wrapper.h"
+#include "mp4_wrapper.h"
+#include "vorbis_wrapper.h"
+#include "opus_wrapper.h"
+
+// The codec libraries in ../lib are Xtensa builds, so on the host these formats are recognised and then fail
+
+static void init_unavailable(void) {
+}
+
+static void run_unavailable(const AudioContext_t* ctx) {
+    ctx->decoder_failed();
+}
+
+static void delete_unavailable(void) {
+}
+
+#define UNAVAILABLE_DECODER { \
+        .init = init_unavailable, \
+        .probe = NULL, \
+        .run = run_unavailable, \
+        .delete = delete_unavailable \
+    }
+
+const DecoderWrapper_t flac_wrapper = UNAVAILABLE_DECODER;
+const DecoderWrapper_t mad_wrapper = UNAVAILABLE_DECODER;
+const DecoderWrapper_t helix_wrapper = UNAVAILABLE_DECODER;
+const DecoderWrapper_t mp4_wrapper = UNAVAILABLE_DECODER;
+const DecoderWrapper_t vorbis_wrapper = UNAVAILABLE_DECODER;
+const DecoderWrapper_t opus_wrapper = UNAVAILABLE_DECODER;
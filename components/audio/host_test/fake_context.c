@@ -0,0 +1,134 @@
+#include "fake_context.h"
+#include "host_test.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+struct fake_input fake_input;
+struct fake_output fake_output;
+int fake_context_faults = 0;
+
+static size_t capacity;
+static size_t max_chunk;
+static uint32_t random_state;
+
+void fake_context_init(size_t output_capacity, size_t chunk, uint32_t seed) {
+    capacity = output_capacity;
+    max_chunk = chunk;
+    random_state = seed;
+    fake_output.left = malloc(capacity * sizeof(int32_t));
+    fake_output.right = malloc(capacity * sizeof(int32_t));
+}
+
+void fake_context_reset(const uint8_t* data, size_t length) {
+    int32_t* left = fake_output.left;
+    int32_t* right = fake_output.right;
+    memset(&fake_input, 0, sizeof(fake_input));
+    memset(&fake_output, 0, sizeof(fake_output));
+    fake_input.data = data;
+    fake_input.length = length;
+    fake_output.left = left;
+    fake_output.right = right;
+}
+
+bool fake_seek_anywhere(size_t position) {
+    return true;
+}
+
+static size_t peek(const uint8_t** data, size_t min_length) {
+    size_t remaining = fake_input.length - fake_input.position;
+    size_t chunk = 1 + test_random(&random_state) % max_chunk;
+    chunk = MAX(chunk, min_length);
+    *data = fake_input.data + fake_input.position;
+    return MIN(chunk, remaining);
+}
+
+static void consume(size_t length) {
+    fake_input.position += length;
+    if (fake_input.position > fake_input.length) {
+        fprintf(stderr, "Consumed to %zu of %zu bytes\n", fake_input.position, fake_input.length);
+        fake_context_faults++;
+    }
+}
+
+static bool seek(size_t position) {
+    if (position > fake_input.length || fake_input.seek == NULL || !fake_input.seek(position))
+        return false;
+
+    fake_input.position = position;
+    return true;
+}
+
+static size_t read_at(size_t position, uint8_t* buffer, size_t length) {
+    if (position >= fake_input.length || fake_input.ranges_refused)
+        return 0;
+
+    length = MIN(length, fake_input.length - position);
+    memcpy(buffer, fake_input.data + position, length);
+    fake_input.reads_at++;
+    return length;
+}
+
+static bool write(const int32_t* left, const int32_t* right, size_t length, unsigned int sample_rate,
+                  unsigned int bit_depth) {
+    if (fake_output.count + length > capacity) {
+        fprintf(stderr, "Wrote %zu samples past %zu\n", fake_output.count + length - capacity, capacity);
+        fake_context_faults++;
+        return false;
+    }
+
+    if (fake_output.count != 0)
+        fake_output.format_changed |= sample_rate != fake_output.sample_rate || bit_depth != fake_output.bit_depth;
+    memcpy(fake_output.left + fake_output.count, left, length * sizeof(int32_t));
+    memcpy(fake_output.right + fake_output.count, right, length * sizeof(int32_t));
+    fake_output.count += length;
+    fake_output.sample_rate = sample_rate;
+    fake_output.bit_depth = bit_depth;
+    fake_output.mono_aliased = left == right;
+    return true;
+}
+
+static void decoder_failed(void) {
+    fake_output.failures++;
+}
+
+static void decoder_finished(void) {
+    fake_output.finishes++;
+}
+
+static size_t bytes_elapsed(void) {
+    return fake_input.position;
+}
+
+static size_t total_bytes(void) {
+    return fake_input.length;
+}
+
+static bool eof(void) {
+    return fake_input.position == fake_input.length;
+}
+
+static bool seek_pending(uint32_t* position_ms) {
+    return fake_input.seek_pending != NULL && fake_input.seek_pending(position_ms);
+}
+
+static void seek_done(uint64_t sample, unsigned int sample_rate) {
+    if (fake_input.seek_done != NULL)
+        fake_input.seek_done(sample, sample_rate);
+}
+
+const AudioContext_t fake_context = {
+        .peek = peek,
+        .consume = consume,
+        .seek = seek,
+        .read_at = read_at,
+        .write = write,
+        .decoder_failed = decoder_failed,
+        .decoder_finished = decoder_finished,
+        .bytes_elapsed = bytes_elapsed,
+        .total_bytes = total_bytes,
+        .eof = eof,
+        .seek_pending = seek_pending,
+        .seek_done = seek_done
+};
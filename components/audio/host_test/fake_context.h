@@ -0,0 +1,44 @@
+#ifndef AIRDAC_FIRMWARE_FAKE_CONTEXT_H
+#define AIRDAC_FIRMWARE_FAKE_CONTEXT_H
+
+#include "audio_common.h"
+
+// The codec tests' stand-in for audio.c: a file in memory, handed to the decoder in random chunk sizes, and
+// what it writes collected for checking. Tests that seek set the hooks after each reset.
+struct fake_input {
+    const uint8_t* data;
+    size_t length;
+    size_t position;
+    unsigned int reads_at;  // Through read_at(), which leaves position alone
+    bool ranges_refused;    // read_at() returns 0, as for an input that cannot read ranges
+    // Asked about each seek within the file, and refuses it by returning false. Without one nothing seeks.
+    bool (*seek)(size_t position);
+    bool (*seek_pending)(uint32_t* position_ms);
+    void (*seek_done)(uint64_t sample, unsigned int sample_rate);
+};
+
+struct fake_output {
+    int32_t* left;
+    int32_t* right;
+    size_t count;
+    unsigned int sample_rate;
+    unsigned int bit_depth;
+    bool format_changed;    // Between one write and the next
+    bool mono_aliased;      // Mono frames were written with right pointing at left
+    int finishes;
+    int failures;
+};
+
+extern struct fake_input fake_input;
+extern struct fake_output fake_output;
+extern const AudioContext_t fake_context;
+// Consumes past the end of the file and writes past the output capacity, over every file
+extern int fake_context_faults;
+
+// Output room for capacity samples per channel, and chunks of up to max_chunk bytes
+void fake_context_init(size_t capacity, size_t max_chunk, uint32_t seed);
+// A new file, with no hooks and nothing written yet
+void fake_context_reset(const uint8_t* data, size_t length);
+bool fake_seek_anywhere(size_t position);
+
+#endif //AIRDAC_FIRMWARE_FAKE_CONTEXT_H
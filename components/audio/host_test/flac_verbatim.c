@@ -0,0 +1,278 @@
+#include "flac_verbatim.h"
+#include "FLAC/format.h"
+#include "FLAC/stream_decoder.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Just enough of the libFLAC stream decoder for flac_parallel.c: a STREAMINFO block, then frames of 16-bit
+// verbatim subframes with independent channels, as flac_verbatim_write_stream() lays them out. The frame CRC-16
+// is checked as libFLAC would, so a frame the splitter cut in the wrong place is reported as an error.
+
+#define MAX_FRAME           (64 * 1024)
+#define SUBFRAME_VERBATIM   0x02
+
+bool flac_verbatim_fail_init = false;
+
+struct verbatim_decoder {
+    FLAC__StreamDecoder decoder;
+    FLAC__StreamDecoderReadCallback read;
+    FLAC__StreamDecoderWriteCallback write;
+    FLAC__StreamDecoderErrorCallback error;
+    void* client;
+    FLAC__StreamDecoderState state;
+    unsigned int sample_rate;
+    unsigned int channels;
+    uint8_t frame[MAX_FRAME];
+    FLAC__int32 samples[2][FLAC__MAX_BLOCK_SIZE];
+};
+
+const char* const FLAC__StreamDecoderErrorStatusString[] = {
+        "FLAC__STREAM_DECODER_ERROR_STATUS_LOST_SYNC",
+        "FLAC__STREAM_DECODER_ERROR_STATUS_BAD_HEADER",
+        "FLAC__STREAM_DECODER_ERROR_STATUS_FRAME_CRC_MISMATCH",
+        "FLAC__STREAM_DECODER_ERROR_STATUS_UNPARSEABLE_STREAM"
+};
+
+static uint16_t crc16(const uint8_t* data, size_t length) {
+    uint16_t crc = 0;
+    for (size_t i = 0; i < length; i++) {
+        crc ^= data[i] << 8;
+        for (int b = 0; b < 8; b++)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x8005 : crc << 1;
+    }
+    return crc;
+}
+
+static uint8_t crc8(const uint8_t* data, size_t length) {
+    uint8_t crc = 0;
+    for (size_t i = 0; i < length; i++) {
+        crc ^= data[i];
+        for (int b = 0; b < 8; b++)
+            crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+    return crc;
+}
+
+static uint8_t* put_be(uint8_t* out, uint64_t value, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--)
+        *out++ = value >> (8 * i);
+    return out;
+}
+
+static unsigned int block_of(const struct flac_verbatim_stream* stream, unsigned int number) {
+    return number == stream->frames - 1 ? stream->last_block : stream->block_size;
+}
+
+static uint8_t* put_frame(uint8_t* out, const struct flac_verbatim_stream* stream, unsigned int number) {
+    uint8_t* frame = out;
+    size_t first = (size_t)number * stream->block_size;
+    unsigned int block = block_of(stream, number);
+
+    // Fixed blocksize, explicit 16-bit block size, rate and depth from STREAMINFO, independent stereo
+    *out++ = 0xFF;
+    *out++ = 0xF8;
+    *out++ = 0x70;
+    *out++ = 0x10;
+    if (number < 0x80) {
+        *out++ = number;
+    } else if (number < 0x800) {
+        *out++ = 0xC0 | (number >> 6);
+        *out++ = 0x80 | (number & 0x3F);
+    } else {
+        *out++ = 0xE0 | (number >> 12);
+        *out++ = 0x80 | ((number >> 6) & 0x3F);
+        *out++ = 0x80 | (number & 0x3F);
+    }
+    out = put_be(out, block - 1, 2);
+    *out = crc8(frame, out - frame);
+    out++;
+
+    for (int c = 0; c < 2; c++) {
+        *out++ = SUBFRAME_VERBATIM;
+        for (unsigned int i = 0; i < block; i++)
+            out = put_be(out, (uint16_t)stream->sample(first + i, c), 2);
+    }
+
+    return put_be(out, crc16(frame, out - frame), 2);
+}
+
+size_t flac_verbatim_stream_size(const struct flac_verbatim_stream* stream) {
+    return 1024 + (size_t)stream->frames * (18 + 4 * stream->block_size);
+}
+
+size_t flac_verbatim_write_stream(uint8_t* out, const struct flac_verbatim_stream* stream, size_t* first_frame) {
+    uint8_t* start = out;
+    size_t total_samples = (size_t)(stream->frames - 1) * stream->block_size + stream->last_block;
+
+    memcpy(out, "fLaC", 4);
+    out += 4;
+    *out++ = 0x00;
+    out = put_be(out, 34, 3);
+    out = put_be(out, stream->block_size, 2);
+    out = put_be(out, stream->block_size, 2);
+    out = put_be(out, 0, 6);
+    *out++ = stream->sample_rate >> 12;
+    *out++ = stream->sample_rate >> 4;
+    *out++ = ((stream->sample_rate & 0x0F) << 4) | (1 << 1);
+    *out++ = 15 << 4;
+    out = put_be(out, total_samples, 4);
+    memset(out, 0, 16);
+    out += 16;
+
+    // Seekpoint offsets are known once the frames are laid out, so they are filled in below
+    uint8_t* points = NULL;
+    unsigned int stride = stream->seekpoint_stride;
+    if (stride != 0) {
+        size_t point_count = (stream->frames + stride - 1) / stride;
+        *out++ = 0x03;
+        out = put_be(out, point_count * 18, 3);
+        points = out;
+        out += point_count * 18;
+    }
+
+    // A last block the decoder has no use for
+    *out++ = 0x81;
+    out = put_be(out, 13, 3);
+    memset(out, 0, 13);
+    out += 13;
+
+    *first_frame = out - start;
+    for (unsigned int i = 0; i < stream->frames; i++) {
+        if (points != NULL && i % stride == 0) {
+            uint8_t* point = points + (i / stride) * 18;
+            point = put_be(point, (uint64_t)i * stream->block_size, 8);
+            point = put_be(point, out - start - *first_frame, 8);
+            put_be(point, block_of(stream, i), 2);
+        }
+        out = put_frame(out, stream, i);
+    }
+
+    return out - start;
+}
+
+// Everything the read callback has, up to capacity
+static size_t read_all(struct verbatim_decoder* d, uint8_t* buffer, size_t capacity) {
+    size_t length = 0;
+    while (length < capacity) {
+        size_t bytes = capacity - length;
+        if (d->read(&d->decoder, buffer + length, &bytes, d->client) != FLAC__STREAM_DECODER_READ_STATUS_CONTINUE)
+            break;
+        length += bytes;
+    }
+    return length;
+}
+
+FLAC__StreamDecoder* FLAC__stream_decoder_new(void) {
+    struct verbatim_decoder* d = calloc(1, sizeof(struct verbatim_decoder));
+    if (d == NULL)
+        return NULL;
+
+    d->state = FLAC__STREAM_DECODER_UNINITIALIZED;
+    return &d->decoder;
+}
+
+FLAC__StreamDecoderInitStatus FLAC__stream_decoder_init_stream(FLAC__StreamDecoder* decoder,
+        FLAC__StreamDecoderReadCallback read_callback, FLAC__StreamDecoderSeekCallback seek_callback,
+        FLAC__StreamDecoderTellCallback tell_callback, FLAC__StreamDecoderLengthCallback length_callback,
+        FLAC__StreamDecoderEofCallback eof_callback, FLAC__StreamDecoderWriteCallback write_callback,
+        FLAC__StreamDecoderMetadataCallback metadata_callback, FLAC__StreamDecoderErrorCallback error_callback,
+        void* client_data) {
+    struct verbatim_decoder* d = (struct verbatim_decoder*)decoder;
+    if (flac_verbatim_fail_init)
+        return FLAC__STREAM_DECODER_INIT_STATUS_MEMORY_ALLOCATION_ERROR;
+
+    d->read = read_callback;
+    d->write = write_callback;
+    d->error = error_callback;
+    d->client = client_data;
+    d->state = FLAC__STREAM_DECODER_SEARCH_FOR_METADATA;
+    return FLAC__STREAM_DECODER_INIT_STATUS_OK;
+}
+
+FLAC__bool FLAC__stream_decoder_finish(FLAC__StreamDecoder* decoder) {
+    struct verbatim_decoder* d = (struct verbatim_decoder*)decoder;
+    d->state = FLAC__STREAM_DECODER_UNINITIALIZED;
+    return true;
+}
+
+FLAC__bool FLAC__stream_decoder_flush(FLAC__StreamDecoder* decoder) {
+    struct verbatim_decoder* d = (struct verbatim_decoder*)decoder;
+    d->state = FLAC__STREAM_DECODER_SEARCH_FOR_FRAME_SYNC;
+    return true;
+}
+
+FLAC__StreamDecoderState FLAC__stream_decoder_get_state(const FLAC__StreamDecoder* decoder) {
+    const struct verbatim_decoder* d = (const struct verbatim_decoder*)decoder;
+    return d->state;
+}
+
+FLAC__bool FLAC__stream_decoder_process_until_end_of_metadata(FLAC__StreamDecoder* decoder) {
+    struct verbatim_decoder* d = (struct verbatim_decoder*)decoder;
+    uint8_t block[4 + 4 + FLAC__STREAM_METADATA_STREAMINFO_LENGTH];
+    if (read_all(d, block, sizeof(block)) != sizeof(block) || memcmp(block, "fLaC", 4) != 0) {
+        d->state = FLAC__STREAM_DECODER_END_OF_STREAM;
+        return false;
+    }
+
+    const uint8_t* info = block + 8;
+    d->sample_rate = (info[10] << 12) | (info[11] << 4) | (info[12] >> 4);
+    d->channels = ((info[12] >> 1) & 0x07) + 1;
+    d->state = FLAC__STREAM_DECODER_SEARCH_FOR_FRAME_SYNC;
+    return true;
+}
+
+// Block size code 7, sample rate and bit depth from STREAMINFO, independent channels
+FLAC__bool FLAC__stream_decoder_process_single(FLAC__StreamDecoder* decoder) {
+    struct verbatim_decoder* d = (struct verbatim_decoder*)decoder;
+    size_t length = read_all(d, d->frame, MAX_FRAME);
+    d->state = FLAC__STREAM_DECODER_END_OF_STREAM;
+
+    const uint8_t* h = d->frame;
+    if (length < 8 || h[0] != 0xFF || (h[1] & 0xFE) != 0xF8 || (h[2] >> 4) != 7 || (h[3] >> 4) != d->channels - 1) {
+        d->error(&d->decoder, FLAC__STREAM_DECODER_ERROR_STATUS_BAD_HEADER, d->client);
+        return true;
+    }
+
+    // The coded number is only skipped here, flac_parallel.c reads it itself
+    size_t pos = 5;
+    for (uint8_t mask = 0x40; (h[4] & 0x80) && (h[4] & mask); mask >>= 1)
+        pos++;
+
+    unsigned int block_size = ((h[pos] << 8) | h[pos + 1]) + 1;
+    pos += 3;
+
+    size_t expected = pos + d->channels * (1 + 2 * block_size) + 2;
+    if (length != expected || crc16(d->frame, length) != 0) {
+        d->error(&d->decoder, FLAC__STREAM_DECODER_ERROR_STATUS_FRAME_CRC_MISMATCH, d->client);
+        return true;
+    }
+
+    const FLAC__int32* channels[2];
+    for (unsigned int c = 0; c < d->channels; c++) {
+        if (d->frame[pos++] != SUBFRAME_VERBATIM) {
+            d->error(&d->decoder, FLAC__STREAM_DECODER_ERROR_STATUS_UNPARSEABLE_STREAM, d->client);
+            return true;
+        }
+
+        for (unsigned int i = 0; i < block_size; i++, pos += 2)
+            d->samples[c][i] = (int16_t)((d->frame[pos] << 8) | d->frame[pos + 1]);
+        channels[c] = d->samples[c];
+    }
+
+    FLAC__Frame frame = { 0 };
+    frame.header.blocksize = block_size;
+    frame.header.sample_rate = d->sample_rate;
+    frame.header.channels = d->channels;
+    frame.header.channel_assignment = FLAC__CHANNEL_ASSIGNMENT_INDEPENDENT;
+    frame.header.bits_per_sample = 16;
+
+    if (d->write(&d->decoder, &frame, channels, d->client) != FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE) {
+        d->state = FLAC__STREAM_DECODER_ABORTED;
+        return false;
+    }
+
+    d->state = FLAC__STREAM_DECODER_SEARCH_FOR_FRAME_SYNC;
+    return true;
+}
@@ -0,0 +1,25 @@
+#ifndef AIRDAC_FIRMWARE_FLAC_VERBATIM_H
+#define AIRDAC_FIRMWARE_FLAC_VERBATIM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A 16-bit stereo stream of verbatim frames, as flac_verbatim.c decodes them
+struct flac_verbatim_stream {
+    unsigned int sample_rate;
+    unsigned int block_size;
+    unsigned int frames;            // Up to 0xFFFF
+    unsigned int last_block;        // Samples in the last frame
+    unsigned int seekpoint_stride;  // Frames between seekpoints, 0 for no seektable
+    int16_t (*sample)(size_t index, int channel);
+};
+
+// Set by a test to make the next init_stream() fail
+extern bool flac_verbatim_fail_init;
+
+size_t flac_verbatim_stream_size(const struct flac_verbatim_stream* stream);
+// Returns the length of the stream, with the offset of its first frame in *first_frame
+size_t flac_verbatim_write_stream(uint8_t* out, const struct flac_verbatim_stream* stream, size_t* first_frame);
+
+#endif //AIRDAC_FIRMWARE_FLAC_VERBATIM_H
@@ -0,0 +1,330 @@
+#include "freertos/FreeRTOS.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct HostTask {
+    pthread_t thread;
+    TaskFunction_t function;
+    void* args;
+    UBaseType_t priority;
+    pthread_mutex_t lock;
+    pthread_cond_t notified;
+    uint32_t value;
+    bool pending;
+};
+
+struct HostSemaphore {
+    pthread_mutex_t lock;
+    pthread_cond_t given;
+    UBaseType_t count;
+    UBaseType_t max_count;
+};
+
+struct HostQueue {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    uint8_t* items;
+    UBaseType_t length;
+    UBaseType_t item_size;
+    UBaseType_t head;
+    UBaseType_t count;
+};
+
+static pthread_key_t task_key;
+static pthread_once_t task_key_once = PTHREAD_ONCE_INIT;
+
+static void create_task_key(void) {
+    pthread_key_create(&task_key, NULL);
+}
+
+static void init_cond(pthread_cond_t* cond) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static struct timespec deadline(TickType_t wait) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += wait / 1000;
+    ts.tv_nsec += (long)(wait % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    return ts;
+}
+
+// Waits on cond until ready() or the wait runs out. The lock is held on entry and on return.
+static bool wait_until(pthread_cond_t* cond, pthread_mutex_t* lock, TickType_t wait, bool (*ready)(void*), void* arg) {
+    struct timespec until = deadline(wait);
+    while (!ready(arg)) {
+        if (wait == 0)
+            return false;
+
+        if (wait == portMAX_DELAY) {
+            pthread_cond_wait(cond, lock);
+        } else if (pthread_cond_timedwait(cond, lock, &until) == ETIMEDOUT) {
+            return ready(arg);
+        }
+    }
+
+    return true;
+}
+
+static void* task_entry(void* arg) {
+    TaskHandle_t task = arg;
+    pthread_once(&task_key_once, create_task_key);
+    pthread_setspecific(task_key, task);
+    task->function(task->args);
+    return NULL;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char* name, uint32_t stack_size, void* args,
+                                   UBaseType_t priority, TaskHandle_t* handle, BaseType_t core) {
+    TaskHandle_t task = calloc(1, sizeof(struct HostTask));
+    assert(task != NULL);
+    task->function = function;
+    task->args = args;
+    task->priority = priority;
+    pthread_mutex_init(&task->lock, NULL);
+    init_cond(&task->notified);
+
+    // The handle is out before the task runs, as it can be notified straight away
+    if (handle != NULL)
+        *handle = task;
+
+    if (pthread_create(&task->thread, NULL, task_entry, task) != 0)
+        return pdFAIL;
+
+    pthread_detach(task->thread);
+    return pdPASS;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t function, const char* name, uint32_t stack_size, void* args,
+                       UBaseType_t priority, TaskHandle_t* handle) {
+    return xTaskCreatePinnedToCore(function, name, stack_size, args, priority, handle, -1);
+}
+
+// Only a task deleting itself is supported
+void vTaskDelete(TaskHandle_t task) {
+    assert(task == NULL || task == xTaskGetCurrentTaskHandle());
+    pthread_exit(NULL);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void) {
+    pthread_once(&task_key_once, create_task_key);
+    return pthread_getspecific(task_key);
+}
+
+UBaseType_t uxTaskPriorityGet(TaskHandle_t task) {
+    if (task == NULL)
+        task = xTaskGetCurrentTaskHandle();
+
+    return task != NULL ? task->priority : 0;
+}
+
+void vTaskDelay(TickType_t ticks) {
+    struct timespec ts = {
+            .tv_sec = ticks / 1000,
+            .tv_nsec = (long)(ticks % 1000) * 1000000
+    };
+    nanosleep(&ts, NULL);
+}
+
+TickType_t xTaskGetTickCount(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (TickType_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+BaseType_t xTaskNotify(TaskHandle_t task, uint32_t value, eNotifyAction action) {
+    BaseType_t result = pdPASS;
+    pthread_mutex_lock(&task->lock);
+    switch (action) {
+        case eNoAction:
+            break;
+        case eSetBits:
+            task->value |= value;
+            break;
+        case eIncrement:
+            task->value++;
+            break;
+        case eSetValueWithOverwrite:
+            task->value = value;
+            break;
+        case eSetValueWithoutOverwrite:
+            if (task->pending)
+                result = pdFAIL;
+            else
+                task->value = value;
+            break;
+    }
+
+    task->pending = true;
+    pthread_cond_signal(&task->notified);
+    pthread_mutex_unlock(&task->lock);
+    return result;
+}
+
+static bool notification_pending(void* arg) {
+    return ((TaskHandle_t)arg)->pending;
+}
+
+// As in FreeRTOS, the value is handed back even when the wait times out, and only cleared on a notification
+BaseType_t xTaskNotifyWait(uint32_t clear_on_entry, uint32_t clear_on_exit, uint32_t* value, TickType_t wait) {
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    assert(task != NULL);
+
+    pthread_mutex_lock(&task->lock);
+    if (!task->pending)
+        task->value &= ~clear_on_entry;
+
+    bool notified = wait_until(&task->notified, &task->lock, wait, notification_pending, task);
+    if (value != NULL)
+        *value = task->value;
+
+    if (notified) {
+        task->value &= ~clear_on_exit;
+        task->pending = false;
+    }
+
+    pthread_mutex_unlock(&task->lock);
+    return notified ? pdTRUE : pdFALSE;
+}
+
+static bool value_nonzero(void* arg) {
+    return ((TaskHandle_t)arg)->value != 0;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t wait) {
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    assert(task != NULL);
+
+    pthread_mutex_lock(&task->lock);
+    wait_until(&task->notified, &task->lock, wait, value_nonzero, task);
+    uint32_t value = task->value;
+    if (value != 0)
+        task->value = clear_on_exit ? 0 : value - 1;
+    task->pending = false;
+    pthread_mutex_unlock(&task->lock);
+    return value;
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max_count, UBaseType_t initial_count) {
+    SemaphoreHandle_t semaphore = calloc(1, sizeof(struct HostSemaphore));
+    assert(semaphore != NULL);
+    pthread_mutex_init(&semaphore->lock, NULL);
+    init_cond(&semaphore->given);
+    semaphore->count = initial_count;
+    semaphore->max_count = max_count;
+    return semaphore;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void) {
+    return xSemaphoreCreateCounting(1, 0);
+}
+
+// No priority inheritance, which the host has no use for
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+    return xSemaphoreCreateCounting(1, 1);
+}
+
+static bool semaphore_available(void* arg) {
+    return ((SemaphoreHandle_t)arg)->count != 0;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t wait) {
+    pthread_mutex_lock(&semaphore->lock);
+    bool taken = wait_until(&semaphore->given, &semaphore->lock, wait, semaphore_available, semaphore);
+    if (taken)
+        semaphore->count--;
+    pthread_mutex_unlock(&semaphore->lock);
+    return taken ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) {
+    pthread_mutex_lock(&semaphore->lock);
+    bool given = semaphore->count < semaphore->max_count;
+    if (given) {
+        semaphore->count++;
+        pthread_cond_signal(&semaphore->given);
+    }
+    pthread_mutex_unlock(&semaphore->lock);
+    return given ? pdTRUE : pdFALSE;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore) {
+    pthread_mutex_destroy(&semaphore->lock);
+    pthread_cond_destroy(&semaphore->given);
+    free(semaphore);
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size) {
+    QueueHandle_t queue = calloc(1, sizeof(struct HostQueue));
+    assert(queue != NULL);
+    queue->items = malloc((size_t)length * item_size);
+    assert(queue->items != NULL);
+    pthread_mutex_init(&queue->lock, NULL);
+    init_cond(&queue->changed);
+    queue->length = length;
+    queue->item_size = item_size;
+    return queue;
+}
+
+static bool queue_has_space(void* arg) {
+    QueueHandle_t queue = arg;
+    return queue->count < queue->length;
+}
+
+static bool queue_has_item(void* arg) {
+    return ((QueueHandle_t)arg)->count != 0;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void* item, TickType_t wait) {
+    pthread_mutex_lock(&queue->lock);
+    bool sent = wait_until(&queue->changed, &queue->lock, wait, queue_has_space, queue);
+    if (sent) {
+        UBaseType_t tail = (queue->head + queue->count) % queue->length;
+        memcpy(queue->items + (size_t)tail * queue->item_size, item, queue->item_size);
+        queue->count++;
+        pthread_cond_broadcast(&queue->changed);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return sent ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void* item, TickType_t wait) {
+    pthread_mutex_lock(&queue->lock);
+    bool received = wait_until(&queue->changed, &queue->lock, wait, queue_has_item, queue);
+    if (received) {
+        memcpy(item, queue->items + (size_t)queue->head * queue->item_size, queue->item_size);
+        queue->head = (queue->head + 1) % queue->length;
+        queue->count--;
+        pthread_cond_broadcast(&queue->changed);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return received ? pdTRUE : pdFALSE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) {
+    pthread_mutex_lock(&queue->lock);
+    UBaseType_t count = queue->count;
+    pthread_mutex_unlock(&queue->lock);
+    return count;
+}
+
+void vQueueDelete(QueueHandle_t queue) {
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->changed);
+    free(queue->items);
+    free(queue);
+}
@@ -0,0 +1,111 @@
+#include "helix-aac/aacdec.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Stands in for the Helix AAC decoder with frames whose payload says what they decode to: a 16-bit frame
+// number and a flags byte, after the ADTS header or as a raw block. Helix's state is modelled where the
+// wrapper depends on it: once given raw block parameters it takes everything as raw blocks until it is freed,
+// and a flush does not change that.
+
+#define ADTS_HEADER_LEN     7
+#define TAGGED_SBR          0x01        // HE-AAC, so the output is twice the core rate and frame length
+#define TAGGED_DAMAGED      0x02
+
+static const int sample_rates[13] = {
+        96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350
+};
+
+struct tagged_decoder {
+    bool raw;
+    AACFrameInfo raw_info;
+    AACFrameInfo last;
+};
+
+// What every output sample of a frame is, so the test can check it
+int16_t helix_tagged_sample(unsigned int frame, size_t index, int channel) {
+    return (int16_t)(frame * 1021 + index * 7 + channel * 333);
+}
+
+HAACDecoder AACInitDecoder(void) {
+    return calloc(1, sizeof(struct tagged_decoder));
+}
+
+void AACFreeDecoder(HAACDecoder decoder) {
+    free(decoder);
+}
+
+int AACFlushCodec(HAACDecoder decoder) {
+    return ERR_AAC_NONE;
+}
+
+int AACSetRawBlockParams(HAACDecoder decoder, int copy_last, AACFrameInfo* info) {
+    struct tagged_decoder* d = decoder;
+    if (info->nChans < 1 || info->nChans > AAC_MAX_NCHANS)
+        return ERR_AAC_RAWBLOCK_PARAMS;
+
+    d->raw = true;
+    d->raw_info = *info;
+    return ERR_AAC_NONE;
+}
+
+void AACGetLastFrameInfo(HAACDecoder decoder, AACFrameInfo* info) {
+    struct tagged_decoder* d = decoder;
+    *info = d->last;
+}
+
+static int decode_payload(struct tagged_decoder* d, const uint8_t* payload, int length, int channels,
+                          int sample_rate, short* out) {
+    // A raw block that starts with a sync word is an ADTS frame handed to a decoder in raw mode
+    if (length < 3 || payload[0] == 0xFF)
+        return ERR_AAC_SYNTAX_ELEMENT;
+    if (payload[2] & TAGGED_DAMAGED)
+        return ERR_AAC_INVALID_FRAME;
+
+    unsigned int frame = (payload[0] << 8) | payload[1];
+    bool sbr = payload[2] & TAGGED_SBR;
+    int samples = sbr ? 2 * AAC_MAX_NSAMPS : AAC_MAX_NSAMPS;
+
+    for (int i = 0; i < samples; i++) {
+        for (int c = 0; c < channels; c++)
+            out[i * channels + c] = helix_tagged_sample(frame, i, c);
+    }
+
+    d->last.nChans = channels;
+    d->last.sampRateCore = sample_rate;
+    d->last.sampRateOut = sbr ? 2 * sample_rate : sample_rate;
+    d->last.bitsPerSample = 16;
+    d->last.outputSamps = samples * channels;
+    return ERR_AAC_NONE;
+}
+
+int AACDecode(HAACDecoder decoder, unsigned char** inbuf, int* bytes_left, short* out) {
+    struct tagged_decoder* d = decoder;
+    const uint8_t* data = *inbuf;
+
+    if (d->raw) {
+        int result = decode_payload(d, data, *bytes_left, d->raw_info.nChans, d->raw_info.sampRateCore, out);
+        *inbuf += *bytes_left;
+        *bytes_left = 0;
+        return result;
+    }
+
+    if (*bytes_left < ADTS_HEADER_LEN || data[0] != 0xFF || (data[1] & 0xF6) != 0xF0)
+        return ERR_AAC_INVALID_ADTS_HEADER;
+
+    unsigned int rate_index = (data[2] >> 2) & 0x0F;
+    int channels = ((data[2] & 0x01) << 2) | (data[3] >> 6);
+    int frame_length = ((data[3] & 0x03) << 11) | (data[4] << 3) | (data[5] >> 5);
+    if (rate_index >= 13 || channels < 1 || channels > AAC_MAX_NCHANS || frame_length <= ADTS_HEADER_LEN)
+        return ERR_AAC_INVALID_ADTS_HEADER;
+    if (*bytes_left < frame_length)
+        return ERR_AAC_INDATA_UNDERFLOW;
+
+    int result = decode_payload(d, data + ADTS_HEADER_LEN, frame_length - ADTS_HEADER_LEN, channels,
+                                sample_rates[rate_index], out);
+    *inbuf += frame_length;
+    *bytes_left -= frame_length;
+    return result;
+}
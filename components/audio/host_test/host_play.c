@@ -0,0 +1,118 @@
+#include "host_test.h"
+#include "audio.h"
+#include "audio_sink.h"
+
+#include <semaphore.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Plays a file through audio.c as the board would, into a WAV file or the null sink, and reports how much faster
+// than real time it decoded. Only WAV and AIFF decode here; the other codecs are linked from Xtensa builds in
+// ../lib and fail on the host.
+//   host_play [-o out.wav] [-t content-type] file
+#define INPUT_CHUNK     4096
+#define BUFFER_MS       250
+
+static struct {
+    uint8_t* data;
+    size_t length;
+    size_t position;
+} input;
+
+static sem_t playback_done;
+static volatile bool failed;
+static volatile uint64_t played_us;
+
+static void decoder_ready(void) {
+    size_t len = input.length - input.position < INPUT_CHUNK ? input.length - input.position : INPUT_CHUNK;
+    const uint8_t* buffer = input.data + input.position;
+    input.position += len;
+    audio_decoder_continue(buffer, len);
+}
+
+static void decoder_finished(void) {
+    sem_post(&playback_done);
+}
+
+static void decoder_failed(void) {
+    failed = true;
+    sem_post(&playback_done);
+}
+
+static void wrote_samples(uint32_t samples, uint32_t sample_rate) {
+    played_us += (uint64_t)samples * 1000000 / sample_rate;
+}
+
+static bool load(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+        return false;
+
+    fseek(file, 0, SEEK_END);
+    input.length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    input.data = malloc(input.length);
+    bool loaded = input.data != NULL && fread(input.data, 1, input.length, file) == input.length;
+    fclose(file);
+    return loaded;
+}
+
+int main(int argc, char** argv) {
+    const char* output_path = NULL;
+    const char* content_type = "audio/wav";
+    int arg = 1;
+    for (; arg + 1 < argc && argv[arg][0] == '-'; arg += 2) {
+        if (strcmp(argv[arg], "-o") == 0)
+            output_path = argv[arg + 1];
+        else if (strcmp(argv[arg], "-t") == 0)
+            content_type = argv[arg + 1];
+        else
+            break;
+    }
+
+    if (arg != argc - 1) {
+        fprintf(stderr, "Usage: %s [-o out.wav] [-t content-type] file\n", argv[0]);
+        return 2;
+    }
+
+    if (!load(argv[arg])) {
+        fprintf(stderr, "Cannot read %s\n", argv[arg]);
+        return 1;
+    }
+
+    const AudioSink_t* sink = &null_sink;
+    if (output_path != NULL) {
+        wav_sink_set_path(output_path);
+        sink = &wav_sink;
+    }
+
+    sem_init(&playback_done, 0, 0);
+    audio_start(sink, 16384, 5, BUFFER_MS);
+
+    AudioDecoderConfig_t config = {
+            .file_size = input.length,
+            .decoder_ready_cb = decoder_ready,
+            .decoder_finished_cb = decoder_finished,
+            .decoder_failed_cb = decoder_failed,
+            .wrote_samples_cb = wrote_samples
+    };
+
+    int64_t start = now_ns();
+    if (!audio_init_decoder(content_type, &config)) {
+        fprintf(stderr, "No decoder for %s\n", content_type);
+        return 1;
+    }
+
+    sem_wait(&playback_done);
+    double elapsed_s = (now_ns() - start) / 1e9;
+    sink->close();
+
+    if (failed) {
+        fprintf(stderr, "Decoding %s failed\n", argv[arg]);
+        return 1;
+    }
+
+    double audio_s = played_us / 1e6;
+    printf("%s: %.3f s of audio in %.3f s, %.1fx real time\n", argv[arg], audio_s, elapsed_s, audio_s / elapsed_s);
+    return 0;
+}
@@ -0,0 +1,49 @@
+#ifndef AIRDAC_FIRMWARE_HOST_TEST_H
+#define AIRDAC_FIRMWARE_HOST_TEST_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+// A failed check is counted and the test carries on, so one run reports everything that is wrong
+static int check_failures = 0;
+
+#define CHECK(_condition) do { \
+        if (!(_condition)) { \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #_condition); \
+            check_failures++; \
+        } \
+    } while (0)
+
+#define CHECK_EQ(_actual, _expected) do { \
+        long long _a = (long long)(_actual); \
+        long long _e = (long long)(_expected); \
+        if (_a != _e) { \
+            fprintf(stderr, "%s:%d: %s is %lld, expected %lld\n", __FILE__, __LINE__, #_actual, _a, _e); \
+            check_failures++; \
+        } \
+    } while (0)
+
+static inline int check_result(void) {
+    if (check_failures != 0)
+        fprintf(stderr, "%d checks failed\n", check_failures);
+    return check_failures != 0;
+}
+
+static inline int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// xorshift32, so every run sees the same sequence
+static inline uint32_t test_random(uint32_t* state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+#endif //AIRDAC_FIRMWARE_HOST_TEST_H
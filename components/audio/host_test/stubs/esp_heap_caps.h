@@ -0,0 +1,34 @@
+#ifndef AIRDAC_FIRMWARE_HOST_ESP_HEAP_CAPS_H
+#define AIRDAC_FIRMWARE_HOST_ESP_HEAP_CAPS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// The host has one heap, so the capabilities are only there to compile
+#define MALLOC_CAP_8BIT         (1 << 2)
+#define MALLOC_CAP_SPIRAM       (1 << 10)
+#define MALLOC_CAP_INTERNAL     (1 << 11)
+#define MALLOC_CAP_DEFAULT      (1 << 12)
+
+static inline void* heap_caps_malloc(size_t size, uint32_t caps) {
+    return malloc(size);
+}
+
+static inline void* heap_caps_calloc(size_t n, size_t size, uint32_t caps) {
+    return calloc(n, size);
+}
+
+static inline void* heap_caps_realloc(void* ptr, size_t size, uint32_t caps) {
+    return realloc(ptr, size);
+}
+
+static inline void heap_caps_free(void* ptr) {
+    free(ptr);
+}
+
+static inline size_t heap_caps_get_minimum_free_size(uint32_t caps) {
+    return 0;
+}
+
+#endif //AIRDAC_FIRMWARE_HOST_ESP_HEAP_CAPS_H
@@ -0,0 +1,21 @@
+#ifndef AIRDAC_FIRMWARE_HOST_ESP_LOG_H
+#define AIRDAC_FIRMWARE_HOST_ESP_LOG_H
+
+// IDF's headers bring these in on the target
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Errors and warnings always go to stderr. The rest only with AUDIO_HOST_LOG set in the environment.
+#define HOST_LOG(_level, _tag, _format, ...) do { \
+        if ((_level) == 'E' || (_level) == 'W' || getenv("AUDIO_HOST_LOG") != NULL) \
+            fprintf(stderr, "%c (%s) " _format "\n", _level, _tag, ##__VA_ARGS__); \
+    } while (0)
+
+#define ESP_LOGE(_tag, _format, ...)    HOST_LOG('E', _tag, _format, ##__VA_ARGS__)
+#define ESP_LOGW(_tag, _format, ...)    HOST_LOG('W', _tag, _format, ##__VA_ARGS__)
+#define ESP_LOGI(_tag, _format, ...)    HOST_LOG('I', _tag, _format, ##__VA_ARGS__)
+#define ESP_LOGD(_tag, _format, ...)    HOST_LOG('D', _tag, _format, ##__VA_ARGS__)
+#define ESP_LOGV(_tag, _format, ...)    HOST_LOG('V', _tag, _format, ##__VA_ARGS__)
+
+#endif //AIRDAC_FIRMWARE_HOST_ESP_LOG_H
@@ -0,0 +1,14 @@
+#ifndef AIRDAC_FIRMWARE_HOST_ESP_TIMER_H
+#define AIRDAC_FIRMWARE_HOST_ESP_TIMER_H
+
+#include <stdint.h>
+#include <time.h>
+
+// Microseconds of monotonic time, like the ESP32's time since boot
+static inline int64_t esp_timer_get_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+#endif //AIRDAC_FIRMWARE_HOST_ESP_TIMER_H
@@ -0,0 +1,81 @@
+#ifndef AIRDAC_FIRMWARE_HOST_FREERTOS_H
+#define AIRDAC_FIRMWARE_HOST_FREERTOS_H
+
+// The part of the FreeRTOS API the audio component uses, on pthreads. Ticks are milliseconds and priorities
+// and core affinity are only recorded, so timing on the host says nothing about scheduling on the ESP32.
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+
+#define pdFALSE                 0
+#define pdTRUE                  1
+#define pdPASS                  pdTRUE
+#define pdFAIL                  pdFALSE
+#define portMAX_DELAY           UINT32_MAX
+#define portTICK_PERIOD_MS      1
+#define portNUM_PROCESSORS      2
+#define pdMS_TO_TICKS(_ms)      ((TickType_t)(_ms))
+
+#define BIT0    0x00000001
+#define BIT1    0x00000002
+#define BIT2    0x00000004
+#define BIT3    0x00000008
+#define BIT4    0x00000010
+#define BIT5    0x00000020
+#define BIT6    0x00000040
+#define BIT7    0x00000080
+#define BIT8    0x00000100
+#define BIT9    0x00000200
+#define BIT10   0x00000400
+#define BIT11   0x00000800
+
+typedef struct HostTask* TaskHandle_t;
+typedef TaskHandle_t xTaskHandle;
+typedef void (*TaskFunction_t)(void* args);
+
+typedef enum {
+    eNoAction,
+    eSetBits,
+    eIncrement,
+    eSetValueWithOverwrite,
+    eSetValueWithoutOverwrite
+} eNotifyAction;
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char* name, uint32_t stack_size, void* args,
+                                   UBaseType_t priority, TaskHandle_t* handle, BaseType_t core);
+BaseType_t xTaskCreate(TaskFunction_t function, const char* name, uint32_t stack_size, void* args,
+                       UBaseType_t priority, TaskHandle_t* handle);
+void vTaskDelete(TaskHandle_t task);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+UBaseType_t uxTaskPriorityGet(TaskHandle_t task);
+void vTaskDelay(TickType_t ticks);
+TickType_t xTaskGetTickCount(void);
+
+BaseType_t xTaskNotify(TaskHandle_t task, uint32_t value, eNotifyAction action);
+BaseType_t xTaskNotifyWait(uint32_t clear_on_entry, uint32_t clear_on_exit, uint32_t* value, TickType_t wait);
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t wait);
+
+typedef struct HostSemaphore* SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void);
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max_count, UBaseType_t initial_count);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t wait);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore);
+void vSemaphoreDelete(SemaphoreHandle_t semaphore);
+
+typedef struct HostQueue* QueueHandle_t;
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size);
+BaseType_t xQueueSend(QueueHandle_t queue, const void* item, TickType_t wait);
+BaseType_t xQueueReceive(QueueHandle_t queue, void* item, TickType_t wait);
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue);
+void vQueueDelete(QueueHandle_t queue);
+
+#endif //AIRDAC_FIRMWARE_HOST_FREERTOS_H
@@ -0,0 +1,201 @@
+#include "host_test.h"
+#include "fake_context.h"
+#include "flac_parallel.h"
+#include "flac_verbatim.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+// flac_parallel.c on real worker threads, fed from memory in random chunk sizes. The stream is made of verbatim
+// frames, decoded by flac_verbatim.c, so every output sample can be traced back to its position in the stream.
+// Some samples are 0xFFF8, which looks like a frame sync code, to make sure the splitter does not cut there.
+#define SAMPLE_RATE         44100
+#define BLOCK_SIZE          1152
+#define FRAMES              41
+#define LAST_BLOCK          500
+#define TOTAL_SAMPLES       ((FRAMES - 1) * BLOCK_SIZE + LAST_BLOCK)
+#define SEEKPOINT_STRIDE    8
+#define MAX_CHUNK           8192
+#define SEEK_MS             600
+#define SEEK_AFTER          (10 * BLOCK_SIZE)
+
+static struct {
+    uint8_t* data;
+    size_t first_frame;
+    uint32_t seek_ms;           // 0 for no seek
+    bool seek_issued;
+    bool seek_only_to_start;    // Every other seek fails
+    bool seek_fails;
+} input;
+
+static struct {
+    size_t index;               // Output count when the seek was done
+    uint64_t sample;
+    int count;
+} seeks;
+
+static int16_t sample(size_t index, int channel) {
+    if (index % 97 == 5)
+        return (int16_t)0xFFF8;
+    return (int16_t)(index * 31 + channel * 12345);
+}
+
+static bool seek_allowed(size_t position) {
+    if (input.seek_fails)
+        return false;
+    return !input.seek_only_to_start || position == input.first_frame;
+}
+
+static bool seek_pending(uint32_t* position_ms) {
+    if (input.seek_ms == 0 || input.seek_issued || fake_output.count < SEEK_AFTER)
+        return false;
+
+    input.seek_issued = true;
+    *position_ms = input.seek_ms;
+    return true;
+}
+
+static void seek_done(uint64_t sample, unsigned int sample_rate) {
+    CHECK_EQ(sample_rate, SAMPLE_RATE);
+    seeks.count++;
+    seeks.index = fake_output.count;
+    seeks.sample = sample;
+}
+
+static void build_stream(bool seektable) {
+    struct flac_verbatim_stream stream = {
+            .sample_rate = SAMPLE_RATE,
+            .block_size = BLOCK_SIZE,
+            .frames = FRAMES,
+            .last_block = LAST_BLOCK,
+            .seekpoint_stride = seektable ? SEEKPOINT_STRIDE : 0,
+            .sample = sample
+    };
+    input.data = malloc(flac_verbatim_stream_size(&stream));
+    size_t length = flac_verbatim_write_stream(input.data, &stream, &input.first_frame);
+
+    input.seek_ms = 0;
+    input.seek_issued = false;
+    input.seek_only_to_start = false;
+    input.seek_fails = false;
+    memset(&seeks, 0, sizeof(seeks));
+    fake_context_reset(input.data, length);
+    fake_input.seek = seek_allowed;
+    fake_input.seek_pending = seek_pending;
+    fake_input.seek_done = seek_done;
+}
+
+// Output from index on should be the stream from first_sample on
+static void check_output(size_t index, size_t first_sample, size_t count) {
+    size_t mismatches = 0;
+    for (size_t i = 0; i < count; i++) {
+        mismatches += fake_output.left[index + i] != sample(first_sample + i, 0);
+        mismatches += fake_output.right[index + i] != sample(first_sample + i, 1);
+    }
+    CHECK_EQ(mismatches, 0);
+}
+
+static void run(void) {
+    CHECK(flac_parallel_run(&fake_context));
+    CHECK(!fake_output.format_changed);
+    CHECK(fake_output.count == 0 || (fake_output.sample_rate == SAMPLE_RATE && fake_output.bit_depth == 16));
+}
+
+static void test_decode(void) {
+    build_stream(false);
+    run();
+
+    CHECK_EQ(fake_output.failures, 0);
+    CHECK_EQ(fake_output.finishes, 1);
+    CHECK_EQ(fake_output.count, TOTAL_SAMPLES);
+    check_output(0, 0, TOTAL_SAMPLES);
+    free(input.data);
+}
+
+static void test_seek(bool seektable) {
+    build_stream(seektable);
+    input.seek_ms = SEEK_MS;
+    run();
+
+    size_t target = (size_t)SEEK_MS * SAMPLE_RATE / 1000;
+    CHECK_EQ(fake_output.failures, 0);
+    CHECK_EQ(fake_output.finishes, 1);
+    CHECK_EQ(seeks.count, 1);
+    CHECK_EQ(seeks.sample, target);
+    CHECK(seeks.index >= SEEK_AFTER);
+    CHECK_EQ(fake_output.count, seeks.index + TOTAL_SAMPLES - target);
+    check_output(0, 0, seeks.index);
+    check_output(seeks.index, target, TOTAL_SAMPLES - target);
+    free(input.data);
+}
+
+// Where no frame can be reached, playback starts over from the first one
+static void test_seek_fallback(void) {
+    build_stream(false);
+    input.seek_ms = SEEK_MS;
+    input.seek_only_to_start = true;
+    run();
+
+    CHECK_EQ(fake_output.failures, 0);
+    CHECK_EQ(fake_output.finishes, 1);
+    CHECK_EQ(seeks.count, 1);
+    CHECK_EQ(seeks.sample, 0);
+    CHECK_EQ(fake_output.count, seeks.index + TOTAL_SAMPLES);
+    check_output(seeks.index, 0, TOTAL_SAMPLES);
+    free(input.data);
+}
+
+static void test_seek_failure(void) {
+    build_stream(false);
+    input.seek_ms = SEEK_MS;
+    input.seek_fails = true;
+    run();
+
+    CHECK_EQ(fake_output.failures, 1);
+    CHECK_EQ(fake_output.finishes, 0);
+    CHECK_EQ(seeks.count, 0);
+    free(input.data);
+}
+
+static void test_truncated(void) {
+    build_stream(false);
+    fake_input.length -= 100;
+    run();
+
+    CHECK_EQ(fake_output.failures, 1);
+    CHECK_EQ(fake_output.finishes, 0);
+    CHECK_EQ(fake_output.count, TOTAL_SAMPLES - LAST_BLOCK);
+    check_output(0, 0, fake_output.count);
+    free(input.data);
+}
+
+// The input is still open, so this must not look like a stop
+static void test_worker_failure(void) {
+    build_stream(false);
+    flac_verbatim_fail_init = true;
+    run();
+    flac_verbatim_fail_init = false;
+
+    CHECK(!fake_context.eof());
+    CHECK_EQ(fake_output.failures, 1);
+    CHECK_EQ(fake_output.finishes, 0);
+    CHECK_EQ(fake_output.count, 0);
+    free(input.data);
+}
+
+int main(void) {
+    fake_context_init(2 * TOTAL_SAMPLES, MAX_CHUNK, 0x2545F491);
+    test_decode();
+    test_seek(false);
+    test_seek(true);
+    test_seek_fallback();
+    test_seek_failure();
+    test_truncated();
+    test_worker_failure();
+
+    // Workers are kept between tracks, so a failed start must not stop the next one
+    test_decode();
+    CHECK_EQ(fake_context_faults, 0);
+    return check_result();
+}
@@ -0,0 +1,373 @@
+#include "host_test.h"
+#include "audio.h"
+#include "audio_sink.h"
+#include "pcm_kernels.h"
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+// Two WAV tracks go through audio.c as one gapless album would: the second is started from track_ending_cb
+// while the first is still in the output ring. The sink plays at SPEEDUP times real time behind a queue the size
+// of the I2S DMA buffers, so a handover that let the ring run dry shows up as a gap in its clock.
+#define TRACK_MS            750
+#define INPUT_CHUNK         4096
+#define BUFFER_MS           250
+#define SPEEDUP             2
+#define SINK_QUEUE_FRAMES   (4 * 511)
+// Host scheduling can hold a thread up this long without the handover being at fault
+#define MAX_GAP_NS          1000000
+
+struct track {
+    uint8_t* data;
+    size_t length;
+    size_t position;
+    unsigned int sample_rate;
+    size_t frames;
+};
+
+static struct track tracks[2];
+static volatile int current_track;
+static sem_t track_ending;
+static sem_t playback_done;
+static volatile int endings;
+static volatile int finishes;
+static volatile int failures;
+
+// What the position counters would see, from the output task
+static struct {
+    size_t samples;
+    unsigned int starts;
+    size_t started_at[2];       // Samples counted before each track's first frame was played
+} counted;
+
+static struct {
+    int32_t* frames;
+    volatile size_t count;
+    size_t capacity;
+    unsigned int sample_rate;
+    int64_t queue_end_ns;
+    int64_t max_gap_ns;
+    unsigned int gaps;
+    unsigned int opens;
+    unsigned int drains;
+    unsigned int flushes;
+    int64_t finish_ns;          // When the end of playback was reported
+    pthread_t output_thread;
+    volatile unsigned int mutes;
+    bool mute_off_thread;       // The sink was muted from some other thread than the one writing to it
+    volatile bool sink_muted;
+    int32_t last_gain;
+    unsigned int ramp_downs;
+    unsigned int audible_while_muted;   // Writes at a gain above zero with the sink muted
+    bool silent;
+    size_t silent_from;         // First frame of the run written at zero gain
+    size_t silent_at_mute;      // Frames of that run when the sink was muted
+} played;
+
+static void put_le16(uint8_t* out, uint16_t value) {
+    out[0] = value;
+    out[1] = value >> 8;
+}
+
+static void put_le32(uint8_t* out, uint32_t value) {
+    put_le16(out, value);
+    put_le16(out + 2, value >> 16);
+}
+
+static int16_t track_sample(int index, size_t frame, int channel) {
+    return (int16_t)(index * 7919 + frame * 3 + channel * 10007);
+}
+
+static void build_track(int index, unsigned int sample_rate) {
+    struct track* track = &tracks[index];
+    track->sample_rate = sample_rate;
+    track->frames = (size_t)sample_rate * TRACK_MS / 1000;
+    track->length = 44 + track->frames * 4;
+    track->position = 0;
+    track->data = malloc(track->length);
+
+    uint8_t* header = track->data;
+    memcpy(header, "RIFF", 4);
+    put_le32(header + 4, track->length - 8);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    put_le32(header + 16, 16);
+    put_le16(header + 20, 1);
+    put_le16(header + 22, 2);
+    put_le32(header + 24, sample_rate);
+    put_le32(header + 28, sample_rate * 4);
+    put_le16(header + 32, 4);
+    put_le16(header + 34, 16);
+    memcpy(header + 36, "data", 4);
+    put_le32(header + 40, track->frames * 4);
+
+    for (size_t i = 0; i < track->frames; i++) {
+        put_le16(header + 44 + 4*i, track_sample(index, i, 0));
+        put_le16(header + 46 + 4*i, track_sample(index, i, 1));
+    }
+}
+
+static bool test_sink_open(unsigned int sample_rate, unsigned int slot_bits) {
+    played.opens++;
+    played.sample_rate = sample_rate;
+    return true;
+}
+
+static size_t test_sink_write(const int32_t* frames, size_t count, int32_t gain, int32_t step) {
+    int64_t now = now_ns();
+    played.output_thread = pthread_self();
+    played.last_gain = gain + step * (int32_t)(count - 1);
+    played.ramp_downs += step < 0;
+    played.audible_while_muted += played.sink_muted && (gain != 0 || step != 0);
+    if (gain != 0 || step != 0) {
+        played.silent = false;
+    } else if (!played.silent) {
+        played.silent = true;
+        played.silent_from = played.count;
+    }
+
+    if (played.count != 0 && now > played.queue_end_ns) {
+        int64_t gap = now - played.queue_end_ns;
+        played.max_gap_ns = MAX(played.max_gap_ns, gap);
+        if (gap > MAX_GAP_NS)
+            played.gaps++;
+    }
+
+    if (now > played.queue_end_ns)
+        played.queue_end_ns = now;
+    played.queue_end_ns += (int64_t)count * 1000000000 / ((int64_t)played.sample_rate * SPEEDUP);
+
+    if (played.count + count <= played.capacity)
+        memcpy(played.frames + played.count * 2, frames, count * 2 * sizeof(int32_t));
+    played.count += count;
+
+    // Blocks like a full DMA queue, until there is room for the next write
+    int64_t limit = (int64_t)SINK_QUEUE_FRAMES * 1000000000 / ((int64_t)played.sample_rate * SPEEDUP);
+    int64_t queued = played.queue_end_ns - now;
+    if (queued > limit) {
+        struct timespec ts = { .tv_sec = 0, .tv_nsec = queued - limit };
+        nanosleep(&ts, NULL);
+    }
+
+    return count;
+}
+
+static void test_sink_drain(void) {
+    played.drains++;
+    int64_t queued = played.queue_end_ns - now_ns();
+    if (queued > 0) {
+        struct timespec ts = { .tv_sec = queued / 1000000000, .tv_nsec = queued % 1000000000 };
+        nanosleep(&ts, NULL);
+    }
+}
+
+static void test_sink_flush(void) {
+    played.flushes++;
+}
+
+static void test_sink_pause(bool paused) {
+}
+
+static size_t test_sink_latency(void) {
+    return SINK_QUEUE_FRAMES;
+}
+
+static void test_sink_mute(bool mute) {
+    played.mute_off_thread |= !pthread_equal(pthread_self(), played.output_thread);
+    played.mutes++;
+    played.sink_muted = mute;
+    if (mute)
+        played.silent_at_mute = played.silent ? played.count - played.silent_from : 0;
+}
+
+static void test_sink_close(void) {
+}
+
+static const AudioSink_t test_sink = {
+        .open = test_sink_open,
+        .write = test_sink_write,
+        .drain = test_sink_drain,
+        .flush = test_sink_flush,
+        .pause = test_sink_pause,
+        .latency = test_sink_latency,
+        .mute = test_sink_mute,
+        .close = test_sink_close
+};
+
+// Input is handed over a chunk at a time, like stream buffers
+static void decoder_ready(void) {
+    struct track* track = &tracks[current_track];
+    size_t len = MIN(INPUT_CHUNK, track->length - track->position);
+    const uint8_t* buffer = track->data + track->position;
+    track->position += len;
+    audio_decoder_continue(buffer, len);
+}
+
+static void decoder_finished(void) {
+    played.finish_ns = now_ns();
+    finishes++;
+    sem_post(&playback_done);
+}
+
+static void decoder_failed(void) {
+    failures++;
+    sem_post(&playback_done);
+}
+
+static bool track_ended(void) {
+    endings++;
+    if (current_track == 1)
+        return false;
+
+    sem_post(&track_ending);
+    return true;
+}
+
+static void wrote_samples(uint32_t samples, uint32_t sample_rate) {
+    counted.samples += samples;
+}
+
+static void track_started(void) {
+    if (counted.starts < 2)
+        counted.started_at[counted.starts] = counted.samples;
+    counted.starts++;
+}
+
+static const AudioDecoderConfig_t config_template = {
+        .decoder_ready_cb = decoder_ready,
+        .decoder_finished_cb = decoder_finished,
+        .decoder_failed_cb = decoder_failed,
+        .track_ending_cb = track_ended,
+        .wrote_samples_cb = wrote_samples,
+        .track_started_cb = track_started
+};
+
+static void start_track(int index) {
+    current_track = index;
+    AudioDecoderConfig_t config = config_template;
+    config.file_size = tracks[index].length;
+    CHECK(audio_init_decoder("audio/wav", &config));
+}
+
+// Stands in for the UPnP task, which starts the next track when the decoder asks for it
+static void* next_track_loop(void* args) {
+    sem_wait(&track_ending);
+    start_track(1);
+    return NULL;
+}
+
+static bool wait_done(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += 10;
+    return sem_timedwait(&playback_done, &ts) == 0;
+}
+
+static void check_played(void) {
+    size_t expected_frames = tracks[0].frames + tracks[1].frames;
+    CHECK_EQ(played.count, expected_frames);
+    if (played.count != expected_frames)
+        return;
+
+    size_t mismatches = 0;
+    size_t frame = 0;
+    for (int t = 0; t < 2; t++) {
+        for (size_t i = 0; i < tracks[t].frames; i++, frame++) {
+            for (int c = 0; c < 2; c++) {
+                if (played.frames[frame * 2 + c] != (int32_t)((uint32_t)(uint16_t)track_sample(t, i, c) << 16))
+                    mismatches++;
+            }
+        }
+    }
+
+    CHECK_EQ(mismatches, 0);
+}
+
+// Both tracks at the output rate, so nothing stops the ring between them
+static void test_handover(void) {
+    build_track(0, 48000);
+    build_track(1, 48000);
+    pthread_t next_track;
+    pthread_create(&next_track, NULL, next_track_loop, NULL);
+
+    start_track(0);
+    CHECK(wait_done());
+    pthread_join(next_track, NULL);
+
+    CHECK_EQ(failures, 0);
+    CHECK_EQ(finishes, 1);
+    CHECK_EQ(endings, 2);
+    CHECK_EQ(played.flushes, 0);
+    CHECK_EQ(played.opens, 1);
+    CHECK_EQ(played.gaps, 0);
+    // The end is reported once the sink has played out, not when the last frames were queued
+    CHECK_EQ(played.drains, 1);
+    CHECK(played.finish_ns >= played.queue_end_ns);
+    check_played();
+
+    // The second track starts counting where its own frames reach the sink, not at the handover
+    CHECK_EQ(counted.starts, 2);
+    CHECK_EQ(counted.started_at[0], 0);
+    CHECK_EQ(counted.started_at[1], tracks[0].frames);
+    CHECK_EQ(counted.samples, tracks[0].frames + tracks[1].frames);
+
+    printf("Handover: %u frames played, longest gap in the sink clock %.3f ms\n",
+           (unsigned int)played.count, played.max_gap_ns / 1e6);
+}
+
+static void sleep_ms(long ms) {
+    struct timespec ts = { .tv_sec = 0, .tv_nsec = ms * 1000000 };
+    nanosleep(&ts, NULL);
+}
+
+// Muting is asked for by the UPnP task, and the sink switched by the output task
+static void test_mute(void) {
+    audio_set_mute(true);
+    for (int i = 0; i < 1000 && played.mutes == 0; i++)
+        sleep_ms(1);
+
+    CHECK_EQ(played.mutes, 1);
+    CHECK(!played.mute_off_thread);
+}
+
+// Muted and unmuted mid-track: the DAC is muted only once the ramp down has played out of the sink's queue, and
+// released before anything above zero gain is written
+static void test_mute_playing(void) {
+    tracks[1].position = 0;
+    size_t start = played.count;
+    audio_set_mute(false);
+    start_track(1);
+    for (int i = 0; i < 1000 && played.count < start + 48000 / 10; i++)
+        sleep_ms(1);
+
+    audio_set_mute(true);
+    for (int i = 0; i < 1000 && !played.sink_muted; i++)
+        sleep_ms(1);
+    CHECK(played.sink_muted);
+    CHECK(played.count < start + tracks[1].frames);
+
+    audio_set_mute(false);
+    CHECK(wait_done());
+    CHECK_EQ(failures, 0);
+    CHECK(!played.sink_muted);
+    CHECK(played.ramp_downs > 0);
+    CHECK(played.silent_at_mute >= SINK_QUEUE_FRAMES);
+    CHECK_EQ(played.audible_while_muted, 0);
+    CHECK_EQ(played.last_gain, PCM_GAIN_UNITY);
+    CHECK(!played.mute_off_thread);
+}
+
+int main(void) {
+    sem_init(&track_ending, 0, 0);
+    sem_init(&playback_done, 0, 0);
+    played.capacity = 2 * 48000 * TRACK_MS / 1000;
+    played.frames = malloc(played.capacity * 2 * sizeof(int32_t));
+
+    audio_start(&test_sink, 8192, 5, BUFFER_MS);
+    test_handover();
+    test_mute();
+    test_mute_playing();
+    return check_result();
+}
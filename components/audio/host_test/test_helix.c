@@ -0,0 +1,205 @@
+#include "host_test.h"
+#include "fake_context.h"
+#include "helix_wrapper.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+// The ADTS framer in helix_wrapper.c, fed from memory in random chunk sizes, with helix_tagged.c in place of
+// Helix. Frames carry their number, so the output shows which frames were decoded, in what order, and whole.
+#define MAX_FRAMES          64
+#define MAX_FILLER          300
+#define GARBAGE_LEN         50
+#define MAX_CHUNK           3000
+#define OUTPUT_CAPACITY     (MAX_FRAMES * 2048)
+#define RATE_44100          4
+#define RATE_24000          6
+
+#define TAGGED_SBR          0x01
+#define TAGGED_DAMAGED      0x02
+
+int16_t helix_tagged_sample(unsigned int frame, size_t index, int channel);
+
+static uint32_t random_state = 0x9E3779B9;
+
+static struct {
+    uint8_t data[MAX_FRAMES * (10 + MAX_FILLER) + 4 * GARBAGE_LEN];
+    size_t frame_offsets[MAX_FRAMES + 1];
+} input;
+
+static size_t put_adts(uint8_t* out, unsigned int frame, unsigned int channels, unsigned int rate_index,
+                       uint8_t flags) {
+    size_t filler = test_random(&random_state) % MAX_FILLER;
+    size_t length = 7 + 3 + filler;
+
+    out[0] = 0xFF;
+    out[1] = 0xF1;
+    out[2] = (1 << 6) | (rate_index << 2) | ((channels >> 2) & 0x01);
+    out[3] = ((channels & 0x03) << 6) | ((length >> 11) & 0x03);
+    out[4] = length >> 3;
+    out[5] = ((length & 0x07) << 5) | 0x1F;
+    out[6] = 0xFC;
+    out[7] = frame >> 8;
+    out[8] = frame;
+    out[9] = flags;
+    for (size_t i = 0; i < filler; i++)
+        out[10 + i] = test_random(&random_state);
+    return length;
+}
+
+// Junk between frames, with a sync word whose header has an invalid sample rate
+static size_t put_garbage(uint8_t* out) {
+    for (size_t i = 0; i < GARBAGE_LEN; i++)
+        out[i] = test_random(&random_state) & 0x7F;
+    out[10] = 0xFF;
+    out[11] = 0xF1;
+    out[12] = 0x3C;
+    return GARBAGE_LEN;
+}
+
+// Frames from first_damaged on, up to damaged of them, fail to decode
+static void build_stream(unsigned int frames, unsigned int channels, unsigned int rate_index, uint8_t flags,
+                         bool garbage, unsigned int first_damaged, unsigned int damaged) {
+    size_t length = 0;
+    if (garbage)
+        length += put_garbage(input.data);
+
+    for (unsigned int i = 0; i < frames; i++) {
+        if (garbage && i == frames / 2)
+            length += put_garbage(input.data + length);
+
+        bool bad = i >= first_damaged && i < first_damaged + damaged;
+        input.frame_offsets[i] = length;
+        length += put_adts(input.data + length, i, channels, rate_index, flags | (bad ? TAGGED_DAMAGED : 0));
+    }
+
+    input.frame_offsets[frames] = length;
+    fake_context_reset(input.data, length);
+}
+
+// The output from index on should be the given frames, in order, at their full length
+static void check_frames(size_t index, unsigned int first_frame, unsigned int frames, size_t frame_samples,
+                         unsigned int channels) {
+    size_t mismatches = 0;
+    for (unsigned int f = 0; f < frames; f++) {
+        for (size_t i = 0; i < frame_samples; i++, index++) {
+            mismatches += fake_output.left[index] != helix_tagged_sample(first_frame + f, i, 0);
+            if (channels > 1)
+                mismatches += fake_output.right[index] != helix_tagged_sample(first_frame + f, i, 1);
+        }
+    }
+    CHECK_EQ(mismatches, 0);
+}
+
+static void test_decode(void) {
+    build_stream(MAX_FRAMES, 2, RATE_44100, 0, true, MAX_FRAMES, 0);
+    init_helix_decoder();
+    run_helix_decoder(&fake_context);
+
+    CHECK_EQ(fake_output.failures, 0);
+    CHECK_EQ(fake_output.finishes, 1);
+    CHECK_EQ(fake_output.sample_rate, 44100);
+    CHECK_EQ(fake_output.bit_depth, 16);
+    CHECK_EQ(fake_output.count, MAX_FRAMES * 1024);
+    check_frames(0, 0, MAX_FRAMES, 1024, 2);
+}
+
+// HE-AAC doubles the rate and the frame length over what the ADTS header says
+static void test_sbr_mono(void) {
+    build_stream(10, 1, RATE_24000, TAGGED_SBR, false, 10, 0);
+    init_helix_decoder();
+    run_helix_decoder(&fake_context);
+
+    CHECK_EQ(fake_output.finishes, 1);
+    CHECK_EQ(fake_output.sample_rate, 48000);
+    CHECK_EQ(fake_output.count, 10 * 2048);
+    CHECK(fake_output.mono_aliased);
+    check_frames(0, 0, 10, 2048, 1);
+}
+
+static void test_truncated(void) {
+    build_stream(20, 2, RATE_44100, 0, false, 20, 0);
+    fake_input.length -= 5;
+    init_helix_decoder();
+    run_helix_decoder(&fake_context);
+
+    CHECK_EQ(fake_output.failures, 0);
+    CHECK_EQ(fake_output.finishes, 1);
+    CHECK_EQ(fake_output.count, 19 * 1024);
+    check_frames(0, 0, 19, 1024, 2);
+}
+
+// Up to eight frames in a row may fail and are skipped, one more fails the track
+static void test_damaged(void) {
+    build_stream(30, 2, RATE_44100, 0, false, 5, 8);
+    init_helix_decoder();
+    run_helix_decoder(&fake_context);
+
+    CHECK_EQ(fake_output.failures, 0);
+    CHECK_EQ(fake_output.finishes, 1);
+    CHECK_EQ(fake_output.count, 22 * 1024);
+    check_frames(0, 0, 5, 1024, 2);
+    check_frames(5 * 1024, 13, 17, 1024, 2);
+
+    build_stream(30, 2, RATE_44100, 0, false, 5, 9);
+    init_helix_decoder();
+    run_helix_decoder(&fake_context);
+
+    CHECK_EQ(fake_output.failures, 1);
+    CHECK_EQ(fake_output.finishes, 0);
+    CHECK_EQ(fake_output.count, 5 * 1024);
+    CHECK_EQ(fake_input.position, input.frame_offsets[14]);
+}
+
+// An M4A track leaves Helix in raw block mode, which the next ADTS track must not inherit
+static void test_raw_then_adts(void) {
+    build_stream(4, 2, RATE_44100, 0, false, 4, 0);
+    init_helix_decoder();
+    CHECK(helix_set_raw_format(2, 44100, 1));
+
+    bool run = true;
+    for (unsigned int i = 0; i < 4; i++) {
+        const uint8_t* block = input.data + input.frame_offsets[i] + 7;
+        size_t length = input.frame_offsets[i + 1] - input.frame_offsets[i] - 7;
+        CHECK_EQ(helix_decode_frame(&fake_context, block, length, &run), 0);
+    }
+    CHECK_EQ(fake_output.count, 4 * 1024);
+    check_frames(0, 0, 4, 1024, 2);
+
+    build_stream(20, 2, RATE_44100, 0, false, 20, 0);
+    init_helix_decoder();
+    run_helix_decoder(&fake_context);
+
+    CHECK_EQ(fake_output.failures, 0);
+    CHECK_EQ(fake_output.finishes, 1);
+    CHECK_EQ(fake_output.count, 20 * 1024);
+    check_frames(0, 0, 20, 1024, 2);
+}
+
+static void test_probe(void) {
+    build_stream(20, 2, RATE_44100, 0, false, 20, 0);
+    AudioStreamInfo_t info = { 0 };
+    CHECK(probe_helix_decoder(&fake_context, &info));
+    CHECK_EQ(fake_input.position, 0);
+    CHECK_EQ(info.sample_rate, 44100);
+    CHECK_EQ(info.channels, 2);
+    CHECK_EQ(info.total_samples, fake_input.length / input.frame_offsets[1] * 1024);
+
+    input.data[1] = 0x00;
+    CHECK(!probe_helix_decoder(&fake_context, &info));
+}
+
+int main(void) {
+    fake_context_init(OUTPUT_CAPACITY, MAX_CHUNK, 0x9E3779B9);
+    test_probe();
+    test_decode();
+    test_sbr_mono();
+    test_truncated();
+    test_damaged();
+    test_raw_then_adts();
+
+    delete_helix_decoder();
+    CHECK_EQ(fake_context_faults, 0);
+    return check_result();
+}
@@ -0,0 +1,246 @@
+#include "host_test.h"
+#include "fake_context.h"
+#include "mp4_wrapper.h"
+
+#include "codecs/alac/alac_wrapper.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// mp4_wrapper.c built with small table windows, over a fast-start M4A of AAC samples tagged for helix_tagged.c.
+// The file is long enough for every table to be read back in several windows, and the output shows that each
+// sample was found in the right chunk, at the right size and in order.
+#define STSC_ENTRIES        12
+#define CHUNKS_PER_ENTRY    2
+#define MAX_SAMPLES         (STSC_ENTRIES * CHUNKS_PER_ENTRY * 3)
+#define MAX_FILLER          40
+#define CHUNK_PADDING       5
+#define MAX_CHUNK           700
+#define OUTPUT_CAPACITY     (MAX_SAMPLES * 1024)
+
+int16_t helix_tagged_sample(unsigned int frame, size_t index, int channel);
+
+// ALAC is only in the Xtensa libraries, and these files are all AAC
+struct alac_codec_s* alac_create_decoder(int magic_cookie_size, unsigned char* magic_cookie,
+                                         unsigned char* sample_size, unsigned* sample_rate,
+                                         unsigned char* channels, unsigned int* block_size) {
+    return NULL;
+}
+
+void alac_delete_decoder(struct alac_codec_s* codec) {
+}
+
+bool alac_to_pcm(struct alac_codec_s* codec, unsigned char* input, unsigned char* output, char channels,
+                 unsigned* out_frames) {
+    return false;
+}
+
+static uint32_t random_state = 0x2545F491;
+
+static struct {
+    uint8_t data[4096 + MAX_SAMPLES * (3 + MAX_FILLER + CHUNK_PADDING)];
+    size_t length;
+    unsigned int samples;
+} input;
+
+static unsigned int backward_seeks;
+
+static bool count_seek(size_t position) {
+    backward_seeks += position < fake_input.position;
+    return true;
+}
+
+static void put_be32(uint8_t* out, uint32_t value) {
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    out[3] = value;
+}
+
+static size_t put_bytes(size_t position, const void* data, size_t length) {
+    memcpy(input.data + position, data, length);
+    return position + length;
+}
+
+static size_t put_word(size_t position, uint32_t value) {
+    put_be32(input.data + position, value);
+    return position + 4;
+}
+
+// Writes the header of a box and returns where its content starts; end_box fills in the size
+static size_t begin_box(size_t position, const char* type) {
+    put_be32(input.data + position, 0);
+    memcpy(input.data + position + 4, type, 4);
+    return position + 8;
+}
+
+static size_t end_box(size_t start, size_t end) {
+    put_be32(input.data + start - 8, end - start + 8);
+    return end;
+}
+
+// AAC LC, 44.1 kHz stereo, in an esds with no optional ES descriptor fields
+static size_t put_stsd(size_t position) {
+    static const uint8_t esds[] = {
+            0, 0, 0, 0,
+            0x03, 22, 0, 1, 0,
+            0x04, 17, 0x40, 0x15, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+            0x05, 2, 0x12, 0x10
+    };
+
+    position = put_word(position, 0);
+    position = put_word(position, 1);
+    size_t entry = begin_box(position, "mp4a");
+    memset(input.data + entry, 0, 28);
+    input.data[entry + 7] = 1;
+    input.data[entry + 17] = 2;
+    input.data[entry + 19] = 16;
+    put_be32(input.data + entry + 24, 44100 << 16);
+    size_t child = begin_box(entry + 28, "esds");
+    return end_box(entry, end_box(child, put_bytes(child, esds, sizeof(esds))));
+}
+
+// Entry e has 1 to 3 samples per chunk over CHUNKS_PER_ENTRY chunks, each chunk padded from the next
+static void build_file(bool co64) {
+    unsigned int chunk_samples[STSC_ENTRIES * CHUNKS_PER_ENTRY];
+    size_t sample_sizes[MAX_SAMPLES];
+    input.samples = 0;
+    for (unsigned int c = 0; c < STSC_ENTRIES * CHUNKS_PER_ENTRY; c++) {
+        chunk_samples[c] = 1 + (c / CHUNKS_PER_ENTRY) % 3;
+        for (unsigned int s = 0; s < chunk_samples[c]; s++)
+            sample_sizes[input.samples++] = 3 + test_random(&random_state) % MAX_FILLER;
+    }
+
+    size_t p = put_bytes(0, "\0\0\0\x10" "ftypM4A \0\0\0\0", 16);
+    size_t moov = begin_box(p, "moov");
+    size_t trak = begin_box(moov, "trak");
+    size_t mdia = begin_box(trak, "mdia");
+
+    size_t box = begin_box(mdia, "mdhd");
+    memset(input.data + box, 0, 24);
+    put_be32(input.data + box + 12, 44100);
+    put_be32(input.data + box + 16, input.samples * 1024);
+    p = end_box(box, box + 24);
+
+    box = begin_box(p, "hdlr");
+    memset(input.data + box, 0, 25);
+    memcpy(input.data + box + 8, "soun", 4);
+    p = end_box(box, box + 25);
+
+    size_t minf = begin_box(p, "minf");
+    size_t stbl = begin_box(minf, "stbl");
+    box = begin_box(stbl, "stsd");
+    p = end_box(box, put_stsd(box));
+
+    box = begin_box(p, "stsz");
+    p = put_word(box, 0);
+    p = put_word(p, 0);
+    p = put_word(p, input.samples);
+    for (unsigned int i = 0; i < input.samples; i++)
+        p = put_word(p, sample_sizes[i]);
+    p = end_box(box, p);
+
+    box = begin_box(p, "stsc");
+    p = put_word(box, 0);
+    p = put_word(p, STSC_ENTRIES);
+    for (unsigned int e = 0; e < STSC_ENTRIES; e++) {
+        p = put_word(p, 1 + e * CHUNKS_PER_ENTRY);
+        p = put_word(p, 1 + e % 3);
+        p = put_word(p, 1);
+    }
+    p = end_box(box, p);
+
+    // The chunk offsets are filled in once the mdat is laid out
+    unsigned int chunks = STSC_ENTRIES * CHUNKS_PER_ENTRY;
+    size_t stco = begin_box(p, co64 ? "co64" : "stco");
+    p = put_word(stco, 0);
+    p = put_word(p, chunks);
+    size_t offsets = p;
+    p = end_box(stco, p + chunks * (co64 ? 8 : 4));
+
+    p = end_box(moov, end_box(trak, end_box(mdia, end_box(minf, end_box(stbl, p)))));
+
+    size_t mdat = begin_box(p, "mdat");
+    p = mdat;
+    unsigned int sample = 0;
+    for (unsigned int c = 0; c < chunks; c++) {
+        p += CHUNK_PADDING;
+        if (co64) {
+            put_be32(input.data + offsets + 8 * c, 0);
+            put_be32(input.data + offsets + 8 * c + 4, p);
+        } else {
+            put_be32(input.data + offsets + 4 * c, p);
+        }
+
+        for (unsigned int s = 0; s < chunk_samples[c]; s++, sample++) {
+            input.data[p] = sample >> 8;
+            input.data[p + 1] = sample;
+            input.data[p + 2] = 0;
+            for (size_t i = 3; i < sample_sizes[sample]; i++)
+                input.data[i + p] = test_random(&random_state);
+            p += sample_sizes[sample];
+        }
+    }
+
+    input.length = end_box(mdat, p);
+    fake_context_reset(input.data, input.length);
+    fake_input.seek = count_seek;
+    backward_seeks = 0;
+}
+
+static void check_output(void) {
+    CHECK_EQ(fake_output.failures, 0);
+    CHECK_EQ(fake_output.finishes, 1);
+    CHECK_EQ(fake_output.sample_rate, 44100);
+    CHECK_EQ(fake_output.count, input.samples * 1024);
+
+    size_t mismatches = 0;
+    for (size_t i = 0; i < fake_output.count; i++) {
+        mismatches += fake_output.left[i] != helix_tagged_sample(i / 1024, i % 1024, 0);
+        mismatches += fake_output.right[i] != helix_tagged_sample(i / 1024, i % 1024, 1);
+    }
+    CHECK_EQ(mismatches, 0);
+}
+
+// Windows past the first are read as ranges, so the stream only ever moves forwards
+static void test_ranged_reads(void) {
+    build_file(false);
+    run_mp4_decoder(&fake_context);
+
+    check_output();
+    CHECK(fake_input.reads_at >= 3);
+    CHECK_EQ(backward_seeks, 0);
+}
+
+// Without ranged reads the stream goes back to each table and returns
+static void test_seek_back(void) {
+    build_file(true);
+    fake_input.ranges_refused = true;
+    run_mp4_decoder(&fake_context);
+
+    check_output();
+    CHECK_EQ(fake_input.reads_at, 0);
+    CHECK(backward_seeks >= 3);
+}
+
+static void test_probe(void) {
+    build_file(false);
+    AudioStreamInfo_t info = { 0 };
+    CHECK(probe_mp4_decoder(&fake_context, &info));
+    CHECK_EQ(fake_input.position, 0);
+    CHECK_EQ(info.sample_rate, 44100);
+    CHECK_EQ(info.channels, 2);
+    CHECK_EQ(info.total_samples, input.samples * 1024);
+}
+
+int main(void) {
+    fake_context_init(OUTPUT_CAPACITY, MAX_CHUNK, 0x9E3779B9);
+    init_mp4_decoder();
+    test_probe();
+    test_ranged_reads();
+    test_seek_back();
+
+    delete_mp4_decoder();
+    CHECK_EQ(fake_context_faults, 0);
+    return check_result();
+}
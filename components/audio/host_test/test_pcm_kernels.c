@@ -0,0 +1,239 @@
+#include "host_test.h"
+#include "pcm_kernels.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#define MAX_FRAMES  1031
+
+static int32_t left[MAX_FRAMES];
+static int32_t right[MAX_FRAMES];
+// One past the frames, for the word that checks nothing is written beyond them
+static int32_t out[MAX_FRAMES * 2 + 1];
+static int32_t expected[MAX_FRAMES * 2];
+static int32_t interleaved[MAX_FRAMES * 2];
+static int16_t packed[MAX_FRAMES * 2 + 1];
+
+// Lengths either side of the unrolled blocks of four
+static const size_t lengths[] = { 0, 1, 2, 3, 4, 5, 7, 8, 9, 255, 256, MAX_FRAMES };
+#define NUM_LENGTHS (sizeof(lengths) / sizeof(lengths[0]))
+
+static const unsigned int depths[] = { 8, 16, 24, 32 };
+#define NUM_DEPTHS (sizeof(depths) / sizeof(depths[0]))
+
+static uint32_t random_state = 0x2545F491;
+
+// Full-range samples of the given depth, sign-extended as the decoders hand them over
+static void fill_samples(int32_t* samples, size_t frames, unsigned int bit_depth) {
+    for (size_t i = 0; i < frames; i++) {
+        uint32_t bits = test_random(&random_state);
+        samples[i] = bit_depth == 32 ? (int32_t)bits : (int32_t)(bits << (32 - bit_depth)) >> (32 - bit_depth);
+    }
+
+    // The extremes are always in there
+    if (frames >= 2) {
+        samples[0] = bit_depth == 32 ? INT32_MIN : -(1 << (bit_depth - 1));
+        samples[1] = bit_depth == 32 ? INT32_MAX : (1 << (bit_depth - 1)) - 1;
+    }
+}
+
+static int32_t ref_scale(int32_t sample, unsigned int shift, int32_t gain) {
+    int64_t full_scale = (int64_t)sample * ((int64_t)1 << shift);
+    return (int32_t)((full_scale * gain) >> 31);
+}
+
+static void test_normalize_shift(void) {
+    CHECK_EQ(pcm_normalize_shift(0), 0);
+    CHECK_EQ(pcm_normalize_shift(8), 24);
+    CHECK_EQ(pcm_normalize_shift(16), 16);
+    CHECK_EQ(pcm_normalize_shift(24), 8);
+    CHECK_EQ(pcm_normalize_shift(25), 7);
+    CHECK_EQ(pcm_normalize_shift(32), 0);
+}
+
+static void test_interleave(void) {
+    for (size_t d = 0; d < NUM_DEPTHS; d++) {
+        unsigned int shift = pcm_normalize_shift(depths[d]);
+        for (size_t l = 0; l < NUM_LENGTHS; l++) {
+            size_t frames = lengths[l];
+            fill_samples(left, frames, depths[d]);
+            fill_samples(right, frames, depths[d]);
+            for (size_t i = 0; i < frames; i++) {
+                expected[2*i] = (int32_t)((uint32_t)left[i] << shift);
+                expected[2*i + 1] = (int32_t)((uint32_t)right[i] << shift);
+            }
+
+            out[frames * 2] = 0x5A5A5A5A;
+            pcm_interleave(out, left, right, frames, shift);
+            CHECK(memcmp(out, expected, frames * 2 * sizeof(int32_t)) == 0);
+            CHECK_EQ(out[frames * 2], 0x5A5A5A5A);
+        }
+    }
+}
+
+static void test_mono_to_stereo(void) {
+    for (size_t d = 0; d < NUM_DEPTHS; d++) {
+        unsigned int shift = pcm_normalize_shift(depths[d]);
+        for (size_t l = 0; l < NUM_LENGTHS; l++) {
+            size_t frames = lengths[l];
+            fill_samples(left, frames, depths[d]);
+            for (size_t i = 0; i < frames; i++)
+                expected[2*i] = expected[2*i + 1] = (int32_t)((uint32_t)left[i] << shift);
+
+            pcm_mono_to_stereo(out, left, frames, shift);
+            CHECK(memcmp(out, expected, frames * 2 * sizeof(int32_t)) == 0);
+
+            // Interleaving a channel with itself takes the same path
+            memset(out, 0, sizeof(out));
+            pcm_interleave(out, left, left, frames, shift);
+            CHECK(memcmp(out, expected, frames * 2 * sizeof(int32_t)) == 0);
+        }
+    }
+}
+
+// The ramps the output task writes, and constant gains down to silence
+static const struct {
+    int32_t gain;
+    int32_t step;
+} ramps[] = {
+        { PCM_GAIN_UNITY, 0 },
+        { 1 << 30, 0 },
+        { 12345678, 0 },
+        { 1, 0 },
+        { 0, 0 },
+        { PCM_GAIN_UNITY, -(PCM_GAIN_UNITY / 256) },
+        { 0, PCM_GAIN_UNITY / 256 },
+        { 1000, -3 }
+};
+#define NUM_RAMPS (sizeof(ramps) / sizeof(ramps[0]))
+
+static void test_copy_gain(void) {
+    for (size_t r = 0; r < NUM_RAMPS; r++) {
+        for (size_t l = 0; l < NUM_LENGTHS; l++) {
+            size_t frames = ramps[r].step != 0 ? MIN(lengths[l], 256) : lengths[l];
+            fill_samples(interleaved, frames * 2, 32);
+            for (size_t i = 0; i < frames; i++) {
+                int32_t gain = ramps[r].gain + (int32_t)i * ramps[r].step;
+                expected[2*i] = ref_scale(interleaved[2*i], 0, gain);
+                expected[2*i + 1] = ref_scale(interleaved[2*i + 1], 0, gain);
+            }
+
+            out[frames * 2] = 0x5A5A5A5A;
+            pcm_copy_gain(out, interleaved, frames, ramps[r].gain, ramps[r].step);
+            CHECK(memcmp(out, expected, frames * 2 * sizeof(int32_t)) == 0);
+            CHECK_EQ(out[frames * 2], 0x5A5A5A5A);
+        }
+    }
+
+    // Unity gain is INT32_MAX rather than 1.0, which costs at most one LSB
+    fill_samples(interleaved, MAX_FRAMES * 2, 32);
+    pcm_copy_gain(out, interleaved, MAX_FRAMES, PCM_GAIN_UNITY, 0);
+    for (size_t i = 0; i < MAX_FRAMES * 2; i++)
+        CHECK(llabs((long long)interleaved[i] - out[i]) <= 1);
+}
+
+// Each step of the table is within a few LSBs of the exact gain and never louder than the one above it
+// Round to nearest, half up, saturating where that would carry past INT16_MAX
+static int16_t ref_pack(int32_t sample) {
+    int64_t rounded = ((int64_t)sample + 0x8000) >> 16;
+    return (int16_t)MIN(rounded, INT16_MAX);
+}
+
+static void test_pack_16(void) {
+    const struct {
+        int32_t in;
+        int16_t out;
+    } anchors[] = {
+            { 0, 0 },
+            { 0x00007FFF, 0 },
+            { 0x00008000, 1 },
+            { -0x00008000, 0 },
+            { -0x00008001, -1 },
+            { 0x12348000, 0x1235 },
+            { 0x7FFF7FFF, INT16_MAX },
+            { 0x7FFF8000, INT16_MAX },
+            { INT32_MAX, INT16_MAX },
+            { INT32_MIN, INT16_MIN },
+            { INT32_MIN + 0x8000, INT16_MIN + 1 }
+    };
+    size_t count = sizeof(anchors) / sizeof(anchors[0]);
+    for (size_t i = 0; i < count; i++)
+        left[i] = anchors[i].in;
+
+    pcm_pack_16(packed, left, count);
+    for (size_t i = 0; i < count; i++)
+        CHECK_EQ(packed[i], anchors[i].out);
+
+    for (size_t l = 0; l < NUM_LENGTHS; l++) {
+        size_t samples = lengths[l];
+        fill_samples(left, samples, 32);
+        packed[samples] = 0x5A5A;
+        pcm_pack_16(packed, left, samples);
+
+        size_t mismatches = 0;
+        for (size_t i = 0; i < samples; i++)
+            mismatches += packed[i] != ref_pack(left[i]);
+        CHECK_EQ(mismatches, 0);
+        CHECK_EQ(packed[samples], 0x5A5A);
+    }
+}
+
+// The same as scaling and then packing, in one pass
+static void test_pack_16_gain(void) {
+    for (size_t r = 0; r < NUM_RAMPS; r++) {
+        for (size_t l = 0; l < NUM_LENGTHS; l++) {
+            size_t frames = ramps[r].step != 0 ? MIN(lengths[l], 256) : lengths[l];
+            fill_samples(interleaved, frames * 2, 32);
+            packed[frames * 2] = 0x5A5A;
+            pcm_pack_16_gain(packed, interleaved, frames, ramps[r].gain, ramps[r].step);
+
+            size_t mismatches = 0;
+            for (size_t i = 0; i < frames; i++) {
+                int32_t gain = ramps[r].gain + (int32_t)i * ramps[r].step;
+                mismatches += packed[2*i] != ref_pack(ref_scale(interleaved[2*i], 0, gain));
+                mismatches += packed[2*i + 1] != ref_pack(ref_scale(interleaved[2*i + 1], 0, gain));
+            }
+            CHECK_EQ(mismatches, 0);
+            CHECK_EQ(packed[frames * 2], 0x5A5A);
+        }
+    }
+}
+
+static void test_gain_table(void) {
+    pcm_gain_init();
+
+    CHECK_EQ(pcm_gain_from_db(0), PCM_GAIN_UNITY);
+    CHECK_EQ(pcm_gain_from_db(256), PCM_GAIN_UNITY);
+    CHECK_EQ(pcm_gain_from_db(PCM_GAIN_MIN_DB - 1), 0);
+    CHECK_EQ(pcm_gain_from_db(-32768), 0);
+
+    double max_error = 0;
+    int32_t previous = PCM_GAIN_UNITY;
+    for (int volume_db = 0; volume_db >= PCM_GAIN_MIN_DB; volume_db--) {
+        int32_t gain = pcm_gain_from_db(volume_db);
+        double exact = pow(10.0, volume_db / 256.0 / 20.0) * INT32_MAX;
+        max_error = fmax(max_error, fabs(gain - exact));
+        CHECK(gain <= previous);
+        previous = gain;
+    }
+
+    CHECK(max_error <= 3.0);
+    printf("Gain table is within %.1f LSB of exact over %d steps\n", max_error, -PCM_GAIN_MIN_DB + 1);
+
+    // 6.02 dB halves the level
+    int32_t half = pcm_gain_from_db(-1541);
+    CHECK(fabs(half / (double)PCM_GAIN_UNITY - 0.5) < 0.001);
+}
+
+int main(void) {
+    test_normalize_shift();
+    test_interleave();
+    test_mono_to_stereo();
+    test_copy_gain();
+    test_pack_16();
+    test_pack_16_gain();
+    test_gain_table();
+    return check_result();
+}
@@ -0,0 +1,146 @@
+#include "host_test.h"
+#include "pcm_ring.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/param.h>
+
+#define RING_FRAMES     1000
+#define STRESS_FRAMES   (64 * 1024 * 1024)
+// The counters start this close to wrapping, so every run crosses the 32-bit boundary
+#define WRAP_OFFSET     4096
+
+static void start_near_wrap(PcmRing_t* ring) {
+    atomic_store(&ring->head, UINT32_MAX - WRAP_OFFSET);
+    atomic_store(&ring->tail, UINT32_MAX - WRAP_OFFSET);
+}
+
+static void test_single_thread(void) {
+    PcmRing_t* ring = pcm_ring_create(RING_FRAMES);
+    CHECK_EQ(ring->capacity, 1024);
+    start_near_wrap(ring);
+
+    int32_t* out;
+    const int32_t* in;
+    CHECK_EQ(pcm_ring_fill(ring), 0);
+    CHECK_EQ(pcm_ring_free(ring), 1024);
+    CHECK_EQ(pcm_ring_read_begin(ring, &in), 0);
+
+    // The counters sit 4097 frames below wrapping, which leaves one frame before the end of the storage
+    CHECK_EQ(pcm_ring_write_begin(ring, &out), 1);
+    out[0] = 1;
+    out[1] = -1;
+    pcm_ring_write_end(ring, 1);
+
+    // The rest is contiguous from the start of the storage
+    CHECK_EQ(pcm_ring_write_begin(ring, &out), 1023);
+    CHECK(out == ring->frames);
+    pcm_ring_write_end(ring, 1023);
+    CHECK_EQ(pcm_ring_fill(ring), 1024);
+    CHECK_EQ(pcm_ring_free(ring), 0);
+    CHECK_EQ(pcm_ring_write_begin(ring, &out), 0);
+
+    CHECK_EQ(pcm_ring_read_begin(ring, &in), 1);
+    CHECK_EQ(in[0], 1);
+    CHECK_EQ(in[1], -1);
+    pcm_ring_read_end(ring, 1);
+    CHECK_EQ(pcm_ring_read_begin(ring, &in), 1023);
+    pcm_ring_read_end(ring, 23);
+    CHECK_EQ(pcm_ring_fill(ring), 1000);
+
+    pcm_ring_flush(ring);
+    CHECK_EQ(pcm_ring_fill(ring), 0);
+    CHECK_EQ(pcm_ring_free(ring), 1024);
+
+    CHECK_EQ(pcm_ring_underruns(ring), 0);
+    pcm_ring_count_underrun(ring);
+    pcm_ring_count_underrun(ring);
+    CHECK_EQ(pcm_ring_underruns(ring), 2);
+
+    pcm_ring_delete(ring);
+}
+
+// Each frame holds its sequence number and its complement, so a torn or reordered frame shows up
+static void* producer(void* arg) {
+    PcmRing_t* ring = arg;
+    uint32_t random = 0x1234567;
+    uint32_t sequence = 0;
+
+    while (sequence < STRESS_FRAMES) {
+        int32_t* frames;
+        size_t len = pcm_ring_write_begin(ring, &frames);
+        if (len == 0) {
+            sched_yield();
+            continue;
+        }
+
+        size_t chunk = 1 + test_random(&random) % ring->capacity;
+        len = MIN(len, chunk);
+        len = MIN(len, STRESS_FRAMES - sequence);
+        for (size_t i = 0; i < len; i++, sequence++) {
+            frames[2*i] = (int32_t)sequence;
+            frames[2*i + 1] = ~(int32_t)sequence;
+        }
+        pcm_ring_write_end(ring, len);
+    }
+
+    return NULL;
+}
+
+static void* consumer(void* arg) {
+    PcmRing_t* ring = arg;
+    uint32_t random = 0x89abcdef;
+    uint32_t sequence = 0;
+    long errors = 0;
+
+    while (sequence < STRESS_FRAMES) {
+        size_t fill = pcm_ring_fill(ring);
+        if (fill > ring->capacity)
+            errors++;
+
+        const int32_t* frames;
+        size_t len = pcm_ring_read_begin(ring, &frames);
+        if (len == 0) {
+            pcm_ring_count_underrun(ring);
+            sched_yield();
+            continue;
+        }
+
+        size_t chunk = 1 + test_random(&random) % ring->capacity;
+        len = MIN(len, chunk);
+        for (size_t i = 0; i < len; i++, sequence++) {
+            if (frames[2*i] != (int32_t)sequence || frames[2*i + 1] != ~(int32_t)sequence)
+                errors++;
+        }
+        pcm_ring_read_end(ring, len);
+    }
+
+    return (void*)errors;
+}
+
+static void test_two_threads(void) {
+    PcmRing_t* ring = pcm_ring_create(RING_FRAMES);
+    start_near_wrap(ring);
+
+    pthread_t producer_thread;
+    pthread_t consumer_thread;
+    pthread_create(&producer_thread, NULL, producer, ring);
+    pthread_create(&consumer_thread, NULL, consumer, ring);
+
+    void* errors;
+    pthread_join(producer_thread, NULL);
+    pthread_join(consumer_thread, &errors);
+
+    CHECK_EQ((long)errors, 0);
+    CHECK_EQ(pcm_ring_fill(ring), 0);
+    CHECK_EQ(atomic_load(&ring->head), (uint32_t)(UINT32_MAX - WRAP_OFFSET + STRESS_FRAMES));
+    printf("%u frames through a %u frame ring, %u underruns\n", STRESS_FRAMES, ring->capacity, pcm_ring_underruns(ring));
+
+    pcm_ring_delete(ring);
+}
+
+int main(void) {
+    test_single_thread();
+    test_two_threads();
+    return check_result();
+}
@@ -0,0 +1,149 @@
+#include "host_test.h"
+#include "tone.h"
+#include "audio.h"
+#include "resampler.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#define INPUT_FRAMES    (192000 / 2)
+#define OUTPUT_RATE     48000
+
+static const unsigned int input_rates[] = { 88200, 96000, 176400, 192000 };
+#define NUM_RATES (sizeof(input_rates) / sizeof(input_rates[0]))
+
+static const AudioResampleQuality_t qualities[] = { AUDIO_RESAMPLE_LOW, AUDIO_RESAMPLE_MEDIUM, AUDIO_RESAMPLE_HIGH };
+#define NUM_QUALITIES (sizeof(qualities) / sizeof(qualities[0]))
+
+static int32_t in_left[INPUT_FRAMES];
+static int32_t in_right[INPUT_FRAMES];
+static int32_t out_left[INPUT_FRAMES];
+static int32_t out_right[INPUT_FRAMES];
+static int32_t chunked_left[INPUT_FRAMES];
+static int32_t chunked_right[INPUT_FRAMES];
+
+static uint32_t random_state = 0x6b8b4567;
+
+// Feeds everything through in pieces of random size, with the output space also handed out in pieces
+static size_t run_chunked(Resampler_t* resampler, const int32_t* left, const int32_t* right, size_t frames,
+                          int32_t* out_l, int32_t* out_r, unsigned int shift) {
+    size_t used = 0;
+    size_t produced = 0;
+    while (1) {
+        // Drawn before MIN(), which evaluates its arguments twice
+        size_t in_len = 1 + test_random(&random_state) % 700;
+        size_t out_len = 1 + test_random(&random_state) % 300;
+        in_len = MIN(in_len, frames - used);
+        out_len = MIN(out_len, INPUT_FRAMES - produced);
+        size_t len = resampler_process(resampler, left + used, right == left ? left + used : right + used, &in_len,
+                                       out_l + produced, out_r + produced, out_len, shift);
+        used += in_len;
+        produced += len;
+
+        // Output held back by a short output space still comes out once the input is used up
+        if (used == frames && len == 0)
+            break;
+    }
+
+    return produced;
+}
+
+static size_t run_whole(Resampler_t* resampler, const int32_t* left, const int32_t* right, size_t frames,
+                        int32_t* out_l, int32_t* out_r, unsigned int shift) {
+    size_t produced = 0;
+    size_t used = 0;
+    while (used < frames) {
+        size_t in_len = frames - used;
+        size_t len = resampler_process(resampler, left + used, right + used, &in_len, out_l + produced, out_r + produced,
+                                       INPUT_FRAMES - produced, shift);
+        used += in_len;
+        produced += len;
+    }
+
+    return produced;
+}
+
+// The output length follows the ratio, and how the input is cut up makes no difference to a single bit
+static void test_ratio_and_chunking(void) {
+    for (size_t q = 0; q < NUM_QUALITIES; q++) {
+        for (size_t r = 0; r < NUM_RATES; r++) {
+            unsigned int in_rate = input_rates[r];
+            size_t frames = INPUT_FRAMES / 2;
+            tone_generate(in_left, frames, 0.5, 1000.0 / in_rate, 24);
+            tone_generate(in_right, frames, 0.25, 3000.0 / in_rate, 24);
+
+            Resampler_t* resampler = resampler_create(in_rate, OUTPUT_RATE, qualities[q]);
+            size_t whole = run_whole(resampler, in_left, in_right, frames, out_left, out_right, 8);
+
+            double expected = (double)frames * OUTPUT_RATE / in_rate;
+            CHECK(fabs(whole - expected) <= 1.0);
+
+            resampler_reset(resampler);
+            size_t chunked = run_chunked(resampler, in_left, in_right, frames, chunked_left, chunked_right, 8);
+            CHECK_EQ(chunked, whole);
+            CHECK(memcmp(chunked_left, out_left, whole * sizeof(int32_t)) == 0);
+            CHECK(memcmp(chunked_right, out_right, whole * sizeof(int32_t)) == 0);
+
+            // Mono only writes the left output
+            resampler_reset(resampler);
+            memset(chunked_right, 0x5A, sizeof(chunked_right));
+            size_t mono = run_chunked(resampler, in_left, in_left, frames, chunked_left, chunked_right, 8);
+            CHECK_EQ(mono, whole);
+            CHECK(memcmp(chunked_left, out_left, whole * sizeof(int32_t)) == 0);
+            CHECK_EQ(chunked_right[0], 0x5A5A5A5A);
+
+            resampler_delete(resampler);
+        }
+    }
+}
+
+// Level of a tone at the given input frequency after resampling, in dB relative to the input
+static double response_db(unsigned int in_rate, AudioResampleQuality_t quality, double frequency_hz) {
+    size_t frames = INPUT_FRAMES;
+    tone_generate(in_left, frames, 0.5, frequency_hz / in_rate, 24);
+
+    Resampler_t* resampler = resampler_create(in_rate, OUTPUT_RATE, quality);
+    size_t produced = run_whole(resampler, in_left, in_left, frames, out_left, out_left, 8);
+    resampler_delete(resampler);
+
+    // The filter's start-up is left out of the fit
+    size_t skip = 1024;
+    double amplitude;
+    double residual;
+    double out_frequency = frequency_hz / OUTPUT_RATE;
+    if (frequency_hz >= OUTPUT_RATE / 2.0) {
+        // Anything left above the output's Nyquist frequency is aliased, so all of the output is measured
+        tone_fit(out_left + skip, produced - skip, fmod(out_frequency, 1.0), &amplitude, &residual);
+        return to_db(hypot(amplitude, residual * M_SQRT2) / 0.5);
+    }
+
+    tone_fit(out_left + skip, produced - skip, out_frequency, &amplitude, &residual);
+    return to_db(amplitude / 0.5);
+}
+
+static void test_frequency_response(void) {
+    // Attenuation at 30 kHz for each quality, a few dB short of what the filters give
+    const double stopband_db[NUM_QUALITIES] = { -60.0, -90.0, -100.0 };
+
+    for (size_t q = 0; q < NUM_QUALITIES; q++) {
+        for (size_t r = 0; r < NUM_RATES; r++) {
+            unsigned int in_rate = input_rates[r];
+            double dc = response_db(in_rate, qualities[q], 100.0);
+            double passband = response_db(in_rate, qualities[q], 10000.0);
+            double stopband = response_db(in_rate, qualities[q], 30000.0);
+            printf("%3u taps, %6u Hz: 100 Hz %+.3f dB, 10 kHz %+.3f dB, 30 kHz %+.1f dB\n",
+                   qualities[q], in_rate, dc, passband, stopband);
+
+            CHECK(fabs(dc) < 0.05);
+            CHECK(fabs(passband) < 0.5);
+            CHECK(stopband < stopband_db[q]);
+        }
+    }
+}
+
+int main(void) {
+    test_ratio_and_chunking();
+    test_frequency_response();
+    return check_result();
+}
@@ -0,0 +1,397 @@
+#include "host_test.h"
+#include "fake_context.h"
+#include "wav_wrapper.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+// WAV, RF64, AIFF and AIFF-C files are written byte by byte here, independently of wav_wrapper.c, with the
+// chunks a real file may carry around the audio: odd-length chunks and their padding, an SSND offset, trailing
+// metadata. Each decodes from memory in random chunk sizes, and every sample must come out bit-exact.
+#define FRAMES          2501        // Not a multiple of the decoder's block, so the last block is short
+#define MAX_FILE        (FRAMES * 6 * 4 + 1024)
+#define MAX_CHUNK       700
+#define SAMPLE_RATE     44100
+
+enum encoding {
+    INT_LE,
+    INT_BE,
+    FLOAT_LE,
+    FLOAT_BE
+};
+
+struct pcm_spec {
+    enum encoding encoding;
+    unsigned int channels;
+    unsigned int bytes;         // Container size of each sample
+    unsigned int valid_bits;    // Left-justified in the container
+    bool unsigned_8bit;         // WAV stores 8-bit samples offset by 128
+};
+
+static uint32_t random_state = 0x1B873593;
+
+// Floats with what they must decode to, including the clipping at and past full scale
+static const float float_samples[] = { 0.0f, 0.5f, -0.5f, 0.25f, -0.125f, 1.0f, -1.0f, 2.0f, -2.0f, NAN };
+static const int32_t float_expected[] = {
+        0, 0x40000000, -0x40000000, 0x20000000, -0x10000000, INT32_MAX, INT32_MIN, INT32_MAX, INT32_MIN, 0
+};
+#define NUM_FLOATS (sizeof(float_samples) / sizeof(float_samples[0]))
+
+static struct {
+    uint8_t data[MAX_FILE];
+    size_t length;
+    int32_t expected[2][FRAMES];
+} file;
+
+static void put_bytes(const void* data, size_t length) {
+    memcpy(file.data + file.length, data, length);
+    file.length += length;
+}
+
+static void put_le(uint64_t value, unsigned int bytes) {
+    for (unsigned int i = 0; i < bytes; i++)
+        file.data[file.length++] = value >> (8 * i);
+}
+
+static void put_be(uint64_t value, unsigned int bytes) {
+    for (unsigned int i = bytes; i > 0; i--)
+        file.data[file.length++] = value >> (8 * (i - 1));
+}
+
+// Returns where the chunk's size goes, for end_chunk()
+static size_t begin_chunk(const char* tag) {
+    put_bytes(tag, 4);
+    file.length += 4;
+    return file.length - 4;
+}
+
+static void end_chunk(size_t size_at, bool big_endian) {
+    uint32_t size = file.length - size_at - 4;
+    size_t end = file.length;
+    file.length = size_at;
+    if (big_endian)
+        put_be(size, 4);
+    else
+        put_le(size, 4);
+    file.length = end;
+
+    if (size & 1)
+        file.data[file.length++] = 0;
+}
+
+// An odd-length chunk the decoder has to skip, padding included
+static void put_odd_chunk(const char* tag, bool big_endian) {
+    size_t size_at = begin_chunk(tag);
+    put_bytes("odd length", 11);
+    end_chunk(size_at, big_endian);
+}
+
+static void put_samples(const struct pcm_spec* spec) {
+    unsigned int bits = spec->bytes * 8;
+    for (size_t i = 0; i < FRAMES; i++) {
+        for (unsigned int c = 0; c < spec->channels; c++) {
+            int32_t expected;
+            if (spec->encoding == FLOAT_LE || spec->encoding == FLOAT_BE) {
+                size_t index = (i * spec->channels + c) % NUM_FLOATS;
+                uint32_t raw;
+                memcpy(&raw, &float_samples[index], 4);
+                if (spec->encoding == FLOAT_LE)
+                    put_le(raw, 4);
+                else
+                    put_be(raw, 4);
+                expected = float_expected[index];
+            } else {
+                // A full-range value of the valid bits, left-justified in the container
+                uint32_t random = test_random(&random_state);
+                int32_t value = (int32_t)(random << (32 - spec->valid_bits)) >> (32 - spec->valid_bits);
+                if (i == 0)
+                    value = -(1 << (spec->valid_bits - 1));
+                else if (i == 1)
+                    value = (1 << (spec->valid_bits - 1)) - 1;
+
+                int64_t container = (int64_t)value * ((int64_t)1 << (bits - spec->valid_bits));
+                uint64_t raw = spec->unsigned_8bit ? (uint64_t)(container + 128) : (uint64_t)container;
+                if (spec->encoding == INT_LE)
+                    put_le(raw, spec->bytes);
+                else
+                    put_be(raw, spec->bytes);
+                expected = (int32_t)container;
+            }
+
+            if (c < 2)
+                file.expected[c][i] = expected;
+        }
+    }
+}
+
+static void start_file(void) {
+    file.length = 0;
+}
+
+static void end_file(void) {
+    fake_context_reset(file.data, file.length);
+    fake_input.seek = fake_seek_anywhere;
+}
+
+#define WAV_EXTENSIBLE  0x01
+#define WAV_RF64        0x02
+#define WAV_EXTRAS      0x04    // Odd-length chunks before and after the audio
+
+static void build_wav(const struct pcm_spec* spec, uint16_t format_tag, unsigned int options) {
+    start_file();
+    bool rf64 = options & WAV_RF64;
+    size_t data_length = (size_t)FRAMES * spec->channels * spec->bytes;
+
+    put_bytes(rf64 ? "RF64" : "RIFF", 4);
+    size_t riff_size_at = file.length;
+    put_le(rf64 ? UINT32_MAX : 0, 4);
+    put_bytes("WAVE", 4);
+
+    size_t ds64_at = 0;
+    if (rf64) {
+        size_t size_at = begin_chunk("ds64");
+        ds64_at = file.length;
+        put_le(0, 8);
+        put_le(data_length, 8);
+        put_le(FRAMES, 8);
+        put_le(0, 4);
+        end_chunk(size_at, false);
+    }
+
+    size_t size_at = begin_chunk("fmt ");
+    unsigned int block = spec->channels * spec->bytes;
+    put_le(options & WAV_EXTENSIBLE ? 0xFFFE : format_tag, 2);
+    put_le(spec->channels, 2);
+    put_le(SAMPLE_RATE, 4);
+    put_le(SAMPLE_RATE * block, 4);
+    put_le(block, 2);
+    put_le(spec->bytes * 8, 2);
+    if (options & WAV_EXTENSIBLE) {
+        put_le(22, 2);
+        put_le(spec->valid_bits, 2);
+        put_le(spec->channels == 1 ? 0x4 : 0x3, 4);
+        put_le(format_tag, 2);
+        put_bytes("\x00\x00\x00\x00\x10\x00\x80\x00\x00\xAA\x00\x38\x9B\x71", 14);
+    }
+    end_chunk(size_at, false);
+
+    if (options & WAV_EXTRAS)
+        put_odd_chunk("LIST", false);
+
+    size_at = begin_chunk("data");
+    put_samples(spec);
+    end_chunk(size_at, false);
+
+    if (options & WAV_EXTRAS)
+        put_odd_chunk("id3 ", false);
+
+    if (rf64) {
+        // A streaming writer leaves the 32-bit size at its maximum and has the real one in ds64
+        size_t end = file.length;
+        file.length = size_at;
+        put_le(UINT32_MAX, 4);
+        file.length = ds64_at;
+        put_le(end - 8, 8);
+        file.length = end;
+    } else {
+        size_t end = file.length;
+        file.length = riff_size_at;
+        put_le(end - 8, 4);
+        file.length = end;
+    }
+    end_file();
+}
+
+// compression is NULL for plain AIFF
+static void build_aiff(const struct pcm_spec* spec, const char* compression) {
+    start_file();
+    put_bytes("FORM", 4);
+    size_t form_size_at = file.length;
+    put_be(0, 4);
+    put_bytes(compression != NULL ? "AIFC" : "AIFF", 4);
+
+    if (compression != NULL) {
+        size_t size_at = begin_chunk("FVER");
+        put_be(0xA2805140, 4);
+        end_chunk(size_at, true);
+    }
+
+    size_t size_at = begin_chunk("COMM");
+    put_be(spec->channels, 2);
+    put_be(FRAMES, 4);
+    put_be(spec->valid_bits, 2);
+
+    // 80-bit extended float, with the integer bit of the mantissa explicit
+    int top = 31;
+    while (!(SAMPLE_RATE & (1u << top)))
+        top--;
+    put_be(16383 + top, 2);
+    put_be((uint64_t)SAMPLE_RATE << (63 - top), 8);
+
+    if (compression != NULL) {
+        put_bytes(compression, 4);
+        put_bytes("\x04none", 5);
+    }
+    end_chunk(size_at, true);
+
+    put_odd_chunk("NAME", true);
+
+    // The samples start after an offset, which the decoder must skip
+    size_at = begin_chunk("SSND");
+    put_be(4, 4);
+    put_be(0, 4);
+    put_bytes("skip", 4);
+    put_samples(spec);
+    end_chunk(size_at, true);
+
+    put_odd_chunk("ANNO", true);
+
+    size_t end = file.length;
+    file.length = form_size_at;
+    put_be(end - 8, 4);
+    file.length = end;
+    end_file();
+}
+
+// Probes and decodes the file, which must play every frame exactly
+static void check_file(const char* name, const struct pcm_spec* spec, unsigned int write_depth) {
+    fprintf(stderr, "%s\n", name);
+
+    AudioStreamInfo_t info = { 0 };
+    CHECK(probe_wav_decoder(&fake_context, &info));
+    CHECK_EQ(fake_input.position, 0);
+    CHECK_EQ(info.sample_rate, SAMPLE_RATE);
+    CHECK_EQ(info.channels, spec->channels);
+    CHECK_EQ(info.bit_depth, spec->valid_bits);
+    CHECK_EQ(info.total_samples, FRAMES);
+
+    init_wav_decoder();
+    run_wav_decoder(&fake_context);
+
+    CHECK_EQ(fake_output.failures, 0);
+    CHECK_EQ(fake_output.finishes, 1);
+    CHECK_EQ(fake_output.count, FRAMES);
+    CHECK_EQ(fake_output.sample_rate, SAMPLE_RATE);
+    CHECK_EQ(fake_output.bit_depth, write_depth);
+    CHECK_EQ(fake_output.mono_aliased, spec->channels == 1);
+
+    size_t mismatches = 0;
+    for (size_t i = 0; i < fake_output.count; i++) {
+        mismatches += fake_output.left[i] != file.expected[0][i];
+        if (spec->channels > 1)
+            mismatches += fake_output.right[i] != file.expected[1][i];
+    }
+    CHECK_EQ(mismatches, 0);
+}
+
+static void test_wav(void) {
+    struct pcm_spec spec = { .encoding = INT_LE, .channels = 2, .bytes = 2, .valid_bits = 16 };
+    build_wav(&spec, 0x0001, WAV_EXTRAS);
+    check_file("WAV 16-bit stereo", &spec, 16);
+
+    spec = (struct pcm_spec){ .encoding = INT_LE, .channels = 1, .bytes = 1, .valid_bits = 8, .unsigned_8bit = true };
+    build_wav(&spec, 0x0001, 0);
+    check_file("WAV 8-bit mono", &spec, 8);
+
+    spec = (struct pcm_spec){ .encoding = INT_LE, .channels = 2, .bytes = 3, .valid_bits = 24 };
+    build_wav(&spec, 0x0001, WAV_EXTRAS);
+    check_file("WAV 24-bit stereo", &spec, 24);
+
+    spec = (struct pcm_spec){ .encoding = INT_LE, .channels = 2, .bytes = 4, .valid_bits = 32 };
+    build_wav(&spec, 0x0001, 0);
+    check_file("WAV 32-bit stereo", &spec, 32);
+
+    // Only the first two of six channels are played
+    spec = (struct pcm_spec){ .encoding = INT_LE, .channels = 6, .bytes = 2, .valid_bits = 16 };
+    build_wav(&spec, 0x0001, WAV_EXTENSIBLE);
+    check_file("WAV 16-bit 5.1 extensible", &spec, 16);
+
+    // 24 valid bits left-justified in 32: reported as 24 bits, written as the 32-bit container
+    spec = (struct pcm_spec){ .encoding = INT_LE, .channels = 2, .bytes = 4, .valid_bits = 24 };
+    build_wav(&spec, 0x0001, WAV_EXTENSIBLE | WAV_EXTRAS);
+    check_file("WAV 24-in-32 extensible", &spec, 32);
+
+    spec = (struct pcm_spec){ .encoding = FLOAT_LE, .channels = 2, .bytes = 4, .valid_bits = 32 };
+    build_wav(&spec, 0x0003, WAV_EXTRAS);
+    check_file("WAV float", &spec, 32);
+
+    build_wav(&spec, 0x0003, WAV_EXTENSIBLE);
+    check_file("WAV float extensible", &spec, 32);
+
+    spec = (struct pcm_spec){ .encoding = INT_LE, .channels = 2, .bytes = 3, .valid_bits = 24 };
+    build_wav(&spec, 0x0001, WAV_RF64 | WAV_EXTRAS);
+    check_file("RF64 24-bit", &spec, 24);
+}
+
+static void test_aiff(void) {
+    struct pcm_spec spec = { .encoding = INT_BE, .channels = 2, .bytes = 2, .valid_bits = 16 };
+    build_aiff(&spec, NULL);
+    check_file("AIFF 16-bit stereo", &spec, 16);
+
+    // Signed, unlike 8-bit WAV
+    spec = (struct pcm_spec){ .encoding = INT_BE, .channels = 1, .bytes = 1, .valid_bits = 8 };
+    build_aiff(&spec, NULL);
+    check_file("AIFF 8-bit mono", &spec, 8);
+
+    spec = (struct pcm_spec){ .encoding = INT_BE, .channels = 2, .bytes = 3, .valid_bits = 24 };
+    build_aiff(&spec, NULL);
+    check_file("AIFF 24-bit stereo", &spec, 24);
+
+    spec = (struct pcm_spec){ .encoding = INT_BE, .channels = 2, .bytes = 2, .valid_bits = 16 };
+    build_aiff(&spec, "NONE");
+    check_file("AIFF-C uncompressed", &spec, 16);
+
+    spec = (struct pcm_spec){ .encoding = INT_LE, .channels = 2, .bytes = 2, .valid_bits = 16 };
+    build_aiff(&spec, "sowt");
+    check_file("AIFF-C sowt", &spec, 16);
+
+    spec = (struct pcm_spec){ .encoding = FLOAT_BE, .channels = 2, .bytes = 4, .valid_bits = 32 };
+    build_aiff(&spec, "fl32");
+    check_file("AIFF-C fl32", &spec, 32);
+}
+
+// Formats the decoder cannot play are turned down at the probe, and fail the track if played anyway
+static void test_unsupported(void) {
+    struct pcm_spec spec = { .encoding = INT_LE, .channels = 2, .bytes = 2, .valid_bits = 16 };
+    build_wav(&spec, 0x0055, 0);
+
+    AudioStreamInfo_t info = { 0 };
+    CHECK(!probe_wav_decoder(&fake_context, &info));
+
+    init_wav_decoder();
+    run_wav_decoder(&fake_context);
+    CHECK_EQ(fake_output.failures, 1);
+    CHECK_EQ(fake_output.count, 0);
+
+    spec = (struct pcm_spec){ .encoding = INT_BE, .channels = 2, .bytes = 2, .valid_bits = 16 };
+    build_aiff(&spec, "ulaw");
+    CHECK(!probe_wav_decoder(&fake_context, &info));
+}
+
+// A file cut short plays what it has
+static void test_truncated(void) {
+    struct pcm_spec spec = { .encoding = INT_LE, .channels = 2, .bytes = 3, .valid_bits = 24 };
+    build_wav(&spec, 0x0001, 0);
+    fake_input.length -= 1000 * 6 + 2;
+
+    init_wav_decoder();
+    run_wav_decoder(&fake_context);
+    CHECK_EQ(fake_output.failures, 0);
+    CHECK_EQ(fake_output.finishes, 1);
+    CHECK_EQ(fake_output.count, FRAMES - 1001);
+    CHECK(memcmp(fake_output.left, file.expected[0], fake_output.count * sizeof(int32_t)) == 0);
+}
+
+int main(void) {
+    fake_context_init(FRAMES, MAX_CHUNK, 0x1B873593);
+    test_wav();
+    test_aiff();
+    test_unsupported();
+    test_truncated();
+
+    delete_wav_decoder();
+    CHECK_EQ(fake_context_faults, 0);
+    return check_result();
+}
@@ -0,0 +1,155 @@
+#include "host_test.h"
+#include "audio.h"
+#include "audio_sink.h"
+
+#include <semaphore.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+// A 24-bit track through audio.c into the WAV sink, read back from the file it wrote. Every sample must come out
+// bit-exact in the 32-bit slots, and the header must carry the track's rate and the length played.
+#define SAMPLE_RATE     44100
+#define FRAMES          30011
+#define INPUT_CHUNK     4096
+#define BUFFER_MS       250
+#define OUTPUT_PATH     "test_wav_sink.wav"
+
+static struct {
+    uint8_t* data;
+    size_t length;
+    size_t position;
+} input;
+
+static sem_t playback_done;
+static volatile int finishes;
+static volatile int failures;
+
+static void put_le16(uint8_t* out, uint16_t value) {
+    out[0] = value;
+    out[1] = value >> 8;
+}
+
+static void put_le32(uint8_t* out, uint32_t value) {
+    put_le16(out, value);
+    put_le16(out + 2, value >> 16);
+}
+
+static uint32_t get_le32(const uint8_t* in) {
+    return in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32_t)in[3] << 24);
+}
+
+static int32_t track_sample(size_t frame, int channel) {
+    int32_t value = (int32_t)((frame * 2654435761u + channel * 40503u) << 8) >> 8;
+    if (frame == 0)
+        value = -0x800000;
+    else if (frame == 1)
+        value = 0x7FFFFF;
+    return value;
+}
+
+static void build_track(void) {
+    input.length = 44 + FRAMES * 6;
+    input.data = malloc(input.length);
+
+    uint8_t* header = input.data;
+    memcpy(header, "RIFF", 4);
+    put_le32(header + 4, input.length - 8);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    put_le32(header + 16, 16);
+    put_le16(header + 20, 1);
+    put_le16(header + 22, 2);
+    put_le32(header + 24, SAMPLE_RATE);
+    put_le32(header + 28, SAMPLE_RATE * 6);
+    put_le16(header + 32, 6);
+    put_le16(header + 34, 24);
+    memcpy(header + 36, "data", 4);
+    put_le32(header + 40, FRAMES * 6);
+
+    for (size_t i = 0; i < FRAMES; i++) {
+        for (int c = 0; c < 2; c++) {
+            uint32_t value = track_sample(i, c);
+            uint8_t* out = header + 44 + 6*i + 3*c;
+            out[0] = value;
+            out[1] = value >> 8;
+            out[2] = value >> 16;
+        }
+    }
+}
+
+static void decoder_ready(void) {
+    size_t len = MIN(INPUT_CHUNK, input.length - input.position);
+    const uint8_t* buffer = input.data + input.position;
+    input.position += len;
+    audio_decoder_continue(buffer, len);
+}
+
+static void decoder_finished(void) {
+    finishes++;
+    sem_post(&playback_done);
+}
+
+static void decoder_failed(void) {
+    failures++;
+    sem_post(&playback_done);
+}
+
+static void wrote_samples(uint32_t samples, uint32_t sample_rate) {
+}
+
+static bool wait_done(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += 10;
+    return sem_timedwait(&playback_done, &ts) == 0;
+}
+
+static void check_file(void) {
+    FILE* file = fopen(OUTPUT_PATH, "rb");
+    CHECK(file != NULL);
+    if (file == NULL)
+        return;
+
+    size_t length = 44 + (size_t)FRAMES * 8;
+    uint8_t* data = malloc(length + 1);
+    CHECK_EQ(fread(data, 1, length + 1, file), length);
+    fclose(file);
+
+    CHECK(memcmp(data, "RIFF", 4) == 0);
+    CHECK_EQ(get_le32(data + 24), SAMPLE_RATE);
+    CHECK_EQ(data[34], 32);
+    CHECK_EQ(get_le32(data + 40), FRAMES * 8);
+
+    size_t mismatches = 0;
+    for (size_t i = 0; i < FRAMES; i++) {
+        for (int c = 0; c < 2; c++)
+            mismatches += (int32_t)get_le32(data + 44 + 8*i + 4*c) != track_sample(i, c) * 256;
+    }
+    CHECK_EQ(mismatches, 0);
+    free(data);
+}
+
+int main(void) {
+    sem_init(&playback_done, 0, 0);
+    build_track();
+
+    wav_sink_set_path(OUTPUT_PATH);
+    audio_start(&wav_sink, 8192, 5, BUFFER_MS);
+
+    AudioDecoderConfig_t config = {
+            .file_size = input.length,
+            .decoder_ready_cb = decoder_ready,
+            .decoder_finished_cb = decoder_finished,
+            .decoder_failed_cb = decoder_failed,
+            .wrote_samples_cb = wrote_samples
+    };
+    CHECK(audio_init_decoder("audio/wav", &config));
+    CHECK(wait_done());
+    CHECK_EQ(failures, 0);
+    CHECK_EQ(finishes, 1);
+
+    wav_sink.close();
+    check_file();
+    remove(OUTPUT_PATH);
+    return check_result();
+}
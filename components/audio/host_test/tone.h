@@ -0,0 +1,64 @@
+#ifndef AIRDAC_FIRMWARE_HOST_TONE_H
+#define AIRDAC_FIRMWARE_HOST_TONE_H
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Sine of amplitude (1.0 is full scale) and frequency (cycles per sample) at the given bit depth
+static inline void tone_generate(int32_t* out, size_t frames, double amplitude, double frequency, unsigned int bit_depth) {
+    double full_scale = (double)((int64_t)1 << (bit_depth - 1)) - 1;
+    for (size_t i = 0; i < frames; i++)
+        out[i] = (int32_t)lrint(amplitude * full_scale * sin(2.0 * M_PI * frequency * i));
+}
+
+// Least-squares fit of a sine at a known frequency plus DC to 32-bit full-scale samples.
+// Gives the amplitude of the fit and the RMS of what is left, both relative to full scale.
+static inline void tone_fit(const int32_t* samples, size_t frames, double frequency, double* amplitude, double* residual) {
+    double m[3][3] = { { 0 } };
+    double v[3] = { 0 };
+    for (size_t i = 0; i < frames; i++) {
+        double basis[3] = { sin(2.0 * M_PI * frequency * i), cos(2.0 * M_PI * frequency * i), 1.0 };
+        double x = samples[i] / 2147483648.0;
+        for (int r = 0; r < 3; r++) {
+            v[r] += basis[r] * x;
+            for (int c = 0; c < 3; c++)
+                m[r][c] += basis[r] * basis[c];
+        }
+    }
+
+    // Gaussian elimination, the system is small and well conditioned
+    for (int p = 0; p < 3; p++) {
+        for (int r = p + 1; r < 3; r++) {
+            double f = m[r][p] / m[p][p];
+            for (int c = p; c < 3; c++)
+                m[r][c] -= f * m[p][c];
+            v[r] -= f * v[p];
+        }
+    }
+
+    double coefficients[3];
+    for (int r = 2; r >= 0; r--) {
+        double sum = v[r];
+        for (int c = r + 1; c < 3; c++)
+            sum -= m[r][c] * coefficients[c];
+        coefficients[r] = sum / m[r][r];
+    }
+
+    double error = 0;
+    for (size_t i = 0; i < frames; i++) {
+        double fit = coefficients[0] * sin(2.0 * M_PI * frequency * i) + coefficients[1] * cos(2.0 * M_PI * frequency * i)
+                     + coefficients[2];
+        double e = samples[i] / 2147483648.0 - fit;
+        error += e * e;
+    }
+
+    *amplitude = hypot(coefficients[0], coefficients[1]);
+    *residual = sqrt(error / frames);
+}
+
+static inline double to_db(double ratio) {
+    return 20.0 * log10(ratio);
+}
+
+#endif //AIRDAC_FIRMWARE_HOST_TONE_H
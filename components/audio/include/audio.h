@@ -5,17 +5,70 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "audio_sink.h"
+
 typedef void (*audio_callback)(void);
 
+// What the stream header says, before any samples are decoded. Unknown fields are 0.
+struct AudioStreamInfo {
+    unsigned int sample_rate;
+    unsigned int bit_depth;
+    unsigned int channels;
+    uint64_t total_samples;
+};
+typedef struct AudioStreamInfo AudioStreamInfo_t;
+
+// file_size of a live stream, which only ends when an empty buffer is passed to audio_decoder_continue()
+#define AUDIO_UNKNOWN_LENGTH SIZE_MAX
+
 struct AudioDecoderConfig {
     size_t file_size;
     audio_callback decoder_ready_cb;
     audio_callback decoder_finished_cb;
     audio_callback decoder_failed_cb;
+    // Called from the decoder task once all input is decoded. Return true if another track will be started
+    // with audio_init_decoder() without a reset; decoder_finished_cb is then not called for this track.
+    bool (*track_ending_cb)(void);
+    void (*stream_info_cb)(const AudioStreamInfo_t* info);
+    // Called from the decoder task to restart the input at a byte offset. The next buffer passed to
+    // audio_decoder_continue() must start there. NULL if the input cannot seek.
+    void (*seek_cb)(size_t position);
+    // Called from the decoder task to read from a byte offset while the input stays where it is. Returns how many
+    // bytes were read. NULL if the input cannot.
+    size_t (*read_cb)(size_t position, uint8_t* buffer, size_t length);
+    // Called from the decoder task when an audio_seek() has landed, with the first sample played from there
+    void (*seeked_cb)(uint64_t sample, uint32_t sample_rate);
+    // Called from the output task with the frames it has played. Frames from the track before are still counted
+    // after audio_init_decoder(), until track_started_cb says this track's first frame has reached the sink.
     void (*wrote_samples_cb)(uint32_t samples, uint32_t sample_rate);
+    audio_callback track_started_cb;
 };
 typedef struct AudioDecoderConfig AudioDecoderConfig_t;
 
+struct AudioOutputStats {
+    size_t buffered_ms;
+    size_t capacity_ms;
+    uint32_t underruns;
+    uint32_t track_start_ms;        // From audio_init_decoder() to the first decoded samples of the last track
+    unsigned int slot_bits;         // Width of each sample as the sink is sent it
+    uint32_t seeks;
+    uint32_t last_seek_ms;          // From audio_seek() to the first samples from the new position
+    uint32_t max_seek_ms;
+    uint32_t last_seek_restarts;    // Times the last seek restarted the input, each a new request upstream
+    size_t min_free_internal;       // Heap low-water marks since boot
+    size_t min_free_spiram;
+};
+typedef struct AudioOutputStats AudioOutputStats_t;
+
+// Resampler filter length in output samples. Longer filters give a deeper stopband for more CPU time.
+enum AudioResampleQuality {
+    AUDIO_RESAMPLE_OFF = 0,
+    AUDIO_RESAMPLE_LOW = 16,
+    AUDIO_RESAMPLE_MEDIUM = 32,
+    AUDIO_RESAMPLE_HIGH = 64
+};
+typedef enum AudioResampleQuality AudioResampleQuality_t;
+
 //struct AudioBufferConfig {
 ////    size_t size;
 //    size_t sample_rate;
@@ -24,12 +77,23 @@ typedef struct AudioDecoderConfig AudioDecoderConfig_t;
 //};
 //typedef struct AudioBufferConfig AudioBufferConfig_t;
 
-void audio_start(size_t stack_size, int priority);
+void audio_start(const AudioSink_t* sink, size_t stack_size, int priority, unsigned int buffer_ms);
 bool audio_init_decoder(const char* content_type, const AudioDecoderConfig_t* config);
 //void audio_init_buffer(const AudioBufferConfig_t* config);
+// An empty buffer ends the input
 void audio_decoder_continue(const uint8_t* new_buffer, size_t buffer_length);
+// Asks the running decoder to move to a time in the track. Returns false if it cannot seek, as in a live stream.
+bool audio_seek(uint32_t position_ms);
 void audio_reset(void);
 void audio_pause_playback(void);
 void audio_resume_playback(void);
+void audio_get_output_stats(AudioOutputStats_t* stats);
+// volume_db is in 1/256 dB, from 0 down to -5120. Lower values are silence.
+void audio_set_volume(int volume_db);
+void audio_set_mute(bool mute);
+// Streams above output_rate are resampled down to it instead of reclocking I2S
+void audio_set_resampling(unsigned int output_rate, AudioResampleQuality_t quality);
+// Sends 16-bit sources to the sink in 16-bit slots rather than 32. Attenuation then rounds to 16 bits.
+void audio_set_native_width(bool enabled);
 
 #endif //AIRDAC_FIRMWARE_AUDIO_H
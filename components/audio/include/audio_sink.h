@@ -0,0 +1,40 @@
+#ifndef AIRDAC_FIRMWARE_AUDIO_SINK_H
+#define AIRDAC_FIRMWARE_AUDIO_SINK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Where the output task sends audio. Frames are interleaved stereo 32-bit, as held in the output ring.
+// Everything is called from the output task, except open() which audio_start() calls first.
+// open() is called again whenever the output sample rate or slot width changes. slot_bits is 16 or 32; frames
+// are still written as 32-bit and a 16-bit sink keeps the top half of each sample. write() blocks until the frames are queued
+// and returns how many were taken. It scales them by gain on the way, Q31 with INT32_MAX as unity, moving by step
+// after every frame; volume is applied here rather than in the ring, so a change is heard without the ring's delay. drain() blocks until everything written has played, flush() drops whatever
+// is queued but not yet played. pause() is called when playback pauses and resumes. latency() is how many
+// written frames are still to be played. mute() switches the DAC's own mute, where it has one.
+struct AudioSink {
+    bool (*open)(unsigned int sample_rate, unsigned int slot_bits);
+    size_t (*write)(const int32_t* frames, size_t count, int32_t gain, int32_t step);
+    void (*drain)(void);
+    void (*flush)(void);
+    void (*pause)(bool paused);
+    size_t (*latency)(void);
+    void (*mute)(bool mute);
+    void (*close)(void);
+};
+typedef struct AudioSink AudioSink_t;
+
+// The DAC on I2S0
+extern const AudioSink_t i2s_sink;
+
+// Writes everything played to a 32-bit stereo WAV file, for checking output bit for bit.
+// The path must be set before audio_start(). The header is completed by close().
+void wav_sink_set_path(const char* path);
+extern const AudioSink_t wav_sink;
+
+// Takes frames as fast as they come and counts them, so decoding runs flat out
+uint64_t null_sink_frames(void);
+extern const AudioSink_t null_sink;
+
+#endif //AIRDAC_FIRMWARE_AUDIO_SINK_H
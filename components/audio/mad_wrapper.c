@@ -5,10 +5,29 @@
 
 #include <memory.h>
 #include <stdio.h>
+#include <sys/param.h>
 
 #include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
 
-#define MADX_INPUT_BUFFER_SIZE	(5*1152*8)
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+
+// Enough for the largest Layer III frame plus the next header
+#define MAD_MIN_INPUT   4096
+
+// One frame is synthesised while the next is decoded. Each slot is about 18 KB of internal RAM.
+#define SYNTH_SLOTS     2
+#define SYNTH_STACK     4096
+
+// Samples of delay libmad's synthesis adds on top of the encoder delay in the LAME header
+#define DECODER_DELAY   529
+#define XING_TOC_LEN    100
+#define ID3V1_LEN       128
+#define APE_FOOTER_LEN  32
 
 static const char TAG[] = "audio_mad";
 
@@ -22,78 +41,133 @@ enum mad_sig {
 struct mad_struct {
     struct mad_stream 	stream;
     struct mad_frame 	frame;
-    struct mad_synth 	synth;
     mad_timer_t 		timer;
     unsigned long		frame_cnt;
 } static* mad;
 
+// The Xing (or LAME "Info") header sits in an otherwise silent first frame
+struct xing_header {
+    uint32_t 	frames;
+    uint32_t 	bytes;
+    bool 		has_toc;
+    uint8_t 	toc[XING_TOC_LEN];
+    bool 		has_lame;
+    uint16_t 	delay;
+    uint16_t 	padding;
+};
+
 struct mad_stat {
-    size_t 		write_size;
-    size_t		readsize;
-//    size_t      offset;
-    size_t		remaining;
-
-    // Will reference some
-    // "middle part" of in_buffer:
-    uint8_t 	*buffstart;
-    uint8_t 	in_buffer[600 + MADX_INPUT_BUFFER_SIZE + MAD_BUFFER_GUARD];
+    // The end of the stream is copied here so libmad gets its zeroed guard bytes
+    uint8_t 	tail[MAD_MIN_INPUT + MAD_BUFFER_GUARD];
+
+    struct xing_header 	xing;
+    bool 		has_xing;
+    size_t 		audio_start;    // Offset of the first frame
+    // Gapless trimming, in samples still to drop and still to play. remaining is UINT64_MAX without a LAME header.
+    uint32_t 	skip;
+    uint64_t 	remaining;
 } static* stat;
 
-static enum mad_sig run_mad(void) {
-    uint8_t* guard_ptr  = NULL;
+// Layer III decoding keeps its overlap state in the frame, so frames are decoded in place on the audio task and
+// only the subband samples are handed over. Polyphase synthesis then runs on its own task on the second core.
+struct mad_slot {
+    struct mad_frame 	frame;
+    struct mad_pcm 		pcm;
+    SemaphoreHandle_t 	done;
+};
 
-    // Executes on initial loop
-    if (stat->readsize == 0 && stat->remaining == 0 && mad->stream.buffer == NULL) {
-        stat->readsize = MADX_INPUT_BUFFER_SIZE;
-        stat->remaining = 0;
-        return MORE_INPUT;
+// Created with the first MPEG stream and kept, as the synthesis task never exits
+static struct {
+    struct mad_slot* 	slots;
+    struct mad_synth 	synth;
+    QueueHandle_t 		queue;
+    size_t 				next_in;
+    size_t 				next_out;
+    // Per stream, in microseconds, and logged when it ends
+    int64_t 			decode_us;
+    volatile int64_t 	synth_us;
+    int64_t 			wait_us;
+} synth_pipe = { 0 };
+
+_Noreturn static void synth_loop(void* args) {
+    while (1) {
+        struct mad_slot* slot;
+        xQueueReceive(synth_pipe.queue, &slot, portMAX_DELAY);
+
+        int64_t start = esp_timer_get_time();
+        mad_synth_frame(&synth_pipe.synth, &slot->frame);
+        memcpy(&slot->pcm, &synth_pipe.synth.pcm, sizeof(struct mad_pcm));
+        synth_pipe.synth_us += esp_timer_get_time() - start;
+        xSemaphoreGive(slot->done);
     }
+}
 
-    if (mad->stream.buffer == NULL || mad->stream.error == MAD_ERROR_BUFLEN) {
-        if(stat->readsize < MADX_INPUT_BUFFER_SIZE) {
-            guard_ptr = stat->buffstart + stat->readsize;
-            memset(guard_ptr, 0, MAD_BUFFER_GUARD);
-            stat->readsize += MAD_BUFFER_GUARD;
-        }
-        // Pipe the new buffer content to libmad's
-        // stream decoder facility.
+// The slots are written on one core and read on the other for every frame, so they are kept out of PSRAM
+static void start_synth_task(void) {
+    synth_pipe.slots = heap_caps_malloc(SYNTH_SLOTS * sizeof(struct mad_slot), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    synth_pipe.queue = xQueueCreate(SYNTH_SLOTS, sizeof(struct mad_slot*));
+    assert(synth_pipe.slots != NULL && synth_pipe.queue != NULL);
 
-        mad_stream_buffer(&mad->stream, stat->buffstart, stat->readsize + stat->remaining );
-        mad->stream.buffer = stat->in_buffer;
+    for (int i = 0; i < SYNTH_SLOTS; i++) {
+        synth_pipe.slots[i].done = xSemaphoreCreateBinary();
+        assert(synth_pipe.slots[i].done != NULL);
+    }
 
-        if ((stat->buffstart[0] == 0xff && (stat->buffstart[1] & 0xe0) == 0xe0)) {
-            ESP_LOGI(TAG, "Synced!");
-            mad->stream.sync = 0;
-        }
-        mad->stream.md_len = 511;
+    xTaskCreatePinnedToCore(synth_loop, "MAD Synth", SYNTH_STACK, NULL, uxTaskPriorityGet(NULL), NULL,
+                            DECODER_HELPER_CORE);
+}
 
-        mad->stream.error = MAD_ERROR_NONE;
-    }
+// Waits for the oldest frame in the pipeline and writes it out, unless output has already stopped
+static bool write_oldest(const AudioContext_t* audio_ctx, bool run) {
+    struct mad_slot* slot = &synth_pipe.slots[synth_pipe.next_out++ % SYNTH_SLOTS];
+    int64_t start = esp_timer_get_time();
+    xSemaphoreTake(slot->done, portMAX_DELAY);
+    synth_pipe.wait_us += esp_timer_get_time() - start;
+    if (!run)
+        return false;
+
+    const struct mad_pcm* pcm = &slot->pcm;
+    size_t offset = MIN(stat->skip, pcm->length);
+    size_t length = MIN(pcm->length - offset, stat->remaining);
+    stat->skip -= offset;
+    stat->remaining -= length;
+    if (length == 0)
+        return true;
+
+    const mad_fixed_t* left = pcm->samples[0] + offset;
+    const mad_fixed_t* right = pcm->channels == 1 ? left : pcm->samples[1] + offset;
+    return audio_ctx->write(left, right, length, pcm->samplerate, 32);
+}
 
-    if (mad_frame_decode(&mad->frame, &mad->stream) ) {
-        if(MAD_RECOVERABLE(mad->stream.error) ) {
-            if(mad->stream.error != MAD_ERROR_LOSTSYNC ||
-               mad->stream.this_frame != guard_ptr ||
-               // Suppress error if caused by ID3 tag.
-               (mad->stream.this_frame[0] != 'I' &&		// ID3v2
-                mad->stream.this_frame[1] != 'D' &&
-                mad->stream.this_frame[2] != '3') ||
-               (mad->stream.this_frame[0] != 'T' &&		// ID3v1
-                mad->stream.this_frame[1] != 'A' &&
-                mad->stream.this_frame[2] != 'G') ) {
-                printf("Recoverable frame level error (%s)\n",
-                       mad_stream_errorstr(&mad->stream));
-            }
+static bool queue_frame(const AudioContext_t* audio_ctx) {
+    bool run = true;
+    if (synth_pipe.next_in - synth_pipe.next_out == SYNTH_SLOTS)
+        run = write_oldest(audio_ctx, run);
+
+    struct mad_slot* slot = &synth_pipe.slots[synth_pipe.next_in++ % SYNTH_SLOTS];
+    slot->frame.header = mad->frame.header;
+    slot->frame.options = mad->frame.options;
+    memcpy(slot->frame.sbsample, mad->frame.sbsample, sizeof(mad->frame.sbsample));
+    xQueueSend(synth_pipe.queue, &slot, portMAX_DELAY);
+    return run;
+}
 
-            return CALL_AGAIN;
-        } else if(mad->stream.error == MAD_ERROR_BUFLEN) {
-            printf("Need more input (%s)\n", mad_stream_errorstr(&mad->stream));
-            stat->remaining = mad->stream.bufend - mad->stream.next_frame;
+static bool drain_frames(const AudioContext_t* audio_ctx, bool run) {
+    while (synth_pipe.next_out != synth_pipe.next_in)
+        run = write_oldest(audio_ctx, run);
+    return run;
+}
 
-//            stat->offset = mad->stream.this_frame - stat->buffstart;
-            stat->readsize = MADX_INPUT_BUFFER_SIZE - stat->remaining;
-            memmove(stat->in_buffer, mad->stream.next_frame - 600, 600 + stat->remaining);
+static enum mad_sig run_mad(void) {
+    int64_t start = esp_timer_get_time();
+    int result = mad_frame_decode(&mad->frame, &mad->stream);
+    synth_pipe.decode_us += esp_timer_get_time() - start;
 
+    if (result) {
+        if(MAD_RECOVERABLE(mad->stream.error) ) {
+            ESP_LOGD(TAG, "Recoverable frame level error (%s)", mad_stream_errorstr(&mad->stream));
+            return CALL_AGAIN;
+        } else if(mad->stream.error == MAD_ERROR_BUFLEN) {
             return MORE_INPUT;
         } else {
             return ERROR_OCCURED;
@@ -102,69 +176,310 @@ static enum mad_sig run_mad(void) {
 
     mad->frame_cnt++;
     mad_timer_add(&mad->timer, mad->frame.header.duration);
-    mad_synth_frame(&mad->synth, &mad->frame);
     return FLUSH_BUFFER;
 }
 
+static const uint16_t mpeg_bitrates[5][14] = {
+        { 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448 },     // MPEG-1 Layer I
+        { 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384 },        // MPEG-1 Layer II
+        { 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320 },         // MPEG-1 Layer III
+        { 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256 },        // MPEG-2 Layer I
+        { 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 }              // MPEG-2 Layer II & III
+};
+static const uint16_t mpeg_sample_rates[3] = { 44100, 48000, 32000 };
+
+// frame points at a Layer III frame header with len bytes behind it
+static bool read_xing(const uint8_t* frame, size_t len, struct xing_header* xing) {
+    if (len < 4)
+        return false;
+
+    uint32_t header = READ_BE32(frame);
+    bool mpeg1 = ((header >> 19) & 0x03) == 3;
+    bool mono = ((header >> 6) & 0x03) == 3;
+    size_t side_info = mpeg1 ? (mono ? 17 : 32) : (mono ? 9 : 17);
+
+    const uint8_t* pos = frame + 4 + side_info;
+    const uint8_t* end = frame + len;
+    if (pos + 8 > end || (memcmp(pos, "Xing", 4) != 0 && memcmp(pos, "Info", 4) != 0))
+        return false;
+
+    memset(xing, 0, sizeof(struct xing_header));
+    uint32_t flags = READ_BE32(pos + 4);
+    pos += 8;
+
+    if (flags & 0x01) {
+        if (pos + 4 > end)
+            return false;
+        xing->frames = READ_BE32(pos);
+        pos += 4;
+    }
+    if (flags & 0x02) {
+        if (pos + 4 > end)
+            return false;
+        xing->bytes = READ_BE32(pos);
+        pos += 4;
+    }
+    if (flags & 0x04) {
+        if (pos + XING_TOC_LEN > end)
+            return false;
+        memcpy(xing->toc, pos, XING_TOC_LEN);
+        xing->has_toc = true;
+        pos += XING_TOC_LEN;
+    }
+    if (flags & 0x08)
+        pos += 4;
+
+    // The LAME extension follows with the encoder delay and padding as two 12-bit fields, 21 bytes in.
+    // FFmpeg writes the same layout under its own name.
+    if (pos + 24 <= end && (memcmp(pos, "LAME", 4) == 0 || memcmp(pos, "Lavc", 4) == 0 || memcmp(pos, "Lavf", 4) == 0)) {
+        xing->delay = (pos[21] << 4) | (pos[22] >> 4);
+        xing->padding = ((pos[22] & 0x0F) << 8) | pos[23];
+        xing->has_lame = true;
+    }
+
+    return true;
+}
+
+// Samples left after gapless trimming, or 0 if the header does not say
+static uint64_t xing_samples(const struct xing_header* xing, unsigned int frame_samples) {
+    uint64_t total = (uint64_t)xing->frames * frame_samples;
+    if (xing->has_lame && total > xing->delay + xing->padding)
+        total -= xing->delay + xing->padding;
+    return total;
+}
+
+// Tags between, before or after frames are stepped over rather than fed to libmad. to_end is how much of the
+// file is left from data.
+static size_t tag_length(const uint8_t* data, size_t len, size_t to_end) {
+    size_t tag = 0;
+    if (len >= 10 && memcmp(data, "ID3", 3) == 0) {
+        tag = id3v2_length(data, len);
+    } else if (len >= APE_FOOTER_LEN && memcmp(data, "APETAGEX", 8) == 0) {
+        // The size covers the items and footer. A tag without a header is only seen at its footer.
+        bool has_header = READ_LE32(data + 20) & (1u << 29);
+        tag = has_header ? READ_LE32(data + 12) + APE_FOOTER_LEN : APE_FOOTER_LEN;
+    } else if (len >= 3 && to_end == ID3V1_LEN && memcmp(data, "TAG", 3) == 0) {
+        tag = ID3V1_LEN;
+    }
+
+    return MIN(tag, to_end);
+}
+
+// The first frame of a VBR file carries a Xing (or LAME "Info") header with the frame count.
+// Without one the stream is assumed to be CBR and the length is estimated from the bitrate.
+bool probe_mad_decoder(const AudioContext_t* audio_ctx, AudioStreamInfo_t* info) {
+    const uint8_t* data;
+    size_t len = audio_ctx->peek(&data, PROBE_LEN);
+    size_t pos = id3v2_length(data, len);
+
+    uint32_t header = 0;
+    unsigned int version = 0, layer = 0, bitrate_i = 0, rate_i = 0;
+    for (; pos + 4 <= len; pos++) {
+        header = READ_BE32(data + pos);
+        version = (header >> 19) & 0x03;
+        layer = (header >> 17) & 0x03;
+        bitrate_i = (header >> 12) & 0x0F;
+        rate_i = (header >> 10) & 0x03;
+
+        if ((header & 0xFFE00000) == 0xFFE00000 && version != 1 && layer != 0
+                && bitrate_i != 0 && bitrate_i != 15 && rate_i != 3)
+            break;
+    }
+
+    if (pos + 4 > len)
+        return false;
+
+    bool mpeg1 = version == 3;
+    bool mono = ((header >> 6) & 0x03) == 3;
+    unsigned int layer_i = 3 - layer;   // 0 is Layer I
+
+    info->sample_rate = mpeg_sample_rates[rate_i] >> (mpeg1 ? 0 : version == 2 ? 1 : 2);
+    info->channels = mono ? 1 : 2;
+
+    unsigned int frame_samples = layer_i == 0 ? 384 : (layer_i == 2 && !mpeg1) ? 576 : 1152;
+    unsigned int kbps = mpeg_bitrates[mpeg1 ? layer_i : layer_i == 0 ? 3 : 4][bitrate_i - 1];
+
+    struct xing_header xing;
+    if (layer_i == 2 && read_xing(data + pos, len - pos, &xing) && xing.frames != 0) {
+        info->total_samples = xing_samples(&xing, frame_samples);
+        return true;
+    }
+
+    if (audio_ctx->total_bytes() == AUDIO_UNKNOWN_LENGTH)
+        return true;
+
+    size_t audio_bytes = audio_ctx->total_bytes() - pos;
+    info->total_samples = (uint64_t)audio_bytes * 8 * info->sample_rate / (kbps * 1000);
+    return true;
+}
+
+// Called with the first decoded frame. Returns true if it is the Xing frame, which carries no audio.
+static bool read_first_frame(const AudioContext_t* audio_ctx, size_t len) {
+    const struct mad_stream* stream = &mad->stream;
+    size_t offset = stream->this_frame - stream->buffer;
+    stat->audio_start = audio_ctx->bytes_elapsed() + offset;
+
+    stat->has_xing = mad->frame.header.layer == MAD_LAYER_III
+            && read_xing(stream->this_frame, len - MIN(offset, len), &stat->xing);
+    if (!stat->has_xing)
+        return false;
+
+    if (stat->xing.has_lame) {
+        stat->skip = stat->xing.delay + DECODER_DELAY;
+        if (stat->xing.frames != 0)
+            stat->remaining = xing_samples(&stat->xing, 32 * MAD_NSBSAMPLES(&mad->frame.header));
+        ESP_LOGI(TAG, "Gapless: %u delay, %u padding", stat->xing.delay, stat->xing.padding);
+    }
+
+    return true;
+}
+
+// The Xing TOC maps each percent of the duration to a 1/256 fraction of the audio bytes. Without one the
+// stream is taken to be CBR at the current frame's bitrate.
+static size_t seek_offset(const AudioContext_t* audio_ctx, uint32_t position_ms, unsigned int sample_rate,
+                          unsigned int frame_samples) {
+    const struct xing_header* xing = &stat->xing;
+    size_t audio_bytes = audio_ctx->total_bytes() - stat->audio_start;
+    uint64_t duration_ms = (uint64_t)xing->frames * frame_samples * 1000 / sample_rate;
+
+    if (stat->has_xing && xing->has_toc && duration_ms != 0) {
+        if (xing->bytes != 0)
+            audio_bytes = MIN(audio_bytes, xing->bytes);
+
+        // Percent in 1/1000ths, interpolated between TOC entries
+        uint32_t percent = MIN((uint64_t)position_ms * 100000 / duration_ms, 99999);
+        unsigned int i = percent / 1000;
+        unsigned int lower = xing->toc[i];
+        unsigned int upper = i < XING_TOC_LEN - 1 ? xing->toc[i + 1] : 256;
+        uint32_t fraction = lower * 1000 + (upper - lower) * (percent % 1000);
+        return stat->audio_start + (uint64_t)audio_bytes * fraction / (256 * 1000);
+    }
+
+    return stat->audio_start + MIN((uint64_t)position_ms * mad->frame.header.bitrate / 8000, audio_bytes);
+}
+
+static void seek_mad(const AudioContext_t* audio_ctx, uint32_t position_ms) {
+    // Frames still in the synthesis pipeline are from before the seek
+    drain_frames(audio_ctx, false);
+
+    unsigned int sample_rate = mad->frame.header.samplerate;
+    unsigned int frame_samples = 32 * MAD_NSBSAMPLES(&mad->frame.header);
+    if (sample_rate == 0)
+        return;
+
+    size_t offset = seek_offset(audio_ctx, position_ms, sample_rate, frame_samples);
+    if (!audio_ctx->seek(MIN(offset, audio_ctx->total_bytes())))
+        return;
+
+    // libmad finds the next sync word itself. The bit reservoir of the first frames after it is lost.
+    mad_stream_finish(&mad->stream);
+    mad_stream_init(&mad->stream);
+    mad_frame_mute(&mad->frame);
+    mad_synth_mute(&synth_pipe.synth);
+
+    uint64_t sample = (uint64_t)position_ms * sample_rate / 1000;
+    if (stat->remaining != UINT64_MAX) {
+        uint64_t total = xing_samples(&stat->xing, frame_samples);
+        stat->remaining = total > sample ? total - sample : 0;
+    }
+    stat->skip = 0;
+
+    ESP_LOGI(TAG, "Seeking to %u ms at byte %u", position_ms, offset);
+    audio_ctx->seek_done(sample, sample_rate);
+}
+
 void run_mad_decoder(const AudioContext_t* audio_ctx) {
     bool run = true;
-    mad->stream.buffer = NULL;
-    stat->readsize = 0;
-    stat->remaining = 0;
-//    stat->offset = 0;
-    stat->buffstart = stat->in_buffer+600;
-
-//    printf("MAD STREAM Before:\n"
-//           "input buffer: 0x%x\n"
-//           "Buffer end: 0x%x\n"
-//           "Skip length: %ld\n"
-//           "sync found: %d\n"
-//           "freerate: %ld\n"
-//           "this_frame: 0x%x\n"
-//           "next_frame: 0x%x\n"
-//           "md_len: %d\n"
-//           "options: 0x%x\n"
-//           "error: %d\n\n",
-//           (size_t)mad->stream.buffer, (size_t)mad->stream.bufend, mad->stream.skiplen, mad->stream.sync,
-//           mad->stream.freerate, (size_t)mad->stream.this_frame, (size_t)mad->stream.next_frame,
-//           mad->stream.md_len, mad->stream.options, mad->stream.error);
+
+    if (synth_pipe.slots == NULL)
+        start_synth_task();
+
+    // The synthesis task is idle between streams
+    synth_pipe.next_in = 0;
+    synth_pipe.next_out = 0;
+    synth_pipe.decode_us = 0;
+    synth_pipe.synth_us = 0;
+    synth_pipe.wait_us = 0;
+    mad_synth_init(&synth_pipe.synth);
 
     while (run) {
-        enum mad_sig ret = run_mad();
-
-        switch (ret) {
-            case CALL_AGAIN:
-                continue;
-            case MORE_INPUT:
-                if (audio_ctx->eof()) {
-                    audio_ctx->decoder_finished();
-                    run = false;
-                    break;
-                }
+        uint32_t position_ms;
+        if (audio_ctx->seek_pending(&position_ms))
+            seek_mad(audio_ctx, position_ms);
+
+        const uint8_t* data;
+        size_t len = audio_ctx->peek(&data, MAD_MIN_INPUT);
+        if (len == 0) {
+            if (drain_frames(audio_ctx, run) && audio_ctx->eof())
+                audio_ctx->decoder_finished();
+            break;
+        }
 
-                stat->readsize = audio_ctx->fill_buffer(stat->buffstart + stat->remaining, stat->readsize);
-                if (stat->readsize == 0)
-                    run = false;
+        // A short peek only happens at the end of the stream
+        bool last = len < MAD_MIN_INPUT;
+        if (last) {
+            memcpy(stat->tail, data, len);
+            memset(stat->tail + len, 0, MAD_BUFFER_GUARD);
+            mad_stream_buffer(&mad->stream, stat->tail, len + MAD_BUFFER_GUARD);
+        } else {
+            mad_stream_buffer(&mad->stream, data, len);
+        }
 
+        size_t to_end = audio_ctx->total_bytes() - audio_ctx->bytes_elapsed();
+        size_t tag = 0;
+        enum mad_sig ret = CALL_AGAIN;
+        while (run && ret != MORE_INPUT) {
+            size_t offset = MIN(mad->stream.next_frame - mad->stream.buffer, len);
+            tag = tag_length(mad->stream.next_frame, len - offset, to_end - offset);
+            if (tag != 0)
                 break;
-            case FLUSH_BUFFER:
-                run = audio_ctx->write(mad->synth.pcm.samples[0], mad->synth.pcm.channels == 1
-                                                            ? mad->synth.pcm.samples[0] : mad->synth.pcm.samples[1],
-                                 mad->synth.pcm.length, mad->synth.pcm.samplerate, 32);
-                break;
-            case ERROR_OCCURED:
-                ESP_LOGE(TAG, "Error code %s\n", mad_stream_errorstr(&mad->stream));
-                audio_ctx->decoder_failed();
-                run = false;
+
+            ret = run_mad();
+
+            switch (ret) {
+                case CALL_AGAIN:
+                case MORE_INPUT:
+                    break;
+                case FLUSH_BUFFER:
+                    if (mad->frame_cnt == 1 && read_first_frame(audio_ctx, len))
+                        break;
+                    run = queue_frame(audio_ctx);
+                    break;
+                case ERROR_OCCURED:
+                    ESP_LOGE(TAG, "Error code %s\n", mad_stream_errorstr(&mad->stream));
+                    if (drain_frames(audio_ctx, run))
+                        audio_ctx->decoder_failed();
+                    run = false;
+                    break;
+                default:
+                    abort();
+            }
+        }
+
+        size_t used = mad->stream.next_frame - mad->stream.buffer;
+        if (tag != 0) {
+            audio_ctx->consume(used);
+            if (!audio_ctx->seek(audio_ctx->bytes_elapsed() + tag))
                 break;
-            default:
-                abort();
+            continue;
         }
+
+        if (last || used == 0 || used > len)
+            used = len;
+        audio_ctx->consume(used);
+    }
+
+    drain_frames(audio_ctx, false);
+
+    // Waiting close to the synthesis time means synthesis, not decoding, sets the pace
+    if (synth_pipe.next_out != 0) {
+        ESP_LOGI(TAG, "%u frames, per frame: decode %lld us, synthesis %lld us, waited for synthesis %lld us",
+                 synth_pipe.next_out, synth_pipe.decode_us / synth_pipe.next_out,
+                 synth_pipe.synth_us / synth_pipe.next_out, synth_pipe.wait_us / synth_pipe.next_out);
     }
 
-    memset(stat, 0, sizeof(struct mad_stat));
     mad_timer_reset(&mad->timer);
-    mad_synth_finish(&mad->synth);
+    mad_synth_finish(&synth_pipe.synth);
     mad_frame_finish(&mad->frame);
     mad_stream_finish(&mad->stream);
 }
@@ -172,23 +487,35 @@ void run_mad_decoder(const AudioContext_t* audio_ctx) {
 void delete_mad_decoder(void) {
     free(mad);
     free(stat);
+    mad = NULL;
+    stat = NULL;
 }
 
 void init_mad_decoder(void) {
-    mad = malloc(sizeof(struct mad_struct));
-    stat = malloc(sizeof(struct mad_stat));
+    if (mad == NULL) {
+        mad = malloc(sizeof(struct mad_struct));
+        stat = malloc(sizeof(struct mad_stat));
+
+        assert(mad != NULL);
+        assert(stat != NULL);
+    }
 
-    assert(mad != NULL);
-    assert(stat != NULL);
+    mad->frame_cnt = 0;
+    memset(&stat->xing, 0, sizeof(struct xing_header));
+    stat->has_xing = false;
+    stat->audio_start = 0;
+    stat->skip = 0;
+    stat->remaining = UINT64_MAX;
 
     mad_stream_init(&mad->stream);
     mad_frame_init(&mad->frame);
-    mad_synth_init(&mad->synth);
     mad_timer_reset(&mad->timer);
 }
 
 const DecoderWrapper_t mad_wrapper = {
         .init = init_mad_decoder,
+        .probe = probe_mad_decoder,
         .run = run_mad_decoder,
-        .delete = delete_mad_decoder
+        .delete = delete_mad_decoder,
+        .seekable = true
 };
\ No newline at end of file
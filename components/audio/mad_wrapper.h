@@ -3,6 +3,7 @@
 
 #include "audio_common.h"
 
+bool probe_mad_decoder(const AudioContext_t* audio_ctx, AudioStreamInfo_t* info);
 void run_mad_decoder(const AudioContext_t* audio_ctx);
 void init_mad_decoder(void);
 void delete_mad_decoder(void);
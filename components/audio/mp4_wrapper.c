@@ -0,0 +1,680 @@
+#include "mp4_wrapper.h"
+#include "helix_wrapper.h"
+#include "pcm_kernels.h"
+
+#include "codecs/alac/alac_wrapper.h"
+
+#include <memory.h>
+#include <sys/param.h>
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+
+#ifndef MP4_WINDOW
+#define MP4_WINDOW          8192        // Entries of the sample size and chunk offset tables kept resident
+#endif
+#ifndef MP4_STSC_WINDOW
+#define MP4_STSC_WINDOW     256         // Sample to chunk entries kept resident
+#endif
+#define MP4_TABLE_READ      2040        // Whole entries of 4, 8 or 12 bytes per ranged table read
+#define MP4_MAX_COOKIE      64
+#define MP4_MAX_LEAF        4096        // Boxes parsed from a single peek
+#define MP4_MAX_PEEK        8192        // Larger samples are gathered into a buffer
+#define MP4_MAX_ERRORS      8
+#define ALAC_PADDING        8
+
+#define FOURCC(_a, _b, _c, _d) (((uint32_t)(_a) << 24) | ((uint32_t)(_b) << 16) | ((uint32_t)(_c) << 8) | (uint32_t)(_d))
+
+static const char TAG[] = "audio_mp4";
+
+enum mp4_codec {
+    MP4_CODEC_NONE,
+    MP4_CODEC_AAC,
+    MP4_CODEC_ALAC
+};
+
+// What the first sound track's mdhd, hdlr and stsd boxes say
+struct mp4_track {
+    enum mp4_codec codec;
+    unsigned int sample_rate;
+    unsigned int channels;
+    unsigned int bit_depth;
+    unsigned int profile;           // AAC object type minus one
+    uint32_t timescale;
+    uint64_t duration;
+    uint8_t cookie[MP4_MAX_COOKIE]; // ALAC specific config, with its box header
+    size_t cookie_length;
+    bool sound;                     // The track being parsed is the one to play
+    bool found;
+};
+
+// Sample tables grow with the length of the file, so only a window of each is resident.
+// Entries outside it are read back from the file.
+struct mp4_table {
+    size_t offset;                  // Of the first entry
+    uint32_t count;
+    uint32_t first;                 // Index of window[0]
+    uint32_t fill;
+    uint32_t capacity;              // Entries the window holds
+    uint8_t entry_size;
+    uint8_t value_offset;           // Of the first 32-bit field kept from each entry
+    uint8_t values;                 // Fields kept per entry
+    uint32_t* window;
+};
+
+static struct mp4_stat {
+    struct mp4_track track;
+    bool have_moov;
+
+    uint32_t sample_size;           // Every sample has this size if non-zero
+    uint32_t sample_count;
+    struct mp4_table sizes;
+    struct mp4_table chunks;
+    struct mp4_table stsc;          // First chunk, 1-based, and samples per chunk
+    uint8_t table_read[MP4_TABLE_READ];
+
+    struct alac_codec_s* alac;
+    unsigned int alac_frames;
+    uint8_t* sample;
+    size_t sample_capacity;
+    uint8_t* pcm;
+    size_t pcm_capacity;
+    int32_t* left;
+    size_t left_capacity;
+    int32_t* right;
+    size_t right_capacity;
+} *stat;
+
+static const uint32_t aac_sample_rates[13] = {
+        96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350
+};
+
+// Buffers are kept between tracks and only grow. Returns NULL if the allocation fails.
+static void* grow(void* buffer, size_t* capacity, size_t length) {
+    if (length <= *capacity)
+        return buffer;
+
+    free(buffer);
+    buffer = heap_caps_malloc(length, MALLOC_CAP_SPIRAM);
+    *capacity = buffer != NULL ? length : 0;
+    return buffer;
+}
+
+static void parse_mdhd(struct mp4_track* track, const uint8_t* data, size_t length) {
+    if (track->found)
+        return;
+
+    if (data[0] == 1 && length >= 32) {
+        track->timescale = READ_BE32(data + 20);
+        track->duration = ((uint64_t)READ_BE32(data + 24) << 32) | READ_BE32(data + 28);
+    } else if (length >= 20) {
+        track->timescale = READ_BE32(data + 12);
+        track->duration = READ_BE32(data + 16);
+    }
+}
+
+// QuickTime files also have a data handler in minf, so a track is only ever marked, never unmarked
+static void parse_hdlr(struct mp4_track* track, const uint8_t* data, size_t length) {
+    if (!track->found && length >= 12 && READ_BE32(data + 8) == FOURCC('s', 'o', 'u', 'n'))
+        track->sound = true;
+}
+
+// Descriptor lengths are 7 bits per byte, with the top bit set on all but the last
+static size_t read_descriptor(const uint8_t** data, const uint8_t* end, uint8_t tag) {
+    if (*data >= end || **data != tag)
+        return 0;
+
+    size_t length = 0;
+    const uint8_t* p = *data + 1;
+    for (int i = 0; i < 4 && p < end; i++) {
+        length = (length << 7) | (*p & 0x7F);
+        if ((*p++ & 0x80) == 0)
+            break;
+    }
+
+    *data = p;
+    return MIN(length, (size_t)(end - p));
+}
+
+static unsigned int read_bits(const uint8_t* data, size_t* bit, unsigned int count) {
+    unsigned int value = 0;
+    for (unsigned int i = 0; i < count; i++, (*bit)++)
+        value = (value << 1) | ((data[*bit >> 3] >> (7 - (*bit & 7))) & 0x01);
+    return value;
+}
+
+// The AudioSpecificConfig at the end of the ES descriptor gives the core format. Explicitly signalled
+// HE-AAC puts the SBR rate first, but Helix only needs the core and finds SBR in the raw blocks itself.
+static bool parse_esds(struct mp4_track* track, const uint8_t* data, size_t length) {
+    const uint8_t* end = data + length;
+    data += 4;
+
+    if (read_descriptor(&data, end, 0x03) == 0 || data + 3 > end)
+        return false;
+    uint8_t flags = data[2];
+    data += 3;
+    if (flags & 0x80)
+        data += 2;
+    if ((flags & 0x40) && data < end)
+        data += 1 + data[0];
+    if (flags & 0x20)
+        data += 2;
+
+    if (read_descriptor(&data, end, 0x04) == 0 || data + 13 > end || data[0] != 0x40)
+        return false;
+    data += 13;
+
+    size_t config_length = read_descriptor(&data, end, 0x05);
+    if (config_length < 2)
+        return false;
+
+    size_t bit = 0;
+    size_t bits = config_length * 8;
+    unsigned int object_type = read_bits(data, &bit, 5);
+    unsigned int rate_i = read_bits(data, &bit, 4);
+    unsigned int rate = rate_i == 15 && bits >= 37 ? read_bits(data, &bit, 24) : rate_i < 13 ? aac_sample_rates[rate_i] : 0;
+    unsigned int channels = read_bits(data, &bit, 4);
+
+    if ((object_type == 5 || object_type == 29) && bit + 9 <= bits) {
+        rate_i = read_bits(data, &bit, 4);
+        if (rate_i == 15)
+            bit += 24;
+        object_type = bit + 5 <= bits ? read_bits(data, &bit, 5) : 2;
+    }
+
+    if (rate == 0 || object_type == 0)
+        return false;
+
+    track->codec = MP4_CODEC_AAC;
+    track->profile = object_type - 1;
+    track->sample_rate = rate;
+    if (channels != 0)
+        track->channels = channels;
+    return true;
+}
+
+static void parse_stsd(struct mp4_track* track, const uint8_t* data, size_t length) {
+    if (!track->sound || length < 8 + 36)
+        return;
+
+    const uint8_t* entry = data + 8;
+    const uint8_t* end = entry + MIN(READ_BE32(entry), length - 8);
+    uint32_t format = READ_BE32(entry + 4);
+
+    // QuickTime sound descriptions grow with their version
+    uint16_t version = READ_BE16(entry + 16);
+    const uint8_t* child = entry + 36 + (version == 1 ? 16 : version == 2 ? 36 : 0);
+
+    track->channels = READ_BE16(entry + 24);
+    track->bit_depth = READ_BE16(entry + 26);
+    track->sample_rate = READ_BE16(entry + 32);
+
+    while (child + 8 <= end) {
+        uint32_t size = READ_BE32(child);
+        uint32_t type = READ_BE32(child + 4);
+        if (size < 8 || size > (size_t)(end - child))
+            break;
+
+        if (format == FOURCC('m', 'p', '4', 'a') && type == FOURCC('e', 's', 'd', 's')) {
+            parse_esds(track, child + 8, size - 8);
+        } else if (format == FOURCC('a', 'l', 'a', 'c') && type == FOURCC('a', 'l', 'a', 'c') && size <= MP4_MAX_COOKIE) {
+            // The ALAC decoder skips this box header itself
+            memcpy(track->cookie, child, size);
+            track->cookie_length = size;
+            track->codec = MP4_CODEC_ALAC;
+            if (size >= 36) {
+                track->bit_depth = child[17];
+                track->channels = child[21];
+                track->sample_rate = READ_BE32(child + 32);
+            }
+        }
+
+        child += size;
+    }
+}
+
+static bool is_container(uint32_t type) {
+    return type == FOURCC('m', 'o', 'o', 'v') || type == FOURCC('t', 'r', 'a', 'k') || type == FOURCC('m', 'd', 'i', 'a')
+           || type == FOURCC('m', 'i', 'n', 'f') || type == FOURCC('s', 't', 'b', 'l');
+}
+
+// Box headers and the leaves the probe needs usually sit in the first few hundred bytes of a fast-start file
+static void probe_boxes(struct mp4_track* track, const uint8_t* data, size_t length) {
+    const uint8_t* end = data + length;
+
+    while (data + 8 <= end) {
+        uint32_t size = READ_BE32(data);
+        uint32_t type = READ_BE32(data + 4);
+        if (size < 8)
+            break;
+
+        size_t available = MIN(size, (size_t)(end - data)) - 8;
+        if (is_container(type)) {
+            if (type == FOURCC('t', 'r', 'a', 'k'))
+                track->sound = false;
+
+            probe_boxes(track, data + 8, available);
+            if (type == FOURCC('t', 'r', 'a', 'k') && track->sound)
+                track->found = true;
+        } else if (available == size - 8) {
+            if (type == FOURCC('m', 'd', 'h', 'd'))
+                parse_mdhd(track, data + 8, available);
+            else if (type == FOURCC('h', 'd', 'l', 'r'))
+                parse_hdlr(track, data + 8, available);
+            else if (type == FOURCC('s', 't', 's', 'd'))
+                parse_stsd(track, data + 8, available);
+        }
+
+        if (size > (size_t)(end - data))
+            break;
+        data += size;
+    }
+}
+
+bool probe_mp4_decoder(const AudioContext_t* audio_ctx, AudioStreamInfo_t* info) {
+    const uint8_t* data;
+    size_t len = audio_ctx->peek(&data, PROBE_LEN);
+    if (len < 8 || READ_BE32(data + 4) != FOURCC('f', 't', 'y', 'p'))
+        return false;
+
+    struct mp4_track track = { 0 };
+    probe_boxes(&track, data, len);
+    if (track.codec == MP4_CODEC_NONE)
+        return false;
+
+    info->sample_rate = track.sample_rate;
+    info->bit_depth = track.codec == MP4_CODEC_ALAC ? track.bit_depth : 16;
+    info->channels = track.channels;
+    if (track.timescale != 0)
+        info->total_samples = track.duration * track.sample_rate / track.timescale;
+    return true;
+}
+
+static bool store_entries(struct mp4_table* table, uint32_t i, const uint8_t* data, uint32_t entries) {
+    uint32_t* value = table->window + (size_t)i * table->values;
+    for (uint32_t j = 0; j < entries; j++, data += table->entry_size) {
+        // 64-bit chunk offsets past 4 GB cannot be reached anyway
+        if (table->entry_size == 8 && READ_BE32(data) != 0)
+            return false;
+        for (uint8_t k = 0; k < table->values; k++)
+            *value++ = READ_BE32(data + table->value_offset + 4 * k);
+    }
+
+    return true;
+}
+
+// Reads entries from the current input position, which has to be where entry index is stored
+static bool load_window(const AudioContext_t* ctx, struct mp4_table* table, uint32_t index) {
+    table->first = index;
+    table->fill = MIN(table->capacity, table->count - index);
+
+    for (uint32_t i = 0; i < table->fill;) {
+        const uint8_t* data;
+        size_t len = ctx->peek(&data, table->entry_size);
+        if (len < table->entry_size)
+            return false;
+
+        uint32_t entries = MIN(len / table->entry_size, table->fill - i);
+        if (store_entries(table, i, data, entries) == false)
+            return false;
+
+        ctx->consume(entries * table->entry_size);
+        i += entries;
+    }
+
+    return true;
+}
+
+// Windows are refilled with ranged reads, which leave the stream and its buffered samples where they are. Only
+// if the input cannot read ranges does it go back to the table and return, restarting the stream twice.
+static bool refill_window(const AudioContext_t* ctx, struct mp4_table* table, uint32_t index) {
+    ESP_LOGI(TAG, "Reading table entries from %u", index);
+    size_t offset = table->offset + (size_t)index * table->entry_size;
+    uint32_t fill = MIN(table->capacity, table->count - index);
+    uint32_t per_read = MP4_TABLE_READ / table->entry_size;
+
+    table->first = index;
+    table->fill = 0;
+    for (uint32_t i = 0; i < fill;) {
+        uint32_t entries = MIN(per_read, fill - i);
+        size_t length = (size_t)entries * table->entry_size;
+        size_t read = ctx->read_at(offset + (size_t)i * table->entry_size, stat->table_read, length);
+        if (read == 0 && i == 0) {
+            size_t position = ctx->bytes_elapsed();
+            return ctx->seek(offset) && load_window(ctx, table, index) && ctx->seek(position);
+        }
+
+        if (read != length || store_entries(table, i, stat->table_read, entries) == false)
+            return false;
+        i += entries;
+    }
+
+    table->fill = fill;
+    return true;
+}
+
+static bool table_get(const AudioContext_t* ctx, struct mp4_table* table, uint32_t index, uint32_t* value) {
+    if (index >= table->count)
+        return false;
+
+    if (index - table->first >= table->fill && refill_window(ctx, table, index) == false) {
+        table->fill = 0;
+        return false;
+    }
+
+    memcpy(value, table->window + (size_t)(index - table->first) * table->values, table->values * sizeof(uint32_t));
+    return true;
+}
+
+// Count fields are read with the box header, the entries themselves go into the window
+static bool read_table(const AudioContext_t* ctx, struct mp4_table* table, uint8_t entry_size, uint8_t value_offset,
+                       size_t header_length) {
+    const uint8_t* data;
+    if (ctx->peek(&data, header_length) < header_length)
+        return false;
+
+    table->count = READ_BE32(data + header_length - 4);
+    table->entry_size = entry_size;
+    table->value_offset = value_offset;
+    ctx->consume(header_length);
+    table->offset = ctx->bytes_elapsed();
+
+    return table->count == 0 || load_window(ctx, table, 0);
+}
+
+static bool read_leaf(const AudioContext_t* ctx, uint32_t type, size_t length) {
+    struct mp4_track* track = &stat->track;
+    bool stbl = track->sound && !track->found;
+    const uint8_t* data;
+
+    switch (type) {
+        case FOURCC('m', 'd', 'h', 'd'):
+        case FOURCC('h', 'd', 'l', 'r'):
+        case FOURCC('s', 't', 's', 'd'):
+            if (length > MP4_MAX_LEAF || ctx->peek(&data, length) < length)
+                return false;
+
+            if (type == FOURCC('m', 'd', 'h', 'd'))
+                parse_mdhd(track, data, length);
+            else if (type == FOURCC('h', 'd', 'l', 'r'))
+                parse_hdlr(track, data, length);
+            else
+                parse_stsd(track, data, length);
+            return true;
+        case FOURCC('s', 't', 's', 'z'):
+            if (!stbl)
+                return true;
+            if (ctx->peek(&data, 12) < 12)
+                return false;
+
+            stat->sample_size = READ_BE32(data + 4);
+            stat->sample_count = READ_BE32(data + 8);
+            if (stat->sample_size != 0)
+                return true;
+            return read_table(ctx, &stat->sizes, 4, 0, 12);
+        case FOURCC('s', 't', 'c', 'o'):
+        case FOURCC('c', 'o', '6', '4'):
+            if (!stbl)
+                return true;
+            if (type == FOURCC('c', 'o', '6', '4'))
+                return read_table(ctx, &stat->chunks, 8, 4, 8);
+            return read_table(ctx, &stat->chunks, 4, 0, 8);
+        case FOURCC('s', 't', 's', 'c'):
+            if (!stbl)
+                return true;
+            return read_table(ctx, &stat->stsc, 12, 0, 8);
+        default:
+            return true;
+    }
+}
+
+// Walks the boxes up to end, descending into the ones on the way to the sample tables. Anything not needed is
+// skipped with seek(), so an mdat in front of the moov is jumped over with a Range request.
+static bool read_boxes(const AudioContext_t* ctx, size_t end, bool top_level) {
+    while (ctx->bytes_elapsed() + 8 <= end) {
+        size_t position = ctx->bytes_elapsed();
+        const uint8_t* data;
+        size_t len = ctx->peek(&data, 16);
+        if (len < 8)
+            return false;
+
+        uint64_t size = READ_BE32(data);
+        uint32_t type = READ_BE32(data + 4);
+        size_t header_length = 8;
+        if (size == 1) {
+            if (len < 16)
+                return false;
+            size = ((uint64_t)READ_BE32(data + 8) << 32) | READ_BE32(data + 12);
+            header_length = 16;
+        } else if (size == 0) {
+            size = end - position;
+        }
+
+        if (size < header_length || size > end - position)
+            return false;
+
+        // Fast-start files have their samples straight after the moov
+        if (top_level && type == FOURCC('m', 'd', 'a', 't') && stat->have_moov)
+            return true;
+
+        size_t box_end = position + size;
+        ctx->consume(header_length);
+
+        if (is_container(type)) {
+            if (type == FOURCC('t', 'r', 'a', 'k'))
+                stat->track.sound = false;
+
+            if (read_boxes(ctx, box_end, false) == false)
+                return false;
+
+            if (type == FOURCC('t', 'r', 'a', 'k') && stat->track.sound)
+                stat->track.found = true;
+            if (type == FOURCC('m', 'o', 'o', 'v'))
+                stat->have_moov = true;
+        } else if (read_leaf(ctx, type, box_end - ctx->bytes_elapsed()) == false) {
+            return false;
+        }
+
+        if (ctx->seek(box_end) == false)
+            return false;
+    }
+
+    return true;
+}
+
+// AAC frames are decoded straight from the stream buffers. The ALAC bit reader may look a few bytes past the end
+// of a frame, so ALAC frames, and anything too big for one peek, are gathered into a padded buffer.
+static const uint8_t* read_sample(const AudioContext_t* ctx, size_t size) {
+    const uint8_t* data;
+    if (size <= MP4_MAX_PEEK && stat->track.codec == MP4_CODEC_AAC) {
+        if (ctx->peek(&data, size) < size)
+            return NULL;
+        ctx->consume(size);
+        return data;
+    }
+
+    stat->sample = grow(stat->sample, &stat->sample_capacity, size + ALAC_PADDING);
+    if (stat->sample == NULL)
+        return NULL;
+    memset(stat->sample + size, 0, ALAC_PADDING);
+
+    for (size_t copied = 0; copied < size;) {
+        size_t len = ctx->peek(&data, 0);
+        if (len == 0)
+            return NULL;
+
+        len = MIN(len, size - copied);
+        memcpy(stat->sample + copied, data, len);
+        ctx->consume(len);
+        copied += len;
+    }
+
+    return stat->sample;
+}
+
+static bool start_codec(void) {
+    struct mp4_track* track = &stat->track;
+
+    if (track->codec == MP4_CODEC_AAC) {
+        ESP_LOGI(TAG, "AAC profile %u, %u Hz, %u channels", track->profile, track->sample_rate, track->channels);
+        return helix_set_raw_format(track->channels, track->sample_rate, track->profile);
+    }
+
+    unsigned char sample_size, channels;
+    unsigned int sample_rate, block_size;
+    stat->alac = alac_create_decoder((int)track->cookie_length, track->cookie, &sample_size, &sample_rate, &channels, &block_size);
+    if (stat->alac == NULL || channels == 0 || channels > 2)
+        return false;
+
+    ESP_LOGI(TAG, "ALAC %u bit, %u Hz, %u channels", sample_size, sample_rate, channels);
+    track->channels = channels;
+    track->sample_rate = sample_rate;
+    track->bit_depth = (sample_size + 7) / 8 * 8;
+    stat->alac_frames = block_size;
+
+    stat->pcm = grow(stat->pcm, &stat->pcm_capacity, (size_t)block_size * channels * track->bit_depth / 8);
+    stat->left = grow(stat->left, &stat->left_capacity, block_size * sizeof(int32_t));
+    stat->right = grow(stat->right, &stat->right_capacity, block_size * sizeof(int32_t));
+    return stat->pcm != NULL && stat->left != NULL && stat->right != NULL;
+}
+
+static int decode_sample(const AudioContext_t* ctx, const uint8_t* data, size_t size, bool* run) {
+    struct mp4_track* track = &stat->track;
+    if (track->codec == MP4_CODEC_AAC)
+        return helix_decode_frame(ctx, data, size, run);
+
+    unsigned int frames = 0;
+    if (!alac_to_pcm(stat->alac, (unsigned char*)data, stat->pcm, (char)track->channels, &frames) || frames > stat->alac_frames)
+        return -1;
+
+    pcm_unpack_le(stat->left, stat->right, stat->pcm, frames, track->bit_depth / 8, track->channels);
+    *run = ctx->write(stat->left, track->channels == 1 ? stat->left : stat->right, frames, track->sample_rate, track->bit_depth);
+    return 0;
+}
+
+// Chunks are located through the chunk offset table, so interleaved tracks and padding are skipped
+static bool play_samples(const AudioContext_t* ctx) {
+    uint32_t chunk = 0;
+    uint32_t stsc_i = 0;
+    uint32_t stsc[2];
+    uint32_t left_in_chunk = 0;
+    unsigned int errors = 0;
+    bool run = true;
+
+    // Only ever looking ahead to the next entry keeps the stsc window moving forwards
+    if (table_get(ctx, &stat->stsc, 0, stsc) == false)
+        return false;
+
+    for (uint32_t i = 0; run && i < stat->sample_count; i++) {
+        if (left_in_chunk == 0) {
+            while (stsc_i + 1 < stat->stsc.count) {
+                uint32_t next[2];
+                if (table_get(ctx, &stat->stsc, stsc_i + 1, next) == false)
+                    return false;
+                if (chunk + 1 < next[0])
+                    break;
+                memcpy(stsc, next, sizeof(stsc));
+                stsc_i++;
+            }
+            left_in_chunk = stsc[1];
+
+            uint32_t offset;
+            if (table_get(ctx, &stat->chunks, chunk++, &offset) == false)
+                return false;
+            if (offset != ctx->bytes_elapsed() && ctx->seek(offset) == false)
+                return false;
+        }
+        left_in_chunk--;
+
+        uint32_t size = stat->sample_size;
+        if (size == 0 && table_get(ctx, &stat->sizes, i, &size) == false)
+            return false;
+
+        const uint8_t* data = read_sample(ctx, size);
+        if (data == NULL)
+            return false;
+
+        if (decode_sample(ctx, data, size, &run) != 0) {
+            if (++errors > MP4_MAX_ERRORS)
+                return false;
+            continue;
+        }
+        errors = 0;
+    }
+
+    if (run)
+        ctx->decoder_finished();
+    return true;
+}
+
+void run_mp4_decoder(const AudioContext_t* audio_ctx) {
+    memset(&stat->track, 0, sizeof(stat->track));
+    stat->have_moov = false;
+    stat->sample_size = 0;
+    stat->sample_count = 0;
+    stat->stsc.count = stat->stsc.fill = 0;
+    stat->sizes.count = stat->sizes.fill = 0;
+    stat->chunks.count = stat->chunks.fill = 0;
+
+    if (read_boxes(audio_ctx, audio_ctx->total_bytes(), true) == false || stat->have_moov == false) {
+        if (!input_stopped(audio_ctx)) {
+            ESP_LOGE(TAG, "Could not read the sample tables");
+            audio_ctx->decoder_failed();
+        }
+        return;
+    }
+
+    if (!stat->track.found || stat->track.codec == MP4_CODEC_NONE || stat->stsc.count == 0 || stat->chunks.count == 0) {
+        ESP_LOGE(TAG, "No playable audio track");
+        audio_ctx->decoder_failed();
+        return;
+    }
+
+    if (start_codec() == false) {
+        ESP_LOGE(TAG, "Unsupported codec configuration");
+        audio_ctx->decoder_failed();
+    } else if (play_samples(audio_ctx) == false && !input_stopped(audio_ctx)) {
+        audio_ctx->decoder_failed();
+    }
+
+    if (stat->alac != NULL) {
+        alac_delete_decoder(stat->alac);
+        stat->alac = NULL;
+    }
+}
+
+void delete_mp4_decoder(void) {
+    free(stat->sizes.window);
+    free(stat->chunks.window);
+    free(stat->stsc.window);
+    free(stat->sample);
+    free(stat->pcm);
+    free(stat->left);
+    free(stat->right);
+    free(stat);
+    stat = NULL;
+}
+
+void init_mp4_decoder(void) {
+    init_helix_decoder();
+    if (stat != NULL)
+        return;
+
+    stat = calloc(1, sizeof(struct mp4_stat));
+    assert(stat != NULL);
+
+    stat->sizes = (struct mp4_table){ .capacity = MP4_WINDOW, .values = 1 };
+    stat->chunks = (struct mp4_table){ .capacity = MP4_WINDOW, .values = 1 };
+    stat->stsc = (struct mp4_table){ .capacity = MP4_STSC_WINDOW, .values = 2 };
+    stat->sizes.window = heap_caps_malloc(MP4_WINDOW * sizeof(uint32_t), MALLOC_CAP_SPIRAM);
+    stat->chunks.window = heap_caps_malloc(MP4_WINDOW * sizeof(uint32_t), MALLOC_CAP_SPIRAM);
+    stat->stsc.window = heap_caps_malloc(MP4_STSC_WINDOW * 2 * sizeof(uint32_t), MALLOC_CAP_SPIRAM);
+    assert(stat->sizes.window != NULL && stat->chunks.window != NULL && stat->stsc.window != NULL);
+}
+
+const DecoderWrapper_t mp4_wrapper = {
+        .init = init_mp4_decoder,
+        .probe = probe_mp4_decoder,
+        .run = run_mp4_decoder,
+        .delete = delete_mp4_decoder
+};
@@ -0,0 +1,13 @@
+#ifndef AIRDAC_FIRMWARE_MP4_WRAPPER_H
+#define AIRDAC_FIRMWARE_MP4_WRAPPER_H
+
+#include "audio_common.h"
+
+bool probe_mp4_decoder(const AudioContext_t* audio_ctx, AudioStreamInfo_t* info);
+void run_mp4_decoder(const AudioContext_t* audio_ctx);
+void init_mp4_decoder(void);
+void delete_mp4_decoder(void);
+
+extern const DecoderWrapper_t mp4_wrapper;
+
+#endif //AIRDAC_FIRMWARE_MP4_WRAPPER_H
@@ -0,0 +1,181 @@
+#include "opus_wrapper.h"
+#include "pcm_kernels.h"
+
+#include "codecs/opusfile/opusfile.h"
+
+#include <memory.h>
+#include <stdio.h>
+#include <sys/param.h>
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+
+// Opus always decodes at 48 kHz, whatever rate the encoder was fed
+#define OPUS_RATE           48000
+// 120 ms, the longest packet Opus allows
+#define OPUS_FRAMES         5760
+#define OGG_HEADER_LEN      27
+#define OPUS_MAX_ERRORS     8
+
+static const char TAG[] = "audio_opus";
+
+static struct opus_stat {
+    const AudioContext_t* ctx;
+    opus_int16* pcm;
+    int32_t* left;
+    int32_t* right;
+    int64_t input_us;       // Time spent waiting for input inside libopusfile
+} *stat;
+
+static int read_callback(void* stream, unsigned char* ptr, int nbytes) {
+    const AudioContext_t* ctx = stat->ctx;
+
+    const uint8_t* data;
+    int64_t start = esp_timer_get_time();
+    size_t len = ctx->peek(&data, 0);
+    stat->input_us += esp_timer_get_time() - start;
+
+    len = MIN(len, (size_t)nbytes);
+    memcpy(ptr, data, len);
+    ctx->consume(len);
+    return len;
+}
+
+// Being seekable lets libopusfile find the exact length from the last granule position and bisect on
+// granule positions when seeking. Opening costs one extra request for the end of the file. A live stream has no
+// end to look for, so it is reported as unseekable.
+static int seek_callback(void* stream, opus_int64 offset, int whence) {
+    const AudioContext_t* ctx = stat->ctx;
+    if (ctx->total_bytes() == AUDIO_UNKNOWN_LENGTH)
+        return -1;
+
+    opus_int64 base = whence == SEEK_CUR ? ctx->bytes_elapsed() : whence == SEEK_END ? ctx->total_bytes() : 0;
+    opus_int64 position = base + offset;
+    if (position < 0 || position > ctx->total_bytes())
+        return -1;
+
+    return ctx->seek(position) ? 0 : -1;
+}
+
+static opus_int64 tell_callback(void* stream) {
+    return stat->ctx->bytes_elapsed();
+}
+
+static const OpusFileCallbacks callbacks = {
+        .read = read_callback,
+        .seek = seek_callback,
+        .tell = tell_callback,
+        .close = NULL
+};
+
+// The identification header is the only packet on the first page. It has no bitrate, so the length is
+// left for libopusfile to find once the stream is open.
+bool probe_opus_decoder(const AudioContext_t* audio_ctx, AudioStreamInfo_t* info) {
+    const uint8_t* data;
+    size_t len = audio_ctx->peek(&data, PROBE_LEN);
+    if (len < OGG_HEADER_LEN || memcmp(data, "OggS", 4) != 0)
+        return false;
+
+    size_t packet = OGG_HEADER_LEN + data[26];
+    if (len < packet + 19 || memcmp(data + packet, "OpusHead", 8) != 0)
+        return false;
+
+    info->channels = MIN(data[packet + 9], 2);
+    info->sample_rate = OPUS_RATE;
+    info->bit_depth = 16;
+    return true;
+}
+
+void run_opus_decoder(const AudioContext_t* audio_ctx) {
+    stat->ctx = audio_ctx;
+
+    int err;
+    OggOpusFile* file = op_open_callbacks(NULL, &callbacks, NULL, 0, &err);
+    if (file == NULL) {
+        ESP_LOGE(TAG, "Could not open stream: %d", err);
+        if (!input_stopped(audio_ctx))
+            audio_ctx->decoder_failed();
+        return;
+    }
+
+    int channels = op_channel_count(file, -1);
+    ESP_LOGI(TAG, "%d channels, %lld samples", channels, op_pcm_total(file, -1));
+
+    // Decode time alone, without waiting on input or output, for the cost per channel logged at the end
+    int64_t decode_us = 0;
+    uint64_t decoded = 0;
+    unsigned int errors = 0;
+    bool run = true;
+    while (run) {
+        uint32_t position_ms;
+        if (audio_ctx->seek_pending(&position_ms)) {
+            ogg_int64_t sample = (ogg_int64_t)position_ms * (OPUS_RATE / 1000);
+            if (op_pcm_seek(file, sample) == 0)
+                audio_ctx->seek_done(sample, OPUS_RATE);
+        }
+
+        // Downmixes surround streams and duplicates mono, so every link comes out as stereo
+        int64_t start = esp_timer_get_time();
+        stat->input_us = 0;
+        int frames = op_read_stereo(file, stat->pcm, OPUS_FRAMES * 2);
+        decode_us += esp_timer_get_time() - start - stat->input_us;
+
+        if (frames < 0) {
+            ESP_LOGW(TAG, "Skipping damaged packet: %d", frames);
+            if (++errors > OPUS_MAX_ERRORS) {
+                audio_ctx->decoder_failed();
+                break;
+            }
+            continue;
+        }
+        errors = 0;
+
+        if (frames == 0) {
+            if (audio_ctx->eof())
+                audio_ctx->decoder_finished();
+            break;
+        }
+
+        decoded += frames;
+        pcm_unpack_le(stat->left, stat->right, (const uint8_t*)stat->pcm, frames, 2, 2);
+        run = audio_ctx->write(stat->left, stat->right, frames, OPUS_RATE, 16);
+    }
+
+    // Page parsing and the stereo downmix are included, as every stream pays for them
+    if (decoded != 0 && channels > 0) {
+        ESP_LOGI(TAG, "Decoding took %lld us per second of audio per channel",
+                 decode_us * OPUS_RATE / (int64_t)decoded / channels);
+    }
+
+    op_free(file);
+}
+
+void delete_opus_decoder(void) {
+    free(stat->pcm);
+    free(stat->left);
+    free(stat->right);
+    free(stat);
+    stat = NULL;
+}
+
+void init_opus_decoder(void) {
+    if (stat != NULL)
+        return;
+
+    stat = calloc(1, sizeof(struct opus_stat));
+    assert(stat != NULL);
+
+    stat->pcm = heap_caps_malloc(OPUS_FRAMES * 2 * sizeof(opus_int16), MALLOC_CAP_SPIRAM);
+    stat->left = heap_caps_malloc(OPUS_FRAMES * sizeof(int32_t), MALLOC_CAP_SPIRAM);
+    stat->right = heap_caps_malloc(OPUS_FRAMES * sizeof(int32_t), MALLOC_CAP_SPIRAM);
+    assert(stat->pcm != NULL && stat->left != NULL && stat->right != NULL);
+}
+
+const DecoderWrapper_t opus_wrapper = {
+        .init = init_opus_decoder,
+        .probe = probe_opus_decoder,
+        .run = run_opus_decoder,
+        .delete = delete_opus_decoder,
+        .seekable = true
+};
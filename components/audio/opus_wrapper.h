@@ -0,0 +1,13 @@
+#ifndef AIRDAC_FIRMWARE_OPUS_WRAPPER_H
+#define AIRDAC_FIRMWARE_OPUS_WRAPPER_H
+
+#include "audio_common.h"
+
+bool probe_opus_decoder(const AudioContext_t* audio_ctx, AudioStreamInfo_t* info);
+void run_opus_decoder(const AudioContext_t* audio_ctx);
+void init_opus_decoder(void);
+void delete_opus_decoder(void);
+
+extern const DecoderWrapper_t opus_wrapper;
+
+#endif //AIRDAC_FIRMWARE_OPUS_WRAPPER_H
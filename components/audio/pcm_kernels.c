@@ -0,0 +1,300 @@
+#include "pcm_kernels.h"
+
+#include <math.h>
+#include <string.h>
+
+// The loops are unrolled by four so the compiler can keep the Xtensa pipeline busy.
+// The ESP32 has no SIMD unit, so this portable path is the only one for now.
+
+#define Q31_MUL(_a, _b) ((int32_t)(((int64_t)(_a) * (_b)) >> 31))
+
+unsigned int pcm_normalize_shift(unsigned int bit_depth) {
+    if (bit_depth == 0 || bit_depth >= 32)
+        return 0;
+
+    return 32 - bit_depth;
+}
+
+void pcm_interleave(int32_t* out, const int32_t* left, const int32_t* right, size_t frames, unsigned int shift) {
+    if (left == right) {
+        pcm_mono_to_stereo(out, left, frames, shift);
+        return;
+    }
+
+    size_t i = 0;
+    for (; i + 4 <= frames; i += 4) {
+        out[0] = left[i] << shift;
+        out[1] = right[i] << shift;
+        out[2] = left[i+1] << shift;
+        out[3] = right[i+1] << shift;
+        out[4] = left[i+2] << shift;
+        out[5] = right[i+2] << shift;
+        out[6] = left[i+3] << shift;
+        out[7] = right[i+3] << shift;
+        out += 8;
+    }
+
+    for (; i < frames; i++) {
+        *out++ = left[i] << shift;
+        *out++ = right[i] << shift;
+    }
+}
+
+void pcm_mono_to_stereo(int32_t* out, const int32_t* mono, size_t frames, unsigned int shift) {
+    size_t i = 0;
+    for (; i + 4 <= frames; i += 4) {
+        int32_t s0 = mono[i] << shift;
+        int32_t s1 = mono[i+1] << shift;
+        int32_t s2 = mono[i+2] << shift;
+        int32_t s3 = mono[i+3] << shift;
+        out[0] = s0;
+        out[1] = s0;
+        out[2] = s1;
+        out[3] = s1;
+        out[4] = s2;
+        out[5] = s2;
+        out[6] = s3;
+        out[7] = s3;
+        out += 8;
+    }
+
+    for (; i < frames; i++) {
+        int32_t s = mono[i] << shift;
+        *out++ = s;
+        *out++ = s;
+    }
+}
+
+void pcm_copy_gain(int32_t* out, const int32_t* in, size_t frames, int32_t gain, int32_t step) {
+    size_t i = 0;
+    for (; i + 4 <= frames; i += 4) {
+        int32_t g1 = gain + step;
+        int32_t g2 = g1 + step;
+        int32_t g3 = g2 + step;
+        out[0] = Q31_MUL(in[0], gain);
+        out[1] = Q31_MUL(in[1], gain);
+        out[2] = Q31_MUL(in[2], g1);
+        out[3] = Q31_MUL(in[3], g1);
+        out[4] = Q31_MUL(in[4], g2);
+        out[5] = Q31_MUL(in[5], g2);
+        out[6] = Q31_MUL(in[6], g3);
+        out[7] = Q31_MUL(in[7], g3);
+        gain = g3 + step;
+        in += 8;
+        out += 8;
+    }
+
+    for (; i < frames; i++) {
+        *out++ = Q31_MUL(*in++, gain);
+        *out++ = Q31_MUL(*in++, gain);
+        gain += step;
+    }
+}
+
+static inline int16_t round_16(int32_t sample) {
+    if (sample >= INT32_MAX - 0x7FFF)
+        return INT16_MAX;
+
+    return (sample + 0x8000) >> 16;
+}
+
+void pcm_pack_16(int16_t* out, const int32_t* in, size_t samples) {
+    size_t i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        out[i] = round_16(in[i]);
+        out[i+1] = round_16(in[i+1]);
+        out[i+2] = round_16(in[i+2]);
+        out[i+3] = round_16(in[i+3]);
+    }
+
+    for (; i < samples; i++)
+        out[i] = round_16(in[i]);
+}
+
+void pcm_pack_16_gain(int16_t* out, const int32_t* in, size_t frames, int32_t gain, int32_t step) {
+    size_t i = 0;
+    for (; i + 4 <= frames; i += 4) {
+        int32_t g1 = gain + step;
+        int32_t g2 = g1 + step;
+        int32_t g3 = g2 + step;
+        out[0] = round_16(Q31_MUL(in[0], gain));
+        out[1] = round_16(Q31_MUL(in[1], gain));
+        out[2] = round_16(Q31_MUL(in[2], g1));
+        out[3] = round_16(Q31_MUL(in[3], g1));
+        out[4] = round_16(Q31_MUL(in[4], g2));
+        out[5] = round_16(Q31_MUL(in[5], g2));
+        out[6] = round_16(Q31_MUL(in[6], g3));
+        out[7] = round_16(Q31_MUL(in[7], g3));
+        gain = g3 + step;
+        in += 8;
+        out += 8;
+    }
+
+    for (; i < frames; i++) {
+        *out++ = round_16(Q31_MUL(*in++, gain));
+        *out++ = round_16(Q31_MUL(*in++, gain));
+        gain += step;
+    }
+}
+
+// Attenuation is split into whole decibels and 1/256 dB steps, so two small tables cover
+// the whole range at full resolution: gain = coarse[dB] * fine[fraction].
+#define GAIN_COARSE_STEPS   (-PCM_GAIN_MIN_DB / 256 + 1)
+#define GAIN_FINE_STEPS     256
+
+static int32_t gain_coarse[GAIN_COARSE_STEPS];
+static int32_t gain_fine[GAIN_FINE_STEPS];
+
+static inline int32_t db_to_q31(double db) {
+    return (int32_t)lround(pow(10.0, db / 20.0) * INT32_MAX);
+}
+
+void pcm_gain_init(void) {
+    for (int i = 0; i < GAIN_COARSE_STEPS; i++)
+        gain_coarse[i] = db_to_q31(-i);
+
+    for (int i = 0; i < GAIN_FINE_STEPS; i++)
+        gain_fine[i] = db_to_q31(-i / 256.0);
+}
+
+int32_t pcm_gain_from_db(int volume_db) {
+    if (volume_db >= 0)
+        return PCM_GAIN_UNITY;
+    if (volume_db < PCM_GAIN_MIN_DB)
+        return 0;
+
+    unsigned int attenuation = -volume_db;
+    return Q31_MUL(gain_coarse[attenuation >> 8], gain_fine[attenuation & 0xFF]);
+}
+
+static void unpack_le16(int32_t* left, int32_t* right, const uint8_t* in, size_t frames, unsigned int channels) {
+    for (size_t i = 0; i < frames; i++) {
+        left[i] = (int16_t)(in[0] | (in[1] << 8));
+        if (channels > 1)
+            right[i] = (int16_t)(in[2] | (in[3] << 8));
+        in += 2*channels;
+    }
+}
+
+static void unpack_le24(int32_t* left, int32_t* right, const uint8_t* in, size_t frames, unsigned int channels) {
+    for (size_t i = 0; i < frames; i++) {
+        left[i] = (int32_t)((in[0] << 8) | (in[1] << 16) | ((uint32_t)in[2] << 24)) >> 8;
+        if (channels > 1)
+            right[i] = (int32_t)((in[3] << 8) | (in[4] << 16) | ((uint32_t)in[5] << 24)) >> 8;
+        in += 3*channels;
+    }
+}
+
+static void unpack_le32(int32_t* left, int32_t* right, const uint8_t* in, size_t frames, unsigned int channels) {
+    for (size_t i = 0; i < frames; i++) {
+        left[i] = (int32_t)(in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32_t)in[3] << 24));
+        if (channels > 1)
+            right[i] = (int32_t)(in[4] | (in[5] << 8) | (in[6] << 16) | ((uint32_t)in[7] << 24));
+        in += 4*channels;
+    }
+}
+
+void pcm_unpack_le(int32_t* left, int32_t* right, const uint8_t* in, size_t frames, unsigned int bytes_per_sample, unsigned int channels) {
+    switch (bytes_per_sample) {
+        case 1:
+            // 8-bit PCM is unsigned
+            for (size_t i = 0; i < frames; i++) {
+                left[i] = (int32_t)in[0] - 128;
+                if (channels > 1)
+                    right[i] = (int32_t)in[1] - 128;
+                in += channels;
+            }
+            break;
+        case 2:
+            unpack_le16(left, right, in, frames, channels);
+            break;
+        case 3:
+            unpack_le24(left, right, in, frames, channels);
+            break;
+        case 4:
+            unpack_le32(left, right, in, frames, channels);
+            break;
+        default:
+            break;
+    }
+}
+
+static void unpack_be16(int32_t* left, int32_t* right, const uint8_t* in, size_t frames, unsigned int channels) {
+    for (size_t i = 0; i < frames; i++) {
+        left[i] = (int16_t)((in[0] << 8) | in[1]);
+        if (channels > 1)
+            right[i] = (int16_t)((in[2] << 8) | in[3]);
+        in += 2*channels;
+    }
+}
+
+static void unpack_be24(int32_t* left, int32_t* right, const uint8_t* in, size_t frames, unsigned int channels) {
+    for (size_t i = 0; i < frames; i++) {
+        left[i] = (int32_t)(((uint32_t)in[0] << 24) | (in[1] << 16) | (in[2] << 8)) >> 8;
+        if (channels > 1)
+            right[i] = (int32_t)(((uint32_t)in[3] << 24) | (in[4] << 16) | (in[5] << 8)) >> 8;
+        in += 3*channels;
+    }
+}
+
+static void unpack_be32(int32_t* left, int32_t* right, const uint8_t* in, size_t frames, unsigned int channels) {
+    for (size_t i = 0; i < frames; i++) {
+        left[i] = (int32_t)(((uint32_t)in[0] << 24) | (in[1] << 16) | (in[2] << 8) | in[3]);
+        if (channels > 1)
+            right[i] = (int32_t)(((uint32_t)in[4] << 24) | (in[5] << 16) | (in[6] << 8) | in[7]);
+        in += 4*channels;
+    }
+}
+
+void pcm_unpack_be(int32_t* left, int32_t* right, const uint8_t* in, size_t frames, unsigned int bytes_per_sample, unsigned int channels) {
+    switch (bytes_per_sample) {
+        case 1:
+            // Unlike WAV, 8-bit AIFF is signed
+            for (size_t i = 0; i < frames; i++) {
+                left[i] = (int8_t)in[0];
+                if (channels > 1)
+                    right[i] = (int8_t)in[1];
+                in += channels;
+            }
+            break;
+        case 2:
+            unpack_be16(left, right, in, frames, channels);
+            break;
+        case 3:
+            unpack_be24(left, right, in, frames, channels);
+            break;
+        case 4:
+            unpack_be32(left, right, in, frames, channels);
+            break;
+        default:
+            break;
+    }
+}
+
+static inline int32_t float_to_q31(uint32_t bits) {
+    float sample;
+    memcpy(&sample, &bits, sizeof(sample));
+
+    if (sample != sample)
+        return 0;
+    if (sample >= 1.0f)
+        return INT32_MAX;
+    if (sample <= -1.0f)
+        return INT32_MIN;
+    return (int32_t)(sample * 2147483648.0f);
+}
+
+static inline uint32_t read_float_bits(const uint8_t* in, bool big_endian) {
+    if (big_endian)
+        return ((uint32_t)in[0] << 24) | (in[1] << 16) | (in[2] << 8) | in[3];
+    return ((uint32_t)in[3] << 24) | (in[2] << 16) | (in[1] << 8) | in[0];
+}
+
+void pcm_unpack_float(int32_t* left, int32_t* right, const uint8_t* in, size_t frames, unsigned int channels, bool big_endian) {
+    for (size_t i = 0; i < frames; i++) {
+        left[i] = float_to_q31(read_float_bits(in, big_endian));
+        if (channels > 1)
+            right[i] = float_to_q31(read_float_bits(in + 4, big_endian));
+        in += 4*channels;
+    }
+}
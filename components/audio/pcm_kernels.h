@@ -0,0 +1,38 @@
+#ifndef AIRDAC_FIRMWARE_PCM_KERNELS_H
+#define AIRDAC_FIRMWARE_PCM_KERNELS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Left shift that brings a sample of the given bit depth up to 32-bit full scale
+unsigned int pcm_normalize_shift(unsigned int bit_depth);
+
+// Output is interleaved stereo 32-bit. left and right may point to the same buffer.
+void pcm_interleave(int32_t* out, const int32_t* left, const int32_t* right, size_t frames, unsigned int shift);
+void pcm_mono_to_stereo(int32_t* out, const int32_t* mono, size_t frames, unsigned int shift);
+
+// Interleaved stereo frames scaled by gain, which is Q31 (INT32_MAX is unity) and moves by step after every frame
+void pcm_copy_gain(int32_t* out, const int32_t* in, size_t frames, int32_t gain, int32_t step);
+
+// Interleaved 32-bit samples to 16-bit, rounded to nearest and saturated. Exact for 16-bit sources at unity gain.
+void pcm_pack_16(int16_t* out, const int32_t* in, size_t samples);
+// Both of the above in one pass, for stereo frames
+void pcm_pack_16_gain(int16_t* out, const int32_t* in, size_t frames, int32_t gain, int32_t step);
+
+#define PCM_GAIN_UNITY      INT32_MAX
+#define PCM_GAIN_MIN_DB     (-5120)
+
+// Volume is in 1/256 dB like RenderingControl's VolumeDB. Anything below PCM_GAIN_MIN_DB is silence.
+void pcm_gain_init(void);
+int32_t pcm_gain_from_db(int volume_db);
+
+// Packed little-endian integer PCM to planar samples in the low bits. right is ignored for mono, and only the
+// first two channels are taken from anything wider.
+void pcm_unpack_le(int32_t* left, int32_t* right, const uint8_t* in, size_t frames, unsigned int bytes_per_sample, unsigned int channels);
+// As above for big-endian PCM, where 8-bit samples are signed
+void pcm_unpack_be(int32_t* left, int32_t* right, const uint8_t* in, size_t frames, unsigned int bytes_per_sample, unsigned int channels);
+// 32-bit IEEE float PCM to 32-bit full scale, clipped at +-1.0
+void pcm_unpack_float(int32_t* left, int32_t* right, const uint8_t* in, size_t frames, unsigned int channels, bool big_endian);
+
+#endif //AIRDAC_FIRMWARE_PCM_KERNELS_H
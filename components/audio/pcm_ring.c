@@ -0,0 +1,94 @@
+#include "pcm_ring.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <sys/param.h>
+
+#include <esp_heap_caps.h>
+
+PcmRing_t* pcm_ring_create(size_t min_frames) {
+    uint32_t capacity = 1;
+    while (capacity < min_frames)
+        capacity <<= 1;
+
+    PcmRing_t* ring = malloc(sizeof(PcmRing_t));
+    assert(ring != NULL);
+
+    ring->frames = heap_caps_malloc(capacity * PCM_RING_CHANNELS * sizeof(int32_t), MALLOC_CAP_SPIRAM);
+    assert(ring->frames != NULL);
+
+    ring->capacity = capacity;
+    ring->mask = capacity - 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->underruns, 0);
+    return ring;
+}
+
+void pcm_ring_delete(PcmRing_t* ring) {
+    free(ring->frames);
+    free(ring);
+}
+
+size_t pcm_ring_write_begin(PcmRing_t* ring, int32_t** frames) {
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    uint32_t free_frames = ring->capacity - (head - tail);
+    uint32_t index = head & ring->mask;
+
+    *frames = ring->frames + index * PCM_RING_CHANNELS;
+    return MIN(free_frames, ring->capacity - index);
+}
+
+void pcm_ring_write_end(PcmRing_t* ring, size_t frames) {
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    atomic_store_explicit(&ring->head, head + frames, memory_order_release);
+}
+
+size_t pcm_ring_read_begin(PcmRing_t* ring, const int32_t** frames) {
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    uint32_t used_frames = head - tail;
+    uint32_t index = tail & ring->mask;
+
+    *frames = ring->frames + index * PCM_RING_CHANNELS;
+    return MIN(used_frames, ring->capacity - index);
+}
+
+void pcm_ring_read_end(PcmRing_t* ring, size_t frames) {
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    atomic_store_explicit(&ring->tail, tail + frames, memory_order_release);
+}
+
+void pcm_ring_flush(PcmRing_t* ring) {
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    atomic_store_explicit(&ring->tail, head, memory_order_release);
+}
+
+void pcm_ring_count_underrun(PcmRing_t* ring) {
+    atomic_fetch_add_explicit(&ring->underruns, 1, memory_order_relaxed);
+}
+
+size_t pcm_ring_fill(const PcmRing_t* ring) {
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    return head - tail;
+}
+
+size_t pcm_ring_free(const PcmRing_t* ring) {
+    return ring->capacity - pcm_ring_fill(ring);
+}
+
+uint32_t pcm_ring_underruns(const PcmRing_t* ring) {
+    return atomic_load_explicit(&ring->underruns, memory_order_relaxed);
+}
+
+uint32_t pcm_ring_written(const PcmRing_t* ring) {
+    return atomic_load_explicit(&ring->head, memory_order_acquire);
+}
+
+uint32_t pcm_ring_read(const PcmRing_t* ring) {
+    return atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
@@ -0,0 +1,45 @@
+#ifndef AIRDAC_FIRMWARE_PCM_RING_H
+#define AIRDAC_FIRMWARE_PCM_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#define PCM_RING_CHANNELS 2
+
+// Single-producer/single-consumer ring of interleaved stereo 32-bit frames.
+// The producer only moves head and the consumer only moves tail, so neither side takes a lock.
+struct PcmRing {
+    int32_t* frames;
+    uint32_t capacity;
+    uint32_t mask;
+    atomic_uint_least32_t head;
+    atomic_uint_least32_t tail;
+    atomic_uint_least32_t underruns;
+};
+typedef struct PcmRing PcmRing_t;
+
+// Capacity is rounded up to a power of two so the free-running counters can wrap
+PcmRing_t* pcm_ring_create(size_t min_frames);
+void pcm_ring_delete(PcmRing_t* ring);
+
+// Producer side
+size_t pcm_ring_write_begin(PcmRing_t* ring, int32_t** frames);
+void pcm_ring_write_end(PcmRing_t* ring, size_t frames);
+
+// Consumer side
+size_t pcm_ring_read_begin(PcmRing_t* ring, const int32_t** frames);
+void pcm_ring_read_end(PcmRing_t* ring, size_t frames);
+void pcm_ring_flush(PcmRing_t* ring);
+void pcm_ring_count_underrun(PcmRing_t* ring);
+
+// Either side
+size_t pcm_ring_fill(const PcmRing_t* ring);
+size_t pcm_ring_free(const PcmRing_t* ring);
+uint32_t pcm_ring_underruns(const PcmRing_t* ring);
+// Free-running frame counts, for marking a place in the stream of frames that passes through the ring
+uint32_t pcm_ring_written(const PcmRing_t* ring);
+uint32_t pcm_ring_read(const PcmRing_t* ring);
+
+#endif //AIRDAC_FIRMWARE_PCM_RING_H
@@ -0,0 +1,176 @@
+#include "resampler.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/param.h>
+
+#define RESAMPLER_BLOCK     256
+#define COEFFICIENT_BITS    28
+#define PASSBAND            0.92
+
+static unsigned int gcd(unsigned int a, unsigned int b) {
+    while (b != 0) {
+        unsigned int t = a % b;
+        a = b;
+        b = t;
+    }
+
+    return a;
+}
+
+static double bessel_i0(double x) {
+    double sum = 1.0;
+    double term = 1.0;
+    for (int k = 1; k < 32; k++) {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+    }
+
+    return sum;
+}
+
+// Longer filters get a wider Kaiser window for a deeper stopband
+static double kaiser_beta(unsigned int taps) {
+    if (taps <= 16)
+        return 6.0;
+    if (taps <= 32)
+        return 8.0;
+    return 10.0;
+}
+
+// Windowed-sinc prototype at up times the input rate, split into up phases.
+// Each phase is stored oldest sample first so the inner loop walks both arrays forwards.
+static void design_filter(Resampler_t* resampler, unsigned int output_taps) {
+    unsigned int up = resampler->up;
+    unsigned int taps = resampler->taps;
+    size_t length = (size_t)taps * up;
+
+    double cutoff = PASSBAND * 0.5 / MAX(up, resampler->down);
+    double beta = kaiser_beta(output_taps);
+    double centre = (length - 1) / 2.0;
+
+    for (unsigned int p = 0; p < up; p++) {
+        for (unsigned int m = 0; m < taps; m++) {
+            size_t j = (size_t)up * (taps - 1 - m) + p;
+            double t = j - centre;
+            double sinc = t == 0 ? 2.0 * cutoff : sin(2.0 * M_PI * cutoff * t) / (M_PI * t);
+            double x = 2.0 * j / (length - 1) - 1.0;
+            double window = bessel_i0(beta * sqrt(MAX(0.0, 1.0 - x * x))) / bessel_i0(beta);
+
+            double h = sinc * window * up;
+            resampler->coefficients[p * taps + m] = (int32_t)lround(h * (1 << COEFFICIENT_BITS));
+        }
+    }
+}
+
+Resampler_t* resampler_create(unsigned int in_rate, unsigned int out_rate, unsigned int taps) {
+    Resampler_t* resampler = malloc(sizeof(Resampler_t));
+    assert(resampler != NULL);
+
+    unsigned int divisor = gcd(in_rate, out_rate);
+    resampler->in_rate = in_rate;
+    resampler->out_rate = out_rate;
+    resampler->up = out_rate / divisor;
+    resampler->down = in_rate / divisor;
+
+    // The filter has to span the same time whatever the ratio, so it grows when decimating
+    resampler->taps = MAX(taps, (taps * resampler->down + resampler->up - 1) / resampler->up);
+
+    resampler->coefficients = malloc(resampler->up * resampler->taps * sizeof(int32_t));
+    assert(resampler->coefficients != NULL);
+    design_filter(resampler, taps);
+
+    size_t capacity = resampler->taps - 1 + RESAMPLER_BLOCK;
+    for (int ch = 0; ch < 2; ch++) {
+        resampler->history[ch] = malloc(capacity * sizeof(int32_t));
+        assert(resampler->history[ch] != NULL);
+    }
+
+    resampler_reset(resampler);
+    return resampler;
+}
+
+void resampler_delete(Resampler_t* resampler) {
+    free(resampler->history[0]);
+    free(resampler->history[1]);
+    free(resampler->coefficients);
+    free(resampler);
+}
+
+// History starts as silence so the first output lines up with the first input sample
+void resampler_reset(Resampler_t* resampler) {
+    resampler->fill = resampler->taps - 1;
+    resampler->phase = 0;
+    memset(resampler->history[0], 0, resampler->fill * sizeof(int32_t));
+    memset(resampler->history[1], 0, resampler->fill * sizeof(int32_t));
+}
+
+static inline int32_t filter(const int32_t* coefficients, const int32_t* samples, unsigned int taps) {
+    int64_t acc = 0;
+    unsigned int k = 0;
+    for (; k + 4 <= taps; k += 4) {
+        acc += (int64_t)coefficients[k] * samples[k];
+        acc += (int64_t)coefficients[k+1] * samples[k+1];
+        acc += (int64_t)coefficients[k+2] * samples[k+2];
+        acc += (int64_t)coefficients[k+3] * samples[k+3];
+    }
+
+    for (; k < taps; k++)
+        acc += (int64_t)coefficients[k] * samples[k];
+
+    acc >>= COEFFICIENT_BITS;
+    if (acc > INT32_MAX)
+        return INT32_MAX;
+    if (acc < INT32_MIN)
+        return INT32_MIN;
+    return (int32_t)acc;
+}
+
+size_t resampler_process(Resampler_t* resampler, const int32_t* left, const int32_t* right, size_t* in_frames,
+                         int32_t* out_left, int32_t* out_right, size_t out_frames, unsigned int shift) {
+    bool mono = left == right;
+    unsigned int taps = resampler->taps;
+    size_t capacity = taps - 1 + RESAMPLER_BLOCK;
+    size_t in_used = 0;
+    size_t produced = 0;
+
+    while (1) {
+        size_t pos = 0;
+        while (produced < out_frames && pos + taps <= resampler->fill) {
+            const int32_t* coefficients = resampler->coefficients + resampler->phase * taps;
+            out_left[produced] = filter(coefficients, resampler->history[0] + pos, taps);
+            if (!mono)
+                out_right[produced] = filter(coefficients, resampler->history[1] + pos, taps);
+            produced++;
+
+            resampler->phase += resampler->down;
+            pos += resampler->phase / resampler->up;
+            resampler->phase %= resampler->up;
+        }
+
+        resampler->fill -= pos;
+        memmove(resampler->history[0], resampler->history[0] + pos, resampler->fill * sizeof(int32_t));
+        memmove(resampler->history[1], resampler->history[1] + pos, resampler->fill * sizeof(int32_t));
+
+        size_t len = MIN(capacity - resampler->fill, *in_frames - in_used);
+        if (produced == out_frames || len == 0)
+            break;
+
+        // Mono is copied into both channels so the history stays valid if the next track is stereo
+        int32_t* history_left = resampler->history[0] + resampler->fill;
+        int32_t* history_right = resampler->history[1] + resampler->fill;
+        for (size_t i = 0; i < len; i++) {
+            history_left[i] = left[in_used + i] << shift;
+            history_right[i] = right[in_used + i] << shift;
+        }
+
+        resampler->fill += len;
+        in_used += len;
+    }
+
+    *in_frames = in_used;
+    return produced;
+}
@@ -0,0 +1,32 @@
+#ifndef AIRDAC_FIRMWARE_RESAMPLER_H
+#define AIRDAC_FIRMWARE_RESAMPLER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Rational polyphase low-pass resampler for planar 32-bit samples.
+// taps is the filter length in output samples, which sets both the stopband and the CPU cost.
+struct Resampler {
+    unsigned int in_rate;
+    unsigned int out_rate;
+    unsigned int up;
+    unsigned int down;
+    unsigned int taps;          // Per phase, in input samples
+    int32_t* coefficients;      // up phases of taps each, Q28
+    int32_t* history[2];
+    size_t fill;
+    unsigned int phase;
+};
+typedef struct Resampler Resampler_t;
+
+Resampler_t* resampler_create(unsigned int in_rate, unsigned int out_rate, unsigned int taps);
+void resampler_delete(Resampler_t* resampler);
+void resampler_reset(Resampler_t* resampler);
+
+// Samples are shifted left by shift before filtering, so the output is 32-bit full scale.
+// *in_frames is updated to the number of input frames consumed. left and right may point to the same buffer,
+// in which case only out_left is written. Returns the number of output frames written.
+size_t resampler_process(Resampler_t* resampler, const int32_t* left, const int32_t* right, size_t* in_frames,
+                         int32_t* out_left, int32_t* out_right, size_t out_frames, unsigned int shift);
+
+#endif //AIRDAC_FIRMWARE_RESAMPLER_H
@@ -0,0 +1,159 @@
+#include "vorbis_wrapper.h"
+
+#include "codecs/vorbis/ivorbisfile.h"
+
+#include <memory.h>
+#include <sys/param.h>
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+// Tremor's samples are fixed point with 1.0 at bit 24, the same scale ov_read() shifts down to 16 bits
+#define VORBIS_BIT_DEPTH    25
+#define VORBIS_MAX_SAMPLE   ((1 << (VORBIS_BIT_DEPTH - 1)) - 1)
+#define OGG_HEADER_LEN      27
+#define VORBIS_MAX_ERRORS   8
+
+static const char TAG[] = "audio_vorbis";
+
+static struct vorbis_stat {
+    OggVorbis_File file;
+    const AudioContext_t* ctx;
+    int64_t input_us;       // Time spent waiting for input inside Tremor
+} *stat;
+
+static size_t read_callback(void* ptr, size_t size, size_t nmemb, void* datasource) {
+    const AudioContext_t* ctx = stat->ctx;
+
+    const uint8_t* data;
+    int64_t start = esp_timer_get_time();
+    size_t len = ctx->peek(&data, 0);
+    stat->input_us += esp_timer_get_time() - start;
+
+    len = MIN(len, size * nmemb);
+    memcpy(ptr, data, len);
+    ctx->consume(len);
+    return len;
+}
+
+// Reporting the stream as unseekable stops Tremor from scanning to the end of the file for its length
+static int seek_callback(void* datasource, ogg_int64_t offset, int whence) {
+    return -1;
+}
+
+static const ov_callbacks callbacks = {
+        .read_func = read_callback,
+        .seek_func = seek_callback,
+        .close_func = NULL,
+        .tell_func = NULL
+};
+
+// The identification header is the only packet on the first page. Its nominal bitrate gives a length estimate.
+bool probe_vorbis_decoder(const AudioContext_t* audio_ctx, AudioStreamInfo_t* info) {
+    const uint8_t* data;
+    size_t len = audio_ctx->peek(&data, PROBE_LEN);
+    if (len < OGG_HEADER_LEN || memcmp(data, "OggS", 4) != 0)
+        return false;
+
+    size_t packet = OGG_HEADER_LEN + data[26];
+    if (len < packet + 28 || memcmp(data + packet, "\x01vorbis", 7) != 0)
+        return false;
+
+    const uint8_t* id = data + packet + 7;
+    info->channels = id[4];
+    info->sample_rate = READ_LE32(id + 5);
+    info->bit_depth = VORBIS_BIT_DEPTH;
+
+    uint32_t bitrate = READ_LE32(id + 13);
+    if (bitrate != 0 && bitrate < INT32_MAX && audio_ctx->total_bytes() != AUDIO_UNKNOWN_LENGTH)
+        info->total_samples = (uint64_t)audio_ctx->total_bytes() * 8 * info->sample_rate / bitrate;
+    return true;
+}
+
+void run_vorbis_decoder(const AudioContext_t* audio_ctx) {
+    stat->ctx = audio_ctx;
+
+    int err = ov_open_callbacks(NULL, &stat->file, NULL, 0, callbacks);
+    if (err != 0) {
+        ESP_LOGE(TAG, "Could not open stream: %d", err);
+        if (!input_stopped(audio_ctx))
+            audio_ctx->decoder_failed();
+        return;
+    }
+
+    vorbis_info* info = ov_info(&stat->file, -1);
+    ESP_LOGI(TAG, "%ld Hz, %d channels", info->rate, info->channels);
+
+    // Decode time alone, without waiting on input or output, for the cost per channel logged at the end
+    int64_t decode_us = 0;
+    uint64_t decoded = 0;
+    unsigned int errors = 0;
+    bool run = true;
+    while (run) {
+        // A zero length read decodes the next packet but leaves its samples in the decoder, where
+        // they can be taken at full precision instead of being clipped to 16 bits
+        int64_t start = esp_timer_get_time();
+        stat->input_us = 0;
+        long ret = ov_read(&stat->file, NULL, 0, NULL);
+        if (ret < 0) {
+            ESP_LOGW(TAG, "Skipping damaged packet: %ld", ret);
+            if (++errors > VORBIS_MAX_ERRORS) {
+                audio_ctx->decoder_failed();
+                break;
+            }
+            continue;
+        }
+        errors = 0;
+
+        ogg_int32_t** pcm;
+        int samples = vorbis_synthesis_pcmout(&stat->file.vd, &pcm);
+        if (samples <= 0) {
+            if (audio_ctx->eof())
+                audio_ctx->decoder_finished();
+            break;
+        }
+
+        // Chained streams can change format at a link boundary
+        info = ov_info(&stat->file, -1);
+        int channels = MIN(info->channels, 2);
+        for (int ch = 0; ch < channels; ch++) {
+            for (int i = 0; i < samples; i++)
+                pcm[ch][i] = MAX(-VORBIS_MAX_SAMPLE, MIN(VORBIS_MAX_SAMPLE, pcm[ch][i]));
+        }
+        decode_us += esp_timer_get_time() - start - stat->input_us;
+        decoded += samples;
+
+        const int32_t* left = (const int32_t*)pcm[0];
+        const int32_t* right = channels == 1 ? left : (const int32_t*)pcm[1];
+        run = audio_ctx->write(left, right, samples, info->rate, VORBIS_BIT_DEPTH);
+        vorbis_synthesis_read(&stat->file.vd, samples);
+    }
+
+    // Tremor decodes every channel, though only two are played. The clipping is included, as every stream pays for it.
+    if (decoded != 0 && info->channels > 0) {
+        ESP_LOGI(TAG, "Decoding took %lld us per second of audio per channel",
+                 decode_us * info->rate / (int64_t)decoded / info->channels);
+    }
+
+    ov_clear(&stat->file);
+}
+
+void delete_vorbis_decoder(void) {
+    free(stat);
+    stat = NULL;
+}
+
+void init_vorbis_decoder(void) {
+    if (stat != NULL)
+        return;
+
+    stat = calloc(1, sizeof(struct vorbis_stat));
+    assert(stat != NULL);
+}
+
+const DecoderWrapper_t vorbis_wrapper = {
+        .init = init_vorbis_decoder,
+        .probe = probe_vorbis_decoder,
+        .run = run_vorbis_decoder,
+        .delete = delete_vorbis_decoder
+};
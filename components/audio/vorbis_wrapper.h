@@ -0,0 +1,13 @@
+#ifndef AIRDAC_FIRMWARE_VORBIS_WRAPPER_H
+#define AIRDAC_FIRMWARE_VORBIS_WRAPPER_H
+
+#include "audio_common.h"
+
+bool probe_vorbis_decoder(const AudioContext_t* audio_ctx, AudioStreamInfo_t* info);
+void run_vorbis_decoder(const AudioContext_t* audio_ctx);
+void init_vorbis_decoder(void);
+void delete_vorbis_decoder(void);
+
+extern const DecoderWrapper_t vorbis_wrapper;
+
+#endif //AIRDAC_FIRMWARE_VORBIS_WRAPPER_H
@@ -1,196 +1,344 @@
 #include "wav_wrapper.h"
+#include "pcm_kernels.h"
 
 #include <memory.h>
+#include <sys/param.h>
 
-#include <esp_heap_caps.h>
 #include <esp_log.h>
 
-#define BUFF_LEN 384000
+#define CONTAINER_HEADER_LEN    12
+#define CHUNK_HEADER_LEN        8
+// Covers WAVE_FORMAT_EXTENSIBLE, ds64 and an AIFF-C COMM chunk up to its compression type
+#define FORMAT_CHUNK_LEN        40
+#define BLOCK_FRAMES            1024
+
+#define WAVE_FORMAT_PCM         0x0001
+#define WAVE_FORMAT_FLOAT       0x0003
+#define WAVE_FORMAT_EXTENSIBLE  0xFFFE
 
 static const char TAG[] = "audio_wav";
 
-static struct wav_stat {
+enum wav_encoding {
+    ENCODING_INT,
+    ENCODING_FLOAT
+};
+
+enum chunk_result {
+    CHUNK_SKIP,
+    CHUNK_AUDIO,
+    CHUNK_INVALID
+};
+
+struct wav_format {
+    bool big_endian;            // AIFF chunk sizes
+    bool big_endian_samples;    // AIFF samples, except AIFF-C "sowt"
+    bool rf64;
+    enum wav_encoding encoding;
     uint16_t channels;
+    uint16_t bit_depth;         // Valid bits, left-justified in the container
+    uint16_t bytes_per_sample;
     uint16_t block_alignment;
-    uint16_t bit_depth;
     uint32_t sample_rate;
-    uint8_t* in_buffer;
+    uint64_t data_size;         // Set from ds64 in RF64 files, then to the audio chunk's length
+};
+
+static struct wav_stat {
+    struct wav_format format;
 
-    size_t channel_samples;
     int32_t* left_buff;
-    int32_t* right_buff;
+    int32_t* right_store;
 } *stat;
 
 void delete_wav_decoder(void) {
-    free(stat->in_buffer);
+    free(stat->left_buff);
+    free(stat->right_store);
     free(stat);
+    stat = NULL;
+}
+
+#define READ_LE64(_buff) (((uint64_t)READ_LE32((_buff) + 4) << 32) | READ_LE32(_buff))
+
+// AIFF stores the sample rate as an 80-bit extended float. Rates are whole numbers, so the top of the
+// mantissa shifted by the exponent is enough.
+static uint32_t read_extended(const uint8_t* data) {
+    int exponent = (READ_BE16(data) & 0x7FFF) - 16383;
+    if (exponent < 0 || exponent > 31)
+        return 0;
+
+    return READ_BE32(data + 2) >> (31 - exponent);
 }
 
-#define ROT2(_buff) (((_buff)[1] << 8) | (_buff)[0])
-#define ROT4(_buff) (((_buff)[3] << 24) | ((_buff)[2] << 16) | ((_buff)[1] << 8) | (_buff)[0])
-#define dump(_buff) printf("%x %x %x %x\n", (_buff)[0], (_buff)[1], (_buff)[2], (_buff)[3])
+static bool read_container(struct wav_format* format, const uint8_t* data) {
+    memset(format, 0, sizeof(struct wav_format));
+
+    if (memcmp(data + 8, "WAVE", 4) == 0) {
+        format->rf64 = memcmp(data, "RF64", 4) == 0;
+        return format->rf64 || memcmp(data, "RIFF", 4) == 0;
+    }
+
+    if (memcmp(data, "FORM", 4) == 0 && (memcmp(data + 8, "AIFF", 4) == 0 || memcmp(data + 8, "AIFC", 4) == 0)) {
+        format->big_endian = true;
+        format->big_endian_samples = true;
+        return true;
+    }
 
-static bool read_wav_header() {
-    uint16_t format = 0;
-    memcpy(&format, stat->in_buffer+20, 2);
-    memcpy(&stat->channels, stat->in_buffer+22, 2);
-    memcpy(&stat->sample_rate, stat->in_buffer+24, 4);
-    memcpy(&stat->block_alignment, stat->in_buffer+32, 2);
-    memcpy(&stat->bit_depth, stat->in_buffer+34, 2);
+    return false;
+}
 
-    if (format != 1) {
-        ESP_LOGE(TAG, "WAV format is not PCM");
+static bool read_fmt(struct wav_format* format, const uint8_t* body, size_t len) {
+    if (len < 16)
         return false;
+
+    uint16_t tag = READ_LE16(body);
+    format->channels = READ_LE16(body + 2);
+    format->sample_rate = READ_LE32(body + 4);
+    format->block_alignment = READ_LE16(body + 12);
+    format->bit_depth = READ_LE16(body + 14);
+
+    // The sub-format GUID starts with the plain format tag
+    if (tag == WAVE_FORMAT_EXTENSIBLE && len >= 40) {
+        tag = READ_LE16(body + 24);
+        uint16_t valid_bits = READ_LE16(body + 18);
+        if (valid_bits != 0)
+            format->bit_depth = valid_bits;
     }
 
-    if (stat->channels == 1) {
-        ESP_LOGI(TAG, "Playing mono");
-    } else if (stat->channels > 2) {
-        ESP_LOGW(TAG, "More than 2 channels not supported");
+    if (tag == WAVE_FORMAT_FLOAT) {
+        format->encoding = ENCODING_FLOAT;
+    } else if (tag != WAVE_FORMAT_PCM) {
+        ESP_LOGE(TAG, "Unsupported WAV format 0x%04x", tag);
         return false;
     }
-//
-//    const char header_info[] =
-//        "\nFormat: %d"
-//        "\nChannels: %d"
-//        "\nSample rate: %d"
-//        "\nBlock alignment: %d"
-//        "\nBits per sample: %d\n"
-//    ;
-//    printf(header_info,
-//        format,
-//        stat->channels,
-//        stat->sample_rate,
-//        stat->block_alignment,
-//        stat->bit_depth
-//    );
 
+    format->bytes_per_sample = format->channels != 0 ? format->block_alignment / format->channels : 0;
     return true;
 }
 
-void run_wav_decoder(const AudioContext_t* audio_ctx) {
-    size_t read_size = audio_ctx->fill_buffer(stat->in_buffer, BUFF_LEN);
-    if (read_size == 0)
-        return;
+static bool read_comm(struct wav_format* format, const uint8_t* body, size_t len) {
+    if (len < 18)
+        return false;
 
-    if (read_wav_header() == false) {
-        audio_ctx->decoder_failed();
-        return;
+    format->channels = READ_BE16(body);
+    format->bit_depth = READ_BE16(body + 6);
+    format->sample_rate = read_extended(body + 8);
+    format->bytes_per_sample = (format->bit_depth + 7) / 8;
+    format->block_alignment = format->bytes_per_sample * format->channels;
+
+    // Plain AIFF has no compression type
+    if (len < 22 || memcmp(body + 18, "NONE", 4) == 0 || memcmp(body + 18, "twos", 4) == 0)
+        return true;
+
+    if (memcmp(body + 18, "sowt", 4) == 0) {
+        format->big_endian_samples = false;
+    } else if (memcmp(body + 18, "fl32", 4) == 0 || memcmp(body + 18, "FL32", 4) == 0) {
+        format->encoding = ENCODING_FLOAT;
+        format->bit_depth = 32;
+        format->bytes_per_sample = 4;
+        format->block_alignment = 4 * format->channels;
+    } else {
+        ESP_LOGE(TAG, "Unsupported AIFF-C compression %.4s", body + 18);
+        return false;
     }
 
-    stat->channel_samples = BUFF_LEN / (stat->block_alignment*20);
-    stat->left_buff = heap_caps_malloc(sizeof(int32_t) * stat->channel_samples, MALLOC_CAP_SPIRAM);
+    return true;
+}
+
+static bool format_valid(const struct wav_format* format) {
+    if (format->sample_rate == 0 || format->channels == 0 || format->bytes_per_sample == 0
+            || format->block_alignment != format->bytes_per_sample * format->channels)
+        return false;
 
-    if (stat->channels == 1) {
-        stat->right_buff = stat->left_buff;
-    } else if (stat->channels == 2) {
-        stat->right_buff = heap_caps_malloc(sizeof(int32_t) * stat->channel_samples, MALLOC_CAP_SPIRAM);
+    if (format->encoding == ENCODING_FLOAT)
+        return format->bytes_per_sample == 4;
+
+    return format->bytes_per_sample <= 4;
+}
+
+// Reads the chunk at data, of which len bytes are available. size is set to the chunk's length without
+// padding. For the audio chunk, offset is set to where the samples start relative to data.
+static enum chunk_result read_chunk(struct wav_format* format, const uint8_t* data, size_t len,
+                                    uint64_t* size, size_t* offset) {
+    const uint8_t* body = data + CHUNK_HEADER_LEN;
+    size_t body_len = MIN(len - CHUNK_HEADER_LEN, FORMAT_CHUNK_LEN);
+    *size = format->big_endian ? READ_BE32(data + 4) : READ_LE32(data + 4);
+
+    if (memcmp(data, "fmt ", 4) == 0 && !format->big_endian)
+        return read_fmt(format, body, MIN(body_len, *size)) ? CHUNK_SKIP : CHUNK_INVALID;
+
+    if (memcmp(data, "COMM", 4) == 0 && format->big_endian)
+        return read_comm(format, body, MIN(body_len, *size)) ? CHUNK_SKIP : CHUNK_INVALID;
+
+    if (memcmp(data, "ds64", 4) == 0 && format->rf64) {
+        if (body_len < 16)
+            return CHUNK_INVALID;
+        format->data_size = READ_LE64(body + 8);
+        return CHUNK_SKIP;
     }
 
-    assert(BUFF_LEN % stat->block_alignment == 0);
+    if (memcmp(data, "data", 4) == 0 && !format->big_endian) {
+        if (!format_valid(format))
+            return CHUNK_INVALID;
 
+        // RF64 keeps the real length in ds64. A streaming writer may leave it at zero.
+        if (!(format->rf64 && *size == UINT32_MAX))
+            format->data_size = *size;
+        *offset = CHUNK_HEADER_LEN;
+        return CHUNK_AUDIO;
+    }
 
-    uint8_t* data_start = NULL;
-    size_t begin = 0;
-    while (data_start == NULL) {
-        // Find 'd'
-        for (size_t i = begin; i < read_size; i++) {
-            if (stat->in_buffer[i] == 'd') {
-                data_start = stat->in_buffer + i;
-                break;
-            }
-        }
-        while (data_start == NULL) {
-//            ESP_LOGI(TAG, "Not found. New buffer");
-            read_size = audio_ctx->fill_buffer(stat->in_buffer, BUFF_LEN);
-            if (read_size == 0)
-                return;
-
-            begin = 0;
-            for (size_t i = begin; i < read_size; i++) {
-                if (stat->in_buffer[i] == 'd') {
-                    data_start = stat->in_buffer + i;
-                    break;
-                }
-            }
-        }
+    if (memcmp(data, "SSND", 4) == 0 && format->big_endian) {
+        if (!format_valid(format) || body_len < 8 || *size < 8)
+            return CHUNK_INVALID;
 
-        size_t offset = data_start - stat->in_buffer;
+        uint32_t skip = READ_BE32(body);
+        format->data_size = *size - 8 - MIN(skip, *size - 8);
+        *offset = CHUNK_HEADER_LEN + 8 + skip;
+        return CHUNK_AUDIO;
+    }
 
-        if (BUFF_LEN - offset < 4) {
-            memmove(stat->in_buffer, data_start, BUFF_LEN - offset);
-            read_size = audio_ctx->fill_buffer(stat->in_buffer + offset, BUFF_LEN - offset);
-            if (read_size == 0)
-                return;
-            data_start = stat->in_buffer;
-            offset = 0;
-        }
-        const char str[] = "ata";
-        for (int i = 0; i < 3; i++) {
-            if (data_start[i+1] != str[i]) {
-                data_start = NULL;
+    return CHUNK_SKIP;
+}
+
+static void fill_info(const struct wav_format* format, AudioStreamInfo_t* info) {
+    info->channels = format->channels;
+    info->sample_rate = format->sample_rate;
+    info->bit_depth = format->bit_depth;
+    if (format->data_size != 0 && format->block_alignment != 0)
+        info->total_samples = format->data_size / format->block_alignment;
+}
+
+// Walks the chunks in the first peek for the format and the start of the audio
+bool probe_wav_decoder(const AudioContext_t* audio_ctx, AudioStreamInfo_t* info) {
+    struct wav_format format;
+    const uint8_t* data;
+    size_t len = audio_ctx->peek(&data, PROBE_LEN);
+    if (len < CONTAINER_HEADER_LEN || read_container(&format, data) == false)
+        return false;
+
+    size_t pos = CONTAINER_HEADER_LEN;
+    while (pos + CHUNK_HEADER_LEN <= len) {
+        uint64_t size;
+        size_t offset;
+        enum chunk_result result = read_chunk(&format, data + pos, len - pos, &size, &offset);
+        if (result == CHUNK_INVALID)
+            return false;
+        if (result == CHUNK_AUDIO)
+            break;
+        if (size > len)
+            break;
+
+        // Chunks are padded to an even length
+        pos += CHUNK_HEADER_LEN + size + (size & 1);
+    }
+
+    if (!format_valid(&format))
+        return false;
+
+    fill_info(&format, info);
+    return true;
+}
+
+// Leaves the input at the first sample, with data_size trimmed to what the file holds
+static bool find_audio(const AudioContext_t* audio_ctx, struct wav_format* format) {
+    const uint8_t* data;
+    size_t len = audio_ctx->peek(&data, CONTAINER_HEADER_LEN);
+    if (len < CONTAINER_HEADER_LEN || read_container(format, data) == false)
+        return false;
+    audio_ctx->consume(CONTAINER_HEADER_LEN);
+
+    while (1) {
+        len = audio_ctx->peek(&data, CHUNK_HEADER_LEN + FORMAT_CHUNK_LEN);
+        if (len < CHUNK_HEADER_LEN)
+            return false;
+
+        uint64_t size;
+        size_t offset;
+        size_t position = audio_ctx->bytes_elapsed();
+        switch (read_chunk(format, data, len, &size, &offset)) {
+            case CHUNK_INVALID:
+                return false;
+            case CHUNK_AUDIO:
+                if (!audio_ctx->seek(position + offset))
+                    return false;
+                size_t remaining = audio_ctx->total_bytes() - audio_ctx->bytes_elapsed();
+                if (format->data_size == 0 || format->data_size > remaining)
+                    format->data_size = remaining;
+                return true;
+            case CHUNK_SKIP:
+                if (position + CHUNK_HEADER_LEN + size + (size & 1) > audio_ctx->total_bytes())
+                    return false;
+                if (!audio_ctx->seek(position + CHUNK_HEADER_LEN + size + (size & 1)))
+                    return false;
                 break;
-            }
         }
-        begin = offset+1;
     }
+}
 
-    begin += 3;
-    if (begin < BUFF_LEN) {
-        memmove(stat->in_buffer, stat->in_buffer + begin, BUFF_LEN - begin);
-    }
-    read_size = audio_ctx->fill_buffer(stat->in_buffer + BUFF_LEN - begin, begin);
+static void unpack(const struct wav_format* format, int32_t* left, int32_t* right, const uint8_t* in, size_t frames) {
+    if (format->encoding == ENCODING_FLOAT)
+        pcm_unpack_float(left, right, in, frames, format->channels, format->big_endian_samples);
+    else if (format->big_endian_samples)
+        pcm_unpack_be(left, right, in, frames, format->bytes_per_sample, format->channels);
+    else
+        pcm_unpack_le(left, right, in, frames, format->bytes_per_sample, format->channels);
+}
 
-    if (read_size == 0)
+void run_wav_decoder(const AudioContext_t* audio_ctx) {
+    struct wav_format* format = &stat->format;
+    if (find_audio(audio_ctx, format) == false) {
+        ESP_LOGE(TAG, "No playable audio chunk");
+        if (!input_stopped(audio_ctx))
+            audio_ctx->decoder_failed();
         return;
+    }
+
+    ESP_LOGI(TAG, "%u Hz, %u bit%s, %u channels", format->sample_rate, format->bit_depth,
+             format->encoding == ENCODING_FLOAT ? " float" : "", format->channels);
 
-    const size_t bytes_per_sample = stat->block_alignment / stat->channels;
-    size_t in_i = 0;
-    read_size = BUFF_LEN;
+    int32_t* right = format->channels == 1 ? stat->left_buff : stat->right_store;
+    // Samples are left-justified, so they are scaled by their container rather than their valid bits
+    unsigned int bit_depth = format->encoding == ENCODING_FLOAT ? 32 : format->bytes_per_sample * 8;
+    size_t end = audio_ctx->bytes_elapsed() + format->data_size;
 
     bool run = true;
     while (run) {
-        for (int i = 0; i < stat->channel_samples; i++) {
-            for (int j = 0; j < bytes_per_sample; j++) {
-                stat->left_buff[i] = stat->in_buffer[in_i++] << 8*j;
-            }
-            if (stat->channels == 2) {
-                for (int j = 0; j < bytes_per_sample; j++) {
-                    stat->right_buff[i] = stat->in_buffer[in_i++] << 8*j;
-                }
-            }
+        size_t remaining = end - audio_ctx->bytes_elapsed();
+        if (remaining < format->block_alignment) {
+            audio_ctx->decoder_finished();
+            break;
         }
 
-        run = audio_ctx->write(stat->left_buff, stat->right_buff, stat->channel_samples, stat->sample_rate, stat->bit_depth);
-
-        if (in_i == read_size) {
-            if (audio_ctx->eof()) {
+        const uint8_t* data;
+        size_t read_size = audio_ctx->peek(&data, format->block_alignment);
+        if (read_size < format->block_alignment) {
+            if (audio_ctx->eof())
                 audio_ctx->decoder_finished();
-                run = false;
-            }
-
-            read_size = audio_ctx->fill_buffer(stat->in_buffer, BUFF_LEN);
-
-            if (read_size == 0)
-                run = false;
-
-            in_i = 0;
+            break;
         }
-    }
 
-    free(stat->left_buff);
+        size_t frames = MIN(MIN(read_size, remaining) / format->block_alignment, BLOCK_FRAMES);
+        unpack(format, stat->left_buff, right, data, frames);
+        audio_ctx->consume(frames * format->block_alignment);
 
-    if (stat->channels == 2)
-        free(stat->right_buff);
+        run = audio_ctx->write(stat->left_buff, right, frames, format->sample_rate, bit_depth);
+    }
 }
 
+// The header is read again at the start of every run, so there is nothing to reset
 void init_wav_decoder(void) {
+    if (stat != NULL)
+        return;
+
     stat = malloc(sizeof(struct wav_stat));
-    stat->in_buffer = heap_caps_malloc(BUFF_LEN, MALLOC_CAP_SPIRAM);
+    assert(stat != NULL);
+    stat->left_buff = malloc(sizeof(int32_t) * BLOCK_FRAMES);
+    stat->right_store = malloc(sizeof(int32_t) * BLOCK_FRAMES);
+    assert(stat->left_buff != NULL && stat->right_store != NULL);
 }
 
 const DecoderWrapper_t wav_wrapper = {
         .init = init_wav_decoder,
+        .probe = probe_wav_decoder,
         .run = run_wav_decoder,
         .delete = delete_wav_decoder
-};
\ No newline at end of file
+};
@@ -3,6 +3,7 @@
 
 #include "audio_common.h"
 
+bool probe_wav_decoder(const AudioContext_t* audio_ctx, AudioStreamInfo_t* info);
 void run_wav_decoder(const AudioContext_t* audio_ctx);
 void init_wav_decoder(void);
 void delete_wav_decoder(void);
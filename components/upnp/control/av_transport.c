@@ -1,6 +1,7 @@
 #include "av_transport.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <math.h>
 
@@ -110,6 +111,7 @@ struct {
     char* A_ARG_TYPE_SeekMode;
     char* A_Arg_TYPE_SeekTarget;
     // A_ARG_TYPE_InstanceID is always 0
+    uint32_t seek_target_ms;
 } avt_state = {
         STATE_NO_MEDIA_PRESENT,
         STATUS_OK,
@@ -150,6 +152,59 @@ static SemaphoreHandle_t avt_mutex;
 
 static FileInfo_t buffer_info = { 0 };
 
+// Unset variables point into var_opt_str, which must never be freed
+static bool is_var_opt_str(const char* str) {
+    for (int i = 0; i < NUM_OPTS; i++) {
+        if (str == var_opt_str[i])
+            return true;
+    }
+
+    return false;
+}
+
+// Returns a new string, or NULL if there is no memory for it
+static char* xml_escape(const char* in) {
+    size_t len = 0;
+    for (const char* c = in; *c != '\0'; c++)
+        len += *c == '&' ? 5 : *c == '<' || *c == '>' ? 4 : *c == '"' || *c == '\'' ? 6 : 1;
+
+    char* out = malloc(len + 1);
+    if (out == NULL)
+        return NULL;
+
+    char* pos = out;
+    for (const char* c = in; *c != '\0'; c++) {
+        switch (*c) {
+            case '&': pos += sprintf(pos, "&amp;"); break;
+            case '<': pos += sprintf(pos, "&lt;"); break;
+            case '>': pos += sprintf(pos, "&gt;"); break;
+            case '"': pos += sprintf(pos, "&quot;"); break;
+            case '\'': pos += sprintf(pos, "&apos;"); break;
+            default: *pos++ = *c;
+        }
+    }
+    *pos = '\0';
+    return out;
+}
+
+// Only set for live streams so far. Called with avt_mutex held.
+static void clear_track_metadata(void) {
+    if (!is_var_opt_str(avt_state.CurrentTrackMetaData))
+        free(avt_state.CurrentTrackMetaData);
+    INIT_STRING(CurrentTrackMetaData, NOT_IMPLEMENTED);
+}
+
+// A queued next track only follows the track it was queued behind. Called with avt_mutex held.
+static void clear_next_track(void) {
+    if (!is_var_opt_str(avt_state.NextAVTransportURI))
+        free(avt_state.NextAVTransportURI);
+    INIT_STRING(NextAVTransportURI, NOTHING);
+
+    if (!is_var_opt_str(avt_state.NextAVTransportURIMetaData))
+        free(avt_state.NextAVTransportURIMetaData);
+    INIT_STRING(NextAVTransportURIMetaData, NOT_IMPLEMENTED);
+}
+
 static char* av_transport_changes(uint32_t changed_variables) {
     char* response = NULL;
     char* pos;
@@ -199,21 +254,45 @@ static inline void state_changed(uint32_t variables) {
     flag_event(AV_TRANSPORT_CHANGED);
 }
 
-static bool get_stream_value(char* metadata, const char* search, uint32_t* value) {
-    char* value_start = strstr(metadata, search);
-    if (value_start != NULL) {
-        value_start += strlen(search);
-        char* value_end = strstr(value_start, "\"");
-        *value_end = '\0';
-        *value = atol(value_start);
-        *value_end = ' ';
-    } else {
+static bool get_stream_value(const char* metadata, const char* search, uint32_t* value) {
+    const char* value_start = strstr(metadata, search);
+    if (value_start == NULL)
         return false;
-    }
 
+    *value = strtoul(value_start + strlen(search), NULL, 10);
     return true;
 }
 
+static bool parse_time(const char* time, uint32_t* time_ms);
+
+// Read before read_duration(), which marks the end of the duration it takes. DLNA gives res@bitrate in bytes
+// per second; without it the size and duration give the average.
+static void read_file_info(const char* metadata) {
+    memset(&buffer_info, 0, sizeof(buffer_info));
+    get_stream_value(metadata, "size=\"", &buffer_info.file_size);
+    get_stream_value(metadata, "bitrate=\"", &buffer_info.bitrate);
+
+    const char duration_search[] = "duration=\"";
+    const char* duration = strstr(metadata, duration_search);
+    uint32_t duration_ms;
+    if (buffer_info.bitrate == 0 && buffer_info.file_size != 0 && duration != NULL &&
+        parse_time(duration + strlen(duration_search), &duration_ms) && duration_ms >= 1000)
+        buffer_info.bitrate = (uint64_t)buffer_info.file_size * 1000 / duration_ms;
+}
+
+static void read_duration(char* metadata) {
+    const char duration_search[] = "duration=\"";
+    char* duration_start = strstr(metadata, duration_search);
+    if (duration_start != NULL) {
+        duration_start += strlen(duration_search);
+        char* duration_end = strstr(duration_start, "\"");
+        *duration_end = '\0';
+        strcpy(avt_state.CurrentMediaDuration, duration_start);
+        strcpy(avt_state.CurrentTrackDuration, duration_start);
+        *duration_end = ' ';
+    }
+}
+
 static action_err_t SetAVTransportURI(char* arguments, char** response) {
     action_err_t ret = Action_OK;
 
@@ -226,6 +305,8 @@ static action_err_t SetAVTransportURI(char* arguments, char** response) {
 
     xSemaphoreTake(avt_mutex, portMAX_DELAY);
     avt_state.TransportStatus = STATUS_OK;
+    clear_track_metadata();
+    clear_next_track();
 
 //    if (strlen(avt_state.AVTransportURIMetaData) != 0)
 //        free(avt_state.AVTransportURIMetaData);
@@ -249,20 +330,10 @@ static action_err_t SetAVTransportURI(char* arguments, char** response) {
 //        *mime_end = ' '; // Insert a non-zero character to allow searching again
 //    }
 //
-    const char duration_search[] = "duration=\"";
-    char* duration_start = strstr(CurrentURIMetaData, duration_search);
-    if (duration_start != NULL) {
-        duration_start += strlen(duration_search);
-        char* duration_end = strstr(duration_start, "\"");
-        *duration_end = '\0';
-        strcpy(avt_state.CurrentMediaDuration, duration_start);
-        strcpy(avt_state.CurrentTrackDuration, duration_start);
-        *duration_end = ' ';
-    }
+    read_file_info(CurrentURIMetaData);
+    read_duration(CurrentURIMetaData);
 //
 //    bool success = true;
-//    success &= get_stream_value(CurrentURIMetaData, "size=\"", &buffer_info.file_size);
-//    success &= get_stream_value(CurrentURIMetaData, "bitrate=\"", &buffer_info.bitrate);
 //    success &= get_stream_value(CurrentURIMetaData, "sampleFrequency=\"", &buffer_info.sample_rate);
 //    success &= get_stream_value(CurrentURIMetaData, "bitsPerSample=\"", &buffer_info.bit_depth);
 //    success &= get_stream_value(CurrentURIMetaData, "nrAudioChannels=\"", &buffer_info.channels);
@@ -293,6 +364,8 @@ static action_err_t SetAVTransportURI(char* arguments, char** response) {
     switch (avt_state.TransportState) {
         case STATE_NO_MEDIA_PRESENT:
         case STATE_STOPPED:
+            // Pre-roll the new URI so Play only has to start the output
+            flag_event(STOP_PLAYBACK | PREPARE_STREAMING);
             avt_state.TransportState = STATE_STOPPED;
             break;
         case STATE_PLAYING:
@@ -309,7 +382,7 @@ static action_err_t SetAVTransportURI(char* arguments, char** response) {
 
     state_changed(TRANSPORTSTATUS | AVTRANSPORTURI | AVTRANSPORTURIMETADATA | CURRENTTRACKURI |
                 CURRENTTRACKMETADATA | CURRENTTRACKDURATION | CURRENTMEDIADURATION |
-                NUMBEROFTRACKS | CURRENTTRACK | TRANSPORTSTATE);
+                NUMBEROFTRACKS | CURRENTTRACK | TRANSPORTSTATE | NEXTAVTRANSPORTURI | NEXTAVTRANSPORTURIMETADATA);
     return ret;
 }
 
@@ -318,7 +391,6 @@ static action_err_t SetNextAVTransportURI(char* arguments, char** response) {
     GET_ARG(NextURI);
     GET_ARG(NextURIMetaData);
 
-    ESP_LOGE("NextURI", "I'm called!");
     if (NextURI == NULL || NextURIMetaData == NULL)
         return Invalid_Args;
 
@@ -329,11 +401,12 @@ static action_err_t SetNextAVTransportURI(char* arguments, char** response) {
     avt_state.NextAVTransportURI = malloc(strlen(NextURI) + 1);
     strcpy(avt_state.NextAVTransportURI, NextURI);
 
-    if (strlen(avt_state.NextAVTransportURIMetaData) != 0)
+    if (!is_var_opt_str(avt_state.NextAVTransportURIMetaData))
         free(avt_state.NextAVTransportURIMetaData);
 
     avt_state.NextAVTransportURIMetaData = malloc(strlen(NextURIMetaData) + 1);
     strcpy(avt_state.NextAVTransportURIMetaData, NextURIMetaData);
+    flag_event(NEXT_TRACK_SET);
     xSemaphoreGive(avt_mutex);
 
     state_changed(NEXTAVTRANSPORTURI | NEXTAVTRANSPORTURIMETADATA);
@@ -429,6 +502,7 @@ static action_err_t Stop(char* arguments, char** response) {
         default:
             avt_state.TransportState = STATE_STOPPED;
             flag_event(STOP_PLAYBACK | RESET_PLAYBACK);
+            clear_next_track();
             avt_state.AbsoluteCounterPosition = 0;
             avt_state.RelativeCounterPosition = 0;
 
@@ -437,7 +511,7 @@ static action_err_t Stop(char* arguments, char** response) {
     }
     xSemaphoreGive(avt_mutex);
 
-    state_changed(TRANSPORTSTATE);
+    state_changed(TRANSPORTSTATE | NEXTAVTRANSPORTURI | NEXTAVTRANSPORTURIMETADATA);
     return ret;
 }
 
@@ -490,6 +564,36 @@ static action_err_t Pause(char* arguments, char** response) {
 
 UNIMPLEMENTED(Record)
 
+// Accepts H+:MM:SS with an optional fraction, either decimal (.F+) or as F0/F1
+static bool parse_time(const char* time, uint32_t* time_ms) {
+    unsigned int hours, minutes, seconds;
+    int length = 0;
+    if (sscanf(time, "%u:%u:%u%n", &hours, &minutes, &seconds, &length) != 3 || minutes > 59 || seconds > 59)
+        return false;
+
+    uint32_t fraction_ms = 0;
+    const char* fraction = time + length;
+    if (*fraction == '.') {
+        unsigned int numerator, denominator;
+        if (sscanf(fraction + 1, "%u/%u", &numerator, &denominator) == 2) {
+            if (denominator == 0 || numerator >= denominator)
+                return false;
+            fraction_ms = numerator * 1000 / denominator;
+        } else {
+            uint32_t scale = 100;
+            for (const char* digit = fraction + 1; *digit >= '0' && *digit <= '9' && scale != 0; digit++) {
+                fraction_ms += (*digit - '0') * scale;
+                scale /= 10;
+            }
+        }
+    }
+
+    *time_ms = ((hours * 60 + minutes) * 60 + seconds) * 1000 + fraction_ms;
+    return true;
+}
+
+// Only time seeks within the current track are supported. The decoder moves at its next frame, and the
+// position counters follow once it has.
 static action_err_t Seek(char* arguments, char** response) {
     action_err_t ret = Action_OK;
 
@@ -500,27 +604,33 @@ static action_err_t Seek(char* arguments, char** response) {
     if (Unit == NULL || Target == NULL)
         return Invalid_Args;
 
-    xSemaphoreTake(avt_mutex, portMAX_DELAY);
-    if (avt_state.TransportState & (STATE_PLAYING | STATE_STOPPED | STATE_PAUSED_PLAYBACK)) {
-        if (avt_state.A_ARG_TYPE_SeekMode != NULL)
-            free(avt_state.A_ARG_TYPE_SeekMode);
+    if (strcmp(Unit, var_opt_str[SEEKMODE_REL_TIME]) != 0 && strcmp(Unit, var_opt_str[SEEKMODE_ABS_TIME]) != 0)
+        return Seek_Unsupported;
 
-        avt_state.A_ARG_TYPE_SeekMode = malloc(strlen(Unit)+1);
-        strcpy(avt_state.A_ARG_TYPE_SeekMode, Unit);
+    uint32_t target_ms;
+    if (!parse_time(Target, &target_ms))
+        return Illegal_Seek;
+
+    xSemaphoreTake(avt_mutex, portMAX_DELAY);
+    switch (avt_state.TransportState) {
+        case STATE_PLAYING:
+        case STATE_PAUSED_PLAYBACK:
+            if (avt_state.A_ARG_TYPE_SeekMode != NULL)
+                free(avt_state.A_ARG_TYPE_SeekMode);
+            avt_state.A_ARG_TYPE_SeekMode = strdup(Unit);
 
-        if (avt_state.A_Arg_TYPE_SeekTarget != NULL)
-            free(avt_state.A_Arg_TYPE_SeekTarget);
+            if (avt_state.A_Arg_TYPE_SeekTarget != NULL)
+                free(avt_state.A_Arg_TYPE_SeekTarget);
+            avt_state.A_Arg_TYPE_SeekTarget = strdup(Target);
 
-        avt_state.A_Arg_TYPE_SeekTarget = malloc(strlen(Target)+1);
-        strcpy(avt_state.A_Arg_TYPE_SeekTarget, Target);
-    } else {
-        ret = Cannot_Transition;
+            avt_state.seek_target_ms = target_ms;
+            flag_event(SEEK_TRACK);
+            break;
+        default:
+            ret = Cannot_Transition;
     }
-
-//    avt_state.TransportState = STATE_TRANSITIONING;
     xSemaphoreGive(avt_mutex);
 
-//    state_changed(TRANSPORTSTATE);
     return ret;
 }
 
@@ -629,12 +739,47 @@ void av_transport_stream_ready(void) {
     state_changed(TRANSPORTSTATE);
 }
 
-void av_transport_update_counters(uint32_t samples, uint32_t sample_rate) {
+bool av_transport_has_next(void) {
     xSemaphoreTake(avt_mutex, portMAX_DELAY);
-    avt_state.AbsoluteCounterPosition += (int)samples;
-    avt_state.RelativeCounterPosition += (int)samples;
+    bool ret = strlen(avt_state.NextAVTransportURI) != 0;
+    xSemaphoreGive(avt_mutex);
+    return ret;
+}
+
+// Promotes NextAVTransportURI to the current track. The position counters carry on with the previous track's
+// tail until av_transport_track_started().
+bool av_transport_next_track(void) {
+    xSemaphoreTake(avt_mutex, portMAX_DELAY);
+    if (strlen(avt_state.NextAVTransportURI) == 0) {
+        xSemaphoreGive(avt_mutex);
+        return false;
+    }
+
+    if (strlen(avt_state.AVTransportURI) != 0)
+        free(avt_state.AVTransportURI);
+
+    avt_state.AVTransportURI = avt_state.NextAVTransportURI;
+    avt_state.CurrentTrackURI = avt_state.AVTransportURI;
+    INIT_STRING(NextAVTransportURI, NOTHING);
+
+    avt_state.CurrentMediaDuration[0] = '\0';
+    avt_state.CurrentTrackDuration[0] = '\0';
+    read_file_info(avt_state.NextAVTransportURIMetaData);
+    read_duration(avt_state.NextAVTransportURIMetaData);
+    if (!is_var_opt_str(avt_state.NextAVTransportURIMetaData))
+        free(avt_state.NextAVTransportURIMetaData);
+    INIT_STRING(NextAVTransportURIMetaData, NOT_IMPLEMENTED);
+    clear_track_metadata();
+    xSemaphoreGive(avt_mutex);
 
-    double elapsed_seconds = (double)avt_state.RelativeCounterPosition / sample_rate;
+    ESP_LOGI(TAG, "Advancing to next track");
+    state_changed(AVTRANSPORTURI | CURRENTTRACKURI | NEXTAVTRANSPORTURI | NEXTAVTRANSPORTURIMETADATA |
+                  CURRENTTRACKMETADATA | CURRENTTRACKDURATION | CURRENTMEDIADURATION);
+    return true;
+}
+
+static void format_time(char* time, uint64_t samples, uint32_t sample_rate) {
+    double elapsed_seconds = (double)samples / sample_rate;
     unsigned int floor_seconds = floor(elapsed_seconds);
     unsigned int milli = (int)((elapsed_seconds - floor_seconds)*1000) % 1000;
     unsigned int seconds = floor_seconds % 60;
@@ -642,12 +787,95 @@ void av_transport_update_counters(uint32_t samples, uint32_t sample_rate) {
     unsigned int minutes = floor_minutes % 60;
     unsigned int hours = ((floor_minutes - minutes) / 60) % 99;
 
-    sprintf(avt_state.AbsoluteTimePosition, "%02d:%02d:%02d.%03d", hours, minutes, seconds, milli);
-    sprintf(avt_state.RelativeTimePosition, "%02d:%02d:%02d.%03d", hours, minutes, seconds, milli);
+    sprintf(time, "%02d:%02d:%02d.%03d", hours, minutes, seconds, milli);
+}
 
+void av_transport_track_started(void) {
+    xSemaphoreTake(avt_mutex, portMAX_DELAY);
+    avt_state.AbsoluteCounterPosition = 0;
+    avt_state.RelativeCounterPosition = 0;
+
+    avt_state.AbsoluteTimePosition[0] = '\0';
+    avt_state.RelativeTimePosition[0] = '\0';
     xSemaphoreGive(avt_mutex);
 }
 
+void av_transport_update_counters(uint32_t samples, uint32_t sample_rate) {
+    xSemaphoreTake(avt_mutex, portMAX_DELAY);
+    avt_state.AbsoluteCounterPosition += (int)samples;
+    avt_state.RelativeCounterPosition += (int)samples;
+
+    format_time(avt_state.AbsoluteTimePosition, avt_state.RelativeCounterPosition, sample_rate);
+    strcpy(avt_state.RelativeTimePosition, avt_state.AbsoluteTimePosition);
+
+    xSemaphoreGive(avt_mutex);
+}
+
+uint32_t av_transport_seek_target(void) {
+    xSemaphoreTake(avt_mutex, portMAX_DELAY);
+    uint32_t target_ms = avt_state.seek_target_ms;
+    xSemaphoreGive(avt_mutex);
+    return target_ms;
+}
+
+void av_transport_set_position(uint64_t sample, uint32_t sample_rate) {
+    xSemaphoreTake(avt_mutex, portMAX_DELAY);
+    avt_state.AbsoluteCounterPosition = (int)sample;
+    avt_state.RelativeCounterPosition = (int)sample;
+
+    format_time(avt_state.AbsoluteTimePosition, sample, sample_rate);
+    strcpy(avt_state.RelativeTimePosition, avt_state.AbsoluteTimePosition);
+    xSemaphoreGive(avt_mutex);
+}
+
+// The stream header is more reliable than the duration in the DIDL metadata, when it has one
+void av_transport_set_duration(uint64_t total_samples, uint32_t sample_rate) {
+    if (total_samples == 0 || sample_rate == 0)
+        return;
+
+    xSemaphoreTake(avt_mutex, portMAX_DELAY);
+    format_time(avt_state.CurrentTrackDuration, total_samples, sample_rate);
+    strcpy(avt_state.CurrentMediaDuration, avt_state.CurrentTrackDuration);
+    xSemaphoreGive(avt_mutex);
+
+    state_changed(CURRENTTRACKDURATION | CURRENTMEDIADURATION);
+}
+
+#define STREAM_TITLE_DIDL \
+    "<DIDL-Lite xmlns=\"urn:schemas-upnp-org:metadata-1-0/DIDL-Lite/\" " \
+    "xmlns:dc=\"http://purl.org/dc/elements/1.1/\" xmlns:upnp=\"urn:schemas-upnp-org:metadata-1-0/upnp/\">" \
+    "<item id=\"0\" parentID=\"-1\" restricted=\"1\"><dc:title>%s</dc:title>" \
+    "<upnp:class>object.item.audioItem.audioBroadcast</upnp:class></item></DIDL-Lite>"
+
+// The title from a live stream becomes the track's DIDL-Lite. Like any value carried inside XML, the document is
+// stored escaped.
+void av_transport_set_stream_title(const char* title) {
+    char* escaped_title = xml_escape(title);
+    if (escaped_title == NULL)
+        return;
+
+    int len = snprintf(NULL, 0, STREAM_TITLE_DIDL, escaped_title);
+    char* didl = malloc(len + 1);
+    if (didl == NULL) {
+        free(escaped_title);
+        return;
+    }
+    sprintf(didl, STREAM_TITLE_DIDL, escaped_title);
+    free(escaped_title);
+
+    char* metadata = xml_escape(didl);
+    free(didl);
+    if (metadata == NULL)
+        return;
+
+    xSemaphoreTake(avt_mutex, portMAX_DELAY);
+    clear_track_metadata();
+    avt_state.CurrentTrackMetaData = metadata;
+    xSemaphoreGive(avt_mutex);
+
+    state_changed(CURRENTTRACKMETADATA);
+}
+
 void init_av_transport(void) {
     avt_events = xEventGroupCreate();
     avt_mutex = xSemaphoreCreateMutex();
@@ -675,6 +903,14 @@ inline char* get_track_url(void) {
     return ret;
 }
 
+// NULL if no track is queued
+char* get_next_track_url(void) {
+    xSemaphoreTake(avt_mutex, portMAX_DELAY);
+    char* ret = strlen(avt_state.NextAVTransportURI) != 0 ? strdup(avt_state.NextAVTransportURI) : NULL;
+    xSemaphoreGive(avt_mutex);
+    return ret;
+}
+
 inline char* get_av_transport_changes(void) {
     uint32_t changed_variables = xEventGroupWaitBits(avt_events, ALL_EVENT_BITS, pdTRUE, pdFALSE, 0);
     return av_transport_changes(changed_variables);
@@ -694,6 +930,7 @@ void av_transport_reset(void) {
 
     avt_state.AVTransportURI = (char*)var_opt_str[NOTHING];
     avt_state.CurrentTrackURI = (char*)var_opt_str[NOTHING];
+    clear_track_metadata();
 
     avt_state.CurrentMediaDuration[0] = '\0';
     avt_state.CurrentTrackDuration[0] = '\0';
@@ -8,12 +8,20 @@
 
 void init_av_transport(void);
 void av_transport_update_counters(uint32_t samples, uint32_t sample_rate);
+void av_transport_set_duration(uint64_t total_samples, uint32_t sample_rate);
+uint32_t av_transport_seek_target(void);
+void av_transport_set_position(uint64_t sample, uint32_t sample_rate);
+void av_transport_set_stream_title(const char* title);
 void av_transport_stream_ready(void);
 void av_transport_reset(void);
+bool av_transport_has_next(void);
+bool av_transport_next_track(void);
+void av_transport_track_started(void);
 action_err_t av_transport_execute(const char* action_name, char* arguments, char** response);
 char* get_av_transport_changes(void);
 char* get_av_transport_all(void);
 char* get_track_url(void);
+char* get_next_track_url(void);
 void get_stream_info(FileInfo_t* info);
 void av_transport_error_occurred(void);
 
@@ -8,9 +8,11 @@ const char protocol_info[] =
         "http-get:*:*:*,"
         "http-get:*:audio/mp3:*,"
         "http-get:*:audio/mp4:*,"
+        "http-get:*:audio/x-m4a:*,"
         "http-get:*:audio/mpeg:*,"
         "http-get:*:audio/basic:*,"
         "http-get:*:audio/ogg:*,"
+        "http-get:*:audio/opus:*,"
         "http-get:*:audio/ac3:*,"
         "http-get:*:audio/aac:*,"
         "http-get:*:audio/vorbis:*,"
@@ -10,6 +10,8 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/semphr.h>
 
+#include <audio.h>
+
 #define MIN_VOL 0
 #define MAX_VOL 100
 #define MIN_VOL_DB -5120
@@ -148,6 +150,7 @@ static action_err_t SetMute(char* arguments, char** response) {
     if (DesiredMute != NULL && (DesiredMute[0] == '0' || DesiredMute[0] == '1') ) {
         xSemaphoreTake(rcs_mutex, portMAX_DELAY);
         rcs_state.Mute = DesiredMute[0] == '1' ? true : false;
+        audio_set_mute(rcs_state.Mute);
         xSemaphoreGive(rcs_mutex);
     } else {
         return Invalid_Args;
@@ -179,11 +182,13 @@ static action_err_t SetVolume(char* arguments, char** response) {
         if (volume < MIN_VOL || volume > MAX_VOL)
             return Out_Of_Range;
 
-        int volume_db = floor(log10((double) volume / 100) * 2560);
+        int volume_db = volume == 0 ? MIN_VOL_DB : (int)floor(log10((double) volume / 100) * 2560);
 
         xSemaphoreTake(rcs_mutex, portMAX_DELAY);
         rcs_state.Volume = volume;
         rcs_state.VolumeDB = volume_db;
+        // Volume 0 is silence rather than the bottom of the dB range
+        audio_set_volume(volume == 0 ? MIN_VOL_DB - 1 : volume_db);
         xSemaphoreGive(rcs_mutex);
     } else {
         return Invalid_Args;
@@ -218,8 +223,9 @@ static action_err_t SetVolumeDB(char* arguments, char** response) {
         int volume = floor(pow10((double) volume_db / 2560) * 100);
 
         xSemaphoreTake(rcs_mutex, portMAX_DELAY);
-        rcs_state.VolumeDB = volume;
-        rcs_state.Volume = volume_db;
+        rcs_state.VolumeDB = volume_db;
+        rcs_state.Volume = volume;
+        audio_set_volume(volume_db);
         xSemaphoreGive(rcs_mutex);
     } else {
         return Invalid_Args;
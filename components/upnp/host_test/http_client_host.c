@@ -0,0 +1,259 @@
+#include "esp_http_client.h"
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define MAX_HEADERS         8
+#define HEADER_LEN          256
+#define RESPONSE_HEAD_LEN   4096
+#define RECEIVE_TIMEOUT_S   5
+
+struct esp_http_client {
+    char host[64];
+    int port;
+    char path[256];
+    char user_agent[64];
+    http_event_handle_cb event_handler;
+    void* user_data;
+    char header_keys[MAX_HEADERS][32];
+    char header_values[MAX_HEADERS][HEADER_LEN];
+    int header_count;
+
+    int fd;
+    int status;
+    int64_t content_length;     // -1 if the response has none
+    int64_t received;
+
+    // Body bytes that came in with the response headers
+    char head[RESPONSE_HEAD_LEN];
+    size_t head_length;
+    size_t body_start;
+};
+
+// http://host[:port]/path
+static bool parse_url(struct esp_http_client* client, const char* url) {
+    const char* prefix = "http://";
+    if (strncmp(url, prefix, strlen(prefix)) != 0)
+        return false;
+
+    const char* host = url + strlen(prefix);
+    const char* path = strchr(host, '/');
+    if (path == NULL)
+        path = "/";
+    size_t host_len = strcspn(host, ":/");
+    if (host_len >= sizeof(client->host))
+        return false;
+
+    memcpy(client->host, host, host_len);
+    client->host[host_len] = '\0';
+    if (host[host_len] == ':')
+        client->port = atoi(host + host_len + 1);
+    snprintf(client->path, sizeof(client->path), "%s", path);
+    return true;
+}
+
+esp_http_client_handle_t esp_http_client_init(const esp_http_client_config_t* config) {
+    struct esp_http_client* client = calloc(1, sizeof(struct esp_http_client));
+    if (client == NULL)
+        return NULL;
+
+    client->port = config->port != 0 ? config->port : 80;
+    client->fd = -1;
+    if (!parse_url(client, config->url)) {
+        free(client);
+        return NULL;
+    }
+
+    snprintf(client->user_agent, sizeof(client->user_agent), "%s", config->user_agent != NULL ? config->user_agent : "");
+    client->event_handler = config->event_handler;
+    client->user_data = config->user_data;
+    return client;
+}
+
+esp_err_t esp_http_client_set_header(esp_http_client_handle_t client, const char* key, const char* value) {
+    int i = 0;
+    while (i < client->header_count && strcasecmp(client->header_keys[i], key) != 0)
+        i++;
+    if (i == MAX_HEADERS)
+        return ESP_FAIL;
+
+    snprintf(client->header_keys[i], sizeof(client->header_keys[i]), "%s", key);
+    snprintf(client->header_values[i], sizeof(client->header_values[i]), "%s", value);
+    client->header_count = MAX(client->header_count, i + 1);
+    return ESP_OK;
+}
+
+static bool send_all(int fd, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+        if (sent <= 0)
+            return false;
+
+        data += sent;
+        length -= sent;
+    }
+
+    return true;
+}
+
+esp_err_t esp_http_client_open(esp_http_client_handle_t client, int write_len) {
+    client->status = 0;
+    client->content_length = -1;
+    client->received = 0;
+    client->head_length = 0;
+    client->body_start = 0;
+
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = htons(client->port) };
+    if (inet_pton(AF_INET, client->host, &address.sin_addr) != 1) {
+        struct hostent* host = gethostbyname(client->host);
+        if (host == NULL)
+            return ESP_FAIL;
+        memcpy(&address.sin_addr, host->h_addr_list[0], sizeof(address.sin_addr));
+    }
+
+    client->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (client->fd < 0)
+        return ESP_FAIL;
+
+    struct timeval timeout = { .tv_sec = RECEIVE_TIMEOUT_S };
+    setsockopt(client->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (connect(client->fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        close(client->fd);
+        client->fd = -1;
+        return ESP_FAIL;
+    }
+
+    char request[1024];
+    int length = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s:%d\r\nUser-Agent: %s\r\n",
+                          client->path, client->host, client->port, client->user_agent);
+    for (int i = 0; i < client->header_count; i++)
+        length += snprintf(request + length, sizeof(request) - length, "%s: %s\r\n", client->header_keys[i],
+                           client->header_values[i]);
+    length += snprintf(request + length, sizeof(request) - length, "Connection: close\r\n\r\n");
+
+    return send_all(client->fd, request, length) ? ESP_OK : ESP_FAIL;
+}
+
+static void header_event(esp_http_client_handle_t client, char* key, char* value) {
+    if (strcasecmp(key, "Content-Length") == 0)
+        client->content_length = strtoll(value, NULL, 10);
+
+    if (client->event_handler == NULL)
+        return;
+
+    esp_http_client_event_t event = {
+            .event_id = HTTP_EVENT_ON_HEADER,
+            .client = client,
+            .user_data = client->user_data,
+            .header_key = key,
+            .header_value = value
+    };
+    client->event_handler(&event);
+}
+
+// Reads up to the blank line, then hands each header to the event handler as IDF does
+int64_t esp_http_client_fetch_headers(esp_http_client_handle_t client) {
+    char* end = NULL;
+    while (end == NULL) {
+        if (client->head_length == sizeof(client->head) - 1)
+            return ESP_FAIL;
+
+        ssize_t received = recv(client->fd, client->head + client->head_length,
+                                sizeof(client->head) - 1 - client->head_length, 0);
+        if (received <= 0)
+            return ESP_FAIL;
+
+        client->head_length += received;
+        client->head[client->head_length] = '\0';
+        end = strstr(client->head, "\r\n\r\n");
+    }
+
+    client->body_start = end + 4 - client->head;
+    *end = '\0';
+
+    char* line = client->head;
+    char* next = strstr(line, "\r\n");
+    if (next != NULL)
+        *next = '\0';
+    if (sscanf(line, "HTTP/%*d.%*d %d", &client->status) != 1)
+        return ESP_FAIL;
+
+    while (next != NULL) {
+        line = next + 2;
+        next = strstr(line, "\r\n");
+        if (next != NULL)
+            *next = '\0';
+
+        char* colon = strchr(line, ':');
+        if (colon == NULL)
+            continue;
+
+        *colon = '\0';
+        char* value = colon + 1;
+        while (*value == ' ')
+            value++;
+        header_event(client, line, value);
+    }
+
+    return client->content_length;
+}
+
+int esp_http_client_get_status_code(esp_http_client_handle_t client) {
+    return client->status;
+}
+
+bool esp_http_client_is_chunked_response(esp_http_client_handle_t client) {
+    return false;
+}
+
+// Waits for all len bytes as IDF does, unless the body ends first. 0 once the body is complete or the server has
+// closed the connection, -1 on an error with nothing read.
+int esp_http_client_read(esp_http_client_handle_t client, char* buffer, int len) {
+    if (client->content_length >= 0)
+        len = (int)MIN((int64_t)len, client->content_length - client->received);
+
+    int read_len = 0;
+    if (len > 0 && client->body_start < client->head_length) {
+        read_len = (int)MIN((size_t)len, client->head_length - client->body_start);
+        memcpy(buffer, client->head + client->body_start, read_len);
+        client->body_start += read_len;
+    }
+
+    while (read_len < len) {
+        ssize_t received = recv(client->fd, buffer + read_len, len - read_len, 0);
+        if (received < 0 && read_len == 0)
+            return -1;
+        if (received <= 0)
+            break;
+
+        read_len += received;
+    }
+
+    client->received += read_len;
+    return read_len;
+}
+
+bool esp_http_client_is_complete_data_received(esp_http_client_handle_t client) {
+    return client->content_length >= 0 && client->received == client->content_length;
+}
+
+esp_err_t esp_http_client_close(esp_http_client_handle_t client) {
+    if (client->fd >= 0)
+        close(client->fd);
+    client->fd = -1;
+    return ESP_OK;
+}
+
+esp_err_t esp_http_client_cleanup(esp_http_client_handle_t client) {
+    esp_http_client_close(client);
+    free(client);
+    return ESP_OK;
+}
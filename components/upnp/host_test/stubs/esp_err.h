@@ -0,0 +1,21 @@
+#ifndef AIRDAC_FIRMWARE_HOST_ESP_ERR_H
+#define AIRDAC_FIRMWARE_HOST_ESP_ERR_H
+
+#include <assert.h>
+
+typedef int esp_err_t;
+
+#define ESP_OK      0
+#define ESP_FAIL    -1
+
+#define ESP_ERROR_CHECK(_x) do { \
+        esp_err_t _err = (_x); \
+        assert(_err == ESP_OK); \
+        (void)_err; \
+    } while (0)
+
+static inline const char* esp_err_to_name(esp_err_t err) {
+    return err == ESP_OK ? "ESP_OK" : "ESP_FAIL";
+}
+
+#endif //AIRDAC_FIRMWARE_HOST_ESP_ERR_H
@@ -0,0 +1,62 @@
+#ifndef AIRDAC_FIRMWARE_HOST_ESP_HTTP_CLIENT_H
+#define AIRDAC_FIRMWARE_HOST_ESP_HTTP_CLIENT_H
+
+// The part of IDF's HTTP client that stream.c uses, on a blocking socket. Only plain http:// URLs and bodies with
+// a Content-Length are handled, which is all the stand-in server in the tests sends.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+typedef struct esp_http_client* esp_http_client_handle_t;
+
+typedef enum {
+    HTTP_METHOD_GET,
+    HTTP_METHOD_HEAD
+} esp_http_client_method_t;
+
+typedef enum {
+    HTTP_EVENT_ERROR,
+    HTTP_EVENT_ON_CONNECTED,
+    HTTP_EVENT_HEADER_SENT,
+    HTTP_EVENT_ON_HEADER,
+    HTTP_EVENT_ON_DATA,
+    HTTP_EVENT_ON_FINISH,
+    HTTP_EVENT_DISCONNECTED
+} esp_http_client_event_id_t;
+
+typedef struct {
+    esp_http_client_event_id_t event_id;
+    esp_http_client_handle_t client;
+    void* data;
+    int data_len;
+    void* user_data;
+    char* header_key;
+    char* header_value;
+} esp_http_client_event_t;
+
+typedef esp_err_t (*http_event_handle_cb)(esp_http_client_event_t* evt);
+
+typedef struct {
+    const char* url;
+    esp_http_client_method_t method;
+    int port;
+    const char* user_agent;
+    http_event_handle_cb event_handler;
+    void* user_data;
+    int timeout_ms;
+} esp_http_client_config_t;
+
+esp_http_client_handle_t esp_http_client_init(const esp_http_client_config_t* config);
+esp_err_t esp_http_client_set_header(esp_http_client_handle_t client, const char* key, const char* value);
+esp_err_t esp_http_client_open(esp_http_client_handle_t client, int write_len);
+int64_t esp_http_client_fetch_headers(esp_http_client_handle_t client);
+int esp_http_client_get_status_code(esp_http_client_handle_t client);
+bool esp_http_client_is_chunked_response(esp_http_client_handle_t client);
+int esp_http_client_read(esp_http_client_handle_t client, char* buffer, int len);
+bool esp_http_client_is_complete_data_received(esp_http_client_handle_t client);
+esp_err_t esp_http_client_close(esp_http_client_handle_t client);
+esp_err_t esp_http_client_cleanup(esp_http_client_handle_t client);
+
+#endif //AIRDAC_FIRMWARE_HOST_ESP_HTTP_CLIENT_H
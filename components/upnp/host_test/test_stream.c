@@ -0,0 +1,490 @@
+#include "host_test.h"
+#include "stream.h"
+
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// stream.c against a stand-in HTTP server on the loopback interface. The server follows a script, one reply per
+// connection: it drops connections part way through the body, refuses them, or answers a Range request with the
+// wrong thing. The test reads the stream as the decoder would and checks every byte arrives once and in order,
+// that each reconnect asks for the range where the last body stopped, and that retries back off. The next track
+// is fetched behind the current one, the way a gapless handover reads it.
+#define FILE_SIZE           (512 * 1024)
+#define RING_LENGTH         (64 * 1024)
+#define DROP_MIN            (8 * 1024)
+#define DROP_MAX            (96 * 1024)
+#define MAX_CONNECTIONS     32
+#define REQUEST_LEN         2048
+// How late a retry may be, for host scheduling and the time to notice the drop
+#define BACKOFF_SLACK_MS    150
+// Paced replies send a chunk at a time, faster than CD audio plays but with each read taking a while
+#define PACE_CHUNK          (16 * 1024)
+#define PACE_MS             50
+#define PAUSE_MS            400
+#define CD_BYTE_RATE        176400
+#define PACED_LENGTH        (12 * PACE_CHUNK)
+// Short enough to download whole into the ring without being read
+#define SHORT_TRACK         (32 * 1024)
+
+enum reply {
+    SERVE,              // 206 with the rest of the file
+    DROP,               // 206, then the connection closes part way through the body
+    REFUSE,             // 503
+    IGNORE_RANGE,       // 200 with the whole file, as a server without Range support answers
+    WRONG_TOTAL,        // 206 for a resource of another length
+    PACED,              // 206, sent a chunk every PACE_MS
+    PAUSED              // As PACED, with one pause of PAUSE_MS half way
+};
+
+struct connection {
+    enum reply reply;
+    size_t offset;          // From the Range header
+    size_t sent;            // Body bytes written
+    int64_t accept_ns;
+    int64_t close_ns;
+};
+
+static struct {
+    int listen_fd;
+    int port;
+    uint8_t* file;
+    uint32_t random;
+    pthread_mutex_t lock;
+    const enum reply* script;
+    size_t script_length;
+    struct connection log[MAX_CONNECTIONS];
+    size_t count;
+    size_t accepted;
+} server;
+
+static volatile bool stream_failed;
+static uint32_t max_stall_ms;
+
+static bool send_all(int fd, const void* data, size_t length) {
+    const uint8_t* bytes = data;
+    while (length > 0) {
+        ssize_t sent = send(fd, bytes, length, MSG_NOSIGNAL);
+        if (sent <= 0)
+            return false;
+
+        bytes += sent;
+        length -= sent;
+    }
+
+    return true;
+}
+
+static bool read_request(int fd, size_t* offset) {
+    char request[REQUEST_LEN] = "";
+    size_t length = 0;
+    while (strstr(request, "\r\n\r\n") == NULL) {
+        ssize_t received = recv(fd, request + length, sizeof(request) - 1 - length, 0);
+        if (received <= 0 || length + received == sizeof(request) - 1)
+            return false;
+
+        length += received;
+        request[length] = '\0';
+    }
+
+    const char* range = strstr(request, "Range: bytes=");
+    *offset = range != NULL ? strtoul(range + strlen("Range: bytes="), NULL, 10) : 0;
+    return true;
+}
+
+static size_t serve_body(int fd, struct connection* connection) {
+    size_t first = connection->offset;
+    size_t length = FILE_SIZE - first;
+    if (connection->reply == DROP) {
+        size_t drop = DROP_MIN + test_random(&server.random) % (DROP_MAX - DROP_MIN);
+        length = MIN(drop, length - 1);
+    }
+
+    char head[256];
+    size_t total = connection->reply == WRONG_TOTAL ? FILE_SIZE + 1 : FILE_SIZE;
+    int head_length = snprintf(head, sizeof(head),
+            "HTTP/1.1 206 Partial Content\r\nContent-Type: audio/flac\r\nAccept-Ranges: bytes\r\n"
+            "Content-Range: bytes %zu-%zu/%zu\r\nContent-Length: %zu\r\n\r\n",
+            first, FILE_SIZE - 1, total, FILE_SIZE - first);
+    if (!send_all(fd, head, head_length))
+        return 0;
+
+    if (connection->reply != PACED && connection->reply != PAUSED)
+        return send_all(fd, server.file + first, length) ? length : 0;
+
+    for (size_t sent = 0; sent < length; sent += PACE_CHUNK) {
+        usleep(PACE_MS * 1000);
+        if (connection->reply == PAUSED && sent == length / 2 / PACE_CHUNK * PACE_CHUNK)
+            usleep(PAUSE_MS * 1000);
+        if (!send_all(fd, server.file + first + sent, MIN(PACE_CHUNK, length - sent)))
+            return sent;
+    }
+
+    return length;
+}
+
+static void reply(int fd, struct connection* connection) {
+    char head[256];
+    int head_length;
+    switch (connection->reply) {
+        case SERVE:
+        case DROP:
+        case WRONG_TOTAL:
+        case PACED:
+        case PAUSED:
+            connection->sent = serve_body(fd, connection);
+            break;
+        case REFUSE:
+            head_length = snprintf(head, sizeof(head), "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n");
+            send_all(fd, head, head_length);
+            break;
+        case IGNORE_RANGE:
+            head_length = snprintf(head, sizeof(head),
+                    "HTTP/1.1 200 OK\r\nContent-Type: audio/flac\r\nContent-Length: %d\r\n\r\n", FILE_SIZE);
+            if (send_all(fd, head, head_length))
+                send_all(fd, server.file, FILE_SIZE);
+            break;
+    }
+}
+
+static void* server_loop(void* args) {
+    while (1) {
+        int fd = accept(server.listen_fd, NULL, NULL);
+        if (fd < 0)
+            continue;
+
+        struct connection connection = { .accept_ns = now_ns() };
+        pthread_mutex_lock(&server.lock);
+        server.accepted++;
+        pthread_mutex_unlock(&server.lock);
+
+        if (!read_request(fd, &connection.offset)) {
+            close(fd);
+            continue;
+        }
+
+        pthread_mutex_lock(&server.lock);
+        size_t index = server.count;
+        connection.reply = index < server.script_length ? server.script[index] : SERVE;
+        pthread_mutex_unlock(&server.lock);
+
+        reply(fd, &connection);
+        shutdown(fd, SHUT_WR);
+        close(fd);
+        connection.close_ns = now_ns();
+
+        pthread_mutex_lock(&server.lock);
+        if (server.count < MAX_CONNECTIONS)
+            server.log[server.count++] = connection;
+        pthread_mutex_unlock(&server.lock);
+    }
+
+    return NULL;
+}
+
+static void start_server(void) {
+    server.file = malloc(FILE_SIZE);
+    server.random = 0x68E31DA4;
+    for (size_t i = 0; i < FILE_SIZE; i++)
+        server.file[i] = test_random(&server.random);
+
+    server.listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    setsockopt(server.listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    CHECK(bind(server.listen_fd, (struct sockaddr*)&address, sizeof(address)) == 0);
+    CHECK(listen(server.listen_fd, 4) == 0);
+
+    socklen_t length = sizeof(address);
+    getsockname(server.listen_fd, (struct sockaddr*)&address, &length);
+    server.port = ntohs(address.sin_port);
+
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_t thread;
+    pthread_create(&thread, NULL, server_loop, NULL);
+}
+
+static void set_script(const enum reply* script, size_t length) {
+    pthread_mutex_lock(&server.lock);
+    server.script = script;
+    server.script_length = length;
+    server.count = 0;
+    server.accepted = 0;
+    pthread_mutex_unlock(&server.lock);
+}
+
+// Connections the server has finished with
+static size_t connections(void) {
+    pthread_mutex_lock(&server.lock);
+    size_t count = server.count;
+    pthread_mutex_unlock(&server.lock);
+    return count;
+}
+
+// Connections the server has taken, including any it is still sending
+static size_t accepted(void) {
+    pthread_mutex_lock(&server.lock);
+    size_t count = server.accepted;
+    pthread_mutex_unlock(&server.lock);
+    return count;
+}
+
+static void track_url(char* url, size_t length) {
+    snprintf(url, length, "http://127.0.0.1:%d/track.flac", server.port);
+}
+
+static bool open_stream(size_t position) {
+    char url[64];
+    track_url(url, sizeof(url));
+    StreamHeaders_t headers;
+    stream_failed = false;
+    return start_stream(url, position, &headers);
+}
+
+// Reads the stream to its end as the decoder would, and returns where it ended. The worst stall seen on the way
+// is kept, as it decays once the reads are quick again.
+static size_t read_stream(size_t position) {
+    size_t mismatches = 0;
+    max_stall_ms = 0;
+    while (1) {
+        StreamStats_t stats;
+        stream_get_stats(&stats);
+        max_stall_ms = MAX(max_stall_ms, stats.worst_stall_ms);
+
+        const uint8_t* buffer;
+        size_t length;
+        stream_take_buffer(&buffer, &length);
+        if (length == 0)
+            break;
+
+        if (position + length > FILE_SIZE || memcmp(buffer, server.file + position, length) != 0)
+            mismatches++;
+        position += length;
+        stream_release_buffer();
+    }
+
+    CHECK_EQ(mismatches, 0);
+    return position;
+}
+
+// Every reconnect asks for the range from where the last body that was accepted stopped
+static void check_offsets(size_t first_offset) {
+    size_t expected = first_offset;
+    for (size_t i = 0; i < server.count; i++) {
+        const struct connection* connection = &server.log[i];
+        CHECK_EQ(connection->offset, expected);
+        if (connection->reply != REFUSE && connection->reply != IGNORE_RANGE && connection->reply != WRONG_TOTAL)
+            expected = connection->offset + connection->sent;
+    }
+}
+
+// With a byte rate the stall measurement starts from the first read
+static void run_script(const enum reply* script, size_t length, size_t position, uint32_t byte_rate,
+                       StreamStats_t* before, StreamStats_t* after) {
+    set_script(script, length);
+    stream_get_stats(before);
+    stream_set_byte_rate(byte_rate);
+    CHECK(open_stream(position));
+    CHECK_EQ(read_stream(position), FILE_SIZE);
+    CHECK(!stream_failed);
+    stop_stream();
+    stream_get_stats(after);
+
+    // The last connection is logged once the server is done sending it. Fewer connections than the script has
+    // means a reply that should have been turned down was taken.
+    for (int i = 0; i < 2000 && connections() < length; i++)
+        usleep(1000);
+    CHECK_EQ(connections(), length);
+    check_offsets(position);
+}
+
+static void test_drops(void) {
+    const enum reply script[] = { DROP, DROP, DROP, DROP, SERVE };
+    StreamStats_t before, after;
+    run_script(script, 5, 0, 0, &before, &after);
+
+    CHECK_EQ(after.reconnects - before.reconnects, 4);
+    CHECK_EQ(after.reconnect_attempts - before.reconnect_attempts, 4);
+    CHECK_EQ(after.lost_streams, before.lost_streams);
+}
+
+// A stream opened part way in, after a seek, resumes from where it got to and not from where it started
+static void test_drop_after_seek(void) {
+    const enum reply script[] = { DROP, SERVE };
+    StreamStats_t before, after;
+    run_script(script, 2, FILE_SIZE / 3, 0, &before, &after);
+    CHECK_EQ(after.reconnects - before.reconnects, 1);
+}
+
+// Each failed attempt doubles the wait before the next, from 250 ms
+static void test_backoff(void) {
+    const enum reply script[] = { DROP, REFUSE, REFUSE, SERVE };
+    StreamStats_t before, after;
+    run_script(script, 4, 0, 0, &before, &after);
+
+    CHECK_EQ(after.reconnects - before.reconnects, 1);
+    CHECK_EQ(after.reconnect_attempts - before.reconnect_attempts, 3);
+
+    int64_t expected_ms[] = { 250, 500, 1000 };
+    for (int i = 0; i < 3; i++) {
+        int64_t since = i == 0 ? server.log[0].close_ns : server.log[i].accept_ns;
+        int64_t gap_ms = (server.log[i + 1].accept_ns - since) / 1000000;
+        CHECK(gap_ms >= expected_ms[i] - 1);
+        CHECK(gap_ms <= expected_ms[i] + BACKOFF_SLACK_MS);
+        printf("Retry %d after %lld ms\n", i + 1, (long long)gap_ms);
+    }
+}
+
+// A resumed download must be a 206 for the same resource, anything else would splice in the wrong bytes
+static void test_range_validation(void) {
+    const enum reply script[] = { DROP, IGNORE_RANGE, WRONG_TOTAL, SERVE };
+    StreamStats_t before, after;
+    run_script(script, 4, 0, 0, &before, &after);
+
+    CHECK_EQ(after.reconnects - before.reconnects, 1);
+    CHECK_EQ(after.reconnect_attempts - before.reconnect_attempts, 3);
+}
+
+// A link that keeps ahead of playback, however slow each read, is no stall. A pause longer than the audio a
+// read brings in is, by the time it overran.
+static void test_stall(void) {
+    const enum reply paced[] = { PACED };
+    StreamStats_t before, after;
+    run_script(paced, 1, FILE_SIZE - PACED_LENGTH, CD_BYTE_RATE, &before, &after);
+    printf("Paced at %d ms a read: worst stall %u ms\n", PACE_MS, max_stall_ms);
+    CHECK(max_stall_ms < PACE_MS / 2);
+
+    const enum reply paused[] = { PAUSED };
+    run_script(paused, 1, FILE_SIZE - PACED_LENGTH, CD_BYTE_RATE, &before, &after);
+    uint32_t read_ms = (uint64_t)PACE_CHUNK * 1000 / CD_BYTE_RATE;
+    printf("Paused for %d ms: worst stall %u ms\n", PAUSE_MS, max_stall_ms);
+    CHECK(max_stall_ms + BACKOFF_SLACK_MS >= PAUSE_MS + PACE_MS - read_ms);
+    CHECK(max_stall_ms <= PAUSE_MS + PACE_MS);
+}
+
+// A stream that cannot be opened is reported to the caller, not through stream_failed_cb
+static void test_start_refused(void) {
+    const enum reply script[] = { REFUSE };
+    set_script(script, 1);
+    CHECK(!open_stream(0));
+    CHECK(!stream_failed);
+}
+
+static void wait_accepted(size_t count) {
+    for (int i = 0; i < 2000 && accepted() < count; i++)
+        usleep(1000);
+}
+
+// The next track's GET goes out as soon as this download has finished, before anything has been read, and its
+// body follows this track's in the ring. A drop in it resumes within the next track.
+static void test_prefetch(void) {
+    const enum reply script[] = { SERVE, DROP, SERVE };
+    set_script(script, 3);
+    CHECK(open_stream(FILE_SIZE - SHORT_TRACK));
+    char url[64];
+    track_url(url, sizeof(url));
+    stream_prefetch(url);
+
+    wait_accepted(2);
+    CHECK_EQ(accepted(), 2);
+    CHECK_EQ(read_stream(FILE_SIZE - SHORT_TRACK), FILE_SIZE);
+
+    StreamHeaders_t headers;
+    CHECK(stream_next_track(&headers));
+    CHECK_EQ(headers.content_length, FILE_SIZE);
+    CHECK(strcmp(headers.content_type, "audio/flac") == 0);
+    CHECK_EQ(read_stream(0), FILE_SIZE);
+    CHECK(!stream_failed);
+    stop_stream();
+
+    for (int i = 0; i < 2000 && connections() < 3; i++)
+        usleep(1000);
+    CHECK_EQ(connections(), 3);
+    CHECK_EQ(server.log[1].offset, 0);
+    CHECK_EQ(server.log[2].offset, server.log[1].sent);
+}
+
+// A next track dropped after it was fetched is not handed over, and is left for the caller to open afresh
+static void test_prefetch_dropped(void) {
+    const enum reply script[] = { SERVE, SERVE };
+    set_script(script, 2);
+    CHECK(open_stream(FILE_SIZE - SHORT_TRACK));
+    char url[64];
+    track_url(url, sizeof(url));
+    stream_prefetch(url);
+    wait_accepted(2);
+    stream_prefetch(NULL);
+
+    CHECK_EQ(read_stream(FILE_SIZE - SHORT_TRACK), FILE_SIZE);
+    StreamHeaders_t headers;
+    CHECK(!stream_next_track(&headers));
+    CHECK(!stream_failed);
+    stop_stream();
+
+    for (int i = 0; i < 2000 && connections() < 2; i++)
+        usleep(1000);
+    CHECK_EQ(connections(), 2);
+}
+
+// A ranged read goes out on a connection of its own and leaves the open stream as it was. A server that ignores
+// the range gets nothing read, so the caller can fall back to seeking.
+static void test_read_range(void) {
+    const enum reply script[] = { SERVE, SERVE };
+    set_script(script, 2);
+    CHECK(open_stream(0));
+    wait_accepted(1);
+
+    char url[64];
+    track_url(url, sizeof(url));
+    size_t position = FILE_SIZE / 3 + 7;
+    uint8_t buffer[3000];
+    CHECK_EQ(stream_read_range(url, position, buffer, sizeof(buffer)), sizeof(buffer));
+    CHECK(memcmp(buffer, server.file + position, sizeof(buffer)) == 0);
+    CHECK_EQ(read_stream(0), FILE_SIZE);
+    CHECK(!stream_failed);
+    stop_stream();
+
+    for (int i = 0; i < 2000 && connections() < 2; i++)
+        usleep(1000);
+    CHECK_EQ(connections(), 2);
+    CHECK(server.log[0].offset == position || server.log[1].offset == position);
+
+    const enum reply ignored[] = { IGNORE_RANGE };
+    set_script(ignored, 1);
+    CHECK_EQ(stream_read_range(url, position, buffer, sizeof(buffer)), 0);
+}
+
+static void buffer_ready(void) {
+}
+
+static void failed(void) {
+    stream_failed = true;
+}
+
+int main(void) {
+    start_server();
+
+    StreamConfig_t config = {
+            .port = 0,
+            .user_agent = "AirDAC host test",
+            .ring_length = RING_LENGTH,
+            .buffer_ready_cb = buffer_ready,
+            .stream_failed_cb = failed
+    };
+    init_stream(8192, 5, &config);
+
+    test_drops();
+    test_drop_after_seek();
+    test_backoff();
+    test_range_validation();
+    test_stall();
+    test_start_refused();
+    test_prefetch();
+    test_prefetch_dropped();
+    test_read_range();
+    return check_result();
+}
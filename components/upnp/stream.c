@@ -2,207 +2,757 @@
 
 #include <sys/param.h>
 #include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdatomic.h>
 
 #include <esp_log.h>
 #include <esp_http_client.h>
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 
 #define START_STREAM  BIT0
 #define DOWNLOAD        BIT1
-#define FLUSH_BUFFER    BIT2
 #define STOP_STREAM     BIT3
+
+// The downloader reads at most this much at a time, and pauses while less than this is free (the high watermark)
+#define READ_LEN        (16 * 1024)
+// Data is handed out once this much is buffered (the low watermark), or the download has finished. It covers the
+// audio decoder's bridge, so a peek straddling two spans never comes up short.
+#define MIN_SPAN        (8 * 1024)
+
+// Spans are capped so the consumer releases often. The fill then only counts data it has yet to reach.
+#define MAX_SPAN        (4 * READ_LEN)
+
+// The downloader runs ahead of the decoder by a time rather than a size: a base depth plus twice the worst recent
+// read stall, so a network that hiccups gets a deeper buffer. The ring is the memory budget for it. A stall is
+// how much longer a read took than the audio it brought in lasts, so a slow but steady link does not count.
+#define PREFETCH_BASE_MS    4000
+#define PREFETCH_MAX_MS     60000
+// The worst stall loses 1/16 of itself at every read
+#define STALL_DECAY         16
+// The consumption rate is averaged over at least this long. Longer gaps between releases are pauses, and dropped.
+#define RATE_WINDOW_MS      2000
+#define RATE_WINDOW_MAX_MS  30000
+
+// A dropped connection is reopened at the same offset, waiting twice as long after each failed attempt
+#define RECONNECT_MIN_MS    250
+#define RECONNECT_MAX_MS    8000
+#define RECONNECT_ATTEMPTS  8
+
+// An ICY metadata block is a length byte counting 16-byte units, then the text
+#define ICY_BLOCK_LEN       (255 * 16)
+#define ICY_TITLE_LEN       256
+
+// The next track is downloaded into the ring right behind this one, once this download has finished
+enum next_state {
+    NEXT_NONE,
+    NEXT_QUEUED,        // Opened once this download has finished
+    NEXT_OPEN,          // Downloading from boundary on
+    NEXT_DROPPED        // Downloading from boundary on, but lost or no longer wanted
+};
+
 static xTaskHandle stream_task;
 static volatile SemaphoreHandle_t stream_mutex;
 
 static const char TAG[] = "streamer";
 
+// Single-producer/single-consumer byte ring. The downloader only moves head and the consumer only moves tail.
+// The first MIN_SPAN bytes are mirrored past the end, so any span of up to MIN_SPAN is contiguous across the wrap.
 static struct {
     STREAM_CONFIG_STRUCT
 
     esp_http_client_handle_t client;
+    StreamHeaders_t headers;
 
     size_t file_size;
 
-    void** buffers;
-    SemaphoreHandle_t* buff_sems;
-    void* download_offset;
-    unsigned int download_i;
-    unsigned int ready_i;
-
-    size_t total_read_len;
-    unsigned int bytes_left;
-    bool once;
+    uint8_t* ring;
+    size_t capacity;
+    size_t mask;
+    atomic_size_t head;
+    atomic_size_t tail;
+    volatile size_t span;
+    SemaphoreHandle_t data_ready;
+
+    // Absolute offset of the next byte to download
+    size_t position;
+    bool active;
+    volatile bool finished;
+    volatile bool failed;
+
+    // A reconnect is pending while retry_ms is set
+    uint32_t retry_ms;
+    TickType_t retry_at;
+    unsigned int attempts;
+    int64_t outage_start;
+    StreamStats_t stats;
+
+    // Prefetch depth. The rate comes from the track's metadata if it had one, else from how fast spans are released.
+    uint32_t rate_hint;
+    volatile uint32_t measured_rate;
+    size_t window_bytes;
+    int64_t window_start;
+    uint32_t stall_ms;
+    size_t target_bytes;
+    bool at_risk;
+
+    // Audio bytes until the next ICY metadata block. Blocks are read aside, so the ring only ever holds audio.
+    size_t icy_left;
+    char* icy_block;
+    char icy_title[ICY_TITLE_LEN];
+
+    // The consumer only reads up to boundary while the next track is in the ring. next_url is guarded by
+    // next_mutex, as the stream task opens it while the caller may replace it.
+    SemaphoreHandle_t next_mutex;
+    char* next_url;
+    volatile enum next_state next_state;
+    size_t boundary;
+    StreamHeaders_t next_headers;
 } stream_info = { 0 };
 
+static inline bool unbounded(void) {
+    return stream_info.file_size == STREAM_UNKNOWN_LENGTH;
+}
+
+// Tail is read first so a concurrent release can never put it past the head that was read
+static inline size_t ring_fill(void) {
+    size_t tail = atomic_load_explicit(&stream_info.tail, memory_order_acquire);
+    size_t head = atomic_load_explicit(&stream_info.head, memory_order_acquire);
+    return head - tail;
+}
+
+// What the consumer may read of the track it is on. Head is read before the state, so bytes of the next track are
+// only counted once the boundary in front of them is known.
+static inline size_t track_fill(void) {
+    size_t tail = atomic_load_explicit(&stream_info.tail, memory_order_acquire);
+    size_t head = atomic_load_explicit(&stream_info.head, memory_order_acquire);
+    if (stream_info.next_state >= NEXT_OPEN)
+        return MIN(head - tail, stream_info.boundary - tail);
+    return head - tail;
+}
+
 static inline void send_ready(void) {
     stream_info.buffer_ready_cb();
 }
-    
+
 static inline void send_failed(void) {
     ESP_LOGW(TAG, "Streamer failed");
+    stream_info.failed = true;
+    xSemaphoreGive(stream_info.data_ready);
     stream_info.stream_failed_cb();
 }
 
-static esp_err_t get_content_cb(esp_http_client_event_t *evt) {
-    if (evt->event_id == HTTP_EVENT_ON_HEADER && strcmp(evt->header_key, "Content-Type") == 0) {
-        strcpy(evt->user_data, evt->header_value);
+// Bytes beyond the span the consumer holds, if there are enough to be worth handing out
+static bool data_waiting(void) {
+    // Once the download has ended even an empty span is worth taking, as it tells the consumer so
+    if (stream_info.finished)
+        return true;
+
+    size_t span = stream_info.span;
+    size_t fill = track_fill();
+    if (fill <= span)
+        return false;
+
+    return fill - span >= MIN_SPAN;
+}
+
+static void copy_header(char* out, size_t out_len, const char* value) {
+    size_t len = strcspn(value, ";");
+    while (len > 0 && value[len-1] == ' ')
+        len--;
+
+    len = MIN(len, out_len - 1);
+    memcpy(out, value, len);
+    out[len] = '\0';
+}
+
+// The response headers arrive while esp_http_client_fetch_headers() runs
+static esp_err_t header_cb(esp_http_client_event_t *evt) {
+    if (evt->event_id != HTTP_EVENT_ON_HEADER)
+        return ESP_OK;
+
+    StreamHeaders_t* headers = evt->user_data;
+    if (strcasecmp(evt->header_key, "Content-Type") == 0) {
+        copy_header(headers->content_type, sizeof(headers->content_type), evt->header_value);
+    } else if (strcasecmp(evt->header_key, "Accept-Ranges") == 0) {
+        headers->accept_ranges = strncasecmp(evt->header_value, "bytes", 5) == 0;
+    } else if (strcasecmp(evt->header_key, "Content-Range") == 0) {
+        // bytes <first>-<last>/<length>
+        const char* total = strchr(evt->header_value, '/');
+        if (total != NULL && total[1] != '*')
+            headers->content_length = strtoul(total + 1, NULL, 10);
+        headers->accept_ranges = true;
+    } else if (strcasecmp(evt->header_key, "icy-metaint") == 0) {
+        headers->icy_interval = strtoul(evt->header_value, NULL, 10);
     }
 
     return ESP_OK;
 }
 
-void stream_get_content_info(const char* url, char* content_type, size_t* content_length) {
-    esp_http_client_config_t head_config = {
+// Every client hands its headers to stream_info.headers, which only the download in progress uses
+static esp_http_client_handle_t create_client(const char* url) {
+    esp_http_client_config_t download_config = {
             .url = url,
-            .method = HTTP_METHOD_HEAD,
+            .method = HTTP_METHOD_GET,
             .port = stream_info.port,
             .user_agent = stream_info.user_agent,
-            .event_handler = get_content_cb,
-            .user_data = content_type
+            .event_handler = header_cb,
+            .user_data = &stream_info.headers
     };
-    esp_http_client_handle_t head_request = esp_http_client_init(&head_config);
-    esp_http_client_perform(head_request);
-    *content_length = esp_http_client_get_content_length(head_request);
+    return esp_http_client_init(&download_config);
+}
 
-    if (*content_length == (size_t)(-1)) {
+static void close_client(void) {
+    ESP_ERROR_CHECK(esp_http_client_close(stream_info.client));
+    ESP_ERROR_CHECK(esp_http_client_cleanup(stream_info.client));
+    stream_info.client = NULL;
+}
+
+static void schedule_reconnect(uint32_t delay_ms) {
+    stream_info.retry_ms = delay_ms;
+    stream_info.retry_at = xTaskGetTickCount() + pdMS_TO_TICKS(delay_ms);
+}
+
+// Requests the body from position on the open client. The connection is closed again if the answer is unusable.
+// Internet radio answers without a length, or chunked, and is then streamed until it ends.
+static bool open_range(esp_http_client_handle_t client, size_t position) {
+    memset(&stream_info.headers, 0, sizeof(StreamHeaders_t));
+    char range[24];
+    snprintf(range, sizeof(range), "bytes=%u-", position);
+    esp_http_client_set_header(client, "Range", range);
+    esp_http_client_set_header(client, "Icy-MetaData", "1");
+
+    esp_err_t err;
+    if ((err = esp_http_client_open(client, 0)) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open HTTP connection: %s", esp_err_to_name(err));
+        return false;
+    }
+
+    int64_t body_length = esp_http_client_fetch_headers(client);
+    int status = esp_http_client_get_status_code(client);
+
+    // A server that ignores Range sends the whole file from the start
+    if (status != 206 && !(status == 200 && position == 0)) {
+        ESP_LOGE(TAG, "Server answered %d for a range from %u", status, position);
+        esp_http_client_close(client);
+        return false;
+    }
+
+    StreamHeaders_t* headers = &stream_info.headers;
+    if (headers->content_length == 0 && body_length > 0)
+        headers->content_length = position + body_length;
+
+    if (headers->content_length == 0 && position == 0 && (body_length < 0 || esp_http_client_is_chunked_response(client)))
+        headers->content_length = STREAM_UNKNOWN_LENGTH;
+
+    if (headers->content_length == 0 || headers->content_length < position) {
         ESP_LOGE(TAG, "Content-length not found");
-        *content_length = 0;
+        esp_http_client_close(client);
+        return false;
+    }
+
+    return true;
+}
+
+// Everything before the ring's head has been kept, so the download carries on from there. The consumer keeps
+// reading what is buffered meanwhile, and only notices the outage if the ring runs dry.
+// A live stream cannot be resumed, so it is joined again where it is now; the decoder resyncs on the next frame.
+static void reconnect(void) {
+    size_t position = unbounded() ? 0 : stream_info.position;
+    stream_info.attempts++;
+    stream_info.stats.reconnect_attempts++;
+
+    if (open_range(stream_info.client, position) && stream_info.headers.content_length == stream_info.file_size) {
+        stream_info.icy_left = stream_info.headers.icy_interval;
+        stream_info.stats.reconnects++;
+        uint32_t outage_ms = (esp_timer_get_time() - stream_info.outage_start) / 1000;
+        stream_info.stall_ms = MAX(stream_info.stall_ms, outage_ms);
+        ESP_LOGI(TAG, "Resumed at %u after %u attempts and %u ms", position, stream_info.attempts, outage_ms);
+        stream_info.attempts = 0;
+        stream_info.retry_ms = 0;
+        xTaskNotify(stream_task, DOWNLOAD, eSetBits);
         return;
     }
 
-    ESP_LOGI(TAG, "Content-type: %s | Content-length: %d", content_type, *content_length);
+    if (stream_info.attempts == RECONNECT_ATTEMPTS) {
+        ESP_LOGE(TAG, "Giving up after %u attempts", stream_info.attempts);
+        stream_info.stats.lost_streams++;
+        stream_info.attempts = 0;
+        stream_info.retry_ms = 0;
+
+        // Only the next track is lost. The track playing is all in the ring, and the next is opened again after it.
+        if (stream_info.next_state >= NEXT_OPEN) {
+            stream_info.next_state = NEXT_DROPPED;
+            stream_info.active = false;
+            return;
+        }
 
-    ESP_ERROR_CHECK(esp_http_client_close(head_request));
-    ESP_ERROR_CHECK(esp_http_client_cleanup(head_request));
+        send_failed();
+        return;
+    }
+
+    schedule_reconnect(MIN(stream_info.retry_ms * 2, RECONNECT_MAX_MS));
+}
+
+static inline uint32_t byte_rate(void) {
+    return stream_info.rate_hint != 0 ? stream_info.rate_hint : stream_info.measured_rate;
+}
+
+// Until the rate is known the whole budget is used
+static void update_prefetch(void) {
+    uint32_t rate = byte_rate();
+    uint32_t target_ms = MIN(PREFETCH_BASE_MS + 2 * stream_info.stall_ms, PREFETCH_MAX_MS);
+    size_t budget = stream_info.capacity - READ_LEN;
+    size_t target = rate == 0 ? budget : MIN((uint64_t)target_ms * rate / 1000, budget);
+    stream_info.target_bytes = MAX(target, MAX_SPAN + READ_LEN);
+
+    StreamStats_t* stats = &stream_info.stats;
+    stats->byte_rate = rate;
+    stats->prefetch_bytes = stream_info.target_bytes;
+    stats->prefetch_ms = rate == 0 ? 0 : (uint64_t)stream_info.target_bytes * 1000 / rate;
+    stats->worst_stall_ms = stream_info.stall_ms;
+}
+
+// A stall as bad as the worst recent one would drain what is buffered
+static void check_risk(void) {
+    uint32_t rate = byte_rate();
+    if (rate == 0)
+        return;
+
+    stream_info.stats.buffered_ms = (uint64_t)ring_fill() * 1000 / rate;
+    bool at_risk = stream_info.stats.buffered_ms < stream_info.stall_ms;
+    if (at_risk && !stream_info.at_risk)
+        stream_info.stats.risk_events++;
+    stream_info.at_risk = at_risk;
+}
+
+static void measure_consumption(size_t released) {
+    int64_t now = esp_timer_get_time();
+    int64_t elapsed_ms = (now - stream_info.window_start) / 1000;
+    if (stream_info.window_start == 0 || elapsed_ms > RATE_WINDOW_MAX_MS) {
+        stream_info.window_start = now;
+        stream_info.window_bytes = 0;
+        return;
+    }
+
+    stream_info.window_bytes += released;
+    if (elapsed_ms < RATE_WINDOW_MS)
+        return;
+
+    uint32_t rate = (uint64_t)stream_info.window_bytes * 1000 / elapsed_ms;
+    uint32_t measured = stream_info.measured_rate;
+    stream_info.measured_rate = measured == 0 ? rate : (3 * measured + rate) / 4;
+    stream_info.window_start = now;
+    stream_info.window_bytes = 0;
+}
+
+// Until the rate is known there is nothing to compare the read with
+static uint32_t read_stall_ms(int64_t read_us, int read_len) {
+    uint32_t rate = byte_rate();
+    if (rate == 0)
+        return 0;
+
+    int64_t playback_us = (int64_t)MAX(read_len, 0) * 1000000 / rate;
+    return read_us > playback_us ? (read_us - playback_us) / 1000 : 0;
+}
+
+static void connection_lost(void) {
+    ESP_LOGW(TAG, "Connection lost at %u, %u bytes buffered", stream_info.position, ring_fill());
+    esp_http_client_close(stream_info.client);
+    stream_info.outage_start = esp_timer_get_time();
+    schedule_reconnect(RECONNECT_MIN_MS);
+}
+
+static bool read_fully(char* out, size_t len) {
+    while (len > 0) {
+        int read_len = esp_http_client_read(stream_info.client, out, (int)len);
+        if (read_len <= 0)
+            return false;
+
+        out += read_len;
+        len -= read_len;
+    }
+
+    return true;
+}
+
+// Only StreamTitle='...'; is used. Titles may contain quotes, so the value ends at the last "';".
+static void parse_icy_block(char* block) {
+    const char key[] = "StreamTitle='";
+    char* title = strstr(block, key);
+    if (title == NULL)
+        return;
+
+    title += sizeof(key) - 1;
+    char* end = NULL;
+    for (char* next = strstr(title, "';"); next != NULL; next = strstr(next + 1, "';"))
+        end = next;
+    if (end == NULL)
+        end = title + strlen(title);
+    *end = '\0';
+
+    if (strcmp(title, stream_info.icy_title) == 0)
+        return;
+
+    snprintf(stream_info.icy_title, sizeof(stream_info.icy_title), "%s", title);
+    ESP_LOGI(TAG, "Now playing: %s", stream_info.icy_title);
+    if (stream_info.title_cb != NULL)
+        stream_info.title_cb(stream_info.icy_title);
+}
+
+static bool read_icy_block(void) {
+    uint8_t units;
+    if (!read_fully((char*)&units, 1))
+        return false;
+
+    size_t len = units * 16;
+    if (len != 0) {
+        if (!read_fully(stream_info.icy_block, len))
+            return false;
+
+        stream_info.icy_block[len] = '\0';
+        parse_icy_block(stream_info.icy_block);
+    }
+
+    stream_info.icy_left = stream_info.headers.icy_interval;
+    return true;
+}
+
+// Runs once this track's download has finished, so the headers it was opened with are no longer needed. The next
+// track carries on into the ring, and the decoder reaches its first bytes without waiting on a request.
+static void open_next(void) {
+    xSemaphoreTake(stream_info.next_mutex, portMAX_DELAY);
+    esp_http_client_handle_t client = create_client(stream_info.next_url);
+    xSemaphoreGive(stream_info.next_mutex);
+
+    int64_t open_start = esp_timer_get_time();
+    bool opened = open_range(client, 0);
+
+    xSemaphoreTake(stream_info.next_mutex, portMAX_DELAY);
+    if (!opened || stream_info.next_state != NEXT_QUEUED) {
+        if (opened)
+            esp_http_client_close(client);
+        esp_http_client_cleanup(client);
+        if (stream_info.next_state == NEXT_QUEUED) {
+            ESP_LOGW(TAG, "Next track could not be opened ahead");
+            stream_info.next_state = NEXT_NONE;
+        }
+        xSemaphoreGive(stream_info.next_mutex);
+        xSemaphoreGive(stream_info.data_ready);
+        return;
+    }
+
+    // The client is swapped rather than cleared, as a NULL client means no stream to stop
+    esp_http_client_handle_t finished_client = stream_info.client;
+    stream_info.client = client;
+    esp_http_client_close(finished_client);
+    esp_http_client_cleanup(finished_client);
+
+    memcpy(&stream_info.next_headers, &stream_info.headers, sizeof(StreamHeaders_t));
+    stream_info.file_size = stream_info.headers.content_length;
+    stream_info.position = 0;
+    stream_info.icy_left = stream_info.headers.icy_interval;
+    stream_info.boundary = atomic_load_explicit(&stream_info.head, memory_order_relaxed);
+    stream_info.next_state = NEXT_OPEN;
+    xSemaphoreGive(stream_info.next_mutex);
+
+    ESP_LOGI(TAG, "Next track opened in %lld ms, %u bytes before it", (esp_timer_get_time() - open_start) / 1000,
+             ring_fill());
+    xSemaphoreGive(stream_info.data_ready);
+    xTaskNotify(stream_task, DOWNLOAD, eSetBits);
 }
 
 static void download_data(void) {
-    if (stream_info.bytes_left == 0) {
+    if (stream_info.position == stream_info.file_size) {
         ESP_LOGI(TAG, "Download finished!");
+        stream_info.finished = true;
+        xSemaphoreGive(stream_info.data_ready);
         send_ready();
+
+        if (stream_info.next_state == NEXT_QUEUED)
+            open_next();
         return;
     }
 
-    int read_len = esp_http_client_read(stream_info.client, stream_info.download_offset, (int)stream_info.buffer_length);
-    if (read_len <= 0) {
-        ESP_LOGE(TAG, "Error read data");
-        send_failed();
+    // Releasing a span wakes the downloader again
+    update_prefetch();
+    size_t head = atomic_load_explicit(&stream_info.head, memory_order_relaxed);
+    size_t fill = ring_fill();
+    if (stream_info.capacity - fill < READ_LEN || fill >= stream_info.target_bytes)
+        return;
+
+    if (stream_info.headers.icy_interval != 0 && stream_info.icy_left == 0 && !read_icy_block()) {
+        connection_lost();
         return;
     }
-    stream_info.bytes_left -= read_len;
 
-    if (stream_info.once == false && stream_info.download_i == stream_info.buffer_count-2) {
-        for (int i = 0; i < stream_info.download_i; i++)
-            xSemaphoreGive(stream_info.buff_sems[i]);
+    size_t index = head & stream_info.mask;
+    size_t len = MIN(MIN(READ_LEN, stream_info.capacity - index), stream_info.file_size - stream_info.position);
+    if (stream_info.headers.icy_interval != 0)
+        len = MIN(len, stream_info.icy_left);
+
+    int64_t read_start = esp_timer_get_time();
+    int read_len = esp_http_client_read(stream_info.client, (char*)stream_info.ring + index, (int)len);
+    uint32_t stall_ms = read_stall_ms(esp_timer_get_time() - read_start, read_len);
+    stream_info.stall_ms = MAX(stall_ms, stream_info.stall_ms - stream_info.stall_ms / STALL_DECAY);
 
-        stream_info.once = true;
+    if (read_len == 0 && unbounded() && esp_http_client_is_complete_data_received(stream_info.client)) {
+        // A chunked response has ended
+        stream_info.file_size = stream_info.position;
+        xTaskNotify(stream_task, DOWNLOAD, eSetBits);
+        return;
     }
 
-    if (stream_info.once == true) {
-        xSemaphoreGive(stream_info.buff_sems[stream_info.download_i]);
+    if (read_len <= 0) {
+        connection_lost();
+        return;
     }
 
-    stream_info.download_i++;
-    if (stream_info.download_i == stream_info.buffer_count) {
-        stream_info.download_i = 0;
+    if (index < MIN_SPAN) {
+        size_t mirrored = MIN((size_t)read_len, MIN_SPAN - index);
+        memcpy(stream_info.ring + stream_info.capacity + index, stream_info.ring + index, mirrored);
     }
 
-    send_ready();
-    xSemaphoreTake(stream_info.buff_sems[stream_info.download_i], portMAX_DELAY);
+    stream_info.position += read_len;
+    if (stream_info.headers.icy_interval != 0)
+        stream_info.icy_left -= read_len;
+
+    atomic_store_explicit(&stream_info.head, head + read_len, memory_order_release);
+    check_risk();
+    xSemaphoreGive(stream_info.data_ready);
+    if (data_waiting())
+        send_ready();
 
-    stream_info.download_offset = stream_info.buffers[stream_info.download_i];
     xTaskNotify(stream_task, DOWNLOAD, eSetBits);
 }
 
+// Blocks until MIN_SPAN bytes are buffered or the download has ended, then hands out everything contiguous.
+// The length is 0 if the stream failed.
 inline void stream_take_buffer(const uint8_t** buffer, size_t* buffer_length) {
-    xSemaphoreTake(stream_info.buff_sems[stream_info.ready_i], portMAX_DELAY);
-    *buffer = stream_info.buffers[stream_info.ready_i];
-    *buffer_length = stream_info.buffer_length;
+    size_t tail = atomic_load_explicit(&stream_info.tail, memory_order_relaxed);
+    size_t fill = track_fill();
+    if (fill < MIN_SPAN && !stream_info.finished && !stream_info.failed && tail != 0)
+        stream_info.stats.starvations++;
+
+    while (fill < MIN_SPAN && !stream_info.finished && !stream_info.failed) {
+        xSemaphoreTake(stream_info.data_ready, portMAX_DELAY);
+        fill = track_fill();
+    }
+
+    size_t index = tail & stream_info.mask;
+    size_t span = MIN(MIN(fill, stream_info.capacity + MIN_SPAN - index), MAX_SPAN);
+    stream_info.span = stream_info.failed ? 0 : span;
+
+    *buffer = stream_info.ring + index;
+    *buffer_length = stream_info.span;
+
+    if (data_waiting())
+        send_ready();
 }
 
 inline void stream_release_buffer(void) {
-    xSemaphoreGive(stream_info.buff_sems[stream_info.ready_i]);
+    size_t tail = atomic_load_explicit(&stream_info.tail, memory_order_relaxed);
+    atomic_store_explicit(&stream_info.tail, tail + stream_info.span, memory_order_release);
+    measure_consumption(stream_info.span);
+    stream_info.span = 0;
+    xTaskNotify(stream_task, DOWNLOAD, eSetBits);
+}
+
+// Replaces what follows this track. Any of it already in the ring stays behind the boundary, and is dropped by
+// stream_next_track(). Called with next_mutex held.
+static void set_next(const char* url) {
+    free(stream_info.next_url);
+    stream_info.next_url = url != NULL ? strdup(url) : NULL;
 
-    stream_info.ready_i++;
-    if (stream_info.ready_i == stream_info.buffer_count)
-        stream_info.ready_i = 0;
+    if (stream_info.next_state >= NEXT_OPEN)
+        stream_info.next_state = NEXT_DROPPED;
+    else
+        stream_info.next_state = url != NULL ? NEXT_QUEUED : NEXT_NONE;
 }
 
-inline void seek_stream(size_t seek_position) {
-    assert(seek_position <= stream_info.file_size);
+// The stream task is stopped, so what follows only has to be queued again
+static bool open_stream(const char* url, size_t position, StreamHeaders_t* headers) {
     xSemaphoreTake(stream_mutex, portMAX_DELAY);
 
-    stream_info.bytes_left = (stream_info.file_size - seek_position);
+    atomic_store(&stream_info.head, 0);
+    atomic_store(&stream_info.tail, 0);
+    stream_info.span = 0;
+    stream_info.finished = false;
+    stream_info.failed = false;
+    stream_info.retry_ms = 0;
+    stream_info.attempts = 0;
+    xSemaphoreTake(stream_info.data_ready, 0);
+
+    xSemaphoreTake(stream_info.next_mutex, portMAX_DELAY);
+    stream_info.next_state = stream_info.next_url != NULL ? NEXT_QUEUED : NEXT_NONE;
+    xSemaphoreGive(stream_info.next_mutex);
+
+    stream_info.client = create_client(url);
+    if (!open_range(stream_info.client, position)) {
+        close_client();
+        xSemaphoreGive(stream_mutex);
+        return false;
+    }
+
+    memcpy(headers, &stream_info.headers, sizeof(StreamHeaders_t));
+    ESP_LOGI(TAG, "Content-type: %s | Content-length: %u | Ranges: %s | ICY interval: %u", headers->content_type,
+             headers->content_length, headers->accept_ranges ? "yes" : "no", headers->icy_interval);
+
+    stream_info.file_size = headers->content_length;
+    stream_info.position = position;
+    stream_info.icy_left = headers->icy_interval;
+    stream_info.icy_title[0] = '\0';
 
     xSemaphoreGive(stream_mutex);
-    xTaskNotify(stream_task, FLUSH_BUFFER | DOWNLOAD, eSetBits);
+    xTaskNotify(stream_task, START_STREAM, eSetBits);
+    return true;
 }
 
-void start_stream(const char* url, size_t file_size) {
-    xSemaphoreTake(stream_mutex, portMAX_DELAY);
+// Everything already downloaded is from the old position, so the connection is reopened with a Range request
+void seek_stream(const char* url, size_t seek_position) {
+    assert(seek_position <= stream_info.file_size);
+    stop_stream();
 
-    stream_info.file_size = file_size;
-    stream_info.bytes_left = stream_info.file_size;
+    StreamHeaders_t headers;
+    if (!open_stream(url, seek_position, &headers))
+        send_failed();
+}
 
-    stream_info.ready_i = 0;
-    stream_info.download_i = 0;
+// Only the GET is made: its headers are all the decoder choice needs, and the body follows on the same connection
+bool start_stream(const char* url, size_t position, StreamHeaders_t* headers) {
+    xSemaphoreTake(stream_info.next_mutex, portMAX_DELAY);
+    set_next(NULL);
+    xSemaphoreGive(stream_info.next_mutex);
 
-    for (int i = 0; i < stream_info.buffer_count; i++) {
-        stream_info.buffers[i] = heap_caps_malloc(stream_info.buffer_length, MALLOC_CAP_SPIRAM);
-        assert(stream_info.buffers[i] != NULL);
-    }
+    return open_stream(url, position, headers);
+}
 
-    esp_http_client_config_t download_config = {
+void stream_prefetch(const char* url) {
+    xSemaphoreTake(stream_info.next_mutex, portMAX_DELAY);
+    bool queued = url != NULL && stream_info.next_url != NULL && strcmp(url, stream_info.next_url) == 0 &&
+                  stream_info.next_state != NEXT_NONE;
+    if (!queued)
+        set_next(url);
+    xSemaphoreGive(stream_info.next_mutex);
+
+    // An open happens at once if this download has already finished
+    xTaskNotify(stream_task, DOWNLOAD, eSetBits);
+}
+
+bool stream_next_track(StreamHeaders_t* headers) {
+    // Once this download has finished a queued track is being opened, and is worth waiting for
+    while (stream_info.next_state == NEXT_QUEUED && stream_info.finished && stream_info.active && !stream_info.failed)
+        xSemaphoreTake(stream_info.data_ready, pdMS_TO_TICKS(100));
+
+    if (stream_info.next_state != NEXT_OPEN)
+        return false;
+
+    // Whatever the decoder left unread of this track is skipped
+    atomic_store_explicit(&stream_info.tail, stream_info.boundary, memory_order_release);
+    stream_info.span = 0;
+    memcpy(headers, &stream_info.next_headers, sizeof(StreamHeaders_t));
+    stream_info.icy_title[0] = '\0';
+
+    xSemaphoreTake(stream_info.next_mutex, portMAX_DELAY);
+    free(stream_info.next_url);
+    stream_info.next_url = NULL;
+    stream_info.next_state = NEXT_NONE;
+    xSemaphoreGive(stream_info.next_mutex);
+
+    // Should the download end meanwhile, the notification below sets this again
+    stream_info.finished = stream_info.position == stream_info.file_size;
+    ESP_LOGI(TAG, "On to the next track with %u bytes of it buffered", ring_fill());
+    xTaskNotify(stream_task, DOWNLOAD, eSetBits);
+    return true;
+}
+
+// No header handler, as stream_info.headers belongs to the download
+size_t stream_read_range(const char* url, size_t position, uint8_t* buffer, size_t length) {
+    if (length == 0)
+        return 0;
+
+    esp_http_client_config_t range_config = {
             .url = url,
             .method = HTTP_METHOD_GET,
             .port = stream_info.port,
             .user_agent = stream_info.user_agent
     };
-    stream_info.client = esp_http_client_init(&download_config);
-    esp_http_client_set_header(stream_info.client, "Range", "0-\n");
-
-    esp_err_t err;
-    if ((err = esp_http_client_open(stream_info.client, 0)) != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to open HTTP connection: %s", esp_err_to_name(err));
-        send_failed();
-        return;
+    esp_http_client_handle_t client = esp_http_client_init(&range_config);
+    if (client == NULL)
+        return 0;
+
+    char range[48];
+    snprintf(range, sizeof(range), "bytes=%u-%u", position, position + length - 1);
+    esp_http_client_set_header(client, "Range", range);
+
+    size_t read = 0;
+    if (esp_http_client_open(client, 0) == ESP_OK) {
+        esp_http_client_fetch_headers(client);
+        if (esp_http_client_get_status_code(client) == 206) {
+            while (read < length) {
+                int len = esp_http_client_read(client, (char*)buffer + read, length - read);
+                if (len <= 0)
+                    break;
+                read += len;
+            }
+        }
     }
 
-    esp_http_client_fetch_headers(stream_info.client);
+    if (read < length)
+        ESP_LOGW(TAG, "Read %u of %u bytes from %u", read, length, position);
+    esp_http_client_close(client);
+    esp_http_client_cleanup(client);
+    return read;
+}
 
-    xSemaphoreGive(stream_mutex);
-    xTaskNotify(stream_task, START_STREAM, eSetBits);
+void stream_set_byte_rate(uint32_t bytes_per_second) {
+    stream_info.rate_hint = bytes_per_second;
+    stream_info.measured_rate = 0;
+    stream_info.window_start = 0;
+    stream_info.stall_ms = 0;
+    stream_info.stats.worst_stall_ms = 0;
+    stream_info.at_risk = false;
+}
+
+void stream_get_stats(StreamStats_t* stats) {
+    memcpy(stats, &stream_info.stats, sizeof(StreamStats_t));
 }
 
+// A stream that failed to open has nothing to stop
 void stop_stream(void) {
+    if (stream_info.client == NULL)
+        return;
+
     xTaskNotify(stream_task, STOP_STREAM, eSetBits);
     xSemaphoreTake(stream_mutex, portMAX_DELAY);
-
-    ESP_ERROR_CHECK(esp_http_client_close(stream_info.client));
-    ESP_ERROR_CHECK(esp_http_client_cleanup(stream_info.client));
-
-    for (int i = 0; i < stream_info.buffer_count; i++) {
-        free(stream_info.buffers[i]);
-    }
-
+    ESP_LOGI(TAG, "Prefetched %u ms (%u bytes) at %u B/s, worst stall %u ms, %u starvations",
+             stream_info.stats.prefetch_ms, stream_info.stats.prefetch_bytes, stream_info.stats.byte_rate,
+             stream_info.stall_ms, stream_info.stats.starvations);
+    close_client();
     xSemaphoreGive(stream_mutex);
 }
 
 _Noreturn static void stream_loop(void* args) {
     ESP_LOGI(TAG, "Stream loop started");
     while (1) {
-        uint32_t bits;
-        xTaskNotifyWait(0, ULONG_MAX, &bits, portMAX_DELAY);
+        uint32_t bits = 0;
+        TickType_t wait = portMAX_DELAY;
+        if (stream_info.retry_ms != 0) {
+            TickType_t now = xTaskGetTickCount();
+            wait = (int32_t)(stream_info.retry_at - now) > 0 ? stream_info.retry_at - now : 0;
+        }
+
+        xTaskNotifyWait(0, ULONG_MAX, &bits, wait);
         if (bits & STOP_STREAM) {
             asm volatile("" ::: "memory");
-
-            for (int i = 0; i < stream_info.buffer_count; i++) {
-                if (i != stream_info.download_i)
-                    xSemaphoreTake(stream_info.buff_sems[i], portMAX_DELAY);
-            }
-
+            stream_info.active = false;
+            stream_info.retry_ms = 0;
             xSemaphoreGive(stream_mutex);
             ESP_LOGI(TAG, "Streamer stopped");
             continue;
@@ -211,35 +761,44 @@ _Noreturn static void stream_loop(void* args) {
         if (bits & START_STREAM) {
             xSemaphoreTake(stream_mutex, portMAX_DELAY);
             ESP_LOGI(TAG, "Starting stream");
-            for (int i = 0; i < stream_info.buffer_count; i++) {
-                // Keep the buffer to download in
-                if (i != stream_info.download_i)
-                    xSemaphoreGive(stream_info.buff_sems[i]);
-            }
-            stream_info.download_offset = stream_info.buffers[stream_info.download_i];
-            stream_info.once = false;
+            stream_info.active = true;
             xTaskNotify(stream_task, DOWNLOAD, eSetBits);
         }
 
-        if (bits & FLUSH_BUFFER) {
-            stream_info.download_offset = stream_info.buffers[stream_info.download_i];
+        if (stream_info.retry_ms != 0) {
+            if ((int32_t)(stream_info.retry_at - xTaskGetTickCount()) <= 0)
+                reconnect();
+            continue;
         }
 
-        if (bits & DOWNLOAD) {
+        // Releases can still arrive after the connection is closed
+        if ((bits & DOWNLOAD) && stream_info.active) {
             download_data();
         }
     }
 }
 
+// The ring is rounded up to a power of two so the free-running positions can wrap
 void init_stream(size_t stack_size, int priority, const StreamConfig_t* config) {
     memcpy(&stream_info, config, sizeof(StreamConfig_t));
 
-    stream_info.buff_sems = malloc(sizeof(SemaphoreHandle_t) * stream_info.buffer_count);
-    stream_info.buffers = malloc(stream_info.buffer_count);
-    for (int i = 0; i < stream_info.buffer_count; i++) {
-        stream_info.buff_sems[i] = xSemaphoreCreateBinary();
-    }
+    stream_info.capacity = MIN_SPAN;
+    while (stream_info.capacity < stream_info.ring_length)
+        stream_info.capacity <<= 1;
+    stream_info.mask = stream_info.capacity - 1;
+
+    stream_info.ring = heap_caps_malloc(stream_info.capacity + MIN_SPAN, MALLOC_CAP_SPIRAM);
+    assert(stream_info.ring != NULL);
+    ESP_LOGI(TAG, "Stream buffer holds %u bytes", stream_info.capacity);
+
+    atomic_init(&stream_info.head, 0);
+    atomic_init(&stream_info.tail, 0);
+    stream_info.data_ready = xSemaphoreCreateBinary();
+
+    stream_info.icy_block = heap_caps_malloc(ICY_BLOCK_LEN + 1, MALLOC_CAP_SPIRAM);
+    assert(stream_info.icy_block != NULL);
 
     stream_mutex = xSemaphoreCreateMutex();
+    stream_info.next_mutex = xSemaphoreCreateMutex();
     xTaskCreate(stream_loop, "Stream Loop", stack_size, NULL, priority, &stream_task);
-}
\ No newline at end of file
+}
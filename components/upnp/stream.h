@@ -3,27 +3,69 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 #define STREAM_CONFIG_STRUCT            \
     int port;                           \
     const char* user_agent;             \
-    size_t buffer_count;                \
-    size_t buffer_length;               \
+    size_t ring_length;                 \
     void (*buffer_ready_cb)(void);         \
-    void (*stream_failed_cb)(void);
+    void (*stream_failed_cb)(void);     \
+    void (*title_cb)(const char* title);
 
 struct StreamConfig {
     STREAM_CONFIG_STRUCT
 };
 typedef struct StreamConfig StreamConfig_t;
 
-void stream_get_content_info(const char* url, char* content_type, size_t* content_length);
+// content_length of a live or chunked stream, which is downloaded until the server ends it
+#define STREAM_UNKNOWN_LENGTH SIZE_MAX
+
+// From the response that opened the stream. content_type has any parameters stripped, and content_length is the
+// whole resource even when the stream opened part way in.
+struct StreamHeaders {
+    char content_type[64];
+    size_t content_length;
+    bool accept_ranges;
+    size_t icy_interval;            // Audio bytes between ICY metadata blocks, 0 without them
+};
+typedef struct StreamHeaders StreamHeaders_t;
+
+// Counters are since boot. Each reconnect resumes a dropped download where it stopped.
+struct StreamStats {
+    uint32_t reconnects;
+    uint32_t reconnect_attempts;
+    uint32_t lost_streams;          // Downloads given up on after every attempt failed
+    uint32_t byte_rate;             // Of the current stream, 0 until known
+    uint32_t prefetch_ms;           // How far the download runs ahead of the decoder
+    size_t prefetch_bytes;
+    uint32_t buffered_ms;
+    uint32_t worst_stall_ms;        // Longest recent read beyond the playing time it fetched, decaying
+    uint32_t risk_events;           // Times the buffer fell below the worst stall
+    uint32_t starvations;           // Times the decoder had to wait for data mid-stream
+};
+typedef struct StreamStats StreamStats_t;
+
 void init_stream(size_t stack_size, int priority, const StreamConfig_t* config);
-void start_stream(const char* url, size_t file_size);
-void seek_stream(size_t seek_position);
+// Returns false, without calling stream_failed_cb, if the request fails or the response cannot be streamed
+bool start_stream(const char* url, size_t position, StreamHeaders_t* headers);
+void seek_stream(const char* url, size_t seek_position);
 void stop_stream(void);
+// The consumer holds one span at a time and releases it before taking the next
 void stream_take_buffer(const uint8_t** buffer, size_t* buffer_length);
 void stream_release_buffer(void);
+// Called for each new track, from its metadata. With 0 the rate is measured from the decoder's consumption.
+void stream_set_byte_rate(uint32_t bytes_per_second);
+// Queues the track that follows, replacing any queued before; NULL drops it. Its GET is made as soon as this
+// download has finished, on a second client, and its body is downloaded into the ring behind this track's.
+void stream_prefetch(const char* url);
+// Moves the consumer on to the queued track once it is done with this one, skipping whatever it left unread.
+// Returns false if the track could not be fetched ahead, and it must then be opened with start_stream().
+bool stream_next_track(StreamHeaders_t* headers);
+// Reads length bytes from position with a Range request of its own, leaving the download and what it has buffered
+// alone. Blocks until done and returns how many bytes were read.
+size_t stream_read_range(const char* url, size_t position, uint8_t* buffer, size_t length);
+void stream_get_stats(StreamStats_t* stats);
 
 
 #endif //AIRDAC_FIRMWARE_STREAM_H
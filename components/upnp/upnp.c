@@ -17,6 +17,7 @@
 #include <freertos/task.h>
 
 #include <esp_log.h>
+#include <esp_timer.h>
 
 #include <esp_netif.h>
 #include <esp_http_server.h>
@@ -30,6 +31,12 @@ static struct {
     uuid_t uuid;
 } upnp_info;
 
+static struct {
+    bool active;
+    bool prepared;
+    volatile size_t seek_position;
+} stream_state = { 0 };
+
 static void buffer_ready(void) {
     ESP_LOGD(TAG, "Buffer ready!");
     flag_event(BUFFER_READY);
@@ -44,15 +51,52 @@ static void playback_finished(void) {
     flag_event(STOP_PLAYBACK);
 }
 
+static bool track_ending(void) {
+    if (av_transport_has_next() == false)
+        return false;
+
+    flag_event(TRACK_ENDED);
+    return true;
+}
+
 static void playback_failed(void) {
     av_transport_error_occurred();
     flag_event(STOP_PLAYBACK);
 }
 
+static void stream_info(const AudioStreamInfo_t* info) {
+    av_transport_set_duration(info->total_samples, info->sample_rate);
+}
+
 static void append_samples(uint32_t samples, uint32_t sample_rate) {
     av_transport_update_counters(samples, sample_rate);
 }
 
+static void track_started(void) {
+    av_transport_track_started();
+}
+
+static void track_seeked(uint64_t sample, uint32_t sample_rate) {
+    av_transport_set_position(sample, sample_rate);
+}
+
+static void stream_title(const char* title) {
+    av_transport_set_stream_title(title);
+}
+
+static void seek_input(size_t position) {
+    stream_state.seek_position = position;
+    flag_event(SEEK_STREAM);
+}
+
+// For data the decoder needs from elsewhere in the file, without moving the stream
+static size_t read_input(size_t position, uint8_t* buffer, size_t length) {
+    char* url = get_track_url();
+    size_t read = url != NULL ? stream_read_range(url, position, buffer, length) : 0;
+    free(url);
+    return read;
+}
+
 static httpd_handle_t start_webserver(void) {
     httpd_handle_t server = NULL;
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
@@ -69,45 +113,83 @@ static httpd_handle_t start_webserver(void) {
     return server;
 }
 
-static void setup_streaming(void) {
-    char* url = get_track_url();
-    char content_type[20];
-    size_t content_length = 0;
-
-    stream_get_content_info(url, content_type, &content_length);
+// The streamer fetches the next track once the current download has finished, so it is ready at the handover
+static void queue_next_track(void) {
+    char* url = get_next_track_url();
+    stream_prefetch(url);
+    free(url);
+}
 
-    if (content_length == 0 || strlen(content_type) == 0) {
-        ESP_LOGE(TAG, "Setting up stream failed");
+// The decoder is chosen from the headers of the GET that opened the stream
+static bool start_decoding(const StreamHeaders_t* headers, bool play) {
+    if (strlen(headers->content_type) == 0) {
+        ESP_LOGE(TAG, "Stream has no content type");
+        stop_stream();
         av_transport_reset();
         av_transport_error_occurred();
-        return;
+        return false;
     }
 
+    FileInfo_t file_info;
+    get_stream_info(&file_info);
+    stream_set_byte_rate(file_info.bitrate);
+
+    // Without byte ranges the decoder can only read forward
+    bool live = headers->content_length == STREAM_UNKNOWN_LENGTH;
     AudioDecoderConfig_t decoder_config = {
-            .file_size = content_length,
+            .file_size = live ? AUDIO_UNKNOWN_LENGTH : headers->content_length,
             .decoder_ready_cb = decoder_ready,
             .decoder_finished_cb = playback_finished,
             .decoder_failed_cb = playback_failed,
+            .track_ending_cb = track_ending,
+            .stream_info_cb = stream_info,
             .wrote_samples_cb = append_samples,
+            .track_started_cb = track_started,
+            .seek_cb = headers->accept_ranges && !live ? seek_input : NULL,
+            .read_cb = headers->accept_ranges && !live ? read_input : NULL,
+            .seeked_cb = track_seeked,
     };
 
-    if (audio_init_decoder(content_type, &decoder_config) != true) {
+    if (audio_init_decoder(headers->content_type, &decoder_config) != true) {
         ESP_LOGW(TAG, "File type not supported");
+        stop_stream();
         av_transport_reset();
         av_transport_error_occurred();
-        return;
+        return false;
     }
 
-    start_stream(url, content_length);
-    free(url);
+    unflag_event(BUFFER_READY | DECODER_READY);
 
     const uint8_t* buffer;
     size_t buffer_length;
     stream_take_buffer(&buffer, &buffer_length);
-
-    unflag_event(BUFFER_READY | DECODER_READY);
     audio_decoder_continue(buffer, buffer_length);
-    av_transport_stream_ready();
+    stream_state.active = true;
+    queue_next_track();
+
+    if (play)
+        av_transport_stream_ready();
+    return true;
+}
+
+// With play false the decoder fills the output ring while the output stays paused
+static bool setup_streaming(bool play) {
+    char* url = get_track_url();
+    int64_t open_start = esp_timer_get_time();
+    StreamHeaders_t headers;
+
+    if (!start_stream(url, 0, &headers)) {
+        ESP_LOGE(TAG, "Setting up stream failed");
+        stop_stream();
+        free(url);
+        av_transport_reset();
+        av_transport_error_occurred();
+        return false;
+    }
+    free(url);
+
+    ESP_LOGI(TAG, "Track opened in %lld ms", (esp_timer_get_time() - open_start) / 1000);
+    return start_decoding(&headers, play);
 }
 
 static void service_eventing(uint32_t bits) {
@@ -150,10 +232,57 @@ static void service_av_transport(uint32_t bits) {
             av_transport_reset();
         }
 
+        if (stream_state.active) {
+            stream_release_buffer();
+            audio_reset();
+            stop_stream();
+        }
+
+        stream_state.active = false;
+        stream_state.prepared = false;
+        unflag_event(STOP_PLAYBACK | TRACK_ENDED | SEEK_STREAM | SEEK_TRACK | BUFFER_READY | DECODER_READY);
+    } else if (bits & TRACK_ENDED) {
+        unflag_event(TRACK_ENDED);
+        ESP_LOGI(TAG, "Starting next track");
+
+        // The decoder is done with this track's input. The output keeps playing the buffered tail meanwhile.
+        stream_release_buffer();
+        unflag_event(SEEK_STREAM | SEEK_TRACK | BUFFER_READY | DECODER_READY);
+
+        StreamHeaders_t headers;
+        if (!av_transport_next_track()) {
+            stop_stream();
+            stream_state.active = false;
+        } else if (stream_next_track(&headers)) {
+            start_decoding(&headers, true);
+        } else {
+            ESP_LOGI(TAG, "Next track was not fetched ahead");
+            stop_stream();
+            stream_state.active = false;
+            setup_streaming(true);
+        }
+    } else if (bits & SEEK_STREAM) {
+        unflag_event(SEEK_STREAM);
+
         stream_release_buffer();
-        audio_reset();
-        stop_stream();
-        unflag_event(STOP_PLAYBACK | BUFFER_READY | DECODER_READY);
+        unflag_event(BUFFER_READY | DECODER_READY);
+
+        char* url = get_track_url();
+        seek_stream(url, stream_state.seek_position);
+        free(url);
+
+        const uint8_t* buffer;
+        size_t buffer_length;
+        stream_take_buffer(&buffer, &buffer_length);
+        audio_decoder_continue(buffer, buffer_length);
+    } else if (bits & SEEK_TRACK) {
+        unflag_event(SEEK_TRACK);
+        if (!stream_state.active || !audio_seek(av_transport_seek_target()))
+            ESP_LOGW(TAG, "Track cannot seek");
+    } else if (bits & NEXT_TRACK_SET) {
+        unflag_event(NEXT_TRACK_SET);
+        if (stream_state.active)
+            queue_next_track();
     } else if (bits & PAUSE_PLAYBACK) {
         unflag_event(PAUSE_PLAYBACK);
         audio_pause_playback();
@@ -168,11 +297,24 @@ static void service_av_transport(uint32_t bits) {
         size_t buffer_length;
         stream_take_buffer(&buffer, &buffer_length);
         audio_decoder_continue(buffer, buffer_length);
+    } else if (bits & PREPARE_STREAMING) {
+        unflag_event(PREPARE_STREAMING);
+
+        ESP_LOGI(TAG, "Pre-rolling");
+        audio_pause_playback();
+        stream_state.prepared = setup_streaming(false);
     } else if (bits & START_STREAMING) {
         unflag_event(START_STREAMING);
+        audio_resume_playback();
 
-        ESP_LOGI(TAG, "Preparing for playback");
-        setup_streaming();
+        if (stream_state.prepared) {
+            ESP_LOGI(TAG, "Starting pre-rolled stream");
+            stream_state.prepared = false;
+            av_transport_stream_ready();
+        } else {
+            ESP_LOGI(TAG, "Preparing for playback");
+            setup_streaming(true);
+        }
     }
 }
 
@@ -218,10 +360,10 @@ void upnp_start(size_t stack_size, int priority, int port, const char* ip_addr,
     StreamConfig_t stream_config = {
             .port = port,
             .user_agent = useragent_STR,
-            .buffer_count = 3,
-            .buffer_length = 409600,
+            .ring_length = 1024 * 1024,     // The budget; how much of it is used follows the track's bitrate
             .buffer_ready_cb = buffer_ready,
-            .stream_failed_cb = playback_failed
+            .stream_failed_cb = playback_failed,
+            .title_cb = stream_title
     };
     init_stream(stack_size, priority-1, &stream_config);
 
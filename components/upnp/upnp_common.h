@@ -21,10 +21,15 @@
 #define START_STREAMING             BIT8
 #define BUFFER_READY                BIT9
 #define DECODER_READY               BIT10
+#define TRACK_ENDED                 BIT11
+#define PREPARE_STREAMING           BIT12
 #define RESUME_PLAYBACK             BIT13
 #define PAUSE_PLAYBACK              BIT14
 #define STOP_PLAYBACK               BIT15
 #define RESET_PLAYBACK              BIT16
+#define SEEK_STREAM                 BIT17
+#define SEEK_TRACK                  BIT18
+#define NEXT_TRACK_SET              BIT19
 
 #define ALL_EVENT_BITS     0x00FFFFFF
 
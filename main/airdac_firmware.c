@@ -101,7 +101,9 @@ _Noreturn void app_main(void)
     lwip_inet_ntop(AF_INET, &ip_struct, ip_addr, INET_ADDRSTRLEN);
 
     ESP_LOGI(TAG, "Starting audio driver");
-    audio_start(4096, 15);
+    audio_start(&i2s_sink, 4096, 15, 500);
+    audio_set_resampling(48000, AUDIO_RESAMPLE_MEDIUM);
+    audio_set_native_width(true);
 
     ESP_LOGI(TAG, "Starting uPnP");
     strcpy(friendly_name, host_name);